@@ -0,0 +1,64 @@
+# typed: false
+
+# Used to quickly run benchmark under RSpec as part of the usual test suite, to validate it didn't bitrot
+VALIDATE_BENCHMARK_MODE = ENV['VALIDATE_BENCHMARK'] == 'true'
+
+return unless __FILE__ == $PROGRAM_NAME || VALIDATE_BENCHMARK_MODE
+
+require 'benchmark/ips'
+require 'ddtrace'
+require 'pry'
+require_relative 'dogstatsd_reporter'
+
+# This benchmark measures the overhead that the allocations collector (Datadog::Profiling::Collectors::Allocations)
+# adds to allocating objects, by comparing the same allocation-heavy loop without the collector, with the collector
+# sampling, and with the collector sampling and tracking the live heap.
+#
+# The collector hooks every single allocation (RUBY_INTERNAL_EVENT_NEWOBJ), so even the allocations that don't get
+# sampled pay a (small) cost; the ones that do get sampled additionally pay for capturing their stack.
+
+class ProfilerAllocationsBenchmark
+  def create_collector(heap_tracking:)
+    Datadog::Profiling::Collectors::Allocations.new(
+      recorder: Datadog::Profiling::StackRecorder.new(enabled_value_types: Datadog::Profiling::StackRecorder::VALUE_TYPES),
+      max_frames: 400,
+      heap_tracking: heap_tracking,
+    )
+  end
+
+  def allocate_objects
+    1000.times { Object.new }
+  end
+
+  def run_benchmark
+    Benchmark.ips do |x|
+      benchmark_time = VALIDATE_BENCHMARK_MODE ? {time: 0.01, warmup: 0} : {time: 10, warmup: 2}
+      x.config(
+        **benchmark_time,
+        suite: report_to_dogstatsd_if_enabled_via_environment_variable(benchmark_name: 'profiler_allocations')
+      )
+
+      x.report("no allocations collector #{ENV['CONFIG']}") do
+        allocate_objects
+      end
+
+      [false, true].each do |heap_tracking|
+        collector = create_collector(heap_tracking: heap_tracking)
+        x.report("allocations collector (heap_tracking: #{heap_tracking}) #{ENV['CONFIG']}") do |times|
+          collector.start
+          times.times { allocate_objects }
+          collector.stop
+        end
+      end
+
+      x.save! 'profiler-allocations-results.json' unless VALIDATE_BENCHMARK_MODE
+      x.compare!
+    end
+  end
+end
+
+puts "Current pid is #{Process.pid}"
+
+ProfilerAllocationsBenchmark.new.instance_exec do
+  run_benchmark
+end
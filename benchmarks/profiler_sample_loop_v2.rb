@@ -0,0 +1,76 @@
+# typed: false
+
+# Used to quickly run benchmark under RSpec as part of the usual test suite, to validate it didn't bitrot
+VALIDATE_BENCHMARK_MODE = ENV['VALIDATE_BENCHMARK'] == 'true'
+
+return unless __FILE__ == $PROGRAM_NAME || VALIDATE_BENCHMARK_MODE
+
+require 'benchmark/ips'
+require 'ddtrace'
+require 'pry'
+require_relative 'dogstatsd_reporter'
+
+# This benchmark measures the performance of the main stack sampling loop of the new profiler
+# (Datadog::Profiling::Collectors::CpuAndWallTime), which is implemented in native code.
+#
+# All the threads created below sit in exactly the same (very deep) stack, which is what we usually see in production
+# for web servers and background job processors, where most threads are waiting for work. This means that this
+# benchmark is expected to be very sensitive to how well the native sampling code handles repetitive stacks.
+
+class ProfilerSampleLoopBenchmarkV2
+  def create_profiler
+    @recorder = Datadog::Profiling::StackRecorder.new
+    @collector = Datadog::Profiling::Collectors::CpuAndWallTime.new(recorder: @recorder, max_frames: 400)
+  end
+
+  def thread_with_very_deep_stack(depth: 200)
+    deep_stack = proc do |n|
+      if n > 0
+        deep_stack.call(n - 1)
+      else
+        sleep
+      end
+    end
+
+    Thread.new { deep_stack.call(depth) }.tap { |t| t.name = "Deep stack #{depth}" }
+  end
+
+  def run_benchmark
+    Benchmark.ips do |x|
+      benchmark_time = VALIDATE_BENCHMARK_MODE ? {time: 0.01, warmup: 0} : {time: 10, warmup: 2}
+      x.config(
+        **benchmark_time,
+        suite: report_to_dogstatsd_if_enabled_via_environment_variable(benchmark_name: 'profiler_sample_loop_v2')
+      )
+
+      x.report("stack collector (repetitive stacks) #{ENV['CONFIG']}") do
+        @collector.sample
+      end
+
+      x.save! 'profiler-sample-loop-v2-results.json' unless VALIDATE_BENCHMARK_MODE
+      x.compare!
+    end
+
+    @recorder.serialize
+  end
+
+  def run_forever
+    while true
+      1000.times { @collector.sample }
+      @recorder.serialize
+      print '.'
+    end
+  end
+end
+
+puts "Current pid is #{Process.pid}"
+
+ProfilerSampleLoopBenchmarkV2.new.instance_exec do
+  create_profiler
+  10.times { thread_with_very_deep_stack }
+  if ARGV.include?('--forever')
+    run_forever
+  else
+    run_benchmark
+  end
+end
@@ -0,0 +1,84 @@
+# typed: false
+
+# Used to quickly run benchmark under RSpec as part of the usual test suite, to validate it didn't bitrot
+VALIDATE_BENCHMARK_MODE = ENV['VALIDATE_BENCHMARK'] == 'true'
+
+return unless __FILE__ == $PROGRAM_NAME || VALIDATE_BENCHMARK_MODE
+
+require 'benchmark/ips'
+require 'ddtrace'
+require 'pry'
+require_relative 'dogstatsd_reporter'
+
+# This benchmark measures how many samples per second the Datadog::Profiling::StackRecorder can record, with and without
+# native sample aggregation (see `sample_aggregation.c`).
+#
+# Samples are aggregated by stack, so each sample is taken from one of a given number of distinct stacks: below the
+# 200-frame deep stack shared by all of them, each stack goes through a distinct sequence of the `frame_*` methods.
+# The same Datadog::Profiling::Collectors::Stack is used for every sample, so that its sampling buffer (and caches) get
+# reused, as they would be by the other collectors.
+#
+# Note that profiles are capped (see `max_aggregated_samples` and `max_aggregated_bytes`), so with the larger numbers of
+# distinct stacks, some of them end up folded into the "Truncated Stacks" sample.
+
+class ProfilerStackRecorderBenchmark
+  UNIQUE_STACKS = [1_000, 10_000, 100_000].freeze
+  FRAME_METHODS = 47 # Enough for 47**3 > 100k distinct sequences of 3 methods
+
+  FRAME_METHODS.times do |index|
+    class_eval <<-RUBY, __FILE__, __LINE__ + 1
+      def frame_#{index}(path, depth, &block)
+        depth < path.size ? send(path[depth], path, depth + 1, &block) : yield
+      end
+    RUBY
+  end
+
+  def initialize
+    @collector = Datadog::Profiling::Collectors::Stack.new
+    @metric_values = Datadog::Profiling::StackRecorder::VALUE_TYPES.map { |type| [type, 0] }.to_h
+      .merge('cpu-time' => 123, 'cpu-samples' => 1, 'wall-time' => 789).freeze
+    @paths = Array.new(UNIQUE_STACKS.max) do |index|
+      [index % FRAME_METHODS, (index / FRAME_METHODS) % FRAME_METHODS, index / (FRAME_METHODS**2)]
+        .map { |method_index| :"frame_#{method_index}" }.freeze
+    end.freeze
+  end
+
+  def at_very_deep_stack(depth: 200, &block)
+    depth > 0 ? at_very_deep_stack(depth: depth - 1, &block) : yield
+  end
+
+  def run_benchmark
+    Benchmark.ips do |x|
+      benchmark_time = VALIDATE_BENCHMARK_MODE ? {time: 0.01, warmup: 0} : {time: 10, warmup: 2}
+      x.config(
+        **benchmark_time,
+        suite: report_to_dogstatsd_if_enabled_via_environment_variable(benchmark_name: 'profiler_stack_recorder')
+      )
+
+      [true, false].each do |aggregate_samples|
+        UNIQUE_STACKS.each do |unique_stacks|
+          recorder = Datadog::Profiling::StackRecorder.new(aggregate_samples: aggregate_samples)
+          collector = @collector
+          metric_values = @metric_values
+          paths = @paths
+          next_sample = 0
+
+          x.report("record_sample (aggregate_samples=#{aggregate_samples}, #{unique_stacks} unique stacks)") do
+            path = paths[next_sample % unique_stacks]
+            send(path.first, path, 1) { collector.sample(Thread.current, recorder, metric_values, []) }
+            next_sample += 1
+          end
+        end
+      end
+
+      x.save! 'profiler-stack-recorder-results.json' unless VALIDATE_BENCHMARK_MODE
+      x.compare!
+    end
+  end
+end
+
+puts "Current pid is #{Process.pid}"
+
+ProfilerStackRecorderBenchmark.new.instance_exec do
+  at_very_deep_stack { run_benchmark }
+end
@@ -1,4 +1,40 @@
 #pragma once
 
+#include <stdbool.h>
+#include <time.h>
+#include "extconf.h"
+
+// Contains the operating-system specific identifier needed to fetch CPU-time, and a flag to indicate if we failed to fetch it
+typedef struct thread_cpu_time_id {
+  bool valid;
+  clockid_t clock_id;
+} thread_cpu_time_id;
+
+// Timer that periodically sends a signal to a thread as it consumes CPU time, see cpu_time_timer_start
+typedef struct cpu_time_timer {
+  bool valid;
+  #ifdef HAVE_PTHREAD_GETCPUCLOCKID
+    timer_t timer_id;
+  #endif
+} cpu_time_timer;
+
+// Contains the current cpu time, and a flag to indicate if we failed to fetch it
+typedef struct thread_cpu_time {
+  bool valid;
+  long result_ns;
+} thread_cpu_time;
+
 void self_test_clock_id(void);
 VALUE clock_id_for(VALUE self, VALUE thread);
+
+// Look up the identifier needed to get the CPU time of the given thread. This lookup is relatively expensive, so
+// callers are expected to cache the result for each thread.
+thread_cpu_time_id thread_cpu_time_id_for(VALUE thread);
+thread_cpu_time thread_cpu_time_for(thread_cpu_time_id time_id);
+
+// Starts a timer that sends `signal` (with `signal_value` as the `si_value.sival_int`) every time the thread identified
+// by `time_id` consumes `interval_ns` of CPU time. If the `native_thread_id` is known (see native_thread_id_for), the
+// signal is delivered to that thread, otherwise it's delivered to the process.
+// Returns an invalid timer if this is not supported on this platform or if the timer could not be created.
+cpu_time_timer cpu_time_timer_start(thread_cpu_time_id time_id, long native_thread_id, int signal, int signal_value, long interval_ns);
+void cpu_time_timer_stop(cpu_time_timer *timer);
@@ -7,6 +7,7 @@
 #include <pthread.h>
 #include <time.h>
 #include <errno.h>
+#include <signal.h>
 
 #include <ruby.h>
 #include "private_vm_api_access.h"
@@ -41,4 +42,71 @@ VALUE clock_id_for(VALUE self, VALUE thread) {
   }
 }
 
+// Unlike clock_id_for, this never raises, as it gets used while sampling
+thread_cpu_time_id thread_cpu_time_id_for(VALUE thread) {
+  rb_nativethread_id_t thread_id = pthread_id_for(thread);
+  clockid_t clock_id;
+
+  int error = pthread_getcpuclockid(thread_id, &clock_id);
+
+  if (error == 0) {
+    return (thread_cpu_time_id) {.valid = true, .clock_id = clock_id};
+  } else {
+    return (thread_cpu_time_id) {.valid = false};
+  }
+}
+
+thread_cpu_time thread_cpu_time_for(thread_cpu_time_id time_id) {
+  thread_cpu_time error = (thread_cpu_time) {.valid = false};
+
+  if (!time_id.valid) return error;
+
+  struct timespec current_cpu;
+
+  if (clock_gettime(time_id.clock_id, &current_cpu) != 0) return error;
+
+  return (thread_cpu_time) {.valid = true, .result_ns = current_cpu.tv_nsec + (current_cpu.tv_sec * 1000 * 1000 * 1000)};
+}
+
+
+// Older glibc versions don't provide this alias
+#ifndef sigev_notify_thread_id
+  #define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+cpu_time_timer cpu_time_timer_start(thread_cpu_time_id time_id, long native_thread_id, int signal, int signal_value, long interval_ns) {
+  cpu_time_timer error = (cpu_time_timer) {.valid = false};
+
+  if (!time_id.valid) return error;
+
+  struct sigevent timer_event = {.sigev_signo = signal, .sigev_value = {.sival_int = signal_value}};
+
+  if (native_thread_id > 0) {
+    timer_event.sigev_notify = SIGEV_THREAD_ID;
+    timer_event.sigev_notify_thread_id = native_thread_id;
+  } else {
+    timer_event.sigev_notify = SIGEV_SIGNAL;
+  }
+
+  timer_t timer_id;
+  if (timer_create(time_id.clock_id, &timer_event, &timer_id) != 0) return error;
+
+  struct timespec interval = {.tv_sec = interval_ns / (1000 * 1000 * 1000), .tv_nsec = interval_ns % (1000 * 1000 * 1000)};
+  struct itimerspec timer_config = {.it_interval = interval, .it_value = interval};
+
+  if (timer_settime(timer_id, 0, &timer_config, NULL) != 0) {
+    timer_delete(timer_id);
+    return error;
+  }
+
+  return (cpu_time_timer) {.valid = true, .timer_id = timer_id};
+}
+
+void cpu_time_timer_stop(cpu_time_timer *timer) {
+  if (!timer->valid) return;
+
+  timer_delete(timer->timer_id);
+  timer->valid = false;
+}
+
 #endif
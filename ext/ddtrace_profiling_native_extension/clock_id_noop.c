@@ -11,4 +11,12 @@
 void self_test_clock_id(void) { } // Nothing to check
 VALUE clock_id_for(VALUE self, VALUE thread) { return Qnil; } // Nothing to return
 
+thread_cpu_time_id thread_cpu_time_id_for(VALUE thread) { return (thread_cpu_time_id) {.valid = false}; }
+thread_cpu_time thread_cpu_time_for(thread_cpu_time_id time_id) { return (thread_cpu_time) {.valid = false}; }
+
+cpu_time_timer cpu_time_timer_start(thread_cpu_time_id time_id, long native_thread_id, int signal, int signal_value, long interval_ns) {
+  return (cpu_time_timer) {.valid = false};
+}
+void cpu_time_timer_stop(cpu_time_timer *timer) { }
+
 #endif
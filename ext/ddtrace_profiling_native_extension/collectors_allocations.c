@@ -0,0 +1,504 @@
+#include <ruby.h>
+#include <ruby/debug.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "collectors_stack.h"
+#include "stack_recorder.h"
+#include "libddprof_helpers.h"
+#include "heap_tracker.h"
+
+// Used to sample object allocations, recording the alloc-samples and alloc-space value types.
+// This file implements the native bits of the Datadog::Profiling::Collectors::Allocations class
+//
+// Allocations are observed via the RUBY_INTERNAL_EVENT_NEWOBJ tracepoint. To keep the overhead low, only some of them
+// get sampled: after each sample, we pick how many bytes to wait for until the next sample from an exponential
+// distribution with mean `sampling_interval_bytes` (this is the same approach as Go's and tcmalloc's heap profilers).
+// Randomizing the interval avoids always sampling the same allocation in loops that allocate in a fixed pattern.
+//
+// Each sample stands for all the allocations since the previous sample, and thus records their count (alloc-samples)
+// and size (alloc-space).
+//
+// Note that at the time RUBY_INTERNAL_EVENT_NEWOBJ gets triggered, the object was only just created (e.g. a String
+// doesn't have its contents yet) so we can't know how much memory it will end up using. Instead, we account every
+// object as the size of an object slot on the Ruby heap (OBJECT_SLOT_SIZE_BYTES).
+//
+// We're not allowed to allocate Ruby objects from inside the tracepoint, and the symbolization of frames may do so.
+// Thus, the tracepoint only captures the raw stack (see sample_thread_deferred) and requests a postponed job to
+// symbolize and record it, as soon as it's safe to do so.
+//
+// When heap tracking is enabled, sampled objects are also kept track of (see heap_tracker.c) until the
+// RUBY_INTERNAL_EVENT_FREEOBJ tracepoint reports they were freed. Every time the profile gets serialized, the objects
+// that are still alive get recorded as heap-space, so we can tell which code paths are keeping memory alive.
+
+#define DEFAULT_SAMPLING_INTERVAL_BYTES (512 * 1024)
+// This is sizeof(RVALUE), which is not available outside of the VM
+#define OBJECT_SLOT_SIZE_BYTES (5 * sizeof(VALUE))
+// Samples captured but not yet recorded (see flush_from_postponed_job); if this fills up, we skip sampling until
+// there's space again
+#define PENDING_SAMPLES_CAPACITY 128
+// Pending samples are presized (see deferred_samples_new), as we can't allocate from inside the tracepoint. Each sample
+// has a single "allocation class" label; longer class names get truncated.
+#define PENDING_SAMPLES_MAX_LABELS 1
+#define PENDING_SAMPLES_MAX_LABEL_BYTES 512
+#define HEAP_TRACKING_DISABLED 0
+
+static VALUE collectors_allocations_class = Qnil;
+
+// Only one instance can be sampling at a time, as the postponed job needs to know which instance to flush.
+// Set/cleared by _native_start/_native_stop.
+static VALUE active_allocations_collector = Qnil;
+
+struct allocations_collector_state {
+  // Note: Places in this file that usually need to be changed when this struct is changed are tagged with
+  // "Update this when modifying state struct"
+  sampling_buffer *sampling_buffer;
+  deferred_samples *pending_samples;
+  VALUE recorder_instance;
+  VALUE tracepoint;
+  // NULL when heap tracking is disabled
+  heap_tracker *heap_tracker;
+  long sampling_interval_bytes;
+  // Once this reaches zero (or below) we sample the next allocation
+  long bytes_until_next_sample;
+  // How many allocations the next sample will stand for
+  long allocations_since_last_sample;
+  // Used to guard against sampling from inside sampling
+  bool during_sample;
+  // State for the random number generator, see next_random
+  uint64_t random_state;
+  // Stats, see _native_stats
+  long sampled_allocations;
+  long skipped_samples;
+  long sampling_time_ns_total;
+};
+
+static void allocations_collector_typed_data_mark(void *state_ptr);
+static void allocations_collector_typed_data_free(void *state_ptr);
+static size_t allocations_collector_typed_data_size(const void *state_ptr);
+static VALUE _native_new(VALUE klass);
+static VALUE _native_initialize(
+  VALUE self,
+  VALUE collector_instance,
+  VALUE recorder_instance,
+  VALUE max_frames,
+  VALUE sampling_interval_bytes,
+  VALUE max_tracked_objects
+);
+static VALUE _native_start(VALUE self, VALUE collector_instance);
+static VALUE _native_stop(VALUE self, VALUE collector_instance);
+static VALUE _native_flush(VALUE self, VALUE collector_instance);
+static VALUE _native_stats(VALUE self, VALUE collector_instance);
+static VALUE _native_track_objects(VALUE self, VALUE collector_instance, VALUE objects);
+static void on_object_event(VALUE tracepoint_data, void *state_ptr);
+static void sample_allocation(struct allocations_collector_state *state, VALUE new_object);
+static long next_sampling_interval_bytes(struct allocations_collector_state *state);
+static uint64_t next_random(struct allocations_collector_state *state);
+static void flush(VALUE collector_instance);
+static void before_serialize(VALUE collector_instance);
+static VALUE record_live_heap(VALUE state_ptr);
+static VALUE flush_pending_samples(VALUE state_ptr);
+static VALUE finish_flush(VALUE state_ptr);
+static void flush_from_postponed_job(void *_unused);
+static VALUE flush_protected(VALUE collector_instance);
+static long monotonic_time_now_ns(void);
+
+void collectors_allocations_init(VALUE profiling_module) {
+  VALUE collectors_module = rb_define_module_under(profiling_module, "Collectors");
+  collectors_allocations_class = rb_define_class_under(collectors_module, "Allocations", rb_cObject);
+
+  // Instances of the Allocations class are "TypedData" objects.
+  // "TypedData" objects are special objects in the Ruby VM that can wrap C structs.
+  // In this case, it wraps the allocations_collector_state.
+  //
+  // Because Ruby doesn't know how to initialize native-level structs, we MUST override the allocation function for objects
+  // of this class so that we can manage this part. Not overriding or disabling the allocation function is a common
+  // gotcha for "TypedData" objects that can very easily lead to VM crashes, see for instance
+  // https://bugs.ruby-lang.org/issues/18007 for a discussion around this.
+  rb_define_alloc_func(collectors_allocations_class, _native_new);
+
+  rb_define_singleton_method(collectors_allocations_class, "_native_initialize", _native_initialize, 5);
+  rb_define_singleton_method(collectors_allocations_class, "_native_start", _native_start, 1);
+  rb_define_singleton_method(collectors_allocations_class, "_native_stop", _native_stop, 1);
+  rb_define_singleton_method(collectors_allocations_class, "_native_flush", _native_flush, 1);
+  rb_define_singleton_method(collectors_allocations_class, "_native_stats", _native_stats, 1);
+  rb_define_singleton_method(collectors_allocations_class, "_native_track_objects", _native_track_objects, 2);
+
+  rb_global_variable(&active_allocations_collector);
+}
+
+// This structure is used to define a Ruby object that stores a pointer to a struct allocations_collector_state
+// See also https://github.com/ruby/ruby/blob/master/doc/extension.rdoc for how this works
+static const rb_data_type_t allocations_collector_typed_data = {
+  .wrap_struct_name = "Datadog::Profiling::Collectors::Allocations",
+  .function = {
+    .dmark = allocations_collector_typed_data_mark,
+    .dfree = allocations_collector_typed_data_free,
+    .dsize = allocations_collector_typed_data_size,
+    //.dcompact = NULL, // FIXME: Add support for compaction
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static void allocations_collector_typed_data_mark(void *state_ptr) {
+  struct allocations_collector_state *state = (struct allocations_collector_state *) state_ptr;
+
+  // Update this when modifying state struct
+  rb_gc_mark(state->recorder_instance);
+  rb_gc_mark(state->tracepoint);
+  sampling_buffer_mark(state->sampling_buffer);
+  deferred_samples_mark(state->pending_samples);
+  heap_tracker_mark(state->heap_tracker);
+}
+
+static void allocations_collector_typed_data_free(void *state_ptr) {
+  struct allocations_collector_state *state = (struct allocations_collector_state *) state_ptr;
+
+  // Update this when modifying state struct
+
+  // Important: Remember that we're only guaranteed to see here what's been set in _native_new, aka
+  // pointers that have been set NULL there may still be NULL here.
+  //
+  // Note: The tracepoint can't be enabled at this point, as the active_allocations_collector keeps us alive
+  if (state->sampling_buffer != NULL) sampling_buffer_free(state->sampling_buffer);
+  if (state->pending_samples != NULL) deferred_samples_free(state->pending_samples);
+  if (state->heap_tracker != NULL) heap_tracker_free(state->heap_tracker);
+
+  ruby_xfree(state);
+}
+
+// Covers the sampling buffer, the pending samples (which are presized, so this doesn't change while sampling) and the
+// heap tracker's tables. The tracepoint is a separate Ruby object, and reports its own size.
+static size_t allocations_collector_typed_data_size(const void *state_ptr) {
+  const struct allocations_collector_state *state = (const struct allocations_collector_state *) state_ptr;
+
+  // Update this when modifying state struct
+  size_t size =
+    sizeof(struct allocations_collector_state) +
+    sampling_buffer_memsize(state->sampling_buffer) +
+    deferred_samples_memsize(state->pending_samples);
+  if (state->heap_tracker != NULL) size += heap_tracker_stats_for(state->heap_tracker).memory_bytes;
+
+  return size;
+}
+
+static VALUE _native_new(VALUE klass) {
+  struct allocations_collector_state *state = ruby_xcalloc(1, sizeof(struct allocations_collector_state));
+
+  // Update this when modifying state struct
+  state->sampling_buffer = NULL;
+  state->pending_samples = NULL;
+  state->recorder_instance = Qnil;
+  state->tracepoint = Qnil;
+  state->heap_tracker = NULL;
+  state->sampling_interval_bytes = DEFAULT_SAMPLING_INTERVAL_BYTES;
+  state->bytes_until_next_sample = DEFAULT_SAMPLING_INTERVAL_BYTES;
+  state->allocations_since_last_sample = 0;
+  state->during_sample = false;
+  // Any non-zero seed works for xorshift; this one makes sure different processes pick different sampling intervals
+  state->random_state = ((uint64_t) monotonic_time_now_ns() << 16) ^ (uint64_t) getpid() ^ (uint64_t) (uintptr_t) state;
+  if (state->random_state == 0) state->random_state = 1;
+  state->sampled_allocations = 0;
+  state->skipped_samples = 0;
+  state->sampling_time_ns_total = 0;
+
+  return TypedData_Wrap_Struct(collectors_allocations_class, &allocations_collector_typed_data, state);
+}
+
+// Heap tracking is enabled by passing a positive max_tracked_objects
+static VALUE _native_initialize(
+  VALUE self,
+  VALUE collector_instance,
+  VALUE recorder_instance,
+  VALUE max_frames,
+  VALUE sampling_interval_bytes,
+  VALUE max_tracked_objects
+) {
+  enforce_recorder_instance(recorder_instance);
+
+  struct allocations_collector_state *state;
+  TypedData_Get_Struct(collector_instance, struct allocations_collector_state, &allocations_collector_typed_data, state);
+
+  int max_frames_requested = NUM2INT(max_frames);
+  if (max_frames_requested < 0) rb_raise(rb_eArgError, "Invalid max_frames: value must not be negative");
+
+  long sampling_interval_bytes_requested = NUM2LONG(sampling_interval_bytes);
+  if (sampling_interval_bytes_requested <= 0) rb_raise(rb_eArgError, "Invalid sampling_interval_bytes: value must be positive");
+
+  int max_tracked_objects_requested = NUM2INT(max_tracked_objects);
+  if (max_tracked_objects_requested < 0) rb_raise(rb_eArgError, "Invalid max_tracked_objects: value must not be negative");
+
+  // Update this when modifying state struct
+  state->sampling_buffer = sampling_buffer_new(max_frames_requested);
+  state->pending_samples = deferred_samples_new(
+    PENDING_SAMPLES_CAPACITY, max_frames_requested, PENDING_SAMPLES_MAX_LABELS, PENDING_SAMPLES_MAX_LABEL_BYTES
+  );
+  state->recorder_instance = recorder_instance;
+  state->sampling_interval_bytes = sampling_interval_bytes_requested;
+  state->bytes_until_next_sample = next_sampling_interval_bytes(state);
+  rb_event_flag_t events = RUBY_INTERNAL_EVENT_NEWOBJ;
+  if (max_tracked_objects_requested != HEAP_TRACKING_DISABLED) {
+    state->heap_tracker = heap_tracker_new(max_tracked_objects_requested);
+    events |= RUBY_INTERNAL_EVENT_FREEOBJ;
+  }
+  state->tracepoint = rb_tracepoint_new(Qnil /* all threads */, events, on_object_event, state);
+
+  // Make sure nothing that was sampled gets left out of the profile, and that it includes the live heap
+  recorder_add_before_serialize_hook(recorder_instance, before_serialize, collector_instance);
+
+  return Qtrue;
+}
+
+// Raises if another instance is already sampling
+static VALUE _native_start(VALUE self, VALUE collector_instance) {
+  struct allocations_collector_state *state;
+  TypedData_Get_Struct(collector_instance, struct allocations_collector_state, &allocations_collector_typed_data, state);
+
+  if (state->recorder_instance == Qnil) rb_raise(rb_eRuntimeError, "Could not start Allocations: Not initialized");
+  if (active_allocations_collector != Qnil) {
+    rb_raise(rb_eRuntimeError, "Could not start Allocations: There's already another instance of Allocations sampling");
+  }
+
+  active_allocations_collector = collector_instance;
+  rb_tracepoint_enable(state->tracepoint);
+
+  return Qtrue;
+}
+
+// Returns false if this instance was not sampling
+static VALUE _native_stop(VALUE self, VALUE collector_instance) {
+  struct allocations_collector_state *state;
+  TypedData_Get_Struct(collector_instance, struct allocations_collector_state, &allocations_collector_typed_data, state);
+
+  if (active_allocations_collector != collector_instance) return Qfalse;
+
+  rb_tracepoint_disable(state->tracepoint);
+  // Any postponed job that is still pending after this will be a no-op, see flush_from_postponed_job. Samples that were
+  // already captured still get recorded, at the latest when the recorder gets serialized.
+  active_allocations_collector = Qnil;
+
+  return Qtrue;
+}
+
+// This method exists only to enable testing Datadog::Profiling::Collectors::Allocations behavior using RSpec.
+// It SHOULD NOT be used for other purposes.
+static VALUE _native_flush(VALUE self, VALUE collector_instance) {
+  flush(collector_instance);
+  return Qtrue;
+}
+
+static VALUE _native_stats(VALUE self, VALUE collector_instance) {
+  struct allocations_collector_state *state;
+  TypedData_Get_Struct(collector_instance, struct allocations_collector_state, &allocations_collector_typed_data, state);
+
+  VALUE stats_as_hash = rb_hash_new();
+  rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("sampled_allocations")), LONG2NUM(state->sampled_allocations));
+  rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("skipped_samples")), LONG2NUM(state->skipped_samples));
+  rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("sampling_time_ns_total")), LONG2NUM(state->sampling_time_ns_total));
+  rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("sampling_interval_bytes")), LONG2NUM(state->sampling_interval_bytes));
+
+  if (state->heap_tracker != NULL) {
+    heap_tracker_stats heap_stats = heap_tracker_stats_for(state->heap_tracker);
+    rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("heap_tracked_objects")), ULONG2NUM(heap_stats.tracked_objects));
+    rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("heap_max_tracked_objects")), ULONG2NUM(heap_stats.max_tracked_objects));
+    rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("heap_tracked_stacks")), ULONG2NUM(heap_stats.tracked_stacks));
+    rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("heap_skipped_objects")), ULONG2NUM(heap_stats.skipped_objects));
+    rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("heap_tracker_memory_bytes")), SIZET2NUM(heap_stats.memory_bytes));
+  }
+
+  return stats_as_hash;
+}
+
+// This method exists only to enable testing the heap tracker (see heap_tracker.c) using RSpec.
+// It SHOULD NOT be used for other purposes.
+//
+// Tracks each of the `objects` as if it had just been sampled (standing for a single allocation) at the current stack.
+// Values that are not objects on the Ruby heap (e.g. Integers) look like objects that got freed without the heap
+// tracker noticing, see live_object_size.
+static VALUE _native_track_objects(VALUE self, VALUE collector_instance, VALUE objects) {
+  struct allocations_collector_state *state;
+  TypedData_Get_Struct(collector_instance, struct allocations_collector_state, &allocations_collector_typed_data, state);
+
+  Check_Type(objects, T_ARRAY);
+  if (state->heap_tracker == NULL) rb_raise(rb_eArgError, "Heap tracking is not enabled");
+
+  int64_t metric_values[ALL_VALUE_TYPES_COUNT] = {0};
+  bool sampled = sample_thread_deferred(
+    rb_thread_current(),
+    state->sampling_buffer,
+    state->pending_samples,
+    (ddprof_ffi_Slice_i64) {.ptr = metric_values, .len = ALL_VALUE_TYPES_COUNT},
+    (ddprof_ffi_Slice_label) {.ptr = NULL, .len = 0},
+    NULL /* stack_snapshot */
+  );
+  if (!sampled) rb_raise(rb_eRuntimeError, "Unexpected: Could not capture the current stack");
+
+  captured_stack allocation_stack = deferred_samples_newest_stack(state->pending_samples);
+  for (long i = 0; i < RARRAY_LEN(objects); i++) {
+    heap_tracker_track_object(state->heap_tracker, rb_ary_entry(objects, i), 1, allocation_stack);
+  }
+
+  return Qtrue;
+}
+
+// This gets called for every allocation (and, with heap tracking, for every object freed), so it's important to keep
+// the common case (not sampling) as cheap as possible
+static void on_object_event(VALUE tracepoint_data, void *state_ptr) {
+  struct allocations_collector_state *state = (struct allocations_collector_state *) state_ptr;
+  rb_trace_arg_t *tracearg = rb_tracearg_from_tracepoint(tracepoint_data);
+
+  if (rb_tracearg_event_flag(tracearg) == RUBY_INTERNAL_EVENT_FREEOBJ) {
+    heap_tracker_untrack_object(state->heap_tracker, rb_tracearg_object(tracearg));
+    return;
+  }
+
+  state->allocations_since_last_sample++;
+  state->bytes_until_next_sample -= OBJECT_SLOT_SIZE_BYTES;
+
+  if (state->bytes_until_next_sample > 0 || state->during_sample) return;
+
+  state->during_sample = true;
+  sample_allocation(state, rb_tracearg_object(tracearg));
+  state->during_sample = false;
+}
+
+static void sample_allocation(struct allocations_collector_state *state, VALUE new_object) {
+  long sampling_start_ns = monotonic_time_now_ns();
+  state->bytes_until_next_sample = next_sampling_interval_bytes(state);
+
+  // We can't record samples from here (see top of file), so if the previous ones were not recorded yet, we skip this
+  // one. The allocations it stood for get included in the next sample instead.
+  if (deferred_samples_count(state->pending_samples) >= PENDING_SAMPLES_CAPACITY) {
+    state->skipped_samples++;
+    return;
+  }
+
+  long allocations = state->allocations_since_last_sample;
+  int64_t metric_values[ALL_VALUE_TYPES_COUNT] = {0};
+  metric_values[ALLOC_SAMPLES_VALUE_POS] = allocations;
+  metric_values[ALLOC_SPACE_VALUE_POS] = state->allocations_since_last_sample * OBJECT_SLOT_SIZE_BYTES;
+  state->allocations_since_last_sample = 0;
+
+  ddprof_ffi_Label class_label = {.key = DDPROF_FFI_CHARSLICE_C("allocation class")};
+  ddprof_ffi_Slice_label labels = {.ptr = &class_label, .len = 0};
+
+  // Note: We can't use rb_class_name here, as that may allocate (e.g. for anonymous classes). Internal objects that
+  // are hidden from Ruby code have no class, and get no label.
+  VALUE klass = rb_obj_class(new_object);
+  VALUE class_name = klass ? rb_class_path_cached(klass) : Qnil;
+  if (RB_TYPE_P(class_name, T_STRING)) {
+    class_label.str = char_slice_from_ruby_string(class_name);
+    labels.len = 1;
+  }
+
+  bool sampled = sample_thread_deferred(
+    rb_thread_current(),
+    state->sampling_buffer,
+    state->pending_samples,
+    (ddprof_ffi_Slice_i64) {.ptr = metric_values, .len = ALL_VALUE_TYPES_COUNT},
+    labels,
+    NULL /* stack_snapshot */
+  );
+  // When the stack could not be captured, nothing gets reported for this sample
+  if (sampled) {
+    state->sampled_allocations++;
+  } else {
+    state->skipped_samples++;
+  }
+
+  // The heap tracker reuses the stack we just captured, rather than unwinding it again
+  if (sampled && state->heap_tracker != NULL) {
+    heap_tracker_track_object(
+      state->heap_tracker, new_object, allocations, deferred_samples_newest_stack(state->pending_samples)
+    );
+  }
+
+  // Note: If there's already a pending flush request, this is a no-op
+  rb_postponed_job_register_one(0, flush_from_postponed_job, NULL);
+
+  state->sampling_time_ns_total += monotonic_time_now_ns() - sampling_start_ns;
+}
+
+// Picks the bytes until the next sample from an exponential distribution with mean `sampling_interval_bytes`, see top
+// of file.
+static long next_sampling_interval_bytes(struct allocations_collector_state *state) {
+  // Uniformly distributed in (0, 1]; we avoid zero as log(0) is -infinity
+  double uniform = ((double) (next_random(state) >> 11) + 1.0) / 9007199254740992.0 /* 2^53 */;
+  long interval = (long) (-log(uniform) * state->sampling_interval_bytes);
+
+  return interval > 0 ? interval : 1;
+}
+
+// xorshift64*: fast, good enough for picking sampling intervals, and doesn't touch any global state
+static uint64_t next_random(struct allocations_collector_state *state) {
+  uint64_t x = state->random_state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  state->random_state = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+static void flush(VALUE collector_instance) {
+  struct allocations_collector_state *state;
+  TypedData_Get_Struct(collector_instance, struct allocations_collector_state, &allocations_collector_typed_data, state);
+
+  // Avoid sampling our own allocations while symbolizing
+  state->during_sample = true;
+  rb_ensure(flush_pending_samples, (VALUE) state, finish_flush, (VALUE) state);
+}
+
+static void before_serialize(VALUE collector_instance) {
+  flush(collector_instance);
+
+  struct allocations_collector_state *state;
+  TypedData_Get_Struct(collector_instance, struct allocations_collector_state, &allocations_collector_typed_data, state);
+
+  if (state->heap_tracker == NULL) return;
+
+  // Avoid sampling our own allocations while symbolizing
+  state->during_sample = true;
+  rb_ensure(record_live_heap, (VALUE) state, finish_flush, (VALUE) state);
+}
+
+static VALUE record_live_heap(VALUE state_ptr) {
+  struct allocations_collector_state *state = (struct allocations_collector_state *) state_ptr;
+  heap_tracker_record_live_heap(state->heap_tracker, state->sampling_buffer, state->recorder_instance);
+  return Qnil;
+}
+
+static VALUE flush_pending_samples(VALUE state_ptr) {
+  struct allocations_collector_state *state = (struct allocations_collector_state *) state_ptr;
+  deferred_samples_flush(state->pending_samples, state->sampling_buffer, state->recorder_instance);
+  return Qnil;
+}
+
+static VALUE finish_flush(VALUE state_ptr) {
+  ((struct allocations_collector_state *) state_ptr)->during_sample = false;
+  return Qnil;
+}
+
+static void flush_from_postponed_job(void *_unused) {
+  VALUE collector_instance = active_allocations_collector;
+
+  // The collector may have been stopped after this job was requested
+  if (collector_instance == Qnil) return;
+
+  // We can't let exceptions escape from a postponed job, as there's no Ruby code above us to handle them
+  int exception_state;
+  rb_protect(flush_protected, collector_instance, &exception_state);
+  if (exception_state) rb_set_errinfo(Qnil);
+}
+
+static VALUE flush_protected(VALUE collector_instance) {
+  flush(collector_instance);
+  return Qnil;
+}
+
+static long monotonic_time_now_ns(void) {
+  struct timespec current_monotonic;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &current_monotonic) != 0) return 0;
+
+  return current_monotonic.tv_nsec + (current_monotonic.tv_sec * 1000 * 1000 * 1000);
+}
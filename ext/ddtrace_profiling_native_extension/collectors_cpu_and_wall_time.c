@@ -1,27 +1,336 @@
 #include <ruby.h>
+#include <ruby/debug.h>
+#include <ruby/thread.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
 #include "collectors_stack.h"
 #include "stack_recorder.h"
 #include "private_vm_api_access.h"
+#include "ruby_helpers.h"
+#include "clock_id.h"
+#include "libddprof_helpers.h"
 
 // Used to periodically (time-based) sample threads, recording elapsed CPU-time and Wall-time between samples.
 // This file implements the native bits of the Datadog::Profiling::Collectors::CpuAndWallTime class
+//
+// Per-thread state (see `struct per_thread_context`) is kept in a hashmap keyed by the thread object. Contexts for
+// threads that are no longer alive get removed at the end of each sample.
+//
+// Each sample records, for every thread, the CPU-time and Wall-time that elapsed since that thread's previous sample.
+// The first time a thread is sampled, there's no previous sample, so we record zero for both.
+//
+// Sampling is driven natively (see _native_start): a background pthread (the "sampling trigger") wakes up at the
+// configured frequency and asks the Ruby VM to call `sample()` as soon as it's safe to do so, using
+// `rb_postponed_job_register_one`.
+//
+// Why does the sampling trigger not call `rb_postponed_job_register_one` directly? Because that function MUST be called
+// from a Ruby thread (on modern Rubies it gets the VM from the current thread's execution context). Instead, the
+// sampling trigger sends a SIGPROF to the thread holding the Global VM Lock (see `gvl_owner`), and it's the signal
+// handler, running on that thread, that calls `rb_postponed_job_register_one`, which is async-signal-safe.
+//
+// Optionally (see `use_cpu_time_timers`), CPU-time can instead be sampled using per-thread CPU-time timers (see
+// cpu_time_timer_start). Periodic sampling is biased for CPU-time: a thread that holds the GVL for a long time gets
+// the same number of samples as an idle one. With timers, each thread gets a SIGPROF after it consumes
+// `sampling_interval_ns` of CPU-time, and the signal handler marks that thread as pending (see
+// `pending_cpu_time_samples`), so that `sample_cpu_time()` unwinds only those threads and records the CPU-time they
+// actually consumed. Threads with an active timer then only get Wall-time recorded by the periodic `sample()`.
+//
+// To bound the profiler's overhead, each `sample()` is timed (together with any `sample_cpu_time()` calls and deferred
+// sample flushes since the previous one), and the sampling trigger waits for however long is needed to keep the time
+// spent sampling under `max_time_usage_pct` (see `update_effective_sampling_interval`). Thus, when sampling gets more
+// expensive (e.g. many threads or deep stacks), the sampling frequency drops (down to one sample per second), instead
+// of the profiler taking more CPU away from the application.
+//
+// Each `sample()` also samples at most `max_threads_sampled` threads, going round-robin over the thread list, so that
+// its cost is bounded regardless of how many threads exist. Threads that get skipped are not losing any time: the next
+// time they get sampled, the elapsed CPU-time and Wall-time since their previous sample get recorded.
+//
+// When a tracer is in use, samples get tagged with the root span id, span id and endpoint of the trace active on each
+// thread (see trace_identifiers_for). These are read directly from the tracer's objects, without calling any Ruby code
+// (and without allocating), mirroring Datadog::Profiling::TraceIdentifiers::Ddtrace#trace_identifiers_for.
+//
+// Time spent in the Garbage Collector gets recorded separately (see on_gc_event): the GC_ENTER/GC_EXIT tracepoints
+// accumulate the CPU-time and Wall-time spent in GC by the thread that triggered it, and a postponed job then records
+// it with a "Garbage Collection" placeholder frame on top of that thread's stack, and a "gc type" label (minor/major).
+// This time is excluded from the thread's next regular sample, so that it doesn't get counted twice.
+//
+// On Ruby 3.2+, we also record how long threads wait to acquire the Global VM Lock (the gvl-wait value type), using the
+// thread event hooks (see on_thread_event). These run without the GVL, so they only keep track of the time in
+// thread-local variables; once a thread is done waiting, a postponed job records the wait with the thread's stack (short
+// waits get dropped, see GVL_WAIT_SAMPLING_THRESHOLD_NS).
+// Because a waiting thread is not running any Ruby code, that's the same stack it had when it started waiting.
+//
+// On Linux (and Ruby 3.1+, where we know each thread's native id), each sample also records how long the thread was
+// runnable but waiting for the kernel to schedule it (the os-runqueue-wait value type), as reported by
+// /proc/self/task/<tid>/schedstat. We keep that file open for every thread, and reread it with `pread`.
+
+#define INVALID_TIME -1
 
 static VALUE collectors_cpu_and_wall_time_class = Qnil;
 
+// When deferring symbolization, this is how many samples we can keep before symbolizing and recording them (see
+// sample_thread_deferred). Once half of them are in use, a postponed job separate from sampling flushes them (see
+// request_deferred_samples_flush); samples are also flushed whenever the recorder is about to be serialized. If the
+// queue still fills up, new samples get dropped (and counted, see _native_stats) rather than flushed while sampling.
+#define DEFERRED_SAMPLES_CAPACITY 1024
+
+#define DEFAULT_SAMPLING_FREQUENCY_HZ 100
+#define DEFAULT_MAX_TIME_USAGE_PCT 2.0
+// Even when sampling is very expensive, we still take at least one sample per second (see
+// update_effective_sampling_interval), as otherwise a single slow sample could leave the profile empty for a long time
+#define MAX_EFFECTIVE_SAMPLING_INTERVAL_NS (1000L * 1000 * 1000)
+
+#define MISSING_TRACER_CONTEXT_KEY 0
+// Enough to fit the digits of a 64-bit unsigned integer, plus the terminating NUL
+#define MAXIMUM_SPAN_ID_DIGITS 21
+// local root span id, span id, trace endpoint, gc type
+#define MAX_LABELS_PER_SAMPLE 4
+
+// Indexes for the per-thread GC time accumulators, see on_gc_event
+#define MINOR_GC 0
+#define MAJOR_GC 1
+#define GC_TYPES_COUNT 2
+
+// Shorter waits for the GVL don't get recorded at all, so that uncontended GVL handoffs (which happen all the time,
+// e.g. around every blocking IO call) don't each trigger a sample, see on_thread_event
+#define GVL_WAIT_SAMPLING_THRESHOLD_NS (100 * 1000)
+
+#ifdef RUBY_INTERNAL_THREAD_EVENT_READY // Ruby 3.2+
+  // These are per-native-thread, and on Ruby 3.2 each Ruby thread has its own native thread. They're only used with
+  // the thread holding the GVL or by the thread itself (while waiting for the GVL), so no extra synchronization is needed.
+  static __thread long gvl_wait_started_at_ns = INVALID_TIME;
+  // The latest wait of this thread that is waiting to be recorded, see sample_gvl_wait_protected
+  static __thread long gvl_wait_pending_ns = 0;
+#endif
+
+// Instance variables read by trace_identifiers_for, see collectors_cpu_and_wall_time_init
+static ID at_active_trace_id;  // Datadog::Tracing::Context#@active_trace
+static ID at_root_span_id;     // Datadog::Tracing::TraceOperation#@root_span
+static ID at_active_span_id;   // Datadog::Tracing::TraceOperation#@active_span
+static ID at_resource_id;      // Datadog::Tracing::TraceOperation#@resource and Datadog::Tracing::SpanOperation#@resource
+static ID at_id_id;            // Datadog::Tracing::SpanOperation#@id
+static ID at_type_id;          // Datadog::Tracing::SpanOperation#@type
+
+// Used to tell minor and major GCs apart, see on_gc_event
+static VALUE major_by_symbol = Qnil;
+
+// Only one instance can be sampling at a time, as there's only one SIGPROF handler and the postponed job needs to know
+// which instance to sample. Set/cleared by _native_start/_native_stop.
+static VALUE active_sampler_instance = Qnil;
+
+// Maximum number of threads with an active CPU-time timer; other threads get their CPU-time sampled periodically
+#define MAX_CPU_TIME_TIMERS 256
+#define NO_CPU_TIME_TIMER_SLOT -1
+
+// See runqueue_wait_now_ns
+#define SCHEDSTAT_NOT_OPEN -1
+#define SCHEDSTAT_UNAVAILABLE -2
+
+// Indexed by a thread's `cpu_time_timer_slot`; set by the signal handler when that thread's CPU-time timer fires, and
+// cleared by sample_cpu_time(). This lives outside of the state struct as the signal handler can't safely look it up.
+static volatile sig_atomic_t pending_cpu_time_samples[MAX_CPU_TIME_TIMERS];
+
 struct cpu_and_wall_time_collector_state {
   // Note: Places in this file that usually need to be changed when this struct is changed are tagged with
   // "Update this when modifying state struct"
   sampling_buffer *sampling_buffer;
+  // Only set when deferring symbolization, NULL otherwise
+  deferred_samples *deferred_samples;
+  // Hashmap <Thread Object, struct per_thread_context>
+  st_table *hash_map_per_thread_context;
   VALUE recorder_instance;
+  // Incremented on every sample; used to detect threads that are gone
+  long sample_count;
+  int max_threads_sampled;
+  // Index, in the thread list, of the first thread to be sampled by the next sample (modulo the number of threads)
+  long next_thread_to_sample;
+  // Used by the sampling trigger thread, see _native_start
+  pthread_t sampling_trigger_thread;
+  // Protects `should_run`, so that stop_sampling_trigger_thread can wake up the sampling trigger while it's waiting
+  pthread_mutex_t sampling_trigger_mutex;
+  pthread_cond_t sampling_trigger_stopped;
+  volatile bool should_run;
+  pid_t sampling_pid; // Process where sampling got started, see sampling_started_in_another_process
+  long sampling_interval_ns; // As configured, see _native_set_sampling_frequency
+  // What the sampling trigger actually uses; can be longer than `sampling_interval_ns` to respect `max_time_usage_pct`
+  volatile long effective_sampling_interval_ns;
+  double max_time_usage_pct;
+  // Where to send the SIGPROF when we can't find the thread holding the GVL (see gvl_owner)
+  rb_nativethread_id_t main_thread_id;
+  bool use_cpu_time_timers;
+  // Which thread is using each CPU-time timer slot (Qnil when free). Threads are kept alive by the hashmap above.
+  VALUE cpu_time_timer_threads[MAX_CPU_TIME_TIMERS];
+  // Overhead stats, see _native_stats
+  long sampling_time_ns_total;
+  long sampling_time_ns_max;
+  long sampling_time_ns_last;
+  // Time spent since the last sample() on other profiler work (sample_cpu_time and flushing deferred samples), which
+  // gets charged to the next sample(), see update_effective_sampling_interval
+  long sampling_time_ns_pending;
+  // Thread-local (fiber-local, actually) key where the tracer keeps its Datadog::Tracing::Context for each thread, or
+  // MISSING_TRACER_CONTEXT_KEY when no tracer is in use
+  ID tracer_context_key;
+  // When false, samples don't get the "trace endpoint" label, see trace_identifiers_for
+  bool endpoint_collection_enabled;
+  // Qnil when not supported by the Ruby VM, see on_gc_event
+  VALUE gc_tracepoint;
+  // Set while the hashmap is being changed in a way that may allocate (and thus trigger the GC), during which the GC
+  // tracepoint can't safely look up contexts
+  bool hash_map_per_thread_context_busy;
+  long gc_samples;
+  long gvl_wait_samples;
+  // Process where the schedstat files of the per-thread contexts were opened, see reset_schedstat_after_fork
+  pid_t schedstat_pid;
+  #ifdef RUBY_INTERNAL_THREAD_EVENT_READY
+    // Only set while sampling, see on_thread_event
+    rb_internal_thread_event_hook_t *thread_event_hook;
+  #endif
+};
+
+// Tracks per-thread state
+struct per_thread_context {
+  // Used by ddtrace_rb_profile_frames to only unwind the part of the stack that changed since the last sample
+  stack_snapshot *stack_snapshot;
+  // Value of `sample_count` when this thread was last seen in the thread list
+  long last_seen_at_sample_count;
+  thread_cpu_time_id thread_cpu_time_id;
+  long cpu_time_at_previous_sample_ns;  // Can be INVALID_TIME until initialized or if getting it fails for another reason
+  long wall_time_at_previous_sample_ns; // Can be INVALID_TIME until initialized
+  // Only valid when use_cpu_time_timers is enabled and the collector is sampling, see start_cpu_time_timer
+  cpu_time_timer cpu_time_timer;
+  int cpu_time_timer_slot; // NO_CPU_TIME_TIMER_SLOT when cpu_time_timer is not valid
+  bool cpu_time_timer_failed; // Avoids retrying on every sample; reset by _native_stop
+  // File descriptor for the thread's schedstat file, or SCHEDSTAT_NOT_OPEN/SCHEDSTAT_UNAVAILABLE
+  int schedstat_fd;
+  long runqueue_wait_at_previous_sample_ns; // Can be INVALID_TIME until initialized or if schedstat is unavailable
+  // Reused every time trace_identifiers_for formats the ids for this thread, to avoid allocating
+  char local_root_span_id[MAXIMUM_SPAN_ID_DIGITS];
+  char span_id[MAXIMUM_SPAN_ID_DIGITS];
+  // Time at the GC_ENTER event, or INVALID_TIME when not in GC, see on_gc_event
+  long gc_cpu_time_at_enter_ns;
+  long gc_wall_time_at_enter_ns;
+  // Time spent in GC (indexed by MINOR_GC/MAJOR_GC) not yet recorded, see sample_pending_gc
+  long gc_cpu_time_pending_ns[GC_TYPES_COUNT];
+  long gc_wall_time_pending_ns[GC_TYPES_COUNT];
+};
+
+// Result of trace_identifiers_for; the char slices are only valid until the next time this thread gets sampled
+struct trace_identifiers {
+  bool valid;
+  ddprof_ffi_CharSlice local_root_span_id;
+  ddprof_ffi_CharSlice span_id;
+  ddprof_ffi_CharSlice trace_endpoint; // Empty when there's no endpoint for the trace
+};
+
+// Used by sample() to pass its arguments to sample_thread_from_list
+struct sample_iteration {
+  struct cpu_and_wall_time_collector_state *state;
+  long current_wall_time_ns;
+  bool arm_cpu_time_timers;
+  long thread_count;
+  long threads_to_sample;
+  long first_thread_to_sample;
+  long thread_index; // Position of the current thread in the thread list
 };
 
 static void cpu_and_wall_time_collector_typed_data_mark(void *state_ptr);
 static void cpu_and_wall_time_collector_typed_data_free(void *state_ptr);
+static size_t cpu_and_wall_time_collector_typed_data_size(const void *state_ptr);
+static int hash_map_per_thread_context_memsize(st_data_t _thread, st_data_t value_context, st_data_t size_ptr);
 static VALUE _native_new(VALUE klass);
-static VALUE _native_initialize(VALUE self, VALUE collector_instance, VALUE recorder_instance, VALUE max_frames);
+static VALUE _native_initialize(
+  VALUE self,
+  VALUE collector_instance,
+  VALUE recorder_instance,
+  VALUE max_frames,
+  VALUE defer_symbolization,
+  VALUE use_cpu_time_timers,
+  VALUE max_time_usage_pct,
+  VALUE max_threads_sampled,
+  VALUE tracer_context_key,
+  VALUE endpoint_collection_enabled
+);
 static VALUE _native_sample(VALUE self, VALUE collector_instance);
 static void sample(VALUE collector_instance);
+static void sample_cpu_time(VALUE collector_instance);
+static bool count_thread(VALUE _thread, void *thread_count);
+static bool sample_thread_from_list(VALUE thread, void *iteration_ptr);
+static void record_thread_sample(
+  struct cpu_and_wall_time_collector_state *state,
+  VALUE thread,
+  struct per_thread_context *thread_context,
+  long cpu_time_ns,
+  long cpu_samples,
+  long wall_time_ns,
+  long runqueue_wait_ns
+);
+static int labels_for(
+  struct cpu_and_wall_time_collector_state *state,
+  VALUE thread,
+  struct per_thread_context *thread_context,
+  ddprof_ffi_Label *label_buffer
+);
 static VALUE _native_thread_list(VALUE self);
+static struct per_thread_context *get_or_create_context_for(VALUE thread, struct cpu_and_wall_time_collector_state *state);
+static int hash_map_per_thread_context_mark(st_data_t key_thread, st_data_t value_context, st_data_t _argument);
+static int hash_map_per_thread_context_free_values(st_data_t _thread, st_data_t value_per_thread_context, st_data_t _argument);
+static int remove_context_if_not_seen(st_data_t _thread, st_data_t value_context, st_data_t argument);
+static VALUE _native_per_thread_context(VALUE self, VALUE collector_instance);
+static int per_thread_context_as_ruby_hash(st_data_t key_thread, st_data_t value_context, st_data_t result_hash);
+static VALUE _native_flush_deferred_samples(VALUE self, VALUE collector_instance);
+static void flush_deferred_samples(VALUE collector_instance);
+static VALUE _native_deferred_samples_count(VALUE self, VALUE collector_instance);
+static void request_deferred_samples_flush(struct cpu_and_wall_time_collector_state *state, VALUE collector_instance);
+static void flush_deferred_samples_from_postponed_job(void *_unused);
+static VALUE flush_deferred_samples_protected(VALUE collector_instance);
+static VALUE _native_start(VALUE self, VALUE collector_instance);
+static VALUE _native_stop(VALUE self, VALUE collector_instance);
+static VALUE _native_set_sampling_frequency(VALUE self, VALUE collector_instance, VALUE sampling_frequency_hz);
+static void stop_sampling_trigger_thread(struct cpu_and_wall_time_collector_state *state);
+static bool sampling_started_in_another_process(struct cpu_and_wall_time_collector_state *state);
+static void stop_sampling(VALUE collector_instance, struct cpu_and_wall_time_collector_state *state);
+static void install_sigprof_signal_handler(void);
+static void remove_sigprof_signal_handler(void);
+static void handle_sampling_signal(int _signal, siginfo_t *info, void *_ucontext);
+static void *run_sampling_trigger_loop(void *state_ptr);
+static void sample_from_postponed_job(void *_unused);
+static VALUE sample_protected(VALUE collector_instance);
+static void sample_cpu_time_from_postponed_job(void *_unused);
+static VALUE sample_cpu_time_protected(VALUE collector_instance);
+static void start_cpu_time_timer(struct cpu_and_wall_time_collector_state *state, VALUE thread, struct per_thread_context *thread_context);
+static void stop_cpu_time_timer(struct cpu_and_wall_time_collector_state *state, struct per_thread_context *thread_context);
+static int stop_cpu_time_timer_for_context(st_data_t _thread, st_data_t value_context, st_data_t state_ptr);
+static long update_time_since_previous_sample(long *time_at_previous_sample_ns, long current_time_ns);
+static long cpu_time_now_ns(struct per_thread_context *thread_context);
+static long wall_time_now_ns(void);
+static long runqueue_wait_now_ns(VALUE thread, struct per_thread_context *thread_context);
+static void reset_schedstat_after_fork(struct cpu_and_wall_time_collector_state *state);
+static int reset_schedstat_for_context(st_data_t _thread, st_data_t value_context, st_data_t _argument);
+static void update_effective_sampling_interval(struct cpu_and_wall_time_collector_state *state, long sampling_time_ns);
+static VALUE _native_stats(VALUE self, VALUE collector_instance);
+static void trace_identifiers_for(
+  struct cpu_and_wall_time_collector_state *state,
+  VALUE thread,
+  struct per_thread_context *thread_context,
+  struct trace_identifiers *trace_identifiers_result
+);
+static bool is_type_web(VALUE root_span_type);
+static void on_gc_event(VALUE tracepoint_data, void *state_ptr);
+static void sample_gc_from_postponed_job(void *_unused);
+static VALUE sample_gc_protected(VALUE collector_instance);
+static void sample_pending_gc(struct cpu_and_wall_time_collector_state *state, VALUE thread, struct per_thread_context *thread_context);
+static void start_thread_event_hook(struct cpu_and_wall_time_collector_state *state);
+static void stop_thread_event_hook(struct cpu_and_wall_time_collector_state *state);
+#ifdef RUBY_INTERNAL_THREAD_EVENT_READY
+  static void on_thread_event(rb_event_flag_t event, const rb_internal_thread_event_data_t *_event_data, void *_unused);
+  static void sample_gvl_wait_from_postponed_job(void *_unused);
+  static VALUE sample_gvl_wait_protected(VALUE collector_instance);
+#endif
 
 void collectors_cpu_and_wall_time_init(VALUE profiling_module) {
   VALUE collectors_module = rb_define_module_under(profiling_module, "Collectors");
@@ -37,9 +346,30 @@ void collectors_cpu_and_wall_time_init(VALUE profiling_module) {
   // https://bugs.ruby-lang.org/issues/18007 for a discussion around this.
   rb_define_alloc_func(collectors_cpu_and_wall_time_class, _native_new);
 
-  rb_define_singleton_method(collectors_cpu_and_wall_time_class, "_native_initialize", _native_initialize, 3);
+  rb_define_singleton_method(collectors_cpu_and_wall_time_class, "_native_initialize", _native_initialize, 9);
   rb_define_singleton_method(collectors_cpu_and_wall_time_class, "_native_sample", _native_sample, 1);
   rb_define_singleton_method(collectors_cpu_and_wall_time_class, "_native_thread_list", _native_thread_list, 0);
+  rb_define_singleton_method(collectors_cpu_and_wall_time_class, "_native_per_thread_context", _native_per_thread_context, 1);
+  rb_define_singleton_method(collectors_cpu_and_wall_time_class, "_native_flush_deferred_samples", _native_flush_deferred_samples, 1);
+  rb_define_singleton_method(collectors_cpu_and_wall_time_class, "_native_deferred_samples_count", _native_deferred_samples_count, 1);
+  rb_define_singleton_method(collectors_cpu_and_wall_time_class, "_native_start", _native_start, 1);
+  rb_define_singleton_method(collectors_cpu_and_wall_time_class, "_native_stop", _native_stop, 1);
+  rb_define_singleton_method(collectors_cpu_and_wall_time_class, "_native_set_sampling_frequency", _native_set_sampling_frequency, 2);
+  rb_define_singleton_method(collectors_cpu_and_wall_time_class, "_native_stats", _native_stats, 1);
+
+  rb_global_variable(&active_sampler_instance);
+
+  at_active_trace_id = rb_intern_const("@active_trace");
+  at_root_span_id = rb_intern_const("@root_span");
+  at_active_span_id = rb_intern_const("@active_span");
+  at_resource_id = rb_intern_const("@resource");
+  at_id_id = rb_intern_const("@id");
+  at_type_id = rb_intern_const("@type");
+
+  major_by_symbol = ID2SYM(rb_intern_const("major_by"));
+  // The first call to rb_gc_latest_gc_info may allocate (it lazily creates the symbols it uses), and so it MUST NOT
+  // happen inside the GC tracepoint
+  rb_gc_latest_gc_info(major_by_symbol);
 }
 
 // This structure is used to define a Ruby object that stores a pointer to a struct cpu_and_wall_time_collector_state
@@ -49,7 +379,7 @@ static const rb_data_type_t cpu_and_wall_time_collector_typed_data = {
   .function = {
     .dmark = cpu_and_wall_time_collector_typed_data_mark,
     .dfree = cpu_and_wall_time_collector_typed_data_free,
-    .dsize = NULL, // We don't track profile memory usage (although it'd be cool if we did!)
+    .dsize = cpu_and_wall_time_collector_typed_data_size,
     //.dcompact = NULL, // FIXME: Add support for compaction
   },
   .flags = RUBY_TYPED_FREE_IMMEDIATELY
@@ -60,6 +390,10 @@ static void cpu_and_wall_time_collector_typed_data_mark(void *state_ptr) {
 
   // Update this when modifying state struct
   rb_gc_mark(state->recorder_instance);
+  rb_gc_mark(state->gc_tracepoint);
+  sampling_buffer_mark(state->sampling_buffer);
+  deferred_samples_mark(state->deferred_samples);
+  st_foreach(state->hash_map_per_thread_context, hash_map_per_thread_context_mark, 0 /* unused */);
 }
 
 static void cpu_and_wall_time_collector_typed_data_free(void *state_ptr) {
@@ -69,23 +403,135 @@ static void cpu_and_wall_time_collector_typed_data_free(void *state_ptr) {
 
   // Important: Remember that we're only guaranteed to see here what's been set in _native_new, aka
   // pointers that have been set NULL there may still be NULL here.
+
+  // This can only happen when the VM is shutting down, as otherwise the active_sampler_instance keeps us alive
+  if (state->should_run) {
+    stop_sampling_trigger_thread(state);
+    stop_thread_event_hook(state);
+  }
+
   if (state->sampling_buffer != NULL) sampling_buffer_free(state->sampling_buffer);
+  if (state->deferred_samples != NULL) deferred_samples_free(state->deferred_samples);
+
+  // Free each entry in the map
+  st_foreach(state->hash_map_per_thread_context, hash_map_per_thread_context_free_values, 0 /* unused */);
+  // ...and then the map
+  st_free_table(state->hash_map_per_thread_context);
+
+  pthread_mutex_destroy(&state->sampling_trigger_mutex);
+  pthread_cond_destroy(&state->sampling_trigger_stopped);
 
   ruby_xfree(state);
 }
 
+static size_t cpu_and_wall_time_collector_typed_data_size(const void *state_ptr) {
+  const struct cpu_and_wall_time_collector_state *state = (const struct cpu_and_wall_time_collector_state *) state_ptr;
+
+  // Update this when modifying state struct
+  size_t size =
+    sizeof(struct cpu_and_wall_time_collector_state) +
+    sampling_buffer_memsize(state->sampling_buffer) +
+    deferred_samples_memsize(state->deferred_samples) +
+    st_memsize(state->hash_map_per_thread_context);
+  st_foreach(state->hash_map_per_thread_context, hash_map_per_thread_context_memsize, (st_data_t) &size);
+
+  return size;
+}
+
+static int hash_map_per_thread_context_memsize(st_data_t _thread, st_data_t value_context, st_data_t size_ptr) {
+  struct per_thread_context *thread_context = (struct per_thread_context *) value_context;
+
+  *((size_t *) size_ptr) += sizeof(struct per_thread_context) + stack_snapshot_memsize(thread_context->stack_snapshot);
+
+  return ST_CONTINUE;
+}
+
+// Mark Ruby thread references we keep as keys in hash_map_per_thread_context, as well as the frames in each thread's
+// stack snapshot.
+// Note: rb_gc_mark (and not rb_gc_mark_movable) is used, as the keys of the hashmap are the object addresses.
+static int hash_map_per_thread_context_mark(st_data_t key_thread, st_data_t value_context, st_data_t _argument) {
+  VALUE thread = (VALUE) key_thread;
+  struct per_thread_context *thread_context = (struct per_thread_context *) value_context;
+
+  rb_gc_mark(thread);
+  stack_snapshot_mark(thread_context->stack_snapshot);
+
+  return ST_CONTINUE;
+}
+
+// Used to clear each of the per_thread_contexts inside the hash_map_per_thread_context
+static int hash_map_per_thread_context_free_values(st_data_t _thread, st_data_t value_per_thread_context, st_data_t _argument) {
+  struct per_thread_context *per_thread_context = (struct per_thread_context*) value_per_thread_context;
+  cpu_time_timer_stop(&per_thread_context->cpu_time_timer);
+  if (per_thread_context->schedstat_fd >= 0) close(per_thread_context->schedstat_fd);
+  stack_snapshot_free(per_thread_context->stack_snapshot);
+  ruby_xfree(per_thread_context);
+  return ST_CONTINUE;
+}
+
 static VALUE _native_new(VALUE klass) {
   struct cpu_and_wall_time_collector_state *state = ruby_xcalloc(1, sizeof(struct cpu_and_wall_time_collector_state));
 
   // Update this when modifying state struct
   state->sampling_buffer = NULL;
+  state->deferred_samples = NULL;
+  state->hash_map_per_thread_context =
+   // "numtable" is an awful name, but TL;DR it's what should be used when keys are `VALUE`s.
+    st_init_numtable();
   state->recorder_instance = Qnil;
+  state->sample_count = 0;
+  state->max_threads_sampled = 0;
+  state->next_thread_to_sample = 0;
+  pthread_mutex_init(&state->sampling_trigger_mutex, NULL);
+  pthread_cond_init(&state->sampling_trigger_stopped, NULL);
+  state->should_run = false;
+  state->sampling_pid = getpid();
+  state->sampling_interval_ns = 1000L * 1000 * 1000 / DEFAULT_SAMPLING_FREQUENCY_HZ;
+  state->effective_sampling_interval_ns = state->sampling_interval_ns;
+  state->max_time_usage_pct = DEFAULT_MAX_TIME_USAGE_PCT;
+  state->sampling_time_ns_total = 0;
+  state->sampling_time_ns_max = 0;
+  state->sampling_time_ns_last = 0;
+  state->sampling_time_ns_pending = 0;
+  state->tracer_context_key = MISSING_TRACER_CONTEXT_KEY;
+  state->use_cpu_time_timers = false;
+  for (int i = 0; i < MAX_CPU_TIME_TIMERS; i++) state->cpu_time_timer_threads[i] = Qnil;
+  state->gc_tracepoint = Qnil;
+  state->hash_map_per_thread_context_busy = false;
+  state->gc_samples = 0;
+  state->gvl_wait_samples = 0;
+  state->schedstat_pid = getpid();
+  #ifdef RUBY_INTERNAL_THREAD_EVENT_READY
+    state->thread_event_hook = NULL;
+  #endif
 
   return TypedData_Wrap_Struct(collectors_cpu_and_wall_time_class, &cpu_and_wall_time_collector_typed_data, state);
 }
 
-static VALUE _native_initialize(VALUE self, VALUE collector_instance, VALUE recorder_instance, VALUE max_frames) {
+static VALUE _native_initialize(
+  VALUE self,
+  VALUE collector_instance,
+  VALUE recorder_instance,
+  VALUE max_frames,
+  VALUE defer_symbolization,
+  VALUE use_cpu_time_timers,
+  VALUE max_time_usage_pct,
+  VALUE max_threads_sampled,
+  VALUE tracer_context_key,
+  VALUE endpoint_collection_enabled
+) {
   enforce_recorder_instance(recorder_instance);
+  ENFORCE_BOOLEAN(defer_symbolization);
+  ENFORCE_BOOLEAN(use_cpu_time_timers);
+  ENFORCE_BOOLEAN(endpoint_collection_enabled);
+  double max_time_usage_pct_requested = NUM2DBL(max_time_usage_pct);
+  if (max_time_usage_pct_requested <= 0 || max_time_usage_pct_requested > 100) {
+    rb_raise(rb_eArgError, "Invalid max_time_usage_pct: value must be > 0 and <= 100");
+  }
+
+  #ifndef HAVE_PTHREAD_GETCPUCLOCKID
+    if (use_cpu_time_timers == Qtrue) rb_raise(rb_eArgError, "CPU-time timers are not supported on this platform");
+  #endif
 
   struct cpu_and_wall_time_collector_state *state;
   TypedData_Get_Struct(collector_instance, struct cpu_and_wall_time_collector_state, &cpu_and_wall_time_collector_typed_data, state);
@@ -93,9 +539,35 @@ static VALUE _native_initialize(VALUE self, VALUE collector_instance, VALUE reco
   int max_frames_requested = NUM2INT(max_frames);
   if (max_frames_requested < 0) rb_raise(rb_eArgError, "Invalid max_frames: value must not be negative");
 
+  int max_threads_sampled_requested = NUM2INT(max_threads_sampled);
+  if (max_threads_sampled_requested <= 0) rb_raise(rb_eArgError, "Invalid max_threads_sampled: value must be positive");
+
   // Update this when modifying state struct
   state->sampling_buffer = sampling_buffer_new(max_frames_requested);
   state->recorder_instance = recorder_instance;
+  state->use_cpu_time_timers = (use_cpu_time_timers == Qtrue);
+  state->max_time_usage_pct = max_time_usage_pct_requested;
+  state->max_threads_sampled = max_threads_sampled_requested;
+  state->endpoint_collection_enabled = (endpoint_collection_enabled == Qtrue);
+  if (tracer_context_key != Qnil) {
+    Check_Type(tracer_context_key, T_SYMBOL);
+    // Note: SYM2ID makes the symbol immortal (if it was a dynamic symbol), so we don't need to mark it
+    state->tracer_context_key = SYM2ID(tracer_context_key);
+  }
+
+  #ifdef RUBY_INTERNAL_EVENT_GC_ENTER // Ruby 2.3+
+    state->gc_tracepoint =
+      rb_tracepoint_new(Qnil /* all threads */, RUBY_INTERNAL_EVENT_GC_ENTER | RUBY_INTERNAL_EVENT_GC_EXIT, on_gc_event, state);
+  #endif
+
+  // Note: Registering the hook again (e.g. if this gets initialized again with the same recorder) is a no-op
+  if (defer_symbolization == Qtrue && state->deferred_samples == NULL) {
+    // Samples get lazily sized for the stacks seen, as presizing all of them for max_frames would take a lot of memory
+    state->deferred_samples = deferred_samples_new(DEFERRED_SAMPLES_CAPACITY, 0, 0, 0);
+  }
+  if (defer_symbolization == Qtrue) {
+    recorder_add_before_serialize_hook(recorder_instance, flush_deferred_samples, collector_instance);
+  }
 
   return Qtrue;
 }
@@ -111,31 +583,1022 @@ static void sample(VALUE collector_instance) {
   struct cpu_and_wall_time_collector_state *state;
   TypedData_Get_Struct(collector_instance, struct cpu_and_wall_time_collector_state, &cpu_and_wall_time_collector_typed_data, state);
 
-  VALUE threads = ddtrace_thread_list();
+  // Note: We use ddtrace_thread_list_each (and not ddtrace_thread_list) so that sampling does not allocate any Ruby objects
+  long thread_count = 0;
+  ddtrace_thread_list_each(count_thread, &thread_count);
+
+  reset_schedstat_after_fork(state);
+
+  state->sample_count++;
+  long current_wall_time_ns = wall_time_now_ns();
+  const long threads_to_sample = thread_count < state->max_threads_sampled ? thread_count : state->max_threads_sampled;
+  const long first_thread_to_sample = thread_count > 0 ? state->next_thread_to_sample % thread_count : 0;
+  state->next_thread_to_sample = first_thread_to_sample + threads_to_sample;
+
+  struct sample_iteration iteration = {
+    .state = state,
+    .current_wall_time_ns = current_wall_time_ns,
+    // CPU-time timers target the sampling signal handler, so they're only used while this instance is sampling
+    .arm_cpu_time_timers = state->use_cpu_time_timers && active_sampler_instance == collector_instance,
+    .thread_count = thread_count,
+    .threads_to_sample = threads_to_sample,
+    .first_thread_to_sample = first_thread_to_sample,
+    .thread_index = 0,
+  };
+  ddtrace_thread_list_each(sample_thread_from_list, &iteration);
+
+  // Clean up contexts for threads that are no longer alive (they were not included in the thread list above)
+  st_foreach(state->hash_map_per_thread_context, remove_context_if_not_seen, (st_data_t) state);
+
+  long sampling_time_ns = wall_time_now_ns() - current_wall_time_ns + state->sampling_time_ns_pending;
+  state->sampling_time_ns_pending = 0;
+  update_effective_sampling_interval(state, sampling_time_ns);
+
+  request_deferred_samples_flush(state, collector_instance);
+}
+
+static bool count_thread(VALUE _thread, void *thread_count) {
+  (*((long *) thread_count))++;
+  return true;
+}
+
+static bool sample_thread_from_list(VALUE thread, void *iteration_ptr) {
+  struct sample_iteration *iteration = (struct sample_iteration *) iteration_ptr;
+  struct cpu_and_wall_time_collector_state *state = iteration->state;
+  long i = iteration->thread_index++;
+
+  struct per_thread_context *thread_context = get_or_create_context_for(thread, state);
+  thread_context->last_seen_at_sample_count = state->sample_count;
+
+  if (iteration->arm_cpu_time_timers && !thread_context->cpu_time_timer.valid && !thread_context->cpu_time_timer_failed) {
+    start_cpu_time_timer(state, thread, thread_context);
+  }
+
+  // Skip threads outside of [first_thread_to_sample, first_thread_to_sample + threads_to_sample), wrapping around
+  // the end of the list. Note that we still needed to get their context, as otherwise it would be considered gone.
+  if ((i - iteration->first_thread_to_sample + iteration->thread_count) % iteration->thread_count >= iteration->threads_to_sample) {
+    return true;
+  }
+
+  // Usually GC time gets recorded right after the GC, but we pick up here anything that was left behind
+  sample_pending_gc(state, thread, thread_context);
+
+  // Threads with an active CPU-time timer get their CPU-time recorded by sample_cpu_time() instead
+  bool sample_cpu_time_periodically = !thread_context->cpu_time_timer.valid;
+
+  long cpu_time_elapsed_ns = sample_cpu_time_periodically ?
+    update_time_since_previous_sample(&thread_context->cpu_time_at_previous_sample_ns, cpu_time_now_ns(thread_context)) : 0;
+  long wall_time_elapsed_ns =
+    update_time_since_previous_sample(&thread_context->wall_time_at_previous_sample_ns, iteration->current_wall_time_ns);
+  // Reading the run-queue wait needs a syscall per thread, so we skip it when the recorder would drop it anyway
+  long runqueue_wait_elapsed_ns = recorder_value_type_enabled(state->recorder_instance, OS_RUNQUEUE_WAIT_VALUE_POS) ?
+    update_time_since_previous_sample(&thread_context->runqueue_wait_at_previous_sample_ns, runqueue_wait_now_ns(thread, thread_context)) : 0;
+
+  record_thread_sample(
+    state,
+    thread,
+    thread_context,
+    cpu_time_elapsed_ns,
+    sample_cpu_time_periodically ? 1 : 0,
+    wall_time_elapsed_ns,
+    runqueue_wait_elapsed_ns
+  );
+
+  return true;
+}
+
+// If sampling took `sampling_time_ns`, and that should be at most `max_time_usage_pct` of the time, then we need to wait
+// for the remaining (100% - max_time_usage_pct) before sampling again. E.g. if sampling took 1ms, and
+// max_time_usage_pct is 2%, then we need to wait for 49ms.
+//
+// The `sampling_time_ns` includes other profiler work done since the previous sample (see sampling_time_ns_pending), so
+// that sampling CPU-time using timers or flushing deferred samples can't exceed the budget unnoticed. The wait is capped
+// at MAX_EFFECTIVE_SAMPLING_INTERVAL_NS.
+//
+// This is the same approach as in Datadog::Profiling::Collectors::OldStack#compute_wait_time.
+static void update_effective_sampling_interval(struct cpu_and_wall_time_collector_state *state, long sampling_time_ns) {
+  state->sampling_time_ns_total += sampling_time_ns;
+  state->sampling_time_ns_last = sampling_time_ns;
+  if (sampling_time_ns > state->sampling_time_ns_max) state->sampling_time_ns_max = sampling_time_ns;
+
+  long wait_time_ns = (long) (sampling_time_ns / (state->max_time_usage_pct / 100.0)) - sampling_time_ns;
+
+  if (wait_time_ns > MAX_EFFECTIVE_SAMPLING_INTERVAL_NS) wait_time_ns = MAX_EFFECTIVE_SAMPLING_INTERVAL_NS;
+
+  state->effective_sampling_interval_ns =
+    wait_time_ns > state->sampling_interval_ns ? wait_time_ns : state->sampling_interval_ns;
+}
+
+// Returns a hash with the time spent sampling, and the current sampling interval, which can be reported as metrics
+static VALUE _native_stats(VALUE self, VALUE collector_instance) {
+  struct cpu_and_wall_time_collector_state *state;
+  TypedData_Get_Struct(collector_instance, struct cpu_and_wall_time_collector_state, &cpu_and_wall_time_collector_typed_data, state);
+
+  VALUE stats_as_hash = rb_hash_new();
+  rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("sample_count")), LONG2NUM(state->sample_count));
+  rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("sampling_time_ns_total")), LONG2NUM(state->sampling_time_ns_total));
+  rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("sampling_time_ns_max")), LONG2NUM(state->sampling_time_ns_max));
+  rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("sampling_time_ns_last")), LONG2NUM(state->sampling_time_ns_last));
+  rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("sampling_interval_ns")), LONG2NUM(state->sampling_interval_ns));
+  rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("effective_sampling_interval_ns")), LONG2NUM(state->effective_sampling_interval_ns));
+  rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("gc_samples")), LONG2NUM(state->gc_samples));
+  rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("gvl_wait_samples")), LONG2NUM(state->gvl_wait_samples));
+  if (state->deferred_samples != NULL) {
+    rb_hash_aset(
+      stats_as_hash,
+      ID2SYM(rb_intern("deferred_samples_dropped")),
+      ULONG2NUM(deferred_samples_dropped(state->deferred_samples))
+    );
+  }
+  return stats_as_hash;
+}
+
+// Samples the threads whose CPU-time timer fired since the last call, see the top of this file for details
+static void sample_cpu_time(VALUE collector_instance) {
+  struct cpu_and_wall_time_collector_state *state;
+  TypedData_Get_Struct(collector_instance, struct cpu_and_wall_time_collector_state, &cpu_and_wall_time_collector_typed_data, state);
+
+  long start_wall_time_ns = wall_time_now_ns();
+
+  for (int slot = 0; slot < MAX_CPU_TIME_TIMERS; slot++) {
+    if (!pending_cpu_time_samples[slot]) continue;
+    pending_cpu_time_samples[slot] = 0;
+
+    VALUE thread = state->cpu_time_timer_threads[slot];
+    st_data_t value_context = 0;
+    if (thread == Qnil || !st_lookup(state->hash_map_per_thread_context, (st_data_t) thread, &value_context)) continue;
+    struct per_thread_context *thread_context = (struct per_thread_context*) value_context;
 
-  const long thread_count = RARRAY_LEN(threads);
-  for (long i = 0; i < thread_count; i++) {
-    VALUE thread = RARRAY_AREF(threads, i);
+    long cpu_time_elapsed_ns =
+      update_time_since_previous_sample(&thread_context->cpu_time_at_previous_sample_ns, cpu_time_now_ns(thread_context));
 
-    int64_t metric_values[ENABLED_VALUE_TYPES_COUNT] = {0};
+    // Note: Wall-time and os-runqueue-wait are sampled periodically
+    record_thread_sample(state, thread, thread_context, cpu_time_elapsed_ns, 1, 0, 0);
+  }
+
+  state->sampling_time_ns_pending += wall_time_now_ns() - start_wall_time_ns;
+}
+
+static void record_thread_sample(
+  struct cpu_and_wall_time_collector_state *state,
+  VALUE thread,
+  struct per_thread_context *thread_context,
+  long cpu_time_ns,
+  long cpu_samples,
+  long wall_time_ns,
+  long runqueue_wait_ns
+) {
+  int64_t metric_values[ALL_VALUE_TYPES_COUNT] = {0};
+
+  metric_values[CPU_TIME_VALUE_POS] = cpu_time_ns;
+  metric_values[CPU_SAMPLES_VALUE_POS] = cpu_samples;
+  metric_values[WALL_TIME_VALUE_POS] = wall_time_ns;
+  metric_values[OS_RUNQUEUE_WAIT_VALUE_POS] = runqueue_wait_ns;
+
+  ddprof_ffi_Slice_i64 metric_values_slice = {.ptr = metric_values, .len = ALL_VALUE_TYPES_COUNT};
 
-    // FIXME: TODO These are just dummy values for now
-    metric_values[CPU_TIME_VALUE_POS] = 12;
-    metric_values[CPU_SAMPLES_VALUE_POS] = 34;
-    metric_values[WALL_TIME_VALUE_POS] = 56;
+  ddprof_ffi_Label label_buffer[MAX_LABELS_PER_SAMPLE];
+  ddprof_ffi_Slice_label labels = {.ptr = label_buffer, .len = labels_for(state, thread, thread_context, label_buffer)};
 
+  if (state->deferred_samples != NULL) {
+    sample_thread_deferred(
+      thread,
+      state->sampling_buffer,
+      state->deferred_samples,
+      metric_values_slice,
+      labels,
+      thread_context->stack_snapshot
+    );
+  } else {
     sample_thread(
       thread,
       state->sampling_buffer,
       state->recorder_instance,
-      (ddprof_ffi_Slice_i64) {.ptr = metric_values, .len = ENABLED_VALUE_TYPES_COUNT},
-      (ddprof_ffi_Slice_label) {.ptr = NULL, .len = 0} // FIXME: TODO we need to gather the expected labels
+      metric_values_slice,
+      labels,
+      thread_context->stack_snapshot
     );
   }
 }
 
+// Fills in the labels that get added to every sample of this thread (e.g. from the active trace), returning how many
+// were added. The `label_buffer` needs to have space for MAX_LABELS_PER_SAMPLE entries.
+static int labels_for(
+  struct cpu_and_wall_time_collector_state *state,
+  VALUE thread,
+  struct per_thread_context *thread_context,
+  ddprof_ffi_Label *label_buffer
+) {
+  int labels_count = 0;
+
+  struct trace_identifiers trace_identifiers_result = {.valid = false};
+  trace_identifiers_for(state, thread, thread_context, &trace_identifiers_result);
+
+  if (trace_identifiers_result.valid) {
+    label_buffer[labels_count++] =
+      (ddprof_ffi_Label) {.key = DDPROF_FFI_CHARSLICE_C("local root span id"), .str = trace_identifiers_result.local_root_span_id};
+    label_buffer[labels_count++] =
+      (ddprof_ffi_Label) {.key = DDPROF_FFI_CHARSLICE_C("span id"), .str = trace_identifiers_result.span_id};
+
+    if (trace_identifiers_result.trace_endpoint.len > 0) {
+      label_buffer[labels_count++] =
+        (ddprof_ffi_Label) {.key = DDPROF_FFI_CHARSLICE_C("trace endpoint"), .str = trace_identifiers_result.trace_endpoint};
+    }
+  }
+
+  return labels_count;
+}
+
 // This method exists only to enable testing Datadog::Profiling::Collectors::CpuAndWallTime behavior using RSpec.
 // It SHOULD NOT be used for other purposes.
 static VALUE _native_thread_list(VALUE self) {
   return ddtrace_thread_list();
 }
+
+static struct per_thread_context *get_or_create_context_for(VALUE thread, struct cpu_and_wall_time_collector_state *state) {
+  struct per_thread_context* thread_context = NULL;
+  st_data_t value_context = 0;
+
+  if (st_lookup(state->hash_map_per_thread_context, (st_data_t) thread, &value_context)) {
+    thread_context = (struct per_thread_context*) value_context;
+  } else {
+    thread_context = ruby_xcalloc(1, sizeof(struct per_thread_context));
+    thread_context->stack_snapshot = stack_snapshot_new();
+    thread_context->thread_cpu_time_id = thread_cpu_time_id_for(thread);
+    thread_context->cpu_time_at_previous_sample_ns = INVALID_TIME;
+    thread_context->wall_time_at_previous_sample_ns = INVALID_TIME;
+    thread_context->cpu_time_timer = (cpu_time_timer) {.valid = false};
+    thread_context->cpu_time_timer_slot = NO_CPU_TIME_TIMER_SLOT;
+    thread_context->cpu_time_timer_failed = false;
+    thread_context->gc_cpu_time_at_enter_ns = INVALID_TIME;
+    thread_context->gc_wall_time_at_enter_ns = INVALID_TIME;
+    thread_context->schedstat_fd = SCHEDSTAT_NOT_OPEN;
+    thread_context->runqueue_wait_at_previous_sample_ns = INVALID_TIME;
+
+    // st_insert may need to grow the hashmap, and thus trigger the GC, see on_gc_event
+    state->hash_map_per_thread_context_busy = true;
+    st_insert(state->hash_map_per_thread_context, (st_data_t) thread, (st_data_t) thread_context);
+    state->hash_map_per_thread_context_busy = false;
+  }
+
+  return thread_context;
+}
+
+static int remove_context_if_not_seen(st_data_t _thread, st_data_t value_context, st_data_t argument) {
+  struct per_thread_context *thread_context = (struct per_thread_context*) value_context;
+  struct cpu_and_wall_time_collector_state *state = (struct cpu_and_wall_time_collector_state *) argument;
+
+  if (thread_context->last_seen_at_sample_count == state->sample_count) return ST_CONTINUE;
+
+  stop_cpu_time_timer(state, thread_context);
+  hash_map_per_thread_context_free_values(0 /* unused */, value_context, 0 /* unused */);
+  return ST_DELETE;
+}
+
+// This method exists only to enable testing Datadog::Profiling::Collectors::CpuAndWallTime behavior using RSpec.
+// It SHOULD NOT be used for other purposes.
+static VALUE _native_per_thread_context(VALUE self, VALUE collector_instance) {
+  struct cpu_and_wall_time_collector_state *state;
+  TypedData_Get_Struct(collector_instance, struct cpu_and_wall_time_collector_state, &cpu_and_wall_time_collector_typed_data, state);
+
+  VALUE result = rb_hash_new();
+  st_foreach(state->hash_map_per_thread_context, per_thread_context_as_ruby_hash, result);
+  return result;
+}
+
+static int per_thread_context_as_ruby_hash(st_data_t key_thread, st_data_t value_context, st_data_t result_hash) {
+  VALUE thread = (VALUE) key_thread;
+  struct per_thread_context *thread_context = (struct per_thread_context*) value_context;
+  VALUE result = (VALUE) result_hash;
+  VALUE context_as_hash = rb_hash_new();
+  rb_hash_aset(result, thread, context_as_hash);
+
+  rb_hash_aset(context_as_hash, ID2SYM(rb_intern("last_seen_at_sample_count")), LONG2NUM(thread_context->last_seen_at_sample_count));
+  rb_hash_aset(context_as_hash, ID2SYM(rb_intern("thread_cpu_time_id_valid?")), thread_context->thread_cpu_time_id.valid ? Qtrue : Qfalse);
+  rb_hash_aset(context_as_hash, ID2SYM(rb_intern("cpu_time_at_previous_sample_ns")), LONG2NUM(thread_context->cpu_time_at_previous_sample_ns));
+  rb_hash_aset(context_as_hash, ID2SYM(rb_intern("wall_time_at_previous_sample_ns")), LONG2NUM(thread_context->wall_time_at_previous_sample_ns));
+  rb_hash_aset(context_as_hash, ID2SYM(rb_intern("cpu_time_timer_active?")), thread_context->cpu_time_timer.valid ? Qtrue : Qfalse);
+  rb_hash_aset(context_as_hash, ID2SYM(rb_intern("runqueue_wait_at_previous_sample_ns")), LONG2NUM(thread_context->runqueue_wait_at_previous_sample_ns));
+
+  return ST_CONTINUE;
+}
+
+// Symbolizes and records any samples that were deferred. This gets called automatically before the recorder is
+// serialized, but can also be called at any other time where the cost of doing so is less of a concern than while
+// sampling.
+static VALUE _native_flush_deferred_samples(VALUE self, VALUE collector_instance) {
+  flush_deferred_samples(collector_instance);
+  return Qtrue;
+}
+
+static void flush_deferred_samples(VALUE collector_instance) {
+  struct cpu_and_wall_time_collector_state *state;
+  TypedData_Get_Struct(collector_instance, struct cpu_and_wall_time_collector_state, &cpu_and_wall_time_collector_typed_data, state);
+
+  if (state->deferred_samples == NULL) return;
+
+  long start_wall_time_ns = wall_time_now_ns();
+  deferred_samples_flush(state->deferred_samples, state->sampling_buffer, state->recorder_instance);
+  state->sampling_time_ns_pending += wall_time_now_ns() - start_wall_time_ns;
+}
+
+// This method exists only to enable testing Datadog::Profiling::Collectors::CpuAndWallTime behavior using RSpec.
+// It SHOULD NOT be used for other purposes.
+static VALUE _native_deferred_samples_count(VALUE self, VALUE collector_instance) {
+  struct cpu_and_wall_time_collector_state *state;
+  TypedData_Get_Struct(collector_instance, struct cpu_and_wall_time_collector_state, &cpu_and_wall_time_collector_typed_data, state);
+
+  return state->deferred_samples == NULL ? INT2FIX(0) : UINT2NUM(deferred_samples_count(state->deferred_samples));
+}
+
+// Deferred samples get flushed from their own postponed job, so that the cost of symbolizing them doesn't get added to
+// the sample that happened to fill up the queue. Only needed while sampling: otherwise, nothing else gets deferred.
+static void request_deferred_samples_flush(struct cpu_and_wall_time_collector_state *state, VALUE collector_instance) {
+  if (state->deferred_samples == NULL || active_sampler_instance != collector_instance) return;
+  if (deferred_samples_count(state->deferred_samples) < deferred_samples_capacity(state->deferred_samples) / 2) return;
+
+  // Note: If there's already a pending flush request, this is a no-op
+  rb_postponed_job_register_one(0, flush_deferred_samples_from_postponed_job, NULL);
+}
+
+static void flush_deferred_samples_from_postponed_job(void *_unused) {
+  VALUE collector_instance = active_sampler_instance;
+
+  // The sampler may have been stopped after this job was requested; anything left gets flushed before serialization
+  if (collector_instance == Qnil) return;
+
+  // We can't let exceptions escape from a postponed job, as there's no Ruby code above us to handle them
+  int exception_state;
+  rb_protect(flush_deferred_samples_protected, collector_instance, &exception_state);
+  if (exception_state) rb_set_errinfo(Qnil);
+}
+
+static VALUE flush_deferred_samples_protected(VALUE collector_instance) {
+  flush_deferred_samples(collector_instance);
+  return Qnil;
+}
+
+// Returns the time elapsed since the previous sample (or zero if there was no previous sample), and updates the
+// previous sample time.
+static long update_time_since_previous_sample(long *time_at_previous_sample_ns, long current_time_ns) {
+  // Invalidate previous state of the counter (if any), it's no longer accurate. We need to get two good reads
+  // in a row to have an accurate delta.
+  if (current_time_ns == INVALID_TIME) {
+    *time_at_previous_sample_ns = INVALID_TIME;
+    return 0;
+  }
+
+  // If we didn't have a time for the previous sample, we use the current one
+  if (*time_at_previous_sample_ns == INVALID_TIME) *time_at_previous_sample_ns = current_time_ns;
+
+  long elapsed_time_ns = current_time_ns - *time_at_previous_sample_ns;
+  *time_at_previous_sample_ns = current_time_ns;
+
+  return elapsed_time_ns >= 0 ? elapsed_time_ns : 0 /* In case something really weird happened */;
+}
+
+// Returns INVALID_TIME if the CPU time for the thread is not available (e.g. not supported on this platform)
+static long cpu_time_now_ns(struct per_thread_context *thread_context) {
+  thread_cpu_time cpu_time = thread_cpu_time_for(thread_context->thread_cpu_time_id);
+
+  return cpu_time.valid ? cpu_time.result_ns : INVALID_TIME;
+}
+
+static long wall_time_now_ns(void) {
+  struct timespec current_monotonic;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &current_monotonic) != 0) rb_sys_fail("Failed to read CLOCK_MONOTONIC");
+
+  return current_monotonic.tv_nsec + (current_monotonic.tv_sec * 1000 * 1000 * 1000);
+}
+
+// Returns how long (in total) the thread spent runnable, but waiting to be scheduled by the kernel, or INVALID_TIME if
+// that's not available (e.g. not on Linux, or we don't know the thread's native id yet).
+//
+// The schedstat file gets opened the first time this is called for a thread, and is then kept open until the thread's
+// context is removed (or the process forks, see reset_schedstat_after_fork).
+static long runqueue_wait_now_ns(VALUE thread, struct per_thread_context *thread_context) {
+  #ifdef __linux__
+    if (thread_context->schedstat_fd == SCHEDSTAT_UNAVAILABLE) return INVALID_TIME;
+
+    if (thread_context->schedstat_fd == SCHEDSTAT_NOT_OPEN) {
+      long native_thread_id = native_thread_id_for(thread);
+      if (native_thread_id == 0) return INVALID_TIME; // Unknown for now (e.g. the thread is still starting up)
+
+      char schedstat_path[64];
+      snprintf(schedstat_path, sizeof(schedstat_path), "/proc/self/task/%ld/schedstat", native_thread_id);
+
+      int fd = open(schedstat_path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        thread_context->schedstat_fd = SCHEDSTAT_UNAVAILABLE;
+        return INVALID_TIME;
+      }
+      thread_context->schedstat_fd = fd;
+    }
+
+    // The file contains "<time running (ns)> <time waiting on a runqueue (ns)> <timeslices run>"
+    char schedstat[96];
+    ssize_t bytes_read = pread(thread_context->schedstat_fd, schedstat, sizeof(schedstat) - 1, 0);
+    if (bytes_read <= 0) return INVALID_TIME;
+    schedstat[bytes_read] = '\0';
+
+    char *runqueue_wait_start = NULL;
+    strtoull(schedstat, &runqueue_wait_start, 10);
+    char *runqueue_wait_end = NULL;
+    unsigned long long runqueue_wait_ns = strtoull(runqueue_wait_start, &runqueue_wait_end, 10);
+
+    return runqueue_wait_end != runqueue_wait_start ? (long) runqueue_wait_ns : INVALID_TIME;
+  #else
+    return INVALID_TIME;
+  #endif
+}
+
+// A forked child inherits the schedstat files, but they're for the parent's threads (the /proc/self they were opened
+// from was the parent's), so they get closed and then reopened for the child's threads as needed. The previous
+// os-runqueue-wait of each thread gets forgotten too, as the child's threads start counting from zero.
+static void reset_schedstat_after_fork(struct cpu_and_wall_time_collector_state *state) {
+  pid_t current_pid = getpid();
+  if (state->schedstat_pid == current_pid) return;
+
+  st_foreach(state->hash_map_per_thread_context, reset_schedstat_for_context, 0 /* unused */);
+  state->schedstat_pid = current_pid;
+}
+
+static int reset_schedstat_for_context(st_data_t _thread, st_data_t value_context, st_data_t _argument) {
+  struct per_thread_context *thread_context = (struct per_thread_context*) value_context;
+
+  if (thread_context->schedstat_fd >= 0) close(thread_context->schedstat_fd);
+  thread_context->schedstat_fd = SCHEDSTAT_NOT_OPEN;
+  thread_context->runqueue_wait_at_previous_sample_ns = INVALID_TIME;
+
+  return ST_CONTINUE;
+}
+
+// Starts the sampling trigger thread, see the top of this file for details.
+// Raises if another instance is already sampling, or if some other library already installed a SIGPROF handler.
+static VALUE _native_start(VALUE self, VALUE collector_instance) {
+  struct cpu_and_wall_time_collector_state *state;
+  TypedData_Get_Struct(collector_instance, struct cpu_and_wall_time_collector_state, &cpu_and_wall_time_collector_typed_data, state);
+
+  if (state->recorder_instance == Qnil) rb_raise(rb_eRuntimeError, "Could not start CpuAndWallTime: Not initialized");
+  if (active_sampler_instance != Qnil) {
+    struct cpu_and_wall_time_collector_state *active_state;
+    TypedData_Get_Struct(
+      active_sampler_instance, struct cpu_and_wall_time_collector_state, &cpu_and_wall_time_collector_typed_data, active_state
+    );
+
+    // An instance that was sampling when the process forked is not actually sampling in the child, so it's fine to
+    // clean it up and replace it
+    if (sampling_started_in_another_process(active_state)) {
+      stop_sampling(active_sampler_instance, active_state);
+    } else {
+      rb_raise(rb_eRuntimeError, "Could not start CpuAndWallTime: There's already another instance of CpuAndWallTime sampling");
+    }
+  }
+
+  install_sigprof_signal_handler();
+
+  state->main_thread_id = pthread_id_for(rb_thread_main());
+  state->should_run = true;
+  state->sampling_pid = getpid();
+  active_sampler_instance = collector_instance;
+  if (state->gc_tracepoint != Qnil) rb_tracepoint_enable(state->gc_tracepoint);
+  start_thread_event_hook(state);
+
+  int error = pthread_create(&state->sampling_trigger_thread, NULL, run_sampling_trigger_loop, state);
+  if (error != 0) {
+    state->should_run = false;
+    active_sampler_instance = Qnil;
+    if (state->gc_tracepoint != Qnil) rb_tracepoint_disable(state->gc_tracepoint);
+    stop_thread_event_hook(state);
+    remove_sigprof_signal_handler();
+    rb_exc_raise(rb_syserr_new(error, "Could not start CpuAndWallTime: Failed to create sampling trigger thread"));
+  }
+
+  return Qtrue;
+}
+
+// Returns false if this instance was not sampling
+static VALUE _native_stop(VALUE self, VALUE collector_instance) {
+  struct cpu_and_wall_time_collector_state *state;
+  TypedData_Get_Struct(collector_instance, struct cpu_and_wall_time_collector_state, &cpu_and_wall_time_collector_typed_data, state);
+
+  if (active_sampler_instance != collector_instance) return Qfalse;
+
+  stop_sampling(collector_instance, state);
+
+  return Qtrue;
+}
+
+static void stop_sampling(VALUE collector_instance, struct cpu_and_wall_time_collector_state *state) {
+  stop_sampling_trigger_thread(state);
+  if (state->gc_tracepoint != Qnil) rb_tracepoint_disable(state->gc_tracepoint);
+  stop_thread_event_hook(state);
+  st_foreach(state->hash_map_per_thread_context, stop_cpu_time_timer_for_context, (st_data_t) state);
+  remove_sigprof_signal_handler();
+  // Any postponed job that is still pending after this will be a no-op, see sample_from_postponed_job
+  if (active_sampler_instance == collector_instance) active_sampler_instance = Qnil;
+}
+
+// Only the thread that called fork survives in the child, so an instance that was sampling in the parent has no
+// sampling trigger thread (and no CPU-time timers, which don't get inherited either) in the child. The rest of the
+// sampling setup (signal handler, GC tracepoint and thread event hook) does get inherited, and gets undone as usual.
+static bool sampling_started_in_another_process(struct cpu_and_wall_time_collector_state *state) {
+  return state->should_run && state->sampling_pid != getpid();
+}
+
+static VALUE _native_set_sampling_frequency(VALUE self, VALUE collector_instance, VALUE sampling_frequency_hz) {
+  struct cpu_and_wall_time_collector_state *state;
+  TypedData_Get_Struct(collector_instance, struct cpu_and_wall_time_collector_state, &cpu_and_wall_time_collector_typed_data, state);
+
+  int frequency_hz = NUM2INT(sampling_frequency_hz);
+  if (frequency_hz <= 0 || frequency_hz > 1000) {
+    rb_raise(rb_eArgError, "Invalid sampling frequency: value must be between 1 and 1000 Hz");
+  }
+
+  // Note: The sampling trigger thread picks this up on its next iteration. The next sample may still make the effective
+  // interval longer than this, see update_effective_sampling_interval.
+  state->sampling_interval_ns = 1000L * 1000 * 1000 / frequency_hz;
+  state->effective_sampling_interval_ns = state->sampling_interval_ns;
+
+  return Qtrue;
+}
+
+static void stop_sampling_trigger_thread(struct cpu_and_wall_time_collector_state *state) {
+  // There's no thread to join in a forked child, see sampling_started_in_another_process. The mutex may have been held
+  // by the sampling trigger in the parent when it forked, so it gets reinitialized too.
+  if (sampling_started_in_another_process(state)) {
+    state->should_run = false;
+    pthread_mutex_init(&state->sampling_trigger_mutex, NULL);
+    pthread_cond_init(&state->sampling_trigger_stopped, NULL);
+    return;
+  }
+
+  pthread_mutex_lock(&state->sampling_trigger_mutex);
+  state->should_run = false;
+  pthread_cond_signal(&state->sampling_trigger_stopped);
+  pthread_mutex_unlock(&state->sampling_trigger_mutex);
+
+  // The sampling trigger thread never needs the GVL, so it's OK to wait for it while holding it. It wakes up as soon as
+  // it gets signaled above (or, at most, after sending one more SIGPROF).
+  int error = pthread_join(state->sampling_trigger_thread, NULL);
+  if (error != 0) rb_exc_raise(rb_syserr_new(error, "Failed to stop sampling trigger thread"));
+}
+
+static void install_sigprof_signal_handler(void) {
+  struct sigaction signal_handler_config = {.sa_flags = SA_RESTART | SA_SIGINFO};
+  struct sigaction existing_signal_handler_config = {.sa_sigaction = NULL};
+  sigemptyset(&signal_handler_config.sa_mask);
+  signal_handler_config.sa_sigaction = handle_sampling_signal;
+
+  if (sigaction(SIGPROF, &signal_handler_config, &existing_signal_handler_config) != 0) {
+    rb_sys_fail("Could not start CpuAndWallTime: Could not install signal handler");
+  }
+
+  // Because signal handlers are process-wide, we only want to be the owners of SIGPROF if nobody else was using it
+  // (e.g. the stackprof gem)
+  if (existing_signal_handler_config.sa_handler != SIG_DFL && existing_signal_handler_config.sa_handler != SIG_IGN) {
+    // A previous handler already existed. Because the profiler is not going to start, we restore it.
+    sigaction(SIGPROF, &existing_signal_handler_config, NULL);
+    rb_raise(
+      rb_eRuntimeError,
+      "Could not start CpuAndWallTime: There's a pre-existing SIGPROF signal handler (is another profiler running?)"
+    );
+  }
+}
+
+// Note: We don't restore SIG_DFL, as its default action is to terminate the process, and there may still be SIGPROF
+// signals in flight from the sampling trigger thread.
+static void remove_sigprof_signal_handler(void) {
+  struct sigaction signal_handler_config = {.sa_handler = SIG_IGN, .sa_flags = SA_RESTART};
+  sigemptyset(&signal_handler_config.sa_mask);
+
+  if (sigaction(SIGPROF, &signal_handler_config, NULL) != 0) rb_sys_fail("Failure while removing the signal handler");
+}
+
+static void handle_sampling_signal(int _signal, siginfo_t *info, void *_ucontext) {
+  bool from_cpu_time_timer = info != NULL && info->si_code == SI_TIMER;
+
+  // Record which thread consumed the CPU-time before anything else, as the signal may get delivered to a non-Ruby
+  // thread (see below) on Rubies where we don't know the native thread id (see cpu_time_timer_start)
+  if (from_cpu_time_timer) {
+    int slot = info->si_value.sival_int;
+    if (slot >= 0 && slot < MAX_CPU_TIME_TIMERS) pending_cpu_time_samples[slot] = 1;
+  }
+
+  // SIGPROF can also be sent to the whole process (e.g. by `setitimer`), in which case it may end up being delivered to a
+  // thread that is not a Ruby thread, and `rb_postponed_job_register_one` MUST NOT be called from such a thread.
+  if (!ruby_native_thread_p()) return;
+
+  int saved_errno = errno;
+  // Note: If there's already a pending sample request, this is a no-op
+  rb_postponed_job_register_one(0, from_cpu_time_timer ? sample_cpu_time_from_postponed_job : sample_from_postponed_job, NULL);
+  errno = saved_errno;
+}
+
+static void *run_sampling_trigger_loop(void *state_ptr) {
+  struct cpu_and_wall_time_collector_state *state = (struct cpu_and_wall_time_collector_state *) state_ptr;
+
+  // This is not a Ruby thread, so make sure that it never gets any signals, as Ruby would not know how to handle them
+  sigset_t signals_to_block;
+  sigfillset(&signals_to_block);
+  pthread_sigmask(SIG_BLOCK, &signals_to_block, NULL);
+
+  pthread_mutex_lock(&state->sampling_trigger_mutex);
+
+  while (state->should_run) {
+    // Waiting on the condition variable (rather than sleeping) lets stop_sampling_trigger_thread wake us up right away
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    uint64_t deadline_ns = (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_usec * 1000 +
+      (uint64_t) state->effective_sampling_interval_ns;
+    struct timespec deadline = {.tv_sec = deadline_ns / 1000000000, .tv_nsec = deadline_ns % 1000000000};
+
+    bool timed_out = false;
+    while (state->should_run && !timed_out) {
+      timed_out =
+        pthread_cond_timedwait(&state->sampling_trigger_stopped, &state->sampling_trigger_mutex, &deadline) == ETIMEDOUT;
+    }
+
+    if (!state->should_run) break;
+
+    // Note: There's a race here -- by the time the signal gets delivered, the owner may have changed, or even (in very
+    // rare cases) have finished. For the former, the signal handler still runs on a Ruby thread, so that's fine.
+    current_gvl_owner owner = gvl_owner();
+    pthread_kill(owner.valid ? owner.owner : state->main_thread_id, SIGPROF);
+  }
+
+  pthread_mutex_unlock(&state->sampling_trigger_mutex);
+
+  return NULL;
+}
+
+static void sample_from_postponed_job(void *_unused) {
+  VALUE collector_instance = active_sampler_instance;
+
+  // The sampler may have been stopped after this job was requested
+  if (collector_instance == Qnil) return;
+
+  // We can't let exceptions escape from a postponed job, as there's no Ruby code above us to handle them
+  int exception_state;
+  rb_protect(sample_protected, collector_instance, &exception_state);
+  if (exception_state) rb_set_errinfo(Qnil);
+}
+
+static VALUE sample_protected(VALUE collector_instance) {
+  // Picks up CPU-time timer signals that got delivered to a non-Ruby thread (see handle_sampling_signal)
+  sample_cpu_time(collector_instance);
+  sample(collector_instance);
+  return Qnil;
+}
+
+static void sample_cpu_time_from_postponed_job(void *_unused) {
+  VALUE collector_instance = active_sampler_instance;
+
+  // The sampler may have been stopped after this job was requested
+  if (collector_instance == Qnil) return;
+
+  // We can't let exceptions escape from a postponed job, as there's no Ruby code above us to handle them
+  int exception_state;
+  rb_protect(sample_cpu_time_protected, collector_instance, &exception_state);
+  if (exception_state) rb_set_errinfo(Qnil);
+}
+
+static VALUE sample_cpu_time_protected(VALUE collector_instance) {
+  sample_cpu_time(collector_instance);
+  return Qnil;
+}
+
+// Arms a timer that sends a SIGPROF carrying a free slot number every time the thread consumes `sampling_interval_ns`
+// of CPU-time. If no slot is free, or the timer can't be created, the thread's CPU-time keeps getting sampled periodically.
+static void start_cpu_time_timer(struct cpu_and_wall_time_collector_state *state, VALUE thread, struct per_thread_context *thread_context) {
+  int slot = NO_CPU_TIME_TIMER_SLOT;
+  for (int i = 0; i < MAX_CPU_TIME_TIMERS; i++) {
+    if (state->cpu_time_timer_threads[i] == Qnil) { slot = i; break; }
+  }
+  if (slot == NO_CPU_TIME_TIMER_SLOT) return;
+
+  pending_cpu_time_samples[slot] = 0;
+  thread_context->cpu_time_timer = cpu_time_timer_start(
+    thread_context->thread_cpu_time_id,
+    native_thread_id_for(thread),
+    SIGPROF,
+    slot,
+    state->sampling_interval_ns
+  );
+
+  if (!thread_context->cpu_time_timer.valid) {
+    thread_context->cpu_time_timer_failed = true;
+    return;
+  }
+
+  thread_context->cpu_time_timer_slot = slot;
+  state->cpu_time_timer_threads[slot] = thread;
+}
+
+static void stop_cpu_time_timer(struct cpu_and_wall_time_collector_state *state, struct per_thread_context *thread_context) {
+  // Timers created before a fork don't exist in the child (and their ids may get reused by new timers), so they only
+  // get forgotten, see sampling_started_in_another_process
+  if (state->sampling_pid == getpid()) {
+    cpu_time_timer_stop(&thread_context->cpu_time_timer);
+  } else {
+    thread_context->cpu_time_timer.valid = false;
+  }
+  thread_context->cpu_time_timer_failed = false;
+
+  if (thread_context->cpu_time_timer_slot == NO_CPU_TIME_TIMER_SLOT) return;
+
+  state->cpu_time_timer_threads[thread_context->cpu_time_timer_slot] = Qnil;
+  pending_cpu_time_samples[thread_context->cpu_time_timer_slot] = 0;
+  thread_context->cpu_time_timer_slot = NO_CPU_TIME_TIMER_SLOT;
+}
+
+static int stop_cpu_time_timer_for_context(st_data_t _thread, st_data_t value_context, st_data_t state_ptr) {
+  stop_cpu_time_timer((struct cpu_and_wall_time_collector_state *) state_ptr, (struct per_thread_context*) value_context);
+  return ST_CONTINUE;
+}
+
+// Native version of Datadog::Profiling::TraceIdentifiers::Ddtrace#trace_identifiers_for: we directly read the instance
+// variables of the tracer objects, instead of calling any of their methods (which may allocate, or run arbitrary code).
+//
+// Note that the ids get formatted into the thread_context, so they're only valid until this thread gets sampled again.
+static void trace_identifiers_for(
+  struct cpu_and_wall_time_collector_state *state,
+  VALUE thread,
+  struct per_thread_context *thread_context,
+  struct trace_identifiers *trace_identifiers_result
+) {
+  if (state->tracer_context_key == MISSING_TRACER_CONTEXT_KEY) return;
+
+  // Note: Unlike Datadog::Tracing::FiberLocalContext#local, this does not create a context if there isn't one yet
+  VALUE current_context = rb_thread_local_aref(thread, state->tracer_context_key);
+  if (current_context == Qnil) return;
+
+  VALUE active_trace = rb_ivar_get(current_context, at_active_trace_id);
+  if (active_trace == Qnil) return;
+
+  VALUE root_span = rb_ivar_get(active_trace, at_root_span_id);
+  VALUE active_span = rb_ivar_get(active_trace, at_active_span_id);
+  if (root_span == Qnil || active_span == Qnil) return;
+
+  VALUE numeric_local_root_span_id = rb_ivar_get(root_span, at_id_id);
+  VALUE numeric_span_id = rb_ivar_get(active_span, at_id_id);
+  if (!RB_INTEGER_TYPE_P(numeric_local_root_span_id) || !RB_INTEGER_TYPE_P(numeric_span_id)) return;
+
+  unsigned long long local_root_span_id = NUM2ULL(numeric_local_root_span_id);
+  unsigned long long span_id = NUM2ULL(numeric_span_id);
+  if (local_root_span_id == 0 || span_id == 0) return;
+
+  int local_root_span_id_length =
+    snprintf(thread_context->local_root_span_id, MAXIMUM_SPAN_ID_DIGITS, "%llu", local_root_span_id);
+  int span_id_length = snprintf(thread_context->span_id, MAXIMUM_SPAN_ID_DIGITS, "%llu", span_id);
+
+  trace_identifiers_result->valid = true;
+  trace_identifiers_result->local_root_span_id =
+    (ddprof_ffi_CharSlice) {.ptr = thread_context->local_root_span_id, .len = local_root_span_id_length};
+  trace_identifiers_result->span_id = (ddprof_ffi_CharSlice) {.ptr = thread_context->span_id, .len = span_id_length};
+
+  // Same as Datadog::Profiling::TraceIdentifiers::Helper#trace_identifiers_for
+  if (!state->endpoint_collection_enabled) return;
+
+  // Note: Currently we're only interested in HTTP service endpoints, see
+  // Datadog::Profiling::TraceIdentifiers::Ddtrace#maybe_extract_resource
+  if (!is_type_web(rb_ivar_get(root_span, at_type_id))) return;
+
+  // Same as Datadog::Tracing::TraceOperation#resource
+  VALUE trace_resource = rb_ivar_get(active_trace, at_resource_id);
+  if (trace_resource == Qnil) trace_resource = rb_ivar_get(root_span, at_resource_id);
+
+  if (RB_TYPE_P(trace_resource, T_STRING)) {
+    trace_identifiers_result->trace_endpoint = char_slice_from_ruby_string(trace_resource);
+  }
+}
+
+// Same as checking for Datadog::Tracing::Metadata::Ext::HTTP::TYPE_INBOUND
+static bool is_type_web(VALUE root_span_type) {
+  return RB_TYPE_P(root_span_type, T_STRING) &&
+    RSTRING_LEN(root_span_type) == strlen("web") &&
+    memcmp(RSTRING_PTR(root_span_type), "web", strlen("web")) == 0;
+}
+
+// Called on every GC_ENTER/GC_EXIT, for every GC step (e.g. with incremental marking and lazy sweeping, a single GC
+// cycle may be split into multiple steps), with the thread that triggered the GC holding the GVL.
+//
+// We're inside the GC, so we MUST NOT allocate any Ruby objects nor call anything that may do so; instead, we only
+// accumulate the time spent into the thread's context, and ask for sample_gc_from_postponed_job to record it.
+static void on_gc_event(VALUE tracepoint_data, void *state_ptr) {
+  struct cpu_and_wall_time_collector_state *state = (struct cpu_and_wall_time_collector_state *) state_ptr;
+
+  if (state->hash_map_per_thread_context_busy) return;
+
+  // Threads that were never sampled don't have a context yet, and we can't create one here (as that allocates)
+  st_data_t value_context = 0;
+  if (!st_lookup(state->hash_map_per_thread_context, (st_data_t) rb_thread_current(), &value_context)) return;
+  struct per_thread_context *thread_context = (struct per_thread_context*) value_context;
+
+  rb_event_flag_t event = rb_tracearg_event_flag(rb_tracearg_from_tracepoint(tracepoint_data));
+
+  if (event == RUBY_INTERNAL_EVENT_GC_ENTER) {
+    thread_context->gc_cpu_time_at_enter_ns = cpu_time_now_ns(thread_context);
+    thread_context->gc_wall_time_at_enter_ns = wall_time_now_ns();
+    return;
+  }
+
+  // GC_EXIT
+  if (thread_context->gc_wall_time_at_enter_ns == INVALID_TIME) return; // E.g. the tracepoint was enabled mid-GC
+
+  // Note: :major_by is only updated at the start of each GC cycle, so it's still valid for later steps of the same cycle
+  int gc_type = rb_gc_latest_gc_info(major_by_symbol) != Qnil ? MAJOR_GC : MINOR_GC;
+
+  long gc_cpu_time_ns = 0;
+  long cpu_time_now = cpu_time_now_ns(thread_context);
+  if (thread_context->gc_cpu_time_at_enter_ns != INVALID_TIME && cpu_time_now != INVALID_TIME) {
+    gc_cpu_time_ns = cpu_time_now - thread_context->gc_cpu_time_at_enter_ns;
+  }
+  long gc_wall_time_ns = wall_time_now_ns() - thread_context->gc_wall_time_at_enter_ns;
+
+  thread_context->gc_cpu_time_at_enter_ns = INVALID_TIME;
+  thread_context->gc_wall_time_at_enter_ns = INVALID_TIME;
+  if (gc_cpu_time_ns < 0) gc_cpu_time_ns = 0;
+  if (gc_wall_time_ns < 0) gc_wall_time_ns = 0;
+
+  thread_context->gc_cpu_time_pending_ns[gc_type] += gc_cpu_time_ns;
+  thread_context->gc_wall_time_pending_ns[gc_type] += gc_wall_time_ns;
+
+  // Skip over the time spent in GC in the thread's next regular sample, as it gets recorded separately
+  if (thread_context->cpu_time_at_previous_sample_ns != INVALID_TIME) {
+    thread_context->cpu_time_at_previous_sample_ns += gc_cpu_time_ns;
+  }
+  if (thread_context->wall_time_at_previous_sample_ns != INVALID_TIME) {
+    thread_context->wall_time_at_previous_sample_ns += gc_wall_time_ns;
+  }
+
+  // Note: If there's already a pending request, this is a no-op
+  rb_postponed_job_register_one(0, sample_gc_from_postponed_job, NULL);
+}
+
+static void sample_gc_from_postponed_job(void *_unused) {
+  VALUE collector_instance = active_sampler_instance;
+
+  // The sampler may have been stopped after this job was requested
+  if (collector_instance == Qnil) return;
+
+  // We can't let exceptions escape from a postponed job, as there's no Ruby code above us to handle them
+  int exception_state;
+  rb_protect(sample_gc_protected, collector_instance, &exception_state);
+  if (exception_state) rb_set_errinfo(Qnil);
+}
+
+// Postponed jobs run on the thread that requested them, so this is (almost always) the thread that triggered the GC.
+// Any GC time left behind for other threads gets picked up by their next regular sample, see sample_thread_from_list.
+static VALUE sample_gc_protected(VALUE collector_instance) {
+  struct cpu_and_wall_time_collector_state *state;
+  TypedData_Get_Struct(collector_instance, struct cpu_and_wall_time_collector_state, &cpu_and_wall_time_collector_typed_data, state);
+
+  VALUE thread = rb_thread_current();
+  st_data_t value_context = 0;
+  if (!st_lookup(state->hash_map_per_thread_context, (st_data_t) thread, &value_context)) return Qnil;
+
+  sample_pending_gc(state, thread, (struct per_thread_context*) value_context);
+  return Qnil;
+}
+
+// Records the time spent in GC by this thread since the last time this was called, with a "Garbage Collection"
+// placeholder frame on top of the thread's current stack
+static void sample_pending_gc(struct cpu_and_wall_time_collector_state *state, VALUE thread, struct per_thread_context *thread_context) {
+  for (int gc_type = 0; gc_type < GC_TYPES_COUNT; gc_type++) {
+    long gc_cpu_time_ns = thread_context->gc_cpu_time_pending_ns[gc_type];
+    long gc_wall_time_ns = thread_context->gc_wall_time_pending_ns[gc_type];
+    if (gc_cpu_time_ns == 0 && gc_wall_time_ns == 0) continue;
+
+    // Reset before sampling, so that it doesn't get recorded twice if sampling raises
+    thread_context->gc_cpu_time_pending_ns[gc_type] = 0;
+    thread_context->gc_wall_time_pending_ns[gc_type] = 0;
+
+    int64_t metric_values[ALL_VALUE_TYPES_COUNT] = {0};
+    metric_values[CPU_TIME_VALUE_POS] = gc_cpu_time_ns;
+    metric_values[WALL_TIME_VALUE_POS] = gc_wall_time_ns;
+
+    ddprof_ffi_Label label_buffer[MAX_LABELS_PER_SAMPLE];
+    int labels_count = labels_for(state, thread, thread_context, label_buffer);
+    label_buffer[labels_count++] = (ddprof_ffi_Label) {
+      .key = DDPROF_FFI_CHARSLICE_C("gc type"),
+      .str = gc_type == MAJOR_GC ? DDPROF_FFI_CHARSLICE_C("major") : DDPROF_FFI_CHARSLICE_C("minor"),
+    };
+
+    sample_thread_with_placeholder_frame(
+      thread,
+      state->sampling_buffer,
+      state->recorder_instance,
+      (ddprof_ffi_Slice_i64) {.ptr = metric_values, .len = ALL_VALUE_TYPES_COUNT},
+      (ddprof_ffi_Slice_label) {.ptr = label_buffer, .len = labels_count},
+      thread_context->stack_snapshot,
+      DDPROF_FFI_CHARSLICE_C("Garbage Collection")
+    );
+    state->gc_samples++;
+  }
+}
+
+static void start_thread_event_hook(struct cpu_and_wall_time_collector_state *state) {
+  #ifdef RUBY_INTERNAL_THREAD_EVENT_READY
+    // The hook gets called on every thread switch, so there's no point in paying for it if gvl-wait is not wanted
+    if (!recorder_value_type_enabled(state->recorder_instance, GVL_WAIT_VALUE_POS)) return;
+
+    state->thread_event_hook = rb_internal_thread_add_event_hook(
+      on_thread_event,
+      RUBY_INTERNAL_THREAD_EVENT_READY | RUBY_INTERNAL_THREAD_EVENT_RESUMED,
+      NULL
+    );
+  #endif
+}
+
+static void stop_thread_event_hook(struct cpu_and_wall_time_collector_state *state) {
+  #ifdef RUBY_INTERNAL_THREAD_EVENT_READY
+    if (state->thread_event_hook == NULL) return;
+
+    rb_internal_thread_remove_event_hook(state->thread_event_hook);
+    state->thread_event_hook = NULL;
+  #endif
+}
+
+#ifdef RUBY_INTERNAL_THREAD_EVENT_READY
+// Called by each thread when it starts waiting for the GVL (READY), and once it got it (RESUMED).
+//
+// Each wait of at least GVL_WAIT_SAMPLING_THRESHOLD_NS gets recorded on its own, with the stack of the thread at that
+// point. Shorter waits get dropped: accumulating them until they added up to the threshold would mean recording the
+// earlier waits with whatever stack the thread had when the last one happened.
+//
+// **IMPORTANT**: The READY event happens without the GVL, so this MUST NOT touch any Ruby objects (nor the collector
+// state), or call anything that may raise.
+static void on_thread_event(rb_event_flag_t event, const rb_internal_thread_event_data_t *_event_data, void *_unused) {
+  struct timespec current_monotonic;
+  if (clock_gettime(CLOCK_MONOTONIC, &current_monotonic) != 0) return;
+  long now_ns = current_monotonic.tv_nsec + (current_monotonic.tv_sec * 1000 * 1000 * 1000);
+
+  if (event == RUBY_INTERNAL_THREAD_EVENT_READY) {
+    gvl_wait_started_at_ns = now_ns;
+    return;
+  }
+
+  // RESUMED
+  if (gvl_wait_started_at_ns == INVALID_TIME) return; // E.g. the hook was installed while this thread was waiting
+
+  long gvl_wait_ns = now_ns - gvl_wait_started_at_ns;
+  gvl_wait_started_at_ns = INVALID_TIME;
+  if (gvl_wait_ns < GVL_WAIT_SAMPLING_THRESHOLD_NS) return;
+
+  // If an earlier wait was still pending (see sample_gvl_wait_protected), it gets replaced, as this thread's stack may
+  // have changed since then
+  gvl_wait_pending_ns = gvl_wait_ns;
+
+  // Note: If there's already a pending request, this is a no-op
+  rb_postponed_job_register_one(0, sample_gvl_wait_from_postponed_job, NULL);
+}
+
+static void sample_gvl_wait_from_postponed_job(void *_unused) {
+  VALUE collector_instance = active_sampler_instance;
+
+  // The sampler may have been stopped after this job was requested
+  if (collector_instance == Qnil) return;
+
+  // We can't let exceptions escape from a postponed job, as there's no Ruby code above us to handle them
+  int exception_state;
+  rb_protect(sample_gvl_wait_protected, collector_instance, &exception_state);
+  if (exception_state) rb_set_errinfo(Qnil);
+}
+
+// The job usually runs on the thread that requested it, right after it got the GVL. If some other thread happened to
+// run it instead, this is a no-op for that thread (or records that thread's own pending wait), and the wait gets
+// recorded the next time this job runs on the thread that requested it, unless a later wait replaces it first (see
+// on_thread_event).
+static VALUE sample_gvl_wait_protected(VALUE collector_instance) {
+  struct cpu_and_wall_time_collector_state *state;
+  TypedData_Get_Struct(collector_instance, struct cpu_and_wall_time_collector_state, &cpu_and_wall_time_collector_typed_data, state);
+
+  long gvl_wait_ns = gvl_wait_pending_ns;
+  if (gvl_wait_ns == 0) return Qnil;
+  // Reset before sampling, so that it doesn't get recorded twice if sampling raises
+  gvl_wait_pending_ns = 0;
+
+  VALUE thread = rb_thread_current();
+  struct per_thread_context *thread_context = get_or_create_context_for(thread, state);
+
+  int64_t metric_values[ALL_VALUE_TYPES_COUNT] = {0};
+  metric_values[GVL_WAIT_VALUE_POS] = gvl_wait_ns;
+
+  ddprof_ffi_Label label_buffer[MAX_LABELS_PER_SAMPLE];
+  ddprof_ffi_Slice_label labels = {.ptr = label_buffer, .len = labels_for(state, thread, thread_context, label_buffer)};
+
+  sample_thread(
+    thread,
+    state->sampling_buffer,
+    state->recorder_instance,
+    (ddprof_ffi_Slice_i64) {.ptr = metric_values, .len = ALL_VALUE_TYPES_COUNT},
+    labels,
+    thread_context->stack_snapshot
+  );
+  state->gvl_wait_samples++;
+
+  return Qnil;
+}
+#endif
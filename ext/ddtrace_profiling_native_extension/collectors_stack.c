@@ -8,11 +8,59 @@
 
 // Gathers stack traces from running threads, storing them in a StackRecorder instance
 // This file implements the native bits of the Datadog::Profiling::Collectors::Stack class
+//
+// Each Datadog::Profiling::Collectors::Stack instance keeps its own sampling_buffer, so that (as with the other
+// collectors) the frame and stack caches below get reused across calls to _native_sample.
 
 #define MAX_FRAMES_LIMIT            10000
 #define MAX_FRAMES_LIMIT_AS_STRING "10000"
 
+// Must be a power of two, see frame_cache_slot_for
+#define FRAME_CACHE_SIZE 1024
+// Must be a power of two, see stack_cache_entry_for
+#define STACK_CACHE_SIZE 32
+
 static VALUE missing_string = Qnil;
+// Keys for the metric_values_hash given to _native_sample, in the same order as all_value_types
+static VALUE value_type_names[ALL_VALUE_TYPES_COUNT];
+
+// Caches the name and filename for a frame returned by ddtrace_rb_profile_frames, so that we don't need to ask the
+// Ruby VM for them on every sample.
+//
+// The `frame` is either an iseq or a callable method entry, and for frames for methods implemented using native code,
+// `filename` is unused (see sample_thread for details).
+//
+// Entries reference Ruby objects and so MUST be marked by the owner of the sampling_buffer (see sampling_buffer_mark).
+// We use rb_gc_mark (and not rb_gc_mark_movable) for them on purpose: this pins them, which means that:
+// * The `frame` object cannot be freed and its address reused for a different frame while it's in the cache
+// * The `name` and `filename` strings cannot be moved, so we can safely keep the `name_slice` and `filename_slice`
+//   pointing at their contents
+typedef struct {
+  VALUE frame;
+  VALUE name;
+  VALUE filename;
+  ddprof_ffi_CharSlice name_slice;
+  ddprof_ffi_CharSlice filename_slice;
+} frame_cache_entry;
+
+// Caches a fully-built stack (e.g. the ddprof_ffi_Line for every frame) so that when a thread is sampled with exactly
+// the same frames and line numbers as a previous sample, we can just reuse it.
+//
+// The raw `stack_buffer`/`lines_buffer`/`is_ruby_frame` arrays returned by ddtrace_rb_profile_frames are kept so that
+// we can confirm that a stack matches exactly (and not just its hash).
+//
+// As with the frame_cache_entry, the `stack_buffer` frames and the `strings` (the names and filenames that the `lines`
+// point to) are pinned, see sampling_buffer_mark.
+typedef struct {
+  uint64_t hash;
+  int captured_frames; // 0 for empty entries
+  int capacity;
+  VALUE *stack_buffer;
+  int *lines_buffer;
+  bool *is_ruby_frame;
+  VALUE *strings; // Holds 2 * capacity entries: the name and filename for each frame
+  ddprof_ffi_Line *lines;
+} stack_cache_entry;
 
 // Used as scratch space during sampling
 struct sampling_buffer {
@@ -20,42 +68,219 @@ struct sampling_buffer {
   VALUE *stack_buffer;
   int *lines_buffer;
   bool *is_ruby_frame;
-  ddprof_ffi_Location *locations;
+  ddprof_ffi_Location *locations; // Has room for max_frames + 1 entries, see record_locations
   ddprof_ffi_Line *lines;
+  // Direct-mapped cache: a frame can only ever be at one slot, and colliding frames just replace each other.
+  // This means that the cache uses a fixed amount of memory and we never need to allocate anything while sampling.
+  frame_cache_entry *frame_cache;
+  // Also direct-mapped, and keyed by the hash of the entire stack, see stack_hash
+  stack_cache_entry *stack_cache;
+  // Names and filenames for the frames being sampled, which get stored in the stack_cache
+  VALUE *strings;
+  // Both caches are dropped whenever the recorder we're sampling into gets flushed, see recorder_epoch
+  uint64_t caches_epoch;
+  // How many cacheable stacks were found in (or missing from) the stack_cache, see Collectors::Stack#stats
+  unsigned long stack_cache_hits;
+  unsigned long stack_cache_misses;
 }; // Note: typedef'd in the header to sampling_buffer
 
-static VALUE _native_sample(VALUE self, VALUE thread, VALUE recorder_instance, VALUE metric_values_hash, VALUE labels_array, VALUE max_frames);
-static void maybe_add_placeholder_frames_omitted(VALUE thread, sampling_buffer* buffer, char *frames_omitted_message, int frames_omitted_message_size);
-static void record_placeholder_stack_in_native_code(VALUE recorder_instance, ddprof_ffi_Slice_i64 metric_values, ddprof_ffi_Slice_label labels);
+// Contains native state for each instance of Datadog::Profiling::Collectors::Stack
+struct stack_collector_state {
+  // Note: Places in this file that usually need to be changed when this struct is changed are tagged with
+  // "Update this when modifying state struct"
+
+  // Lazily created by _native_sample (and recreated if a different max_frames is requested)
+  sampling_buffer *sampling_buffer;
+};
+
+// A sample that was captured by sample_thread_deferred, but that was not yet symbolized nor recorded.
+//
+// The arrays are sized for the stack that was captured (and reused for later samples), rather than for max_frames, so
+// that the memory needed for deferring grows with the actual stacks seen, unless the queue is presized (see
+// deferred_samples_new). Labels are copied into `labels_storage`, as the caller's labels are not expected to be around
+// by the time the sample gets recorded.
+typedef struct {
+  int captured_frames; // Can also be PLACEHOLDER_STACK_IN_NATIVE_CODE
+  ptrdiff_t stack_depth; // Only set when the captured frames filled up max_frames, see maybe_add_placeholder_frames_omitted
+  int capacity;
+  VALUE *stack_buffer;
+  int *lines_buffer;
+  bool *is_ruby_frame;
+  int64_t metric_values[ALL_VALUE_TYPES_COUNT];
+  size_t metric_values_count;
+  ddprof_ffi_Label *labels;
+  size_t labels_count;
+  size_t labels_capacity;
+  char *labels_storage;
+  size_t labels_storage_capacity;
+} deferred_sample;
+
+// Fixed-size queue of samples waiting for deferred_samples_flush. Samples are flushed in the order they were captured.
+//
+// The raw frames in each sample are Ruby objects, which MUST be marked by the owner (see deferred_samples_mark) until
+// the sample gets recorded.
+struct deferred_samples {
+  unsigned int capacity;
+  unsigned int first;
+  unsigned int count;
+  unsigned long dropped; // Samples not captured because the queue was full, see sample_thread_deferred
+  bool presized; // When set, the arrays of every sample were allocated upfront and never grow, see deferred_samples_new
+  deferred_sample *samples;
+}; // Note: typedef'd in the header to deferred_samples
+
+static void stack_collector_typed_data_mark(void *state_ptr);
+static void stack_collector_typed_data_free(void *state_ptr);
+static size_t stack_collector_typed_data_size(const void *state_ptr);
+static VALUE _native_new(VALUE klass);
+static VALUE _native_sample(
+  VALUE self,
+  VALUE collector_instance,
+  VALUE thread,
+  VALUE recorder_instance,
+  VALUE metric_values_hash,
+  VALUE labels_array,
+  VALUE max_frames
+);
+static VALUE _native_stats(VALUE self, VALUE collector_instance);
+static void record_captured_stack(
+  sampling_buffer* buffer,
+  int captured_frames,
+  ptrdiff_t stack_depth,
+  VALUE recorder_instance,
+  ddprof_ffi_Slice_i64 metric_values,
+  ddprof_ffi_Slice_label labels,
+  const ddprof_ffi_Line *placeholder_line_on_top
+);
+static void maybe_add_placeholder_frames_omitted(ptrdiff_t stack_depth, sampling_buffer* buffer, char *frames_omitted_message, int frames_omitted_message_size);
+static void record_placeholder_stack_in_native_code(
+  sampling_buffer* buffer,
+  VALUE recorder_instance,
+  ddprof_ffi_Slice_i64 metric_values,
+  ddprof_ffi_Slice_label labels,
+  const ddprof_ffi_Line *placeholder_line_on_top
+);
+static void record_locations(
+  sampling_buffer* buffer,
+  VALUE recorder_instance,
+  ddprof_ffi_Location *locations,
+  int locations_count,
+  ddprof_ffi_Slice_i64 metric_values,
+  ddprof_ffi_Slice_label labels,
+  const ddprof_ffi_Line *placeholder_line_on_top,
+  const sample_stack_identity *stack
+);
+static frame_cache_entry *frame_cache_entry_for(sampling_buffer* buffer, VALUE frame, bool is_ruby_frame);
+static void frame_cache_reset(sampling_buffer* buffer);
+static uint64_t stack_hash(sampling_buffer* buffer, int captured_frames);
+static stack_cache_entry *stack_cache_entry_for(sampling_buffer* buffer, int captured_frames, uint64_t hash);
+static void stack_cache_store(sampling_buffer* buffer, int captured_frames, uint64_t hash);
+static void stack_cache_reset(sampling_buffer* buffer);
+static void record_cached_stack(
+  stack_cache_entry *entry,
+  sampling_buffer* buffer,
+  VALUE recorder_instance,
+  ddprof_ffi_Slice_i64 metric_values,
+  ddprof_ffi_Slice_label labels,
+  const ddprof_ffi_Line *placeholder_line_on_top
+);
+static void deferred_sample_reserve(deferred_sample *sample, int frames_needed, ddprof_ffi_Slice_label labels);
+static void deferred_sample_reserve_labels(deferred_sample *sample, size_t labels_needed, size_t labels_storage_needed);
+static void deferred_sample_copy_labels(deferred_sample *sample, ddprof_ffi_Slice_label labels);
 
 void collectors_stack_init(VALUE profiling_module) {
   VALUE collectors_module = rb_define_module_under(profiling_module, "Collectors");
   VALUE collectors_stack_class = rb_define_class_under(collectors_module, "Stack", rb_cObject);
+  // Hosts of native data should undefine the default allocator, and define their own, see
+  // https://docs.ruby-lang.org/en/master/extension_rdoc.html#label-C+struct+to+Ruby+object
+  rb_undef_alloc_func(collectors_stack_class);
+  rb_define_alloc_func(collectors_stack_class, _native_new);
 
-  rb_define_singleton_method(collectors_stack_class, "_native_sample", _native_sample, 5);
+  rb_define_singleton_method(collectors_stack_class, "_native_sample", _native_sample, 6);
+  rb_define_singleton_method(collectors_stack_class, "_native_stats", _native_stats, 1);
 
   missing_string = rb_str_new2("");
   rb_global_variable(&missing_string);
+
+  for (unsigned int i = 0; i < ALL_VALUE_TYPES_COUNT; i++) {
+    value_type_names[i] = rb_obj_freeze(rb_str_new_cstr(all_value_types[i].type_.ptr));
+    rb_global_variable(&value_type_names[i]);
+  }
+}
+
+// This structure is used to define a Ruby object that stores a pointer to a struct stack_collector_state
+// See also https://github.com/ruby/ruby/blob/master/doc/extension.rdoc for how this works
+static const rb_data_type_t stack_collector_typed_data = {
+  .wrap_struct_name = "Datadog::Profiling::Collectors::Stack",
+  .function = {
+    .dmark = stack_collector_typed_data_mark,
+    .dfree = stack_collector_typed_data_free,
+    .dsize = stack_collector_typed_data_size,
+    //.dcompact = NULL, // FIXME: Add support for compaction
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static void stack_collector_typed_data_mark(void *state_ptr) {
+  struct stack_collector_state *state = (struct stack_collector_state *) state_ptr;
+
+  // Update this when modifying state struct
+  sampling_buffer_mark(state->sampling_buffer);
+}
+
+static void stack_collector_typed_data_free(void *state_ptr) {
+  struct stack_collector_state *state = (struct stack_collector_state *) state_ptr;
+
+  // Update this when modifying state struct
+  if (state->sampling_buffer != NULL) sampling_buffer_free(state->sampling_buffer);
+
+  ruby_xfree(state);
+}
+
+static size_t stack_collector_typed_data_size(const void *state_ptr) {
+  const struct stack_collector_state *state = (const struct stack_collector_state *) state_ptr;
+
+  // Update this when modifying state struct
+  return sizeof(struct stack_collector_state) + sampling_buffer_memsize(state->sampling_buffer);
+}
+
+static VALUE _native_new(VALUE klass) {
+  struct stack_collector_state *state = ruby_xcalloc(1, sizeof(struct stack_collector_state));
+
+  // Update this when modifying state struct
+  state->sampling_buffer = NULL;
+
+  return TypedData_Wrap_Struct(klass, &stack_collector_typed_data, state);
 }
 
 // This method exists only to enable testing Datadog::Profiling::Collectors::Stack behavior using RSpec.
 // It SHOULD NOT be used for other purposes.
-static VALUE _native_sample(VALUE self, VALUE thread, VALUE recorder_instance, VALUE metric_values_hash, VALUE labels_array, VALUE max_frames) {
+static VALUE _native_sample(
+  VALUE self,
+  VALUE collector_instance,
+  VALUE thread,
+  VALUE recorder_instance,
+  VALUE metric_values_hash,
+  VALUE labels_array,
+  VALUE max_frames
+) {
+  struct stack_collector_state *state;
+  TypedData_Get_Struct(collector_instance, struct stack_collector_state, &stack_collector_typed_data, state);
+
   Check_Type(metric_values_hash, T_HASH);
   Check_Type(labels_array, T_ARRAY);
 
-  if (RHASH_SIZE(metric_values_hash) != ENABLED_VALUE_TYPES_COUNT) {
+  if (RHASH_SIZE(metric_values_hash) != ALL_VALUE_TYPES_COUNT) {
     rb_raise(
       rb_eArgError,
       "Mismatched values for metrics; expected %lu values and got %lu instead",
-      ENABLED_VALUE_TYPES_COUNT,
+      ALL_VALUE_TYPES_COUNT,
       RHASH_SIZE(metric_values_hash)
     );
   }
 
-  int64_t metric_values[ENABLED_VALUE_TYPES_COUNT];
-  for (unsigned int i = 0; i < ENABLED_VALUE_TYPES_COUNT; i++) {
-    VALUE metric_value = rb_hash_fetch(metric_values_hash, rb_str_new_cstr(enabled_value_types[i].type_.ptr));
+  int64_t metric_values[ALL_VALUE_TYPES_COUNT];
+  for (unsigned int i = 0; i < ALL_VALUE_TYPES_COUNT; i++) {
+    VALUE metric_value = rb_hash_fetch(metric_values_hash, value_type_names[i]);
     metric_values[i] = NUM2LONG(metric_value);
   }
 
@@ -74,65 +299,274 @@ static VALUE _native_sample(VALUE self, VALUE thread, VALUE recorder_instance, V
   int max_frames_requested = NUM2INT(max_frames);
   if (max_frames_requested < 0) rb_raise(rb_eArgError, "Invalid max_frames: value must not be negative");
 
-  sampling_buffer *buffer = sampling_buffer_new(max_frames_requested);
+  if (state->sampling_buffer != NULL && state->sampling_buffer->max_frames != (unsigned int) max_frames_requested) {
+    sampling_buffer_free(state->sampling_buffer);
+    state->sampling_buffer = NULL;
+  }
+  if (state->sampling_buffer == NULL) state->sampling_buffer = sampling_buffer_new(max_frames_requested);
 
   sample_thread(
     thread,
-    buffer,
+    state->sampling_buffer,
     recorder_instance,
-    (ddprof_ffi_Slice_i64) {.ptr = metric_values, .len = ENABLED_VALUE_TYPES_COUNT},
-    (ddprof_ffi_Slice_label) {.ptr = labels, .len = labels_count}
+    (ddprof_ffi_Slice_i64) {.ptr = metric_values, .len = ALL_VALUE_TYPES_COUNT},
+    (ddprof_ffi_Slice_label) {.ptr = labels, .len = labels_count},
+    NULL
   );
 
-  sampling_buffer_free(buffer);
-
   return Qtrue;
 }
 
-void sample_thread(VALUE thread, sampling_buffer* buffer, VALUE recorder_instance, ddprof_ffi_Slice_i64 metric_values, ddprof_ffi_Slice_label labels) {
+static VALUE _native_stats(VALUE self, VALUE collector_instance) {
+  struct stack_collector_state *state;
+  TypedData_Get_Struct(collector_instance, struct stack_collector_state, &stack_collector_typed_data, state);
+
+  sampling_buffer *buffer = state->sampling_buffer;
+  VALUE stats_as_hash = rb_hash_new();
+
+  rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("stack_cache_hits")), ULONG2NUM(buffer ? buffer->stack_cache_hits : 0));
+  rb_hash_aset(
+    stats_as_hash, ID2SYM(rb_intern("stack_cache_misses")), ULONG2NUM(buffer ? buffer->stack_cache_misses : 0)
+  );
+
+  return stats_as_hash;
+}
+
+// The `stack_snapshot` is optional; when provided it MUST always be used with the same thread (see
+// ddtrace_rb_profile_frames for details).
+void sample_thread(
+  VALUE thread,
+  sampling_buffer* buffer,
+  VALUE recorder_instance,
+  ddprof_ffi_Slice_i64 metric_values,
+  ddprof_ffi_Slice_label labels,
+  stack_snapshot *stack_snapshot
+) {
   int captured_frames = ddtrace_rb_profile_frames(
     thread,
     0 /* stack starting depth */,
     buffer->max_frames,
     buffer->stack_buffer,
     buffer->lines_buffer,
-    buffer->is_ruby_frame
+    buffer->is_ruby_frame,
+    stack_snapshot
   );
 
-  // Idea: Should we release the global vm lock (GVL) after we get the data from `rb_profile_frames`? That way other Ruby threads
-  // could continue making progress while the sample was ingested into the profile.
+  // Note: Gathering the stack_depth is cheap, but it's only needed when we filled up the buffer
+  ptrdiff_t stack_depth = captured_frames == (long) buffer->max_frames ? stack_depth_for(thread) : 0;
+
+  record_captured_stack(buffer, captured_frames, stack_depth, recorder_instance, metric_values, labels, NULL);
+}
+
+// Variant of sample_thread that adds a placeholder frame on top of the thread's stack, e.g. to show time that was
+// spent by the Ruby VM itself (such as in the Garbage Collector) as being triggered by the code that was running.
+// As with the other placeholder frames, the `placeholder_name` gets used as the frame's filename.
+void sample_thread_with_placeholder_frame(
+  VALUE thread,
+  sampling_buffer* buffer,
+  VALUE recorder_instance,
+  ddprof_ffi_Slice_i64 metric_values,
+  ddprof_ffi_Slice_label labels,
+  stack_snapshot *stack_snapshot,
+  ddprof_ffi_CharSlice placeholder_name
+) {
+  ddprof_ffi_Line placeholder_line = {
+    .function = (ddprof_ffi_Function) {.name = DDPROF_FFI_CHARSLICE_C(""), .filename = placeholder_name},
+    .line = 0,
+  };
+
+  int captured_frames = ddtrace_rb_profile_frames(
+    thread,
+    0 /* stack starting depth */,
+    buffer->max_frames,
+    buffer->stack_buffer,
+    buffer->lines_buffer,
+    buffer->is_ruby_frame,
+    stack_snapshot
+  );
+  ptrdiff_t stack_depth = captured_frames == (long) buffer->max_frames ? stack_depth_for(thread) : 0;
+
+  record_captured_stack(buffer, captured_frames, stack_depth, recorder_instance, metric_values, labels, &placeholder_line);
+}
+
+// Variant of sample_thread that only captures the raw stack (and copies the metric values and labels) into `deferred`,
+// leaving the symbolization and recording to deferred_samples_flush. This minimizes the time spent sampling each thread,
+// at the cost of keeping the raw samples around until they are flushed.
+//
+// If `deferred` is full, the sample gets dropped (and counted, see deferred_samples_dropped) and this returns false:
+// flushing here would add the full cost of symbolization to the sample, which is what deferring is meant to avoid.
+// Owners are expected to flush well before that, from outside the sampling path.
+//
+// Why don't we release the global vm lock (GVL) for the symbolization instead? The `rb_profile_frame_...` methods
+// we use to symbolize are not safe to call without the GVL, as they may allocate Ruby objects. So instead,
+// we move symbolization to a point where the cost does not get added to each individual sample, such as just before
+// the profile gets serialized (see recorder_add_before_serialize_hook).
+bool sample_thread_deferred(
+  VALUE thread,
+  sampling_buffer* buffer,
+  deferred_samples *deferred,
+  ddprof_ffi_Slice_i64 metric_values,
+  ddprof_ffi_Slice_label labels,
+  stack_snapshot *stack_snapshot
+) {
+  if (deferred->count == deferred->capacity) {
+    deferred->dropped++;
+    return false;
+  }
+
+  if (metric_values.len > ALL_VALUE_TYPES_COUNT) rb_raise(rb_eArgError, "Unexpected number of metric values");
+
+  deferred_sample *sample = &deferred->samples[(deferred->first + deferred->count) % deferred->capacity];
+
+  // Any allocations must happen BEFORE we capture the stack: if they triggered the GC, the frames we had just captured
+  // would not yet be visible to it (see deferred_samples_mark).
   //
-  // Other things to take into consideration if we go in that direction:
-  // * Is it safe to call `rb_profile_frame_...` methods on things from the `stack_buffer` without the GVL acquired?
-  // * We need to make `VALUE` references in the `stack_buffer` visible to the Ruby GC
-  // * Should we move this into a different thread entirely?
-  // * If we don't move it into a different thread, does releasing the GVL on a Ruby thread mean that we're introducing
-  //   a new thread switch point where there previously was none?
+  // Note: ddtrace_rb_profile_frames walks one more control frame than what stack_depth_for reports
+  ptrdiff_t stack_depth = stack_depth_for(thread);
+  if (!deferred->presized) {
+    deferred_sample_reserve(sample, stack_depth + 1 < (long) buffer->max_frames ? (int) stack_depth + 1 : (int) buffer->max_frames, labels);
+  }
 
-  // Ruby does not give us path and line number for methods implemented using native code.
-  // The convention in Kernel#caller_locations is to instead use the path and line number of the first Ruby frame
-  // on the stack that is below (e.g. directly or indirectly has called) the native method.
-  // Thus, we keep that frame here to able to replicate that behavior.
-  // (This is why we also iterate the sampling buffers backwards below -- so that it's easier to keep the last_ruby_frame)
-  VALUE last_ruby_frame = Qnil;
-  int last_ruby_line = 0;
+  memcpy(sample->metric_values, metric_values.ptr, metric_values.len * sizeof(int64_t));
+  sample->metric_values_count = metric_values.len;
+  deferred_sample_copy_labels(sample, labels);
+
+  sample->captured_frames = ddtrace_rb_profile_frames(
+    thread,
+    0 /* stack starting depth */,
+    sample->capacity,
+    sample->stack_buffer,
+    sample->lines_buffer,
+    sample->is_ruby_frame,
+    stack_snapshot
+  );
+  sample->stack_depth = sample->captured_frames == (long) buffer->max_frames ? stack_depth : 0;
+
+  deferred->count++;
+  return true;
+}
+
+// Records a stack that was captured earlier using ddtrace_rb_profile_frames, and that was kept around by the caller
+// (e.g. see heap_tracker.c). The caller MUST keep the frames alive (marked) until this returns.
+void record_raw_stack(
+  sampling_buffer* buffer,
+  const VALUE *frames,
+  const int *lines,
+  const bool *is_ruby_frame,
+  int frames_count,
+  ptrdiff_t stack_depth,
+  VALUE recorder_instance,
+  ddprof_ffi_Slice_i64 metric_values,
+  ddprof_ffi_Slice_label labels
+) {
+  if (frames_count > (int) buffer->max_frames) frames_count = buffer->max_frames;
+
+  if (frames_count > 0) {
+    memcpy(buffer->stack_buffer, frames, frames_count * sizeof(VALUE));
+    memcpy(buffer->lines_buffer, lines, frames_count * sizeof(int));
+    memcpy(buffer->is_ruby_frame, is_ruby_frame, frames_count * sizeof(bool));
+  }
+
+  record_captured_stack(buffer, frames_count, stack_depth, recorder_instance, metric_values, labels, NULL);
+}
+
+void deferred_samples_flush(deferred_samples *deferred, sampling_buffer* buffer, VALUE recorder_instance) {
+  while (deferred->count > 0) {
+    deferred_sample *sample = &deferred->samples[deferred->first];
+
+    if (sample->captured_frames > 0) {
+      memcpy(buffer->stack_buffer, sample->stack_buffer, sample->captured_frames * sizeof(VALUE));
+      memcpy(buffer->lines_buffer, sample->lines_buffer, sample->captured_frames * sizeof(int));
+      memcpy(buffer->is_ruby_frame, sample->is_ruby_frame, sample->captured_frames * sizeof(bool));
+    }
+
+    // Unlike with sample_thread, these frames may no longer be on any thread's stack, so we only remove the sample from
+    // the queue (thus making its frames no longer visible to the GC) after it's been recorded
+    record_captured_stack(
+      buffer,
+      sample->captured_frames,
+      sample->stack_depth,
+      recorder_instance,
+      (ddprof_ffi_Slice_i64) {.ptr = sample->metric_values, .len = sample->metric_values_count},
+      (ddprof_ffi_Slice_label) {.ptr = sample->labels, .len = sample->labels_count},
+      NULL /* placeholder_line_on_top */
+    );
+
+    deferred->first = (deferred->first + 1) % deferred->capacity;
+    deferred->count--;
+  }
+
+  deferred->first = 0;
+}
 
+static void record_captured_stack(
+  sampling_buffer* buffer,
+  int captured_frames,
+  ptrdiff_t stack_depth,
+  VALUE recorder_instance,
+  ddprof_ffi_Slice_i64 metric_values,
+  ddprof_ffi_Slice_label labels,
+  const ddprof_ffi_Line *placeholder_line_on_top
+) {
   if (captured_frames == PLACEHOLDER_STACK_IN_NATIVE_CODE) {
-    record_placeholder_stack_in_native_code(recorder_instance, metric_values, labels);
+    record_placeholder_stack_in_native_code(buffer, recorder_instance, metric_values, labels, placeholder_line_on_top);
     return;
   }
 
+  uint64_t current_epoch = recorder_epoch(recorder_instance);
+  if (buffer->caches_epoch != current_epoch) {
+    frame_cache_reset(buffer);
+    stack_cache_reset(buffer);
+    buffer->caches_epoch = current_epoch;
+  }
+
+  // Stacks that filled up the buffer are never cached, as their "frames omitted" placeholder (see below) depends on the
+  // full depth of the stack, which we don't get from ddtrace_rb_profile_frames.
+  bool cacheable_stack = captured_frames < (long) buffer->max_frames;
+  uint64_t hash = 0;
+
+  if (cacheable_stack) {
+    hash = stack_hash(buffer, captured_frames);
+    stack_cache_entry *cached_stack = stack_cache_entry_for(buffer, captured_frames, hash);
+
+    if (cached_stack != NULL) {
+      buffer->stack_cache_hits++;
+      record_cached_stack(cached_stack, buffer, recorder_instance, metric_values, labels, placeholder_line_on_top);
+      return;
+    }
+
+    buffer->stack_cache_misses++;
+  }
+
+  // Ruby does not give us path and line number for methods implemented using native code.
+  // The convention in Kernel#caller_locations is to instead use the path and line number of the first Ruby frame
+  // on the stack that is below (e.g. directly or indirectly has called) the native method.
+  // Thus, we keep that frame's filename and line here to able to replicate that behavior.
+  // (This is why we also iterate the sampling buffers backwards below -- so that it's easier to keep the last ruby frame)
+  //
+  // Note that we copy the filename out of the frame cache, rather than keeping a pointer to its entry, as the entry may
+  // get replaced by a colliding frame further up the stack.
+  VALUE last_ruby_filename_string = missing_string;
+  ddprof_ffi_CharSlice last_ruby_filename = char_slice_from_ruby_string(missing_string);
+  int last_ruby_line = 0;
+
   for (int i = captured_frames - 1; i >= 0; i--) {
-    VALUE name, filename;
+    ddprof_ffi_CharSlice name, filename;
     int line;
 
     if (buffer->is_ruby_frame[i]) {
-      last_ruby_frame = buffer->stack_buffer[i];
-      last_ruby_line = buffer->lines_buffer[i];
+      frame_cache_entry *frame_info = frame_cache_entry_for(buffer, buffer->stack_buffer[i], true);
 
-      name = rb_profile_frame_base_label(buffer->stack_buffer[i]);
-      filename = rb_profile_frame_path(buffer->stack_buffer[i]);
+      name = frame_info->name_slice;
+      filename = frame_info->filename_slice;
       line = buffer->lines_buffer[i];
+
+      buffer->strings[2 * i] = frame_info->name;
+      buffer->strings[2 * i + 1] = frame_info->filename;
+
+      last_ruby_filename_string = frame_info->filename;
+      last_ruby_filename = filename;
+      last_ruby_line = line;
     } else {
       // **IMPORTANT**: Be very careful when calling any `rb_profile_frame_...` API with a non-Ruby frame, as legacy
       // Rubies may assume that what's in a buffer will lead to a Ruby frame.
@@ -141,29 +575,43 @@ void sample_thread(VALUE thread, sampling_buffer* buffer, VALUE recorder_instanc
       // rb_profile_frames for Ruby 2.2 and below) and CALLING **ANY** OF THOSE APIs ON IT WILL CAUSE INSTANT VM CRASHES
 
 #ifndef USE_LEGACY_RB_PROFILE_FRAMES // Modern Rubies
-      name = ddtrace_rb_profile_frame_method_name(buffer->stack_buffer[i]);
+      frame_cache_entry *frame_info = frame_cache_entry_for(buffer, buffer->stack_buffer[i], false);
+      name = frame_info->name_slice;
+      buffer->strings[2 * i] = frame_info->name;
 #else // Ruby < 2.3
-      name = buffer->stack_buffer[i];
+      VALUE native_name = buffer->stack_buffer[i];
+      native_name = NIL_P(native_name) ? missing_string : native_name;
+      name = char_slice_from_ruby_string(native_name);
+      buffer->strings[2 * i] = native_name;
 #endif
 
-      filename = NIL_P(last_ruby_frame) ? Qnil : rb_profile_frame_path(last_ruby_frame);
+      filename = last_ruby_filename;
       line = last_ruby_line;
-    }
 
-    name = NIL_P(name) ? missing_string : name;
-    filename = NIL_P(filename) ? missing_string : filename;
+      buffer->strings[2 * i + 1] = last_ruby_filename_string;
+    }
 
     buffer->lines[i] = (ddprof_ffi_Line) {
-      .function = (ddprof_ffi_Function) {
-        .name = char_slice_from_ruby_string(name),
-        .filename = char_slice_from_ruby_string(filename)
-      },
+      .function = (ddprof_ffi_Function) {.name = name, .filename = filename},
       .line = line,
     };
 
     buffer->locations[i] = (ddprof_ffi_Location) {.lines = (ddprof_ffi_Slice_line) {.ptr = &buffer->lines[i], .len = 1}};
   }
 
+  // Cacheable stacks always fit in the buffer, so they don't get the "frames omitted" placeholder below, and can be
+  // identified by their raw frames (see sample_stack_identity)
+  sample_stack_identity stack = {
+    .frames = buffer->stack_buffer,
+    .lines = buffer->lines_buffer,
+    .is_ruby_frame = buffer->is_ruby_frame,
+    .strings = buffer->strings,
+    .frames_count = captured_frames,
+    .hash = hash,
+  };
+
+  if (cacheable_stack) stack_cache_store(buffer, captured_frames, hash);
+
   // Used below; since we want to stack-allocate this, we must do it here rather than in maybe_add_placeholder_frames_omitted
   const int frames_omitted_message_size = sizeof(MAX_FRAMES_LIMIT_AS_STRING " frames omitted");
   char frames_omitted_message[frames_omitted_message_size];
@@ -171,21 +619,23 @@ void sample_thread(VALUE thread, sampling_buffer* buffer, VALUE recorder_instanc
   // If we filled up the buffer, some frames may have been omitted. In that case, we'll add a placeholder frame
   // with that info.
   if (captured_frames == (long) buffer->max_frames) {
-    maybe_add_placeholder_frames_omitted(thread, buffer, frames_omitted_message, frames_omitted_message_size);
+    maybe_add_placeholder_frames_omitted(stack_depth, buffer, frames_omitted_message, frames_omitted_message_size);
   }
 
-  record_sample(
+  record_locations(
+    buffer,
     recorder_instance,
-    (ddprof_ffi_Sample) {
-      .locations = (ddprof_ffi_Slice_location) {.ptr = buffer->locations, .len = captured_frames},
-      .values = metric_values,
-      .labels = labels,
-    }
+    buffer->locations,
+    captured_frames,
+    metric_values,
+    labels,
+    placeholder_line_on_top,
+    cacheable_stack ? &stack : NULL
   );
 }
 
-static void maybe_add_placeholder_frames_omitted(VALUE thread, sampling_buffer* buffer, char *frames_omitted_message, int frames_omitted_message_size) {
-  ptrdiff_t frames_omitted = stack_depth_for(thread) - buffer->max_frames;
+static void maybe_add_placeholder_frames_omitted(ptrdiff_t stack_depth, sampling_buffer* buffer, char *frames_omitted_message, int frames_omitted_message_size) {
+  ptrdiff_t frames_omitted = stack_depth - buffer->max_frames;
 
   if (frames_omitted == 0) return; // Perfect fit!
 
@@ -226,7 +676,13 @@ static void maybe_add_placeholder_frames_omitted(VALUE thread, sampling_buffer*
 //
 // To give customers visibility into these threads, rather than reporting an empty stack, we replace the empty stack
 // with one containing a placeholder frame, so that these threads are properly represented in the UX.
-static void record_placeholder_stack_in_native_code(VALUE recorder_instance, ddprof_ffi_Slice_i64 metric_values, ddprof_ffi_Slice_label labels) {
+static void record_placeholder_stack_in_native_code(
+  sampling_buffer* buffer,
+  VALUE recorder_instance,
+  ddprof_ffi_Slice_i64 metric_values,
+  ddprof_ffi_Slice_label labels,
+  const ddprof_ffi_Line *placeholder_line_on_top
+) {
   ddprof_ffi_Line placeholder_stack_in_native_code_line = {
     .function = (ddprof_ffi_Function) {
       .name = DDPROF_FFI_CHARSLICE_C(""),
@@ -237,13 +693,57 @@ static void record_placeholder_stack_in_native_code(VALUE recorder_instance, ddp
   ddprof_ffi_Location placeholder_stack_in_native_code_location =
     {.lines = (ddprof_ffi_Slice_line) {.ptr = &placeholder_stack_in_native_code_line, .len = 1}};
 
+  // This stack is only made up of placeholders, so it has no frames to identify it by
+  sample_stack_identity stack = {
+    .frames = buffer->stack_buffer,
+    .lines = buffer->lines_buffer,
+    .is_ruby_frame = buffer->is_ruby_frame,
+    .strings = buffer->strings,
+    .frames_count = 0,
+    .hash = 0,
+  };
+
+  record_locations(
+    buffer,
+    recorder_instance,
+    &placeholder_stack_in_native_code_location,
+    1,
+    metric_values,
+    labels,
+    placeholder_line_on_top,
+    &stack
+  );
+}
+
+// Records the sample, adding the placeholder_line_on_top (if any) as the topmost frame.
+// The `locations` can either be the buffer's own locations, or somewhere else.
+static void record_locations(
+  sampling_buffer* buffer,
+  VALUE recorder_instance,
+  ddprof_ffi_Location *locations,
+  int locations_count,
+  ddprof_ffi_Slice_i64 metric_values,
+  ddprof_ffi_Slice_label labels,
+  const ddprof_ffi_Line *placeholder_line_on_top,
+  const sample_stack_identity *stack
+) {
+  if (placeholder_line_on_top != NULL) {
+    // Note: memmove (and not memcpy), as this usually moves the buffer's locations by one position
+    memmove(&buffer->locations[1], locations, locations_count * sizeof(ddprof_ffi_Location));
+    buffer->locations[0] =
+      (ddprof_ffi_Location) {.lines = (ddprof_ffi_Slice_line) {.ptr = placeholder_line_on_top, .len = 1}};
+    locations = buffer->locations;
+    locations_count++;
+  }
+
   record_sample(
     recorder_instance,
     (ddprof_ffi_Sample) {
-      .locations = (ddprof_ffi_Slice_location) {.ptr = &placeholder_stack_in_native_code_location, .len = 1},
+      .locations = (ddprof_ffi_Slice_location) {.ptr = locations, .len = locations_count},
       .values = metric_values,
       .labels = labels,
-    }
+    },
+    stack
   );
 }
 
@@ -259,8 +759,13 @@ sampling_buffer *sampling_buffer_new(unsigned int max_frames) {
   buffer->stack_buffer  = ruby_xcalloc(max_frames, sizeof(VALUE));
   buffer->lines_buffer  = ruby_xcalloc(max_frames, sizeof(int));
   buffer->is_ruby_frame = ruby_xcalloc(max_frames, sizeof(bool));
-  buffer->locations     = ruby_xcalloc(max_frames, sizeof(ddprof_ffi_Location));
+  buffer->locations     = ruby_xcalloc(max_frames + 1, sizeof(ddprof_ffi_Location));
   buffer->lines         = ruby_xcalloc(max_frames, sizeof(ddprof_ffi_Line));
+  buffer->frame_cache   = ruby_xcalloc(FRAME_CACHE_SIZE, sizeof(frame_cache_entry));
+  buffer->stack_cache   = ruby_xcalloc(STACK_CACHE_SIZE, sizeof(stack_cache_entry));
+  buffer->strings       = ruby_xcalloc(2 * max_frames, sizeof(VALUE));
+
+  frame_cache_reset(buffer);
 
   return buffer;
 }
@@ -273,6 +778,365 @@ void sampling_buffer_free(sampling_buffer *buffer) {
   ruby_xfree(buffer->is_ruby_frame);
   ruby_xfree(buffer->locations);
   ruby_xfree(buffer->lines);
+  ruby_xfree(buffer->frame_cache);
+
+  for (int i = 0; i < STACK_CACHE_SIZE; i++) {
+    stack_cache_entry *entry = &buffer->stack_cache[i];
+    if (entry->capacity == 0) continue;
+
+    ruby_xfree(entry->stack_buffer);
+    ruby_xfree(entry->lines_buffer);
+    ruby_xfree(entry->is_ruby_frame);
+    ruby_xfree(entry->strings);
+    ruby_xfree(entry->lines);
+  }
+  ruby_xfree(buffer->stack_cache);
+  ruby_xfree(buffer->strings);
 
   ruby_xfree(buffer);
 }
+
+// Must be called by the owner of a long-lived sampling_buffer from its dmark function, see frame_cache_entry for details
+void sampling_buffer_mark(sampling_buffer *buffer) {
+  if (buffer == NULL) return;
+
+  for (int i = 0; i < FRAME_CACHE_SIZE; i++) {
+    frame_cache_entry *entry = &buffer->frame_cache[i];
+    if (entry->frame == Qnil) continue;
+
+    rb_gc_mark(entry->frame);
+    rb_gc_mark(entry->name);
+    rb_gc_mark(entry->filename);
+  }
+
+  for (int i = 0; i < STACK_CACHE_SIZE; i++) {
+    stack_cache_entry *entry = &buffer->stack_cache[i];
+
+    for (int j = 0; j < entry->captured_frames; j++) {
+      rb_gc_mark(entry->stack_buffer[j]);
+      rb_gc_mark(entry->strings[2 * j]);
+      rb_gc_mark(entry->strings[2 * j + 1]);
+    }
+  }
+}
+
+static inline unsigned int frame_cache_slot_for(VALUE frame) {
+  // Objects are at least 8-byte aligned, so the lowest bits carry no information
+  return (unsigned int) ((frame >> 3) ^ (frame >> 13)) & (FRAME_CACHE_SIZE - 1);
+}
+
+static frame_cache_entry *frame_cache_entry_for(sampling_buffer* buffer, VALUE frame, bool is_ruby_frame) {
+  frame_cache_entry *entry = &buffer->frame_cache[frame_cache_slot_for(frame)];
+
+  if (entry->frame == frame) return entry;
+
+  VALUE name, filename;
+
+  if (is_ruby_frame) {
+    name = rb_profile_frame_base_label(frame);
+    filename = rb_profile_frame_path(frame);
+  } else {
+    name = ddtrace_rb_profile_frame_method_name(frame);
+    filename = Qnil; // Not used, see sample_thread
+  }
+
+  name = NIL_P(name) ? missing_string : name;
+  filename = NIL_P(filename) ? missing_string : filename;
+
+  *entry = (frame_cache_entry) {
+    .frame = frame,
+    .name = name,
+    .filename = filename,
+    .name_slice = char_slice_from_ruby_string(name),
+    .filename_slice = char_slice_from_ruby_string(filename),
+  };
+
+  return entry;
+}
+
+static void frame_cache_reset(sampling_buffer* buffer) {
+  // Note: Qnil is not a valid frame, so we use it to mark empty slots
+  for (int i = 0; i < FRAME_CACHE_SIZE; i++) {
+    buffer->frame_cache[i] = (frame_cache_entry) {.frame = Qnil, .name = Qnil, .filename = Qnil};
+  }
+}
+
+// FNV-1a-style hash over the raw stack returned by ddtrace_rb_profile_frames. This is a lot cheaper than resolving the
+// frames, so we can afford to do it on every sample.
+static uint64_t stack_hash(sampling_buffer* buffer, int captured_frames) {
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (int i = 0; i < captured_frames; i++) {
+    hash = (hash ^ (uint64_t) buffer->stack_buffer[i]) * 1099511628211ULL;
+    hash = (hash ^ (((uint64_t) buffer->lines_buffer[i] << 1) | buffer->is_ruby_frame[i])) * 1099511628211ULL;
+  }
+
+  return hash ^ (uint64_t) captured_frames;
+}
+
+static stack_cache_entry *stack_cache_entry_for(sampling_buffer* buffer, int captured_frames, uint64_t hash) {
+  stack_cache_entry *entry = &buffer->stack_cache[hash & (STACK_CACHE_SIZE - 1)];
+
+  bool matches =
+    entry->captured_frames == captured_frames &&
+    entry->hash == hash &&
+    memcmp(entry->stack_buffer, buffer->stack_buffer, captured_frames * sizeof(VALUE)) == 0 &&
+    memcmp(entry->lines_buffer, buffer->lines_buffer, captured_frames * sizeof(int)) == 0 &&
+    memcmp(entry->is_ruby_frame, buffer->is_ruby_frame, captured_frames * sizeof(bool)) == 0;
+
+  return (captured_frames > 0 && matches) ? entry : NULL;
+}
+
+// Copies the stack that was just built in the buffer into the stack cache, replacing whatever was in its slot
+static void stack_cache_store(sampling_buffer* buffer, int captured_frames, uint64_t hash) {
+  if (captured_frames == 0) return;
+
+  stack_cache_entry *entry = &buffer->stack_cache[hash & (STACK_CACHE_SIZE - 1)];
+
+  // Make sure that the entry is never seen in an inconsistent state (e.g. by sampling_buffer_mark, if the allocations
+  // below trigger the GC)
+  entry->captured_frames = 0;
+
+  if (entry->capacity < captured_frames) {
+    entry->stack_buffer  = ruby_xrealloc2(entry->stack_buffer, captured_frames, sizeof(VALUE));
+    entry->lines_buffer  = ruby_xrealloc2(entry->lines_buffer, captured_frames, sizeof(int));
+    entry->is_ruby_frame = ruby_xrealloc2(entry->is_ruby_frame, captured_frames, sizeof(bool));
+    entry->strings       = ruby_xrealloc2(entry->strings, 2 * captured_frames, sizeof(VALUE));
+    entry->lines         = ruby_xrealloc2(entry->lines, captured_frames, sizeof(ddprof_ffi_Line));
+    entry->capacity      = captured_frames;
+  }
+
+  memcpy(entry->stack_buffer, buffer->stack_buffer, captured_frames * sizeof(VALUE));
+  memcpy(entry->lines_buffer, buffer->lines_buffer, captured_frames * sizeof(int));
+  memcpy(entry->is_ruby_frame, buffer->is_ruby_frame, captured_frames * sizeof(bool));
+  memcpy(entry->strings, buffer->strings, 2 * captured_frames * sizeof(VALUE));
+  memcpy(entry->lines, buffer->lines, captured_frames * sizeof(ddprof_ffi_Line));
+
+  entry->hash = hash;
+  entry->captured_frames = captured_frames;
+}
+
+static void stack_cache_reset(sampling_buffer* buffer) {
+  // Note: We keep the arrays allocated for each entry around, so they can be reused
+  for (int i = 0; i < STACK_CACHE_SIZE; i++) buffer->stack_cache[i].captured_frames = 0;
+}
+
+static void record_cached_stack(
+  stack_cache_entry *entry,
+  sampling_buffer* buffer,
+  VALUE recorder_instance,
+  ddprof_ffi_Slice_i64 metric_values,
+  ddprof_ffi_Slice_label labels,
+  const ddprof_ffi_Line *placeholder_line_on_top
+) {
+  for (int i = 0; i < entry->captured_frames; i++) {
+    buffer->locations[i] = (ddprof_ffi_Location) {.lines = (ddprof_ffi_Slice_line) {.ptr = &entry->lines[i], .len = 1}};
+  }
+
+  sample_stack_identity stack = {
+    .frames = entry->stack_buffer,
+    .lines = entry->lines_buffer,
+    .is_ruby_frame = entry->is_ruby_frame,
+    .strings = entry->strings,
+    .frames_count = entry->captured_frames,
+    .hash = entry->hash,
+  };
+
+  record_locations(
+    buffer,
+    recorder_instance,
+    buffer->locations,
+    entry->captured_frames,
+    metric_values,
+    labels,
+    placeholder_line_on_top,
+    &stack
+  );
+}
+
+// When `presized_frames` is zero, the arrays for each sample are lazily allocated, see deferred_sample_reserve.
+//
+// Otherwise, they all get allocated here, with room for `presized_frames` frames (which must be the max_frames of the
+// sampling_buffer that gets used with it), `presized_labels` labels and `presized_labels_bytes` bytes of label keys and
+// values, and sample_thread_deferred never allocates. This is needed when sampling from places where allocating is not
+// allowed, such as the RUBY_INTERNAL_EVENT_NEWOBJ tracepoint. Labels that don't fit get left out (or truncated).
+deferred_samples *deferred_samples_new(
+  unsigned int capacity,
+  int presized_frames,
+  size_t presized_labels,
+  size_t presized_labels_bytes
+) {
+  if (capacity == 0) rb_raise(rb_eArgError, "Invalid deferred samples capacity: value must be > 0");
+
+  deferred_samples *deferred = ruby_xcalloc(1, sizeof(deferred_samples));
+
+  deferred->capacity = capacity;
+  deferred->first = 0;
+  deferred->count = 0;
+  deferred->dropped = 0;
+  deferred->presized = presized_frames > 0;
+  deferred->samples = ruby_xcalloc(capacity, sizeof(deferred_sample));
+
+  if (deferred->presized) {
+    for (unsigned int i = 0; i < capacity; i++) {
+      deferred_sample *sample = &deferred->samples[i];
+      sample->stack_buffer  = ruby_xcalloc(presized_frames, sizeof(VALUE));
+      sample->lines_buffer  = ruby_xcalloc(presized_frames, sizeof(int));
+      sample->is_ruby_frame = ruby_xcalloc(presized_frames, sizeof(bool));
+      sample->capacity      = presized_frames;
+      deferred_sample_reserve_labels(sample, presized_labels, presized_labels_bytes);
+    }
+  }
+
+  return deferred;
+}
+
+void deferred_samples_free(deferred_samples *deferred) {
+  if (deferred == NULL) rb_raise(rb_eArgError, "deferred_samples_free called with NULL deferred samples");
+
+  for (unsigned int i = 0; i < deferred->capacity; i++) {
+    deferred_sample *sample = &deferred->samples[i];
+
+    ruby_xfree(sample->stack_buffer);
+    ruby_xfree(sample->lines_buffer);
+    ruby_xfree(sample->is_ruby_frame);
+    ruby_xfree(sample->labels);
+    ruby_xfree(sample->labels_storage);
+  }
+  ruby_xfree(deferred->samples);
+
+  ruby_xfree(deferred);
+}
+
+// Used by the owners of a sampling_buffer to report their memory usage (e.g. via ObjectSpace.memsize_of)
+size_t sampling_buffer_memsize(sampling_buffer *buffer) {
+  if (buffer == NULL) return 0;
+
+  size_t size =
+    sizeof(sampling_buffer) +
+    buffer->max_frames * (sizeof(VALUE) + sizeof(int) + sizeof(bool) + sizeof(ddprof_ffi_Line) + 2 * sizeof(VALUE)) +
+    (buffer->max_frames + 1) * sizeof(ddprof_ffi_Location) +
+    FRAME_CACHE_SIZE * sizeof(frame_cache_entry) +
+    STACK_CACHE_SIZE * sizeof(stack_cache_entry);
+
+  for (int i = 0; i < STACK_CACHE_SIZE; i++) {
+    size += buffer->stack_cache[i].capacity * (sizeof(VALUE) + sizeof(int) + sizeof(bool) + 2 * sizeof(VALUE) + sizeof(ddprof_ffi_Line));
+  }
+
+  return size;
+}
+
+// Must be called by the owner of the deferred_samples from its dmark function, see struct deferred_samples.
+// As with the frame cache, the frames are pinned, as they get compared by address once they're flushed.
+void deferred_samples_mark(deferred_samples *deferred) {
+  if (deferred == NULL) return;
+
+  for (unsigned int i = 0; i < deferred->count; i++) {
+    deferred_sample *sample = &deferred->samples[(deferred->first + i) % deferred->capacity];
+
+    for (int j = 0; j < sample->captured_frames; j++) rb_gc_mark(sample->stack_buffer[j]);
+  }
+}
+
+size_t deferred_samples_memsize(deferred_samples *deferred) {
+  if (deferred == NULL) return 0;
+
+  size_t size = sizeof(deferred_samples) + deferred->capacity * sizeof(deferred_sample);
+
+  for (unsigned int i = 0; i < deferred->capacity; i++) {
+    deferred_sample *sample = &deferred->samples[i];
+    size +=
+      sample->capacity * (sizeof(VALUE) + sizeof(int) + sizeof(bool)) +
+      sample->labels_capacity * sizeof(ddprof_ffi_Label) +
+      sample->labels_storage_capacity;
+  }
+
+  return size;
+}
+
+unsigned int deferred_samples_count(deferred_samples *deferred) {
+  return deferred->count;
+}
+
+unsigned int deferred_samples_capacity(deferred_samples *deferred) {
+  return deferred->capacity;
+}
+
+unsigned long deferred_samples_dropped(deferred_samples *deferred) {
+  return deferred->dropped;
+}
+
+// Returns the stack captured by the latest sample_thread_deferred call, so that callers that need it for something
+// else too don't need to unwind the stack again. It's only valid until the next sample_thread_deferred or
+// deferred_samples_flush call, and MUST NOT be called when there are no pending samples.
+captured_stack deferred_samples_newest_stack(deferred_samples *deferred) {
+  if (deferred->count == 0) rb_raise(rb_eRuntimeError, "Unexpected call to deferred_samples_newest_stack without samples");
+
+  deferred_sample *sample = &deferred->samples[(deferred->first + deferred->count - 1) % deferred->capacity];
+
+  return (captured_stack) {
+    .frames = sample->stack_buffer,
+    .lines = sample->lines_buffer,
+    .is_ruby_frame = sample->is_ruby_frame,
+    .frames_count = sample->captured_frames,
+    .stack_depth = sample->stack_depth,
+  };
+}
+
+static void deferred_sample_reserve(deferred_sample *sample, int frames_needed, ddprof_ffi_Slice_label labels) {
+  if (sample->capacity < frames_needed) {
+    sample->stack_buffer  = ruby_xrealloc2(sample->stack_buffer, frames_needed, sizeof(VALUE));
+    sample->lines_buffer  = ruby_xrealloc2(sample->lines_buffer, frames_needed, sizeof(int));
+    sample->is_ruby_frame = ruby_xrealloc2(sample->is_ruby_frame, frames_needed, sizeof(bool));
+    sample->capacity      = frames_needed;
+  }
+
+  size_t labels_storage_needed = 0;
+  for (size_t i = 0; i < labels.len; i++) labels_storage_needed += labels.ptr[i].key.len + labels.ptr[i].str.len;
+
+  deferred_sample_reserve_labels(sample, labels.len, labels_storage_needed);
+}
+
+static void deferred_sample_reserve_labels(deferred_sample *sample, size_t labels_needed, size_t labels_storage_needed) {
+  if (sample->labels_capacity < labels_needed) {
+    sample->labels = ruby_xrealloc2(sample->labels, labels_needed, sizeof(ddprof_ffi_Label));
+    sample->labels_capacity = labels_needed;
+  }
+
+  if (sample->labels_storage_capacity < labels_storage_needed) {
+    sample->labels_storage = ruby_xrealloc(sample->labels_storage, labels_storage_needed);
+    sample->labels_storage_capacity = labels_storage_needed;
+  }
+}
+
+// Copies as much of `slice` as fits in the `storage_left` bytes at `storage`
+static inline ddprof_ffi_CharSlice copy_char_slice(ddprof_ffi_CharSlice slice, char **storage, size_t *storage_left) {
+  if (slice.len == 0) return slice;
+
+  size_t length = slice.len < *storage_left ? slice.len : *storage_left;
+  if (length > 0) memcpy(*storage, slice.ptr, length);
+  ddprof_ffi_CharSlice copy = {.ptr = *storage, .len = length};
+  *storage += length;
+  *storage_left -= length;
+
+  return copy;
+}
+
+// Only presized samples (see deferred_samples_new) can run out of space here; otherwise, deferred_sample_reserve was
+// called before with the same labels. Labels whose key doesn't fit entirely get left out.
+static void deferred_sample_copy_labels(deferred_sample *sample, ddprof_ffi_Slice_label labels) {
+  char *storage = sample->labels_storage;
+  size_t storage_left = sample->labels_storage_capacity;
+  size_t labels_count = 0;
+
+  for (size_t i = 0; i < labels.len && labels_count < sample->labels_capacity; i++) {
+    if (labels.ptr[i].key.len > storage_left) break;
+
+    ddprof_ffi_Label *label = &sample->labels[labels_count++];
+    *label = labels.ptr[i];
+    label->key = copy_char_slice(labels.ptr[i].key, &storage, &storage_left);
+    label->str = copy_char_slice(labels.ptr[i].str, &storage, &storage_left);
+  }
+
+  sample->labels_count = labels_count;
+}
@@ -1,9 +1,72 @@
 #pragma once
 
 #include <ddprof/ffi.h>
+#include "private_vm_api_access.h"
 
 typedef struct sampling_buffer sampling_buffer;
+typedef struct deferred_samples deferred_samples;
 
-void sample_thread(VALUE thread, sampling_buffer* buffer, VALUE recorder_instance, ddprof_ffi_Slice_i64 metric_values, ddprof_ffi_Slice_label labels);
+// Raw stack of a sample captured by sample_thread_deferred, see deferred_samples_newest_stack
+typedef struct {
+  const VALUE *frames;
+  const int *lines;
+  const bool *is_ruby_frame;
+  int frames_count; // Can also be PLACEHOLDER_STACK_IN_NATIVE_CODE
+  ptrdiff_t stack_depth; // Only set when the captured frames filled up max_frames, see record_raw_stack
+} captured_stack;
+
+void sample_thread(
+  VALUE thread,
+  sampling_buffer* buffer,
+  VALUE recorder_instance,
+  ddprof_ffi_Slice_i64 metric_values,
+  ddprof_ffi_Slice_label labels,
+  stack_snapshot *stack_snapshot
+);
+void sample_thread_with_placeholder_frame(
+  VALUE thread,
+  sampling_buffer* buffer,
+  VALUE recorder_instance,
+  ddprof_ffi_Slice_i64 metric_values,
+  ddprof_ffi_Slice_label labels,
+  stack_snapshot *stack_snapshot,
+  ddprof_ffi_CharSlice placeholder_name
+);
 sampling_buffer *sampling_buffer_new(unsigned int max_frames);
 void sampling_buffer_free(sampling_buffer *buffer);
+void sampling_buffer_mark(sampling_buffer *buffer);
+size_t sampling_buffer_memsize(sampling_buffer *buffer);
+
+bool sample_thread_deferred(
+  VALUE thread,
+  sampling_buffer* buffer,
+  deferred_samples *deferred,
+  ddprof_ffi_Slice_i64 metric_values,
+  ddprof_ffi_Slice_label labels,
+  stack_snapshot *stack_snapshot
+);
+void record_raw_stack(
+  sampling_buffer* buffer,
+  const VALUE *frames,
+  const int *lines,
+  const bool *is_ruby_frame,
+  int frames_count,
+  ptrdiff_t stack_depth,
+  VALUE recorder_instance,
+  ddprof_ffi_Slice_i64 metric_values,
+  ddprof_ffi_Slice_label labels
+);
+void deferred_samples_flush(deferred_samples *deferred, sampling_buffer* buffer, VALUE recorder_instance);
+deferred_samples *deferred_samples_new(
+  unsigned int capacity,
+  int presized_frames,
+  size_t presized_labels,
+  size_t presized_labels_bytes
+);
+void deferred_samples_free(deferred_samples *deferred);
+void deferred_samples_mark(deferred_samples *deferred);
+size_t deferred_samples_memsize(deferred_samples *deferred);
+unsigned int deferred_samples_count(deferred_samples *deferred);
+unsigned int deferred_samples_capacity(deferred_samples *deferred);
+unsigned long deferred_samples_dropped(deferred_samples *deferred);
+captured_stack deferred_samples_newest_stack(deferred_samples *deferred);
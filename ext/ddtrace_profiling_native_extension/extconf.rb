@@ -113,6 +113,9 @@ end
 # On older Rubies, there was no struct rb_native_thread. See private_vm_api_acccess.c for details.
 $defs << '-DNO_RB_NATIVE_THREAD' if RUBY_VERSION < '3.2'
 
+# On older Rubies, there was no struct rb_thread_sched (the gvl struct was used instead). See private_vm_api_acccess.c for details.
+$defs << '-DNO_RB_THREAD_SCHED' if RUBY_VERSION < '3.2'
+
 # On older Rubies, we need to use a backported version of this function. See private_vm_api_access.h for details.
 $defs << '-DUSE_BACKPORTED_RB_PROFILE_FRAME_METHOD_NAME' if RUBY_VERSION < '3'
 
@@ -145,6 +148,11 @@ unless pkg_config('ddprof_ffi_with_rpath')
   skip_building_extension!(Datadog::Profiling::NativeExtensionHelpers::Supported::FAILED_TO_CONFIGURE_LIBDDPROF)
 end
 
+# Used to compress pprofs natively (see pprof_compression.c). Both codecs are optional: each one is only available if
+# its library (and header) can be found when building. These checks define HAVE_LIBZ and HAVE_LIBZSTD.
+have_library('z', 'deflate', 'zlib.h')
+have_library('zstd', 'ZSTD_compress', 'zstd.h')
+
 # Tag the native extension library with the Ruby version and Ruby platform.
 # This makes it easier for development (avoids "oops I forgot to rebuild when I switched my Ruby") and ensures that
 # the wrong library is never loaded.
@@ -0,0 +1,363 @@
+#include <ruby.h>
+#include <stdlib.h>
+#include <string.h>
+#include "heap_tracker.h"
+#include "private_vm_api_access.h"
+#include "stack_recorder.h"
+
+// Used by the allocations collector (see collectors_allocations.c) to report the live heap: which of the objects it
+// sampled are still alive, and where they were allocated.
+//
+// Objects get added by heap_tracker_track_object (from the NEWOBJ tracepoint, reusing the stack that the allocations
+// collector captured for the allocation sample) and removed by heap_tracker_untrack_object (from the FREEOBJ
+// tracepoint). Every time the profile is serialized, heap_tracker_record_live_heap records one sample per allocation
+// stack, with the heap-space used by the objects still alive that were allocated there.
+//
+// Objects are keyed by their address, and we don't keep them alive (e.g. we don't mark them). This means that:
+// * We may miss an object being freed (the VM skips the FREEOBJ tracepoint if it's triggered while another internal
+//   tracepoint, such as our own NEWOBJ one, is running) or being moved (by GC compaction). Thus, before using any object
+//   we check it still looks alive (see live_object_size) and if it doesn't, we stop tracking it.
+// * If the address of such an object gets reused, we may attribute the new object to the old object's stack. This
+//   should be very rare, as only sampled objects get tracked.
+//
+// To bound the memory used, at most `max_tracked_objects` objects get tracked at any one time, and their stacks are
+// deduplicated. A stack gets freed as soon as its last object does (see release_stack). Because the NEWOBJ and FREEOBJ
+// tracepoints MUST NOT trigger the GC, we use malloc/free (and not ruby_xmalloc/ruby_xfree) for stacks.
+
+#define EMPTY_SLOT Qfalse // Never the address of an object
+#define STACK_TABLE_BUCKETS 1024
+
+// An allocation stack, shared by all tracked objects that were allocated there
+typedef struct heap_stack {
+  uint64_t hash;
+  int frames_count;
+  ptrdiff_t stack_depth; // Only set when the captured frames filled up max_frames, see record_raw_stack
+  // How many tracked objects were allocated at this stack. Stacks that reach zero get freed, see release_stack.
+  unsigned long live_objects;
+  int64_t live_heap_bytes; // Only used by heap_tracker_record_live_heap
+  VALUE *frames;
+  int *lines;
+  bool *is_ruby_frame;
+  struct heap_stack *next; // Next stack in the same bucket
+} heap_stack;
+
+typedef struct {
+  VALUE object; // EMPTY_SLOT if this slot is not being used
+  // How many allocations this object stands for, as each sampled object is representative of all the objects
+  // allocated since the previous sample
+  long weight;
+  heap_stack *stack;
+} tracked_object;
+
+struct heap_tracker {
+  unsigned int max_tracked_objects;
+  unsigned long tracked_objects;
+  unsigned long tracked_stacks;
+  unsigned long skipped_objects;
+  size_t stacks_memory_bytes;
+  // Hashtable using open addressing with linear probing. We size it at (at least) twice max_tracked_objects, and to a
+  // power of two, so that it never needs to grow and lookups stay fast.
+  tracked_object *objects;
+  unsigned long objects_capacity;
+  heap_stack *stacks[STACK_TABLE_BUCKETS];
+  // Set while heap_tracker_record_live_heap goes over the stacks, during which they can't be freed (recording may
+  // trigger the GC, and thus the FREEOBJ tracepoint), see release_stack
+  bool recording_live_heap;
+}; // Note: typedef'd in the header to heap_tracker
+
+static heap_stack *find_or_create_stack(heap_tracker *tracker, captured_stack allocation_stack);
+static void release_stack(heap_tracker *tracker, heap_stack *stack);
+static void heap_stack_free(heap_stack *stack);
+static uint64_t heap_stack_hash(captured_stack allocation_stack);
+static unsigned long slot_for(heap_tracker *tracker, VALUE object);
+static unsigned long object_hash(VALUE object);
+static void remove_object_at(heap_tracker *tracker, unsigned long slot);
+static void free_stacks_without_live_objects(heap_tracker *tracker);
+
+heap_tracker *heap_tracker_new(unsigned int max_tracked_objects) {
+  heap_tracker *tracker = ruby_xcalloc(1, sizeof(heap_tracker));
+
+  tracker->max_tracked_objects = max_tracked_objects;
+
+  tracker->objects_capacity = 1;
+  while (tracker->objects_capacity < 2UL * max_tracked_objects) tracker->objects_capacity *= 2;
+  // Note: this relies on EMPTY_SLOT being zero, as ruby_xcalloc zeroes the memory
+  tracker->objects = ruby_xcalloc(tracker->objects_capacity, sizeof(tracked_object));
+
+  return tracker;
+}
+
+void heap_tracker_free(heap_tracker *tracker) {
+  for (int i = 0; i < STACK_TABLE_BUCKETS; i++) {
+    heap_stack *stack = tracker->stacks[i];
+    while (stack != NULL) {
+      heap_stack *next = stack->next;
+      heap_stack_free(stack);
+      stack = next;
+    }
+  }
+
+  ruby_xfree(tracker->objects);
+  ruby_xfree(tracker);
+}
+
+// Frames in the stacks we keep MUST be marked, as they're only used later (when the profile gets serialized).
+// Note: rb_gc_mark (and not rb_gc_mark_movable) is used, as stacks get compared using the frame addresses.
+void heap_tracker_mark(heap_tracker *tracker) {
+  if (tracker == NULL) return;
+
+  for (int i = 0; i < STACK_TABLE_BUCKETS; i++) {
+    for (heap_stack *stack = tracker->stacks[i]; stack != NULL; stack = stack->next) {
+      for (int j = 0; j < stack->frames_count; j++) rb_gc_mark(stack->frames[j]);
+    }
+  }
+}
+
+void heap_tracker_track_object(heap_tracker *tracker, VALUE object, long weight, captured_stack allocation_stack) {
+  if (tracker->tracked_objects >= tracker->max_tracked_objects) {
+    tracker->skipped_objects++;
+    return;
+  }
+
+  // Note: This also covers PLACEHOLDER_STACK_IN_NATIVE_CODE
+  if (allocation_stack.frames_count <= 0) return;
+
+  heap_stack *stack = find_or_create_stack(tracker, allocation_stack);
+  if (stack == NULL) return; // Out of memory, skip it
+  // Must happen before releasing the previous stack below, as it may be this same one
+  stack->live_objects++;
+
+  unsigned long slot = slot_for(tracker, object);
+  tracked_object *entry = &tracker->objects[slot];
+
+  if (entry->object == object) {
+    // The previous object at this address got freed or moved, but we missed it, see top of file
+    release_stack(tracker, entry->stack);
+  } else {
+    tracker->tracked_objects++;
+  }
+
+  *entry = (tracked_object) {.object = object, .weight = weight, .stack = stack};
+}
+
+// Note: This gets called for every object that gets freed, so it's important to keep it cheap
+void heap_tracker_untrack_object(heap_tracker *tracker, VALUE object) {
+  if (tracker->tracked_objects == 0) return;
+
+  unsigned long slot = slot_for(tracker, object);
+  if (tracker->objects[slot].object != object) return;
+
+  heap_stack *stack = tracker->objects[slot].stack;
+  remove_object_at(tracker, slot);
+  release_stack(tracker, stack);
+}
+
+void heap_tracker_record_live_heap(heap_tracker *tracker, sampling_buffer *buffer, VALUE recorder_instance) {
+  tracker->recording_live_heap = true;
+
+  for (int i = 0; i < STACK_TABLE_BUCKETS; i++) {
+    for (heap_stack *stack = tracker->stacks[i]; stack != NULL; stack = stack->next) stack->live_heap_bytes = 0;
+  }
+
+  // Objects that turn out not to be alive anymore get removed, which may move other objects to the current slot. Thus, we
+  // only move on to the next slot when we didn't remove anything.
+  //
+  // Note that when a cluster of slots wraps around the end of the table, removing an object may also move an object we
+  // already looked at (from the start of the table) to the current slot. That's why the live objects only get summed up
+  // below, once all the dead ones are gone and nothing moves anymore.
+  for (unsigned long i = 0; i < tracker->objects_capacity;) {
+    tracked_object *entry = &tracker->objects[i];
+
+    if (entry->object != EMPTY_SLOT && live_object_size(entry->object) == 0) {
+      heap_stack *stack = entry->stack;
+      remove_object_at(tracker, i);
+      release_stack(tracker, stack);
+      continue;
+    }
+
+    i++;
+  }
+
+  for (unsigned long i = 0; i < tracker->objects_capacity; i++) {
+    tracked_object *entry = &tracker->objects[i];
+    if (entry->object == EMPTY_SLOT) continue;
+
+    entry->stack->live_heap_bytes += (int64_t) live_object_size(entry->object) * entry->weight;
+  }
+
+  int64_t metric_values[ALL_VALUE_TYPES_COUNT] = {0};
+  ddprof_ffi_Slice_i64 metric_values_slice = {.ptr = metric_values, .len = ALL_VALUE_TYPES_COUNT};
+
+  for (int i = 0; i < STACK_TABLE_BUCKETS; i++) {
+    for (heap_stack *stack = tracker->stacks[i]; stack != NULL; stack = stack->next) {
+      if (stack->live_heap_bytes == 0) continue;
+
+      metric_values[HEAP_SPACE_VALUE_POS] = stack->live_heap_bytes;
+      record_raw_stack(
+        buffer,
+        stack->frames,
+        stack->lines,
+        stack->is_ruby_frame,
+        stack->frames_count,
+        stack->stack_depth,
+        recorder_instance,
+        metric_values_slice,
+        (ddprof_ffi_Slice_label) {.ptr = NULL, .len = 0}
+      );
+    }
+  }
+
+  // Note: If recording raised, stacks without live objects only get freed on the next successful call
+  tracker->recording_live_heap = false;
+  free_stacks_without_live_objects(tracker);
+}
+
+heap_tracker_stats heap_tracker_stats_for(heap_tracker *tracker) {
+  return (heap_tracker_stats) {
+    .tracked_objects = tracker->tracked_objects,
+    .max_tracked_objects = tracker->max_tracked_objects,
+    .tracked_stacks = tracker->tracked_stacks,
+    .skipped_objects = tracker->skipped_objects,
+    .memory_bytes =
+      sizeof(heap_tracker) +
+      tracker->objects_capacity * sizeof(tracked_object) +
+      tracker->stacks_memory_bytes,
+  };
+}
+
+static heap_stack *find_or_create_stack(heap_tracker *tracker, captured_stack allocation_stack) {
+  int frames_count = allocation_stack.frames_count;
+  uint64_t hash = heap_stack_hash(allocation_stack);
+  heap_stack **bucket = &tracker->stacks[hash % STACK_TABLE_BUCKETS];
+
+  for (heap_stack *stack = *bucket; stack != NULL; stack = stack->next) {
+    if (
+      stack->hash == hash &&
+      stack->frames_count == frames_count &&
+      memcmp(stack->frames, allocation_stack.frames, frames_count * sizeof(VALUE)) == 0 &&
+      memcmp(stack->lines, allocation_stack.lines, frames_count * sizeof(int)) == 0
+    ) {
+      return stack;
+    }
+  }
+
+  heap_stack *stack = calloc(1, sizeof(heap_stack));
+  if (stack == NULL) return NULL;
+  stack->frames = malloc(frames_count * sizeof(VALUE));
+  stack->lines = malloc(frames_count * sizeof(int));
+  stack->is_ruby_frame = malloc(frames_count * sizeof(bool));
+  if (stack->frames == NULL || stack->lines == NULL || stack->is_ruby_frame == NULL) {
+    heap_stack_free(stack);
+    return NULL;
+  }
+
+  stack->hash = hash;
+  stack->frames_count = frames_count;
+  stack->stack_depth = allocation_stack.stack_depth;
+  memcpy(stack->frames, allocation_stack.frames, frames_count * sizeof(VALUE));
+  memcpy(stack->lines, allocation_stack.lines, frames_count * sizeof(int));
+  memcpy(stack->is_ruby_frame, allocation_stack.is_ruby_frame, frames_count * sizeof(bool));
+
+  // Only make the stack visible (e.g. to heap_tracker_mark) once it's fully initialized
+  stack->next = *bucket;
+  *bucket = stack;
+  tracker->tracked_stacks++;
+  tracker->stacks_memory_bytes += sizeof(heap_stack) + frames_count * (sizeof(VALUE) + sizeof(int) + sizeof(bool));
+
+  return stack;
+}
+
+// Called once an object allocated at `stack` is no longer tracked. The stack gets freed right away when that was its
+// last object, unless heap_tracker_record_live_heap is going over the stacks; if so, it gets freed once that's done.
+static void release_stack(heap_tracker *tracker, heap_stack *stack) {
+  stack->live_objects--;
+  if (stack->live_objects > 0 || tracker->recording_live_heap) return;
+
+  heap_stack **previous_next = &tracker->stacks[stack->hash % STACK_TABLE_BUCKETS];
+  while (*previous_next != stack) previous_next = &(*previous_next)->next;
+  *previous_next = stack->next;
+
+  tracker->tracked_stacks--;
+  tracker->stacks_memory_bytes -= sizeof(heap_stack) + stack->frames_count * (sizeof(VALUE) + sizeof(int) + sizeof(bool));
+  heap_stack_free(stack);
+}
+
+static void heap_stack_free(heap_stack *stack) {
+  free(stack->frames);
+  free(stack->lines);
+  free(stack->is_ruby_frame);
+  free(stack);
+}
+
+// FNV-1a over the frames and lines
+static uint64_t heap_stack_hash(captured_stack allocation_stack) {
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (int i = 0; i < allocation_stack.frames_count; i++) {
+    hash = (hash ^ (uint64_t) allocation_stack.frames[i]) * 1099511628211ULL;
+    hash = (hash ^ (uint64_t) allocation_stack.lines[i]) * 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+// Returns either the slot where the object is, or the empty slot where it should go
+static unsigned long slot_for(heap_tracker *tracker, VALUE object) {
+  unsigned long mask = tracker->objects_capacity - 1;
+  unsigned long slot = object_hash(object) & mask;
+
+  while (tracker->objects[slot].object != EMPTY_SLOT && tracker->objects[slot].object != object) {
+    slot = (slot + 1) & mask;
+  }
+
+  return slot;
+}
+
+static unsigned long object_hash(VALUE object) {
+  // Objects are aligned, so the lower bits carry no information
+  return (unsigned long) ((((uint64_t) object) >> 3) * 11400714819323198485ULL >> 16);
+}
+
+// Backward shift deletion: rather than leaving tombstones behind, we move back any following objects that would
+// otherwise become unreachable by linear probing
+static void remove_object_at(heap_tracker *tracker, unsigned long slot) {
+  unsigned long mask = tracker->objects_capacity - 1;
+  unsigned long next = slot;
+
+  while (true) {
+    next = (next + 1) & mask;
+    VALUE next_object = tracker->objects[next].object;
+    if (next_object == EMPTY_SLOT) break;
+
+    // If the ideal slot for the next object is cyclically in (slot, next], it can stay where it is
+    unsigned long ideal = object_hash(next_object) & mask;
+    bool can_stay = slot <= next ? (slot < ideal && ideal <= next) : (slot < ideal || ideal <= next);
+    if (can_stay) continue;
+
+    tracker->objects[slot] = tracker->objects[next];
+    slot = next;
+  }
+
+  tracker->objects[slot].object = EMPTY_SLOT;
+  tracker->tracked_objects--;
+}
+
+static void free_stacks_without_live_objects(heap_tracker *tracker) {
+  for (int i = 0; i < STACK_TABLE_BUCKETS; i++) {
+    heap_stack **previous_next = &tracker->stacks[i];
+
+    while (*previous_next != NULL) {
+      heap_stack *stack = *previous_next;
+
+      if (stack->live_objects > 0) {
+        previous_next = &stack->next;
+        continue;
+      }
+
+      *previous_next = stack->next;
+      tracker->tracked_stacks--;
+      tracker->stacks_memory_bytes -= sizeof(heap_stack) + stack->frames_count * (sizeof(VALUE) + sizeof(int) + sizeof(bool));
+      heap_stack_free(stack);
+    }
+  }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <ruby.h>
+#include <stdbool.h>
+#include "collectors_stack.h"
+
+// Keeps track of which sampled objects are still alive, and where they were allocated, so that we can report the live
+// heap (see heap_tracker_record_live_heap). See heap_tracker.c for details.
+typedef struct heap_tracker heap_tracker;
+
+typedef struct {
+  unsigned long tracked_objects;
+  unsigned long max_tracked_objects;
+  unsigned long tracked_stacks;
+  // Objects we did not track because we were already tracking max_tracked_objects
+  unsigned long skipped_objects;
+  size_t memory_bytes;
+} heap_tracker_stats;
+
+heap_tracker *heap_tracker_new(unsigned int max_tracked_objects);
+void heap_tracker_free(heap_tracker *tracker);
+void heap_tracker_mark(heap_tracker *tracker);
+// Both of these are safe to call from inside the NEWOBJ/FREEOBJ tracepoints (e.g. they never allocate Ruby objects)
+void heap_tracker_track_object(heap_tracker *tracker, VALUE object, long weight, captured_stack allocation_stack);
+void heap_tracker_untrack_object(heap_tracker *tracker, VALUE object);
+void heap_tracker_record_live_heap(heap_tracker *tracker, sampling_buffer *buffer, VALUE recorder_instance);
+heap_tracker_stats heap_tracker_stats_for(heap_tracker *tracker);
@@ -1,11 +1,28 @@
 #include <ruby.h>
 #include <ruby/thread.h>
+#include <unistd.h>
 #include <ddprof/ffi.h>
 #include "libddprof_helpers.h"
 #include "ruby_helpers.h"
+#include "serialized_profile.h"
+#include "spool.h"
+#include "upload_queue.h"
 
 // Used to report profiling data to Datadog.
 // This file implements the native bits of the Datadog::Profiling::HttpTransport class
+//
+// Each HttpTransport keeps its libddprof exporter around between exports, so that its connections to the agent (or to
+// the intake, in agentless mode) get reused. As the exporter includes the tags to report, it gets replaced whenever
+// the tags change (see `_native_configure_exporter`). Each exporter comes with an untagged sibling, used to report back
+// spooled profiles with the tags they were spooled with (see upload_queue.c).
+//
+// Profiles can either be reported right away (`_native_do_export`, which blocks the calling thread until done), or
+// queued to be reported in the background (`_native_enqueue_export`, see upload_queue.c), in which case how it went is
+// picked up later via `_native_take_upload_results`.
+//
+// Optionally, profiles that fail to be reported because the agent (or intake) is unreachable or unavailable get written
+// to a spool directory (see spool.c), and reported back from the upload queue's sender thread once reporting works
+// again. In both cases, spooling happens without holding the Global VM Lock.
 
 static VALUE ok_symbol = Qnil; // :ok in Ruby
 static VALUE error_symbol = Qnil; // :error in Ruby
@@ -17,24 +34,76 @@ static ID log_failure_to_process_tag_id; // id of :log_failure_to_process_tag in
 
 static VALUE http_transport_class = Qnil;
 
+// Profiles get reported every minute, so more than this means that reporting is failing or very slow anyway
+#define MAX_PENDING_UPLOADS 2
+#define MAX_UPLOAD_RESULTS_TAKEN 16
+
+struct http_transport_state {
+  // Note: Places in this file that usually need to be changed when this struct is changed are tagged with
+  // "Update this when modifying state struct"
+  shared_exporter *exporter; // NULL until configured
+  // libddprof exporters can't be used (nor dropped) after a fork, so we keep track of which process created it
+  pid_t exporter_pid;
+  // Set while the exporter is being used without the Global VM Lock, so we don't replace or free it under its feet
+  bool export_in_progress;
+  upload_queue *upload_queue; // NULL until the first profile gets queued (or the spool needs replaying)
+  spool *spool; // NULL unless configured
+  // Why the last profile reported by _native_do_export could not be spooled (NULL if it was, or didn't need to be).
+  // Gets reported (and cleared) by _native_take_upload_results.
+  const char *unreported_spool_failure;
+};
+
+// Arguments shared by _native_do_export and _native_enqueue_export
+struct export_arguments {
+  ddprof_ffi_Timespec start;
+  ddprof_ffi_Timespec finish;
+  uint64_t timeout_milliseconds;
+  ddprof_ffi_File files[2];
+  ddprof_ffi_Slice_file slice_files;
+  // When set, the pprof contents (files[0].file) are left empty, to be filled in from the serialized profile
+  bool have_serialized_profile;
+};
+
+struct wait_for_pending_uploads_arguments {
+  upload_queue *upload_queue;
+  uint64_t timeout_milliseconds;
+  bool is_idle;
+};
+
 struct call_exporter_without_gvl_arguments {
   ddprof_ffi_ProfileExporterV3 *exporter;
   ddprof_ffi_Request *request;
   ddprof_ffi_CancellationToken *cancel_token;
   ddprof_ffi_SendResult result;
   bool send_ran;
+  // When set, the profile gets spooled if it could not be reported; the fields below are only used for that
+  spool *spool;
+  ddprof_ffi_Timespec start;
+  ddprof_ffi_Timespec finish;
+  ddprof_ffi_Slice_file slice_files;
+  ddprof_ffi_ByteSlice encoded_tags;
+  const char *spool_failure; // Set if spooling failed, see spool_write
 };
 
+static VALUE _native_new(VALUE klass);
+static void http_transport_typed_data_free(void *state_ptr);
 inline static ddprof_ffi_ByteSlice byte_slice_from_ruby_string(VALUE string);
 static VALUE _native_validate_exporter(VALUE self, VALUE exporter_configuration);
+static VALUE _native_configure_exporter(
+  VALUE self,
+  VALUE transport_instance,
+  VALUE exporter_configuration,
+  VALUE tags_as_array
+);
 static ddprof_ffi_NewProfileExporterV3Result create_exporter(VALUE exporter_configuration, VALUE tags_as_array);
+static VALUE encode_tags(VALUE tags_as_array);
 static VALUE handle_exporter_failure(ddprof_ffi_NewProfileExporterV3Result exporter_result);
 static ddprof_ffi_EndpointV3 endpoint_from(VALUE exporter_configuration);
 static ddprof_ffi_Vec_tag convert_tags(VALUE tags_as_array);
 static void safely_log_failure_to_process_tag(ddprof_ffi_Vec_tag tags, VALUE err_details);
 static VALUE _native_do_export(
   VALUE self,
-  VALUE exporter_configuration,
+  VALUE transport_instance,
   VALUE upload_timeout_milliseconds,
   VALUE start_timespec_seconds,
   VALUE start_timespec_nanoseconds,
@@ -43,17 +112,56 @@ static VALUE _native_do_export(
   VALUE pprof_file_name,
   VALUE pprof_data,
   VALUE code_provenance_file_name,
-  VALUE code_provenance_data,
-  VALUE tags_as_array
+  VALUE code_provenance_data
+);
+static VALUE _native_enqueue_export(
+  VALUE self,
+  VALUE transport_instance,
+  VALUE upload_timeout_milliseconds,
+  VALUE start_timespec_seconds,
+  VALUE start_timespec_nanoseconds,
+  VALUE finish_timespec_seconds,
+  VALUE finish_timespec_nanoseconds,
+  VALUE pprof_file_name,
+  VALUE pprof_data,
+  VALUE code_provenance_file_name,
+  VALUE code_provenance_data
+);
+static VALUE _native_configure_spool(
+  VALUE self,
+  VALUE transport_instance,
+  VALUE spool_directory,
+  VALUE spool_max_size_bytes
 );
+static VALUE _native_replay_spool(VALUE self, VALUE transport_instance, VALUE upload_timeout_milliseconds);
+static VALUE _native_take_upload_results(VALUE self, VALUE transport_instance);
+static VALUE _native_wait_for_pending_uploads(VALUE self, VALUE transport_instance, VALUE timeout_milliseconds);
+static struct http_transport_state *get_state(VALUE transport_instance);
+static bool have_usable_exporter(struct http_transport_state *state);
+static upload_queue *get_or_create_upload_queue(struct http_transport_state *state);
 static void *call_exporter_without_gvl(void *call_args);
 static void interrupt_exporter_call(void *cancel_token);
+static void *wait_for_pending_uploads_without_gvl(void *call_args);
+static void interrupt_wait_for_pending_uploads(void *upload_queue);
 
 void http_transport_init(VALUE profiling_module) {
   http_transport_class = rb_define_class_under(profiling_module, "HttpTransport", rb_cObject);
 
+  // Instances of the HttpTransport class are "TypedData" objects, so they can keep their libddprof exporter.
+  // We MUST override the allocation function for objects of this class so that the struct always gets initialized,
+  // see https://bugs.ruby-lang.org/issues/18007 for a discussion around this.
+  rb_define_alloc_func(http_transport_class, _native_new);
+
   rb_define_singleton_method(http_transport_class, "_native_validate_exporter",  _native_validate_exporter, 1);
-  rb_define_singleton_method(http_transport_class, "_native_do_export",  _native_do_export, 11);
+  rb_define_singleton_method(http_transport_class, "_native_configure_exporter",  _native_configure_exporter, 3);
+  rb_define_singleton_method(http_transport_class, "_native_do_export",  _native_do_export, 10);
+  rb_define_singleton_method(http_transport_class, "_native_enqueue_export",  _native_enqueue_export, 10);
+  rb_define_singleton_method(http_transport_class, "_native_configure_spool",  _native_configure_spool, 3);
+  rb_define_singleton_method(http_transport_class, "_native_replay_spool",  _native_replay_spool, 2);
+  rb_define_singleton_method(http_transport_class, "_native_take_upload_results",  _native_take_upload_results, 1);
+  rb_define_singleton_method(
+    http_transport_class, "_native_wait_for_pending_uploads",  _native_wait_for_pending_uploads, 2
+  );
 
   ok_symbol = ID2SYM(rb_intern_const("ok"));
   error_symbol = ID2SYM(rb_intern_const("error"));
@@ -62,6 +170,45 @@ void http_transport_init(VALUE profiling_module) {
   log_failure_to_process_tag_id = rb_intern_const("log_failure_to_process_tag");
 }
 
+// This structure is used to define a Ruby object that stores a pointer to a struct http_transport_state
+// See also https://github.com/ruby/ruby/blob/master/doc/extension.rdoc for how this works
+static const rb_data_type_t http_transport_typed_data = {
+  .wrap_struct_name = "Datadog::Profiling::HttpTransport",
+  .function = {
+    .dfree = http_transport_typed_data_free,
+    .dsize = NULL, // We don't know how much memory the libddprof exporter uses
+    // No need to provide dmark nor dcompact because we don't reference Ruby VALUEs
+  },
+  // Note: Not RUBY_TYPED_FREE_IMMEDIATELY, as freeing drops the libddprof exporter and shuts down the upload queue
+  // (which takes its mutex). Neither should happen in the middle of the GC sweeping objects, so we let Ruby defer it.
+  .flags = 0
+};
+
+static VALUE _native_new(VALUE klass) {
+  struct http_transport_state *state = ruby_xcalloc(1, sizeof(struct http_transport_state));
+
+  // Update this when modifying state struct
+  state->exporter = NULL;
+  state->exporter_pid = 0;
+  state->export_in_progress = false;
+  state->upload_queue = NULL;
+  state->spool = NULL;
+  state->unreported_spool_failure = NULL;
+
+  return TypedData_Wrap_Struct(klass, &http_transport_typed_data, state);
+}
+
+static void http_transport_typed_data_free(void *state_ptr) {
+  struct http_transport_state *state = (struct http_transport_state *) state_ptr;
+
+  // Update this when modifying state struct
+  if (have_usable_exporter(state)) shared_exporter_release(state->exporter);
+  if (state->upload_queue != NULL) upload_queue_shutdown(state->upload_queue);
+  if (state->spool != NULL) spool_release(state->spool);
+
+  ruby_xfree(state);
+}
+
 inline static ddprof_ffi_ByteSlice byte_slice_from_ruby_string(VALUE string) {
   Check_Type(string, T_STRING);
   ddprof_ffi_ByteSlice byte_slice = {.ptr = (uint8_t *) StringValuePtr(string), .len = RSTRING_LEN(string)};
@@ -82,6 +229,50 @@ static VALUE _native_validate_exporter(VALUE self, VALUE exporter_configuration)
   return rb_ary_new_from_args(2, ok_symbol, Qnil);
 }
 
+// Replaces the exporter used to report profiles; the previous one (if any) is only dropped if the new one was
+// successfully created. Profiles that were already queued keep using the exporter they were queued with.
+static VALUE _native_configure_exporter(
+  VALUE self,
+  VALUE transport_instance,
+  VALUE exporter_configuration,
+  VALUE tags_as_array
+) {
+  struct http_transport_state *state = get_state(transport_instance);
+
+  if (state->export_in_progress) rb_raise(rb_eRuntimeError, "Cannot replace exporter while an export is in progress");
+
+  // This needs to be called BEFORE creating any exporters, since it can raise an exception
+  VALUE encoded_tags = encode_tags(tags_as_array);
+
+  ddprof_ffi_NewProfileExporterV3Result exporter_result = create_exporter(exporter_configuration, tags_as_array);
+
+  VALUE failure_tuple = handle_exporter_failure(exporter_result);
+  if (!NIL_P(failure_tuple)) return failure_tuple;
+
+  // The exporter configuration was already validated above and there are no tags to convert, so this won't raise (and
+  // leak the exporter we just created)
+  ddprof_ffi_NewProfileExporterV3Result untagged_exporter_result =
+    create_exporter(exporter_configuration, rb_ary_new());
+
+  if (untagged_exporter_result.tag != DDPROF_FFI_NEW_PROFILE_EXPORTER_V3_RESULT_OK) {
+    ddprof_ffi_NewProfileExporterV3Result_drop(exporter_result);
+    return handle_exporter_failure(untagged_exporter_result);
+  }
+
+  shared_exporter *untagged_exporter = shared_exporter_new(untagged_exporter_result, (ddprof_ffi_ByteSlice) {0}, NULL);
+  shared_exporter *exporter = untagged_exporter == NULL ?
+    NULL : shared_exporter_new(exporter_result, byte_slice_from_ruby_string(encoded_tags), untagged_exporter);
+  if (untagged_exporter == NULL) ddprof_ffi_NewProfileExporterV3Result_drop(exporter_result);
+  if (exporter == NULL) return rb_ary_new_from_args(2, error_symbol, rb_str_new_cstr("Failed to allocate exporter"));
+
+  // An exporter created before a fork is leaked rather than dropped, as that's not safe to do in the child
+  if (have_usable_exporter(state)) shared_exporter_release(state->exporter);
+  state->exporter = exporter;
+  state->exporter_pid = getpid();
+
+  return rb_ary_new_from_args(2, ok_symbol, Qnil);
+}
+
 static ddprof_ffi_NewProfileExporterV3Result create_exporter(VALUE exporter_configuration, VALUE tags_as_array) {
   Check_Type(exporter_configuration, T_ARRAY);
   Check_Type(tags_as_array, T_ARRAY);
@@ -100,6 +291,40 @@ static ddprof_ffi_NewProfileExporterV3Result create_exporter(VALUE exporter_conf
   return exporter_result;
 }
 
+// Returns the tags encoded as described in spool.h, so they can be spooled along with the profiles. Tags with NUL
+// characters can't be encoded, but libddprof would reject them anyway, so they're skipped.
+static VALUE encode_tags(VALUE tags_as_array) {
+  Check_Type(tags_as_array, T_ARRAY);
+
+  long tags_count = RARRAY_LEN(tags_as_array);
+  VALUE encoded_tags = rb_str_buf_new(0);
+
+  for (long i = 0; i < tags_count; i++) {
+    VALUE name_value_pair = rb_ary_entry(tags_as_array, i);
+    Check_Type(name_value_pair, T_ARRAY);
+
+    // Note: We can index the array without checking its size first because rb_ary_entry returns Qnil if out of bounds
+    VALUE tag_name = rb_ary_entry(name_value_pair, 0);
+    VALUE tag_value = rb_ary_entry(name_value_pair, 1);
+    Check_Type(tag_name, T_STRING);
+    Check_Type(tag_value, T_STRING);
+
+    if (
+      memchr(RSTRING_PTR(tag_name), '\0', RSTRING_LEN(tag_name)) != NULL ||
+      memchr(RSTRING_PTR(tag_value), '\0', RSTRING_LEN(tag_value)) != NULL
+    ) {
+      continue;
+    }
+
+    rb_str_buf_cat(encoded_tags, RSTRING_PTR(tag_name), RSTRING_LEN(tag_name));
+    rb_str_buf_cat(encoded_tags, "", 1);
+    rb_str_buf_cat(encoded_tags, RSTRING_PTR(tag_value), RSTRING_LEN(tag_value));
+    rb_str_buf_cat(encoded_tags, "", 1);
+  }
+
+  return encoded_tags;
+}
+
 static VALUE handle_exporter_failure(ddprof_ffi_NewProfileExporterV3Result exporter_result) {
   if (exporter_result.tag == DDPROF_FFI_NEW_PROFILE_EXPORTER_V3_RESULT_OK) return Qnil;
 
@@ -196,22 +421,33 @@ static void safely_log_failure_to_process_tag(ddprof_ffi_Vec_tag tags, VALUE err
 // Note: This function handles a bunch of libddprof dynamically-allocated objects, so it MUST not use any Ruby APIs
 // which can raise exceptions, otherwise the objects will be leaked.
 static VALUE perform_export(
-  ddprof_ffi_NewProfileExporterV3Result valid_exporter_result, // Must be called with a valid exporter result
+  struct http_transport_state *state, // Must have an exporter and be marked with export_in_progress
   ddprof_ffi_Timespec start,
   ddprof_ffi_Timespec finish,
   ddprof_ffi_Slice_file slice_files,
   ddprof_ffi_Vec_tag *additional_tags,
-  uint64_t timeout_milliseconds
+  uint64_t timeout_milliseconds,
+  VALUE borrowed_serialized_profile // Qnil if the pprof was passed in as a String
 ) {
-  ddprof_ffi_ProfileExporterV3 *exporter = valid_exporter_result.ok;
+  ddprof_ffi_ProfileExporterV3 *exporter = shared_exporter_get(state->exporter);
   ddprof_ffi_CancellationToken *cancel_token = ddprof_ffi_CancellationToken_new();
   ddprof_ffi_Request *request =
     ddprof_ffi_ProfileExporterV3_build(exporter, start, finish, slice_files, additional_tags, timeout_milliseconds);
 
   // We'll release the Global VM Lock while we're calling send, so that the Ruby VM can continue to work while this
   // is pending
-  struct call_exporter_without_gvl_arguments args =
-    {.exporter = exporter, .request = request, .cancel_token = cancel_token, .send_ran = false};
+  struct call_exporter_without_gvl_arguments args = {
+    .exporter = exporter,
+    .request = request,
+    .cancel_token = cancel_token,
+    .send_ran = false,
+    .spool = state->spool,
+    .start = start,
+    .finish = finish,
+    .slice_files = slice_files,
+    .encoded_tags = shared_exporter_tags(state->exporter),
+    .spool_failure = NULL,
+  };
 
   // We use rb_thread_call_without_gvl2 instead of rb_thread_call_without_gvl as the gvl2 variant never raises any
   // exceptions.
@@ -245,6 +481,7 @@ static VALUE perform_export(
     // As a workaround, we get libddprof to clean up the request by asking for the send to be cancelled, and then calling
     // it anyway. This will make libddprof free the request and return immediately which gets us the expected effect.
     interrupt_exporter_call((void *) cancel_token);
+    args.spool = NULL; // We're holding the Global VM Lock, so this is not a good time to be writing to disk
     call_exporter_without_gvl((void *) &args);
   }
 
@@ -253,12 +490,16 @@ static VALUE perform_export(
 
   ruby_status = success ? ok_symbol : error_symbol;
   ruby_result = success ? UINT2NUM(result.http_response.code) : ruby_string_from_vec_u8(result.failure);
+  if (args.spool_failure != NULL) state->unreported_spool_failure = args.spool_failure;
 
   // Clean up all dynamically-allocated things
   ddprof_ffi_SendResult_drop(args.result);
   ddprof_ffi_CancellationToken_drop(cancel_token);
-  ddprof_ffi_NewProfileExporterV3Result_drop(valid_exporter_result);
-  // The request itself does not need to be freed as libddprof takes care of it.
+  // The exporter is kept for the next export, and the request itself does not need to be freed as libddprof takes care
+  // of it.
+  // Once sent, the serialized profile is not needed anymore, so we don't wait for the GC to free it
+  if (!NIL_P(borrowed_serialized_profile)) serialized_profile_return(borrowed_serialized_profile, true);
+  state->export_in_progress = false;
 
   // We've cleaned up everything, so if there's an exception to be raised, let's have it
   if (pending_exception) rb_jump_tag(pending_exception);
@@ -266,9 +507,10 @@ static VALUE perform_export(
   return rb_ary_new_from_args(2, ruby_status, ruby_result);
 }
 
-static VALUE _native_do_export(
-  VALUE self,
-  VALUE exporter_configuration,
+// Validates the arguments, and gathers them into `args` (without copying anything). This needs to be called before
+// dealing with any dynamically-allocated things, as it can raise.
+static void read_export_arguments(
+  struct export_arguments *args,
   VALUE upload_timeout_milliseconds,
   VALUE start_timespec_seconds,
   VALUE start_timespec_nanoseconds,
@@ -277,8 +519,7 @@ static VALUE _native_do_export(
   VALUE pprof_file_name,
   VALUE pprof_data,
   VALUE code_provenance_file_name,
-  VALUE code_provenance_data,
-  VALUE tags_as_array
+  VALUE code_provenance_data
 ) {
   Check_Type(upload_timeout_milliseconds, T_FIXNUM);
   Check_Type(start_timespec_seconds, T_FIXNUM);
@@ -286,44 +527,266 @@ static VALUE _native_do_export(
   Check_Type(finish_timespec_seconds, T_FIXNUM);
   Check_Type(finish_timespec_nanoseconds, T_FIXNUM);
   Check_Type(pprof_file_name, T_STRING);
-  Check_Type(pprof_data, T_STRING);
+  // The pprof can be either a SerializedProfile (see serialized_profile.c), which gets used without copying and is
+  // released after sending, or a String
+  args->have_serialized_profile = is_serialized_profile(pprof_data);
+  if (!args->have_serialized_profile) Check_Type(pprof_data, T_STRING);
   Check_Type(code_provenance_file_name, T_STRING);
 
   // Code provenance can be disabled and in that case will be set to nil
   bool have_code_provenance = !NIL_P(code_provenance_data);
   if (have_code_provenance) Check_Type(code_provenance_data, T_STRING);
 
-  uint64_t timeout_milliseconds = NUM2ULONG(upload_timeout_milliseconds);
+  args->timeout_milliseconds = NUM2ULONG(upload_timeout_milliseconds);
 
-  ddprof_ffi_Timespec start =
+  args->start = (ddprof_ffi_Timespec)
     {.seconds = NUM2LONG(start_timespec_seconds), .nanoseconds = NUM2UINT(start_timespec_nanoseconds)};
-  ddprof_ffi_Timespec finish =
+  args->finish = (ddprof_ffi_Timespec)
     {.seconds = NUM2LONG(finish_timespec_seconds), .nanoseconds = NUM2UINT(finish_timespec_nanoseconds)};
 
   int files_to_report = 1 + (have_code_provenance ? 1 : 0);
-  ddprof_ffi_File files[files_to_report];
-  ddprof_ffi_Slice_file slice_files = {.ptr = files, .len = files_to_report};
+  args->slice_files = (ddprof_ffi_Slice_file) {.ptr = args->files, .len = files_to_report};
 
-  files[0] = (ddprof_ffi_File) {
+  args->files[0] = (ddprof_ffi_File) {
     .name = char_slice_from_ruby_string(pprof_file_name),
-    .file = byte_slice_from_ruby_string(pprof_data)
+    .file = args->have_serialized_profile ? (ddprof_ffi_ByteSlice) {0} : byte_slice_from_ruby_string(pprof_data)
   };
   if (have_code_provenance) {
-    files[1] = (ddprof_ffi_File) {
+    args->files[1] = (ddprof_ffi_File) {
       .name = char_slice_from_ruby_string(code_provenance_file_name),
       .file = byte_slice_from_ruby_string(code_provenance_data)
     };
   }
+}
+
+static VALUE _native_do_export(
+  VALUE self,
+  VALUE transport_instance,
+  VALUE upload_timeout_milliseconds,
+  VALUE start_timespec_seconds,
+  VALUE start_timespec_nanoseconds,
+  VALUE finish_timespec_seconds,
+  VALUE finish_timespec_nanoseconds,
+  VALUE pprof_file_name,
+  VALUE pprof_data,
+  VALUE code_provenance_file_name,
+  VALUE code_provenance_data
+) {
+  struct http_transport_state *state = get_state(transport_instance);
+
+  struct export_arguments args;
+  read_export_arguments(
+    &args,
+    upload_timeout_milliseconds,
+    start_timespec_seconds,
+    start_timespec_nanoseconds,
+    finish_timespec_seconds,
+    finish_timespec_nanoseconds,
+    pprof_file_name,
+    pprof_data,
+    code_provenance_file_name,
+    code_provenance_data
+  );
 
   ddprof_ffi_Vec_tag *null_additional_tags = NULL;
 
-  ddprof_ffi_NewProfileExporterV3Result exporter_result = create_exporter(exporter_configuration, tags_as_array);
-  // Note: Do not add anything that can raise exceptions after this line, as otherwise the exporter memory will leak
+  if (!have_usable_exporter(state)) {
+    return rb_ary_new_from_args(2, error_symbol, rb_str_new_cstr("Exporter was not configured"));
+  }
+  if (state->export_in_progress) {
+    return rb_ary_new_from_args(2, error_symbol, rb_str_new_cstr("Another export is already in progress"));
+  }
+  if (args.have_serialized_profile && !serialized_profile_borrow(pprof_data, &args.files[0].file)) {
+    return rb_ary_new_from_args(2, error_symbol, rb_str_new_cstr("SerializedProfile was already released"));
+  }
+  // Note: Do not add anything that can raise exceptions after this line, as otherwise the serialized profile would
+  // never be returned
+
+  state->export_in_progress = true;
+
+  return perform_export(
+    state,
+    args.start,
+    args.finish,
+    args.slice_files,
+    null_additional_tags,
+    args.timeout_milliseconds,
+    args.have_serialized_profile ? pprof_data : Qnil
+  );
+}
 
-  VALUE failure_tuple = handle_exporter_failure(exporter_result);
-  if (!NIL_P(failure_tuple)) return failure_tuple;
+// Queues the profile to be reported by the upload queue's sender thread, and returns right away. Everything needed
+// gets copied, apart from SerializedProfiles, which get taken over (and thus are released after this returns).
+static VALUE _native_enqueue_export(
+  VALUE self,
+  VALUE transport_instance,
+  VALUE upload_timeout_milliseconds,
+  VALUE start_timespec_seconds,
+  VALUE start_timespec_nanoseconds,
+  VALUE finish_timespec_seconds,
+  VALUE finish_timespec_nanoseconds,
+  VALUE pprof_file_name,
+  VALUE pprof_data,
+  VALUE code_provenance_file_name,
+  VALUE code_provenance_data
+) {
+  struct http_transport_state *state = get_state(transport_instance);
+
+  struct export_arguments args;
+  read_export_arguments(
+    &args,
+    upload_timeout_milliseconds,
+    start_timespec_seconds,
+    start_timespec_nanoseconds,
+    finish_timespec_seconds,
+    finish_timespec_nanoseconds,
+    pprof_file_name,
+    pprof_data,
+    code_provenance_file_name,
+    code_provenance_data
+  );
+
+  if (!have_usable_exporter(state)) {
+    return rb_ary_new_from_args(2, error_symbol, rb_str_new_cstr("Exporter was not configured"));
+  }
+
+  if (get_or_create_upload_queue(state) == NULL) {
+    return rb_ary_new_from_args(2, error_symbol, rb_str_new_cstr("Failed to allocate upload queue"));
+  }
+
+  pprof_buffer pprof;
+  if (args.have_serialized_profile && !serialized_profile_take(pprof_data, &pprof)) {
+    return rb_ary_new_from_args(2, error_symbol, rb_str_new_cstr("SerializedProfile was already released or in use"));
+  }
+
+  upload *new_upload = upload_new(
+    state->exporter,
+    args.start,
+    args.finish,
+    args.timeout_milliseconds,
+    args.slice_files,
+    args.have_serialized_profile ? &pprof : NULL
+  );
+
+  if (new_upload == NULL) {
+    if (args.have_serialized_profile) pprof_buffer_drop(&pprof);
+    return rb_ary_new_from_args(2, error_symbol, rb_str_new_cstr("Failed to allocate upload"));
+  }
+
+  const char *error = upload_queue_push(state->upload_queue, new_upload);
+
+  if (error != NULL) return rb_ary_new_from_args(2, error_symbol, rb_str_new_cstr(error));
+
+  return rb_ary_new_from_args(2, ok_symbol, Qnil);
+}
+
+// Must be called before any profiles get reported
+static VALUE _native_configure_spool(
+  VALUE self,
+  VALUE transport_instance,
+  VALUE spool_directory,
+  VALUE spool_max_size_bytes
+) {
+  struct http_transport_state *state = get_state(transport_instance);
+
+  Check_Type(spool_directory, T_STRING);
+  uint64_t max_size_bytes = NUM2ULL(spool_max_size_bytes);
+
+  if (state->spool != NULL || state->upload_queue != NULL) rb_raise(rb_eRuntimeError, "Spool was already configured");
+
+  state->spool = spool_new(StringValueCStr(spool_directory), max_size_bytes);
+  if (state->spool == NULL) rb_raise(rb_eNoMemError, "Failed to allocate spool");
+
+  return Qnil;
+}
+
+// Asks for spooled profiles to be reported back in the background (by the upload queue's sender thread). Queued
+// profiles already take care of this, so this is only needed after profiles get reported via _native_do_export.
+static VALUE _native_replay_spool(VALUE self, VALUE transport_instance, VALUE upload_timeout_milliseconds) {
+  struct http_transport_state *state = get_state(transport_instance);
+
+  uint64_t timeout_milliseconds = NUM2ULONG(upload_timeout_milliseconds);
+
+  if (state->spool == NULL) return rb_ary_new_from_args(2, error_symbol, rb_str_new_cstr("Spool was not configured"));
+  if (!have_usable_exporter(state)) {
+    return rb_ary_new_from_args(2, error_symbol, rb_str_new_cstr("Exporter was not configured"));
+  }
+  if (get_or_create_upload_queue(state) == NULL) {
+    return rb_ary_new_from_args(2, error_symbol, rb_str_new_cstr("Failed to allocate upload queue"));
+  }
+
+  const char *error = upload_queue_replay_spool(state->upload_queue, state->exporter, timeout_milliseconds);
+
+  if (error != NULL) return rb_ary_new_from_args(2, error_symbol, rb_str_new_cstr(error));
+
+  return rb_ary_new_from_args(2, ok_symbol, Qnil);
+}
+
+// Returns the results of the queued profiles that finished being reported since the last call, oldest first, in the
+// same format as _native_do_export returns them
+static VALUE _native_take_upload_results(VALUE self, VALUE transport_instance) {
+  struct http_transport_state *state = get_state(transport_instance);
+
+  VALUE ruby_results = rb_ary_new();
+
+  if (state->unreported_spool_failure != NULL) {
+    VALUE failure = rb_sprintf("%s%s", SPOOL_FAILURE_PREFIX, state->unreported_spool_failure);
+    state->unreported_spool_failure = NULL;
+    rb_ary_push(ruby_results, rb_ary_new_from_args(2, error_symbol, failure));
+  }
+
+  if (state->upload_queue == NULL) return ruby_results;
+
+  upload_result results[MAX_UPLOAD_RESULTS_TAKEN];
+  unsigned int results_count = upload_queue_take_results(state->upload_queue, results, MAX_UPLOAD_RESULTS_TAKEN);
+
+  for (unsigned int i = 0; i < results_count; i++) {
+    upload_result result = results[i];
+    bool success = result.http_response;
+
+    // Note: If Ruby fails to allocate memory here, the failures not yet converted get leaked
+    VALUE ruby_result = success ?
+      UINT2NUM(result.http_status_code) :
+      rb_str_new_cstr(result.failure != NULL ? result.failure : "Failed to report profile");
+    free(result.failure);
+
+    rb_ary_push(ruby_results, rb_ary_new_from_args(2, success ? ok_symbol : error_symbol, ruby_result));
+  }
+
+  return ruby_results;
+}
+// Waits (without the Global VM Lock) for the queued profiles to finish being reported, for at most
+// `timeout_milliseconds`. Returns true if there's nothing left to report.
+static VALUE _native_wait_for_pending_uploads(VALUE self, VALUE transport_instance, VALUE timeout_milliseconds) {
+  struct http_transport_state *state = get_state(transport_instance);
+
+  if (state->upload_queue == NULL) return Qtrue;
+
+  struct wait_for_pending_uploads_arguments args =
+    {.upload_queue = state->upload_queue, .timeout_milliseconds = NUM2ULONG(timeout_milliseconds), .is_idle = false};
+
+  // Nothing here needs cleaning up, so it's fine if rb_thread_call_without_gvl raises afterwards
+  rb_thread_call_without_gvl(
+    wait_for_pending_uploads_without_gvl, &args, interrupt_wait_for_pending_uploads, state->upload_queue
+  );
 
-  return perform_export(exporter_result, start, finish, slice_files, null_additional_tags, timeout_milliseconds);
+  return args.is_idle ? Qtrue : Qfalse;
+}
+
+static struct http_transport_state *get_state(VALUE transport_instance) {
+  struct http_transport_state *state;
+  TypedData_Get_Struct(transport_instance, struct http_transport_state, &http_transport_typed_data, state);
+  return state;
+}
+
+static bool have_usable_exporter(struct http_transport_state *state) {
+  return state->exporter != NULL && state->exporter_pid == getpid();
+}
+
+// Returns NULL if out of memory
+static upload_queue *get_or_create_upload_queue(struct http_transport_state *state) {
+  if (state->upload_queue == NULL) state->upload_queue = upload_queue_new(MAX_PENDING_UPLOADS, state->spool);
+  return state->upload_queue;
 }
 
 static void *call_exporter_without_gvl(void *call_args) {
@@ -332,6 +795,11 @@ static void *call_exporter_without_gvl(void *call_args) {
   args->result = ddprof_ffi_ProfileExporterV3_send(args->exporter, args->request, args->cancel_token);
   args->send_ran = true;
 
+  // Spooling is best-effort: if it fails (e.g. the disk is full), the profile gets dropped, as it would without a spool
+  if (args->spool != NULL && spool_should_keep(args->result)) {
+    args->spool_failure = spool_write(args->spool, args->start, args->finish, args->slice_files, args->encoded_tags);
+  }
+
   return NULL; // Unused
 }
 
@@ -339,3 +807,17 @@ static void *call_exporter_without_gvl(void *call_args) {
 static void interrupt_exporter_call(void *cancel_token) {
   ddprof_ffi_CancellationToken_cancel((ddprof_ffi_CancellationToken *) cancel_token);
 }
+
+static void *wait_for_pending_uploads_without_gvl(void *call_args) {
+  struct wait_for_pending_uploads_arguments *args = (struct wait_for_pending_uploads_arguments *) call_args;
+
+  args->is_idle = upload_queue_wait_until_idle(args->upload_queue, args->timeout_milliseconds);
+
+  return NULL; // Unused
+}
+
+// Called by Ruby when it wants to interrupt wait_for_pending_uploads_without_gvl above, e.g. when the app wants to
+// exit cleanly
+static void interrupt_wait_for_pending_uploads(void *upload_queue) {
+  upload_queue_interrupt_waiters((struct upload_queue *) upload_queue);
+}
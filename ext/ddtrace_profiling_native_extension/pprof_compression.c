@@ -0,0 +1,231 @@
+#include "extconf.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+#ifdef HAVE_LIBZ
+  #include <zlib.h>
+#endif
+#ifdef HAVE_LIBZSTD
+  #include <zstd.h>
+#endif
+#include "pprof_compression.h"
+
+// Used to compress the pprofs serialized by the StackRecorder before they get reported (see stack_recorder.c).
+//
+// Each codec is optional, and only available if its library was found when the native extension was built (see
+// extconf.rb). Compression happens right after serialization, without holding the Global VM Lock, and the compressed
+// pprof replaces the uncompressed one, which gets freed right away.
+//
+// Memory here is allocated with malloc/free rather than ruby_xmalloc/ruby_xfree, as compressed pprofs may get freed by
+// the upload queue's sender thread (see upload_queue.c).
+
+#define GZIP_DEFAULT_LEVEL 6
+#define GZIP_MAX_LEVEL 9
+#define ZSTD_DEFAULT_LEVEL 3
+
+static uint64_t monotonic_time_ns(void);
+static void shrink_to_fit(pprof_buffer *output);
+#ifdef HAVE_LIBZ
+static const char *compress_gzip(ddprof_ffi_ByteSlice input, int level, pprof_buffer *output);
+#endif
+#ifdef HAVE_LIBZSTD
+static const char *compress_zstd(ddprof_ffi_ByteSlice input, int level, pprof_buffer *output);
+#endif
+
+pprof_buffer pprof_buffer_from(ddprof_ffi_SerializeResult serialize_result) {
+  ddprof_ffi_Vec_u8 buffer = serialize_result.ok.buffer;
+
+  return (pprof_buffer) {
+    .bytes = {.ptr = buffer.ptr, .len = buffer.len},
+    .capacity_bytes = buffer.capacity,
+    .codec = PPROF_COMPRESSION_NONE,
+    .has_serialize_result = true,
+    .serialize_result = serialize_result,
+    .compressed = NULL,
+  };
+}
+
+void pprof_buffer_drop(pprof_buffer *buffer) {
+  if (buffer->has_serialize_result) ddprof_ffi_SerializeResult_drop(buffer->serialize_result);
+  free(buffer->compressed);
+
+  *buffer = (pprof_buffer) {.has_serialize_result = false, .compressed = NULL};
+}
+
+bool pprof_compression_available(pprof_compression_codec codec) {
+  switch (codec) {
+    case PPROF_COMPRESSION_NONE:
+      return true;
+    case PPROF_COMPRESSION_GZIP:
+      #ifdef HAVE_LIBZ
+        return true;
+      #else
+        return false;
+      #endif
+    case PPROF_COMPRESSION_ZSTD:
+      #ifdef HAVE_LIBZSTD
+        return true;
+      #else
+        return false;
+      #endif
+  }
+
+  return false;
+}
+
+const char *pprof_compression_validate(pprof_compression_codec codec, int level) {
+  if (!pprof_compression_available(codec)) return "Compression codec is not available in this build";
+  if (level == PPROF_COMPRESSION_DEFAULT_LEVEL) return NULL;
+
+  switch (codec) {
+    case PPROF_COMPRESSION_NONE:
+      return NULL;
+    case PPROF_COMPRESSION_GZIP:
+      return (level >= 1 && level <= GZIP_MAX_LEVEL) ? NULL : "Invalid gzip compression level, must be between 1 and 9";
+    case PPROF_COMPRESSION_ZSTD:
+      #ifdef HAVE_LIBZSTD
+        return (level >= 1 && level <= ZSTD_maxCLevel()) ? NULL : "Invalid zstd compression level";
+      #else
+        break;
+      #endif
+  }
+
+  return "Unexpected compression codec";
+}
+
+const char *pprof_buffer_compress(
+  pprof_buffer *buffer,
+  pprof_compression_codec codec,
+  int level,
+  pprof_compression_stats *stats
+) {
+  if (codec == PPROF_COMPRESSION_NONE) return NULL;
+  if (buffer->codec != PPROF_COMPRESSION_NONE) return "Profile was already compressed";
+
+  const char *error = pprof_compression_validate(codec, level);
+  if (error != NULL) return error;
+
+  uint64_t started_at_ns = monotonic_time_ns();
+  pprof_buffer compressed = {.codec = codec, .has_serialize_result = false};
+
+  switch (codec) {
+    case PPROF_COMPRESSION_GZIP:
+      #ifdef HAVE_LIBZ
+        error = compress_gzip(buffer->bytes, level, &compressed);
+      #endif
+      break;
+    case PPROF_COMPRESSION_ZSTD:
+      #ifdef HAVE_LIBZSTD
+        error = compress_zstd(buffer->bytes, level, &compressed);
+      #endif
+      break;
+    case PPROF_COMPRESSION_NONE:
+      break;
+  }
+
+  if (error != NULL) return error;
+
+  *stats = (pprof_compression_stats) {
+    .uncompressed_bytes = buffer->bytes.len,
+    .compressed_bytes = compressed.bytes.len,
+    .duration_ns = monotonic_time_ns() - started_at_ns,
+  };
+
+  pprof_buffer_drop(buffer);
+  *buffer = compressed;
+
+  return NULL;
+}
+
+static uint64_t monotonic_time_ns(void) {
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) return 0;
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Gives back the unused part of the output buffer, as compressed pprofs may be kept around for a while (e.g. while
+// waiting to be reported)
+static void shrink_to_fit(pprof_buffer *output) {
+  if (output->bytes.len == 0 || output->bytes.len == output->capacity_bytes) return;
+
+  uint8_t *shrunk = realloc(output->compressed, output->bytes.len);
+  if (shrunk == NULL) return; // The original buffer is still valid, so we just keep using it
+
+  output->compressed = shrunk;
+  output->bytes.ptr = shrunk;
+  output->capacity_bytes = output->bytes.len;
+}
+
+#ifdef HAVE_LIBZ
+static const char *compress_gzip(ddprof_ffi_ByteSlice input, int level, pprof_buffer *output) {
+  if (input.len > UINT_MAX) return "Profile is too large to be compressed with gzip";
+
+  z_stream stream = {.zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL};
+  // 15 is zlib's default window size, and adding 16 asks for a gzip (rather than zlib) header, which is the format
+  // pprofs get compressed with by the Ruby code (see Datadog::Core::Utils::Compression.gzip)
+  int window_bits = 15 + 16;
+  int memory_level = 8; // zlib's default
+  int result = deflateInit2(
+    &stream,
+    level == PPROF_COMPRESSION_DEFAULT_LEVEL ? GZIP_DEFAULT_LEVEL : level,
+    Z_DEFLATED,
+    window_bits,
+    memory_level,
+    Z_DEFAULT_STRATEGY
+  );
+  if (result != Z_OK) return "Failed to initialize gzip compression";
+
+  uLong capacity_bytes = deflateBound(&stream, input.len);
+  uint8_t *compressed = malloc(capacity_bytes);
+  if (compressed == NULL) {
+    deflateEnd(&stream);
+    return "Failed to allocate buffer for gzip compression";
+  }
+
+  stream.next_in = (Bytef *) input.ptr;
+  stream.avail_in = input.len;
+  stream.next_out = compressed;
+  stream.avail_out = capacity_bytes;
+
+  // As the output buffer is large enough for the worst case (see deflateBound), a single call does it
+  result = deflate(&stream, Z_FINISH);
+  size_t compressed_bytes = stream.total_out;
+  deflateEnd(&stream);
+
+  if (result != Z_STREAM_END) {
+    free(compressed);
+    return "Failed to compress profile with gzip";
+  }
+
+  output->compressed = compressed;
+  output->bytes = (ddprof_ffi_ByteSlice) {.ptr = compressed, .len = compressed_bytes};
+  output->capacity_bytes = capacity_bytes;
+  shrink_to_fit(output);
+
+  return NULL;
+}
+#endif
+
+#ifdef HAVE_LIBZSTD
+static const char *compress_zstd(ddprof_ffi_ByteSlice input, int level, pprof_buffer *output) {
+  size_t capacity_bytes = ZSTD_compressBound(input.len);
+  uint8_t *compressed = malloc(capacity_bytes);
+  if (compressed == NULL) return "Failed to allocate buffer for zstd compression";
+
+  int compression_level = level == PPROF_COMPRESSION_DEFAULT_LEVEL ? ZSTD_DEFAULT_LEVEL : level;
+  size_t compressed_bytes = ZSTD_compress(compressed, capacity_bytes, input.ptr, input.len, compression_level);
+
+  if (ZSTD_isError(compressed_bytes)) {
+    free(compressed);
+    return "Failed to compress profile with zstd";
+  }
+
+  output->compressed = compressed;
+  output->bytes = (ddprof_ffi_ByteSlice) {.ptr = compressed, .len = compressed_bytes};
+  output->capacity_bytes = capacity_bytes;
+  shrink_to_fit(output);
+
+  return NULL;
+}
+#endif
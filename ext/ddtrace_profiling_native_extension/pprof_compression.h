@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <ddprof/ffi.h>
+
+// Everything in this file can be used from any thread, and none of it needs (nor uses) the Global VM Lock or any
+// other Ruby APIs. See pprof_compression.c for details.
+
+typedef enum {
+  PPROF_COMPRESSION_NONE,
+  PPROF_COMPRESSION_GZIP,
+  PPROF_COMPRESSION_ZSTD,
+} pprof_compression_codec;
+
+// Used to pick the codec's default level
+#define PPROF_COMPRESSION_DEFAULT_LEVEL -1
+
+// The bytes of a serialized pprof, which may have been compressed. Whoever holds it is responsible for dropping it.
+typedef struct {
+  ddprof_ffi_ByteSlice bytes;
+  size_t capacity_bytes;
+  pprof_compression_codec codec;
+  // Before compression, the bytes live in libddprof's serialization result; afterwards, in a buffer we allocated
+  bool has_serialize_result;
+  ddprof_ffi_SerializeResult serialize_result;
+  uint8_t *compressed;
+} pprof_buffer;
+
+typedef struct {
+  size_t uncompressed_bytes;
+  size_t compressed_bytes;
+  uint64_t duration_ns;
+} pprof_compression_stats;
+
+// Takes ownership of an OK `serialize_result`
+pprof_buffer pprof_buffer_from(ddprof_ffi_SerializeResult serialize_result);
+void pprof_buffer_drop(pprof_buffer *buffer);
+
+// Whether the codec was available when the native extension was built (see extconf.rb)
+bool pprof_compression_available(pprof_compression_codec codec);
+// Returns NULL if the codec is available and supports the `level`, or a description of what's wrong otherwise
+const char *pprof_compression_validate(pprof_compression_codec codec, int level);
+// Replaces the uncompressed contents of the `buffer` with their compressed version, and frees the uncompressed ones.
+// Returns NULL on success, or a description of what went wrong (in which case the `buffer` is left untouched).
+const char *pprof_buffer_compress(
+  pprof_buffer *buffer,
+  pprof_compression_codec codec,
+  int level,
+  pprof_compression_stats *stats
+);
@@ -20,6 +20,13 @@
 #define PRIVATE_VM_API_ACCESS_SKIP_RUBY_INCLUDES
 #include "private_vm_api_access.h"
 
+#ifndef RUBY_MJIT_HEADER
+  // Used by live_object_size; these have been around (and exported, for the objspace extension) since Ruby 2.1 but
+  // they're not in the headers we get for older Rubies
+  size_t rb_obj_memsize_of(VALUE);
+  int rb_objspace_markable_object_p(VALUE obj);
+#endif
+
 // MRI has a similar rb_thread_ptr() function which we can't call it directly
 // because Ruby does not expose the thread_data_type publicly.
 // Instead, we have our own version of that function, and we lazily initialize the thread_data_type pointer
@@ -43,6 +50,68 @@ rb_nativethread_id_t pthread_id_for(VALUE thread) {
   #endif
 }
 
+// Returns the memory used by the object, or zero if `object` is not a live object (e.g. it was freed, or moved by
+// GC compaction)
+size_t live_object_size(VALUE object) {
+  // This also checks that the object is in a page that's part of the Ruby heap, so it's safe to call with any value
+  if (!rb_objspace_markable_object_p(object)) return 0;
+
+  switch (BUILTIN_TYPE(object)) {
+    case T_NONE:
+    case T_ZOMBIE:
+    #ifdef T_MOVED
+      case T_MOVED:
+    #endif
+      return 0;
+    default:
+      return rb_obj_memsize_of(object);
+  }
+}
+
+// Returns the operating system's id for the thread (e.g. what `gettid()` returns on Linux), or 0 if this information is
+// not available on this Ruby version.
+long native_thread_id_for(VALUE thread) {
+  #ifdef RB_THREAD_T_HAS_NATIVE_ID // Ruby >= 3.1
+    #ifndef NO_RB_NATIVE_THREAD
+      struct rb_native_thread* native_thread = thread_struct_from_object(thread)->nt;
+      return native_thread == NULL ? 0 : native_thread->tid;
+    #else
+      return thread_struct_from_object(thread)->tid;
+    #endif
+  #else
+    return 0;
+  #endif
+}
+
+// Returns the thread currently holding the Global VM Lock (or more correctly, the main Ractor's lock).
+//
+// Unlike most other functions in this file, this one is safe to call from a thread that is not a Ruby thread AND without
+// holding the GVL; but of course by the time the caller looks at the result, a different thread may be holding the GVL.
+//
+// On Rubies where we don't have access to the VM internals needed for this (< 2.6), this always returns an invalid owner.
+current_gvl_owner gvl_owner(void) {
+  const rb_thread_t *current_owner = NULL;
+
+  #ifndef RUBY_MJIT_HEADER // Ruby < 2.6
+    // Not supported
+  #elif !defined(HAVE_RUBY_RACTOR_H) // Ruby 2.6 and 2.7
+    current_owner = GET_VM()->gvl.owner;
+  #elif defined(NO_RB_THREAD_SCHED) // Ruby 3.0 and 3.1
+    current_owner = GET_VM()->ractor.main_ractor->threads.gvl.owner;
+  #else // Ruby >= 3.2
+    current_owner = GET_VM()->ractor.main_ractor->threads.sched.running;
+  #endif
+
+  if (current_owner == NULL) return (current_gvl_owner) {.valid = false};
+
+  #ifndef NO_RB_NATIVE_THREAD
+    if (current_owner->nt == NULL) return (current_gvl_owner) {.valid = false};
+    return (current_gvl_owner) {.valid = true, .owner = current_owner->nt->thread_id};
+  #else
+    return (current_gvl_owner) {.valid = true, .owner = current_owner->thread_id};
+  #endif
+}
+
 // Returns the stack depth by using the same approach as rb_profile_frames and backtrace_each: get the positions
 // of the end and current frame pointers and subtracting them.
 ptrdiff_t stack_depth_for(VALUE thread) {
@@ -63,15 +132,91 @@ ptrdiff_t stack_depth_for(VALUE thread) {
   return end_cfp <= cfp ? 0 : end_cfp - cfp - 1;
 }
 
+// Used by ddtrace_rb_profile_frames to remember the frames it returned for a given thread, so that a later call for the
+// same thread can skip resolving the frames that did not change since then, and reuse the previous result for them
+// instead (see "Incremental unwinding" in ddtrace_rb_profile_frames).
+//
+// The key fields (`cfp` to `me_cref`) are only compared, never dereferenced. A control frame that still has the same
+// address, iseq, pc, environment and method entry/cref as before is stopped at the same place, and thus resolves to the
+// same `frame`/`line` as before.
+//
+// Note that a frame matching does NOT mean that the frames below it (e.g. its callers) did not change: control frames
+// get reused after being popped, so e.g. going from `main -> a -> sleep` to `main -> b -> sleep` leaves the `sleep`
+// frame unchanged, with a different caller. This is why every frame that gets reused is checked
+// (see `stack_snapshot_base_unchanged`).
+typedef struct {
+  const void *cfp;
+  const void *iseq;
+  const void *pc;
+  const void *ep;
+  VALUE me_cref;
+  VALUE frame;
+  int line;
+  bool is_ruby_frame;
+} stack_snapshot_frame;
+
+struct stack_snapshot {
+  // Sorted from the top of the stack (e.g. ordered by increasing cfp address)
+  stack_snapshot_frame *frames;
+  int frames_count;
+  // Was `frames` cut short by the `limit` passed to ddtrace_rb_profile_frames?
+  bool truncated;
+  // Used to assemble the new `frames` while the previous ones are still being used; swapped with `frames` after each
+  // call to ddtrace_rb_profile_frames
+  stack_snapshot_frame *next_frames;
+  int capacity;
+};
+
+stack_snapshot *stack_snapshot_new(void) {
+  // Frames are lazily allocated by ddtrace_rb_profile_frames, as they depend on the depth of the thread's stack
+  return ruby_xcalloc(1, sizeof(stack_snapshot));
+}
+
+void stack_snapshot_free(stack_snapshot *snapshot) {
+  ruby_xfree(snapshot->frames);
+  ruby_xfree(snapshot->next_frames);
+  ruby_xfree(snapshot);
+}
+
+// The `frame`s get reused in later samples, so we need to keep them alive; and because we compare the key fields by
+// address, they must not move either, which is why we use rb_gc_mark and not rb_gc_mark_movable.
+void stack_snapshot_mark(stack_snapshot *snapshot) {
+  for (int i = 0; i < snapshot->frames_count; i++) {
+    rb_gc_mark(snapshot->frames[i].frame);
+    rb_gc_mark(snapshot->frames[i].me_cref);
+  }
+}
+
+size_t stack_snapshot_memsize(stack_snapshot *snapshot) {
+  return sizeof(stack_snapshot) + 2 * snapshot->capacity * sizeof(stack_snapshot_frame); // frames + next_frames
+}
+
+static void stack_snapshot_reserve(stack_snapshot *snapshot, int frames_needed) {
+  if (snapshot->capacity >= frames_needed) return;
+
+  int new_capacity = snapshot->capacity > 0 ? snapshot->capacity : 64;
+  while (new_capacity < frames_needed) new_capacity *= 2;
+
+  // Note: Allocating may trigger GC, so `frames` must stay valid and consistent with `frames_count` until realloc is done
+  snapshot->next_frames = ruby_xrealloc2(snapshot->next_frames, new_capacity, sizeof(stack_snapshot_frame));
+  snapshot->frames = ruby_xrealloc2(snapshot->frames, new_capacity, sizeof(stack_snapshot_frame));
+  snapshot->capacity = new_capacity;
+}
+
+static void stack_snapshot_invalidate(stack_snapshot *snapshot) {
+  if (snapshot != NULL) snapshot->frames_count = 0;
+}
+
 // This was renamed in Ruby 3.2
 #if !defined(ccan_list_for_each) && defined(list_for_each)
   #define ccan_list_for_each list_for_each
 #endif
 
+static bool is_thread_alive(rb_thread_t *thread);
+
 #ifndef USE_LEGACY_LIVING_THREADS_ST // Ruby > 2.1
 // Tries to match rb_thread_list() but that method isn't accessible to extensions
-VALUE ddtrace_thread_list(void) {
-  VALUE result = rb_ary_new();
+void ddtrace_thread_list_each(ddtrace_thread_callback callback, void *callback_data) {
   rb_thread_t *thread = NULL;
 
   // Ruby 3 Safety: Our implementation is inspired by `rb_ractor_thread_list` BUT that method wraps the operations below
@@ -91,43 +236,55 @@ VALUE ddtrace_thread_list(void) {
     rb_vm_t *vm = thread_struct_from_object(rb_thread_current())->vm;
     list_for_each(&vm->living_threads, thread, vmlt_node) {
   #endif
-      switch (thread->status) {
-        case THREAD_RUNNABLE:
-        case THREAD_STOPPED:
-        case THREAD_STOPPED_FOREVER:
-          rb_ary_push(result, thread->self);
-        default:
-          break;
-      }
+      if (is_thread_alive(thread) && !callback(thread->self, callback_data)) break;
     }
-
-  return result;
 }
 #else // USE_LEGACY_LIVING_THREADS_ST
-static int ddtrace_thread_list_each(st_data_t thread_object, st_data_t _value, void *result_object);
-
-// Alternative ddtrace_thread_list implementation for Ruby 2.1. In this Ruby version, living threads were stored in a
-// hashmap (st) instead of a list.
-VALUE ddtrace_thread_list() {
-  VALUE result = rb_ary_new();
-  st_foreach(thread_struct_from_object(rb_thread_current())->vm->living_threads, ddtrace_thread_list_each, result);
-  return result;
+struct thread_list_each_arguments {
+  ddtrace_thread_callback callback;
+  void *callback_data;
+};
+
+static int thread_list_each_st_entry(st_data_t thread_object, st_data_t _value, st_data_t arguments_ptr);
+
+// Alternative ddtrace_thread_list_each implementation for Ruby 2.1. In this Ruby version, living threads were stored in
+// a hashmap (st) instead of a list.
+void ddtrace_thread_list_each(ddtrace_thread_callback callback, void *callback_data) {
+  struct thread_list_each_arguments arguments = {.callback = callback, .callback_data = callback_data};
+  st_foreach(thread_struct_from_object(rb_thread_current())->vm->living_threads, thread_list_each_st_entry, (st_data_t) &arguments);
 }
 
-static int ddtrace_thread_list_each(st_data_t thread_object, st_data_t _value, void *result_object) {
-  VALUE result = (VALUE) result_object;
+static int thread_list_each_st_entry(st_data_t thread_object, st_data_t _value, st_data_t arguments_ptr) {
+  struct thread_list_each_arguments *arguments = (struct thread_list_each_arguments *) arguments_ptr;
   rb_thread_t *thread = thread_struct_from_object((VALUE) thread_object);
+
+  if (is_thread_alive(thread) && !arguments->callback(thread->self, arguments->callback_data)) return ST_STOP;
+  return ST_CONTINUE;
+}
+#endif // USE_LEGACY_LIVING_THREADS_ST
+
+static bool is_thread_alive(rb_thread_t *thread) {
   switch (thread->status) {
     case THREAD_RUNNABLE:
     case THREAD_STOPPED:
     case THREAD_STOPPED_FOREVER:
-      rb_ary_push(result, thread->self);
+      return true;
     default:
-      break;
+      return false;
   }
-  return ST_CONTINUE;
 }
-#endif // USE_LEGACY_LIVING_THREADS_ST
+
+static bool add_thread_to_array(VALUE thread, void *array_ptr) {
+  rb_ary_push(*((VALUE *) array_ptr), thread);
+  return true;
+}
+
+// Note: This allocates a new array every time; prefer ddtrace_thread_list_each when that matters (e.g. when sampling)
+VALUE ddtrace_thread_list(void) {
+  VALUE result = rb_ary_new();
+  ddtrace_thread_list_each(add_thread_to_array, &result);
+  return result;
+}
 
 // -----------------------------------------------------------------------------
 // The sources below are modified versions of code extracted from the Ruby project.
@@ -226,6 +383,81 @@ calc_lineno(const rb_iseq_t *iseq, const VALUE *pc)
     return 0;
 }
 
+#ifndef USE_LEGACY_RB_VM_FRAME_METHOD_ENTRY
+  #define CONTROL_FRAME_ME_CREF(cfp) ((cfp)->ep[VM_ENV_DATA_INDEX_ME_CREF])
+#else // Ruby < 2.4
+  #define CONTROL_FRAME_ME_CREF(cfp) ((cfp)->ep[-1])
+#endif
+
+static inline bool stack_snapshot_frame_matches(const stack_snapshot_frame *frame, const rb_control_frame_t *cfp) {
+  return frame->cfp == (const void *) cfp &&
+    frame->iseq == (const void *) cfp->iseq &&
+    frame->pc == (const void *) cfp->pc &&
+    frame->ep == (const void *) cfp->ep &&
+    frame->me_cref == CONTROL_FRAME_ME_CREF(cfp);
+}
+
+// Mirrors the checks in the ddtrace_rb_profile_frames loop below: is this a control frame that would be returned?
+static inline bool control_frame_gets_recorded(const rb_control_frame_t *cfp) {
+  if (cfp->iseq && !cfp->pc) return false;
+#ifndef USE_ISEQ_P_INSTEAD_OF_RUBYFRAME_P // Modern Rubies
+  if (VM_FRAME_RUBYFRAME_P(cfp)) return true;
+#else // Ruby < 2.4
+  if (RUBY_VM_NORMAL_ISEQ_P(cfp->iseq)) return true;
+#endif
+
+  const rb_callable_method_entry_t *cme = rb_vm_frame_method_entry(cfp);
+  return cme && cme->def->type == VM_METHOD_TYPE_CFUNC;
+}
+
+// Checks that walking from `cfp` towards the base of the stack would return exactly the `expected` frames: each of them
+// must still match the control frame at its address, and no other control frame in between may get recorded.
+// If `result_ends_with_expected` (e.g. the result will get cut at the limit after them), anything below the last of the
+// `expected` frames does not matter; otherwise, it must not contain any frames to record either.
+//
+// This is linear on the depth of the stack, but only compares pointers, which is way cheaper than resolving the frames.
+static bool stack_snapshot_base_unchanged(
+  const stack_snapshot_frame *expected,
+  int expected_count,
+  bool result_ends_with_expected,
+  const rb_control_frame_t *cfp,
+  const rb_control_frame_t *end_cfp
+) {
+  int checked = 0;
+
+  for (; cfp != end_cfp; cfp = RUBY_VM_PREVIOUS_CONTROL_FRAME(cfp)) {
+    if (checked < expected_count && expected[checked].cfp == (const void *) cfp) {
+      if (!stack_snapshot_frame_matches(&expected[checked], cfp)) return false;
+      checked++;
+      if (checked == expected_count && result_ends_with_expected) return true;
+    } else if (control_frame_gets_recorded(cfp)) {
+      return false;
+    }
+  }
+
+  return checked == expected_count;
+}
+
+static inline void stack_snapshot_record_frame(
+  stack_snapshot *snapshot,
+  int position,
+  const rb_control_frame_t *cfp,
+  VALUE frame,
+  int line,
+  bool is_ruby_frame
+) {
+  snapshot->next_frames[position] = (stack_snapshot_frame) {
+    .cfp = cfp,
+    .iseq = cfp->iseq,
+    .pc = cfp->pc,
+    .ep = cfp->ep,
+    .me_cref = CONTROL_FRAME_ME_CREF(cfp),
+    .frame = frame,
+    .line = line,
+    .is_ruby_frame = is_ruby_frame,
+  };
+}
+
 // Taken from upstream vm_backtrace.c at commit 5f10bd634fb6ae8f74a4ea730176233b0ca96954 (March 2022, Ruby 3.2 trunk)
 // Copyright (C) 1993-2012 Yukihiro Matsumoto
 // Modifications:
@@ -254,6 +486,7 @@ calc_lineno(const rb_iseq_t *iseq, const VALUE *pc)
 //   for iseqs created from calls to `eval` and `instance_eval`. This makes it so that `rb_profile_frame_path` on
 //   the `VALUE` returned by rb_profile_frames returns `(eval)` instead of the path of the file where the `eval`
 //   was called from.
+// * Add optional `snapshot` argument, used to implement incremental unwinding (see below).
 //
 // **IMPORTANT: WHEN CHANGING THIS FUNCTION, CONSIDER IF THE SAME CHANGE ALSO NEEDS TO BE MADE TO THE VARIANT FOR
 // RUBY 2.2 AND BELOW WHICH IS ALSO PRESENT ON THIS FILE**
@@ -286,7 +519,14 @@ calc_lineno(const rb_iseq_t *iseq, const VALUE *pc)
 //    and friends). We've found quite a few situations where the data from rb_profile_frames and the reference APIs
 //    disagree, and quite a few of them seem oversights/bugs (speculation from my part) rather than deliberate
 //    decisions.
-int ddtrace_rb_profile_frames(VALUE thread, int start, int limit, VALUE *buff, int *lines, bool* is_ruby_frame)
+//
+// 6. To support incremental unwinding. Between two samples of the same thread, usually only the top of the stack
+//    changes, while the (often very deep) base stays the same. When a `snapshot` is provided, we compare each control
+//    frame we walk against the ones we returned the last time this function was called with that same `snapshot`.
+//    Once we find one that did not change, we check that the rest of the stack did not change either, and if so copy
+//    the rest of the result from the snapshot. This way, only the frames that changed get resolved (looking up method
+//    entries and line numbers), and the unchanged ones only get compared by address. See `stack_snapshot_frame`.
+int ddtrace_rb_profile_frames(VALUE thread, int start, int limit, VALUE *buff, int *lines, bool* is_ruby_frame, stack_snapshot *snapshot)
 {
     int i;
     // Modified from upstream: Instead of using `GET_EC` to collect info from the current thread,
@@ -300,12 +540,21 @@ int ddtrace_rb_profile_frames(VALUE thread, int start, int limit, VALUE *buff, i
     const rb_control_frame_t *cfp = ec->cfp, *end_cfp = RUBY_VM_END_CONTROL_FRAME(ec);
     const rb_callable_method_entry_t *cme;
 
+    // Incremental unwinding is not supported together with `start`, as the snapshot would not describe the full stack
+    if (start > 0) snapshot = NULL;
+
     // `vm_backtrace.c` includes this check in several methods, and I think this happens on either dead or newly-created
     // threads, but I'm not entirely sure
-    if (end_cfp == NULL) return 0;
+    if (end_cfp == NULL) {
+        stack_snapshot_invalidate(snapshot);
+        return 0;
+    }
 
     // Avoid sampling dead threads
-    if (th->status == THREAD_KILLED) return 0;
+    if (th->status == THREAD_KILLED) {
+        stack_snapshot_invalidate(snapshot);
+        return 0;
+    }
 
     // Fix: Skip dummy frame that shows up in main thread.
     //
@@ -321,9 +570,56 @@ int ddtrace_rb_profile_frames(VALUE thread, int start, int limit, VALUE *buff, i
     end_cfp = RUBY_VM_NEXT_CONTROL_FRAME(end_cfp);
 
     // See comment on `record_placeholder_stack_in_native_code` for a full explanation of what this means (and why we don't just return 0)
-    if (end_cfp <= cfp) return PLACEHOLDER_STACK_IN_NATIVE_CODE;
+    if (end_cfp <= cfp) {
+        stack_snapshot_invalidate(snapshot);
+        return PLACEHOLDER_STACK_IN_NATIVE_CODE;
+    }
+
+    int previous_frames_count = 0, previous_index = 0;
+    bool previous_truncated = false, reused_previous_frames = false, reused_up_to_limit = false;
+    if (snapshot != NULL) {
+        previous_frames_count = snapshot->frames_count;
+        previous_truncated = snapshot->truncated;
+        stack_snapshot_reserve(snapshot, limit < (end_cfp - cfp) ? limit : (int) (end_cfp - cfp));
+    }
+
+    // Once the previous frames could not be reused, we don't try again, as checking is linear on the depth of the stack
+    bool try_reusing = snapshot != NULL;
 
     for (i=0; i<limit && cfp != end_cfp;) {
+        if (try_reusing) {
+            stack_snapshot_frame *previous_frames = snapshot->frames;
+
+            // Both the previous frames and the current walk are ordered by increasing cfp address, so we can do a merge-like
+            // pass over both, and never need to look back
+            while (previous_index < previous_frames_count && previous_frames[previous_index].cfp < (const void *) cfp) previous_index++;
+
+            if (previous_index < previous_frames_count && stack_snapshot_frame_matches(&previous_frames[previous_index], cfp)) {
+                int reusable_frames = previous_frames_count - previous_index;
+                if (i + reusable_frames > limit) reusable_frames = limit - i;
+                bool ends_at_limit = i + reusable_frames == limit;
+
+                // If the previous result was truncated, we can only reuse it if it also gets us to the limit, as
+                // otherwise we'd be missing the frames that didn't fit in the previous result
+                if ((!previous_truncated || ends_at_limit) &&
+                  stack_snapshot_base_unchanged(&previous_frames[previous_index], reusable_frames, ends_at_limit, cfp, end_cfp)) {
+                    for (int j = 0; j < reusable_frames; j++) {
+                        stack_snapshot_frame *previous_frame = &previous_frames[previous_index + j];
+                        buff[i + j] = previous_frame->frame;
+                        lines[i + j] = previous_frame->line;
+                        is_ruby_frame[i + j] = previous_frame->is_ruby_frame;
+                        snapshot->next_frames[i + j] = *previous_frame;
+                    }
+                    i += reusable_frames;
+                    reused_previous_frames = true;
+                    reused_up_to_limit = ends_at_limit;
+                    break;
+                }
+
+                try_reusing = false;
+            }
+        }
+
         if (cfp->iseq && !cfp->pc) {
           // Fix: Do nothing -- this frame should not be used
           //
@@ -370,6 +666,7 @@ int ddtrace_rb_profile_frames(VALUE thread, int start, int limit, VALUE *buff, i
 
             lines[i] = calc_lineno(cfp->iseq, cfp->pc);
             is_ruby_frame[i] = true;
+            if (snapshot != NULL) stack_snapshot_record_frame(snapshot, i, cfp, buff[i], lines[i], is_ruby_frame[i]);
             i++;
         }
         else {
@@ -378,12 +675,24 @@ int ddtrace_rb_profile_frames(VALUE thread, int start, int limit, VALUE *buff, i
                 buff[i] = (VALUE)cme;
                 lines[i] = 0;
                 is_ruby_frame[i] = false;
+                if (snapshot != NULL) stack_snapshot_record_frame(snapshot, i, cfp, buff[i], lines[i], is_ruby_frame[i]);
                 i++;
             }
         }
         cfp = RUBY_VM_PREVIOUS_CONTROL_FRAME(cfp);
     }
 
+    if (snapshot != NULL) {
+        stack_snapshot_frame *previous_frames = snapshot->frames;
+
+        // Note: If we reused the previous frames up to the limit, we did not check what's below them, so we
+        // conservatively assume there's more (which only means that this result won't get reused with a larger limit)
+        snapshot->truncated = reused_previous_frames ? reused_up_to_limit : (cfp != end_cfp);
+        snapshot->frames = snapshot->next_frames;
+        snapshot->frames_count = i;
+        snapshot->next_frames = previous_frames;
+    }
+
     return i;
 }
 
@@ -618,7 +927,9 @@ calc_lineno(const rb_iseq_t *iseq, const VALUE *pc)
 // The `rb_profile_frames` function changed quite a bit between Ruby 2.2 and 2.3. Since the change was quite complex
 // I opted not to try to extend support to Ruby 2.2 and below using the same custom function, and instead I started
 // anew from the Ruby 2.2 version of the function, applying some of the same fixes that we have for the modern version.
-int ddtrace_rb_profile_frames(VALUE thread, int start, int limit, VALUE *buff, int *lines, bool* is_ruby_frame)
+//
+// Incremental unwinding is not supported on these Rubies, so the `snapshot` argument is ignored.
+int ddtrace_rb_profile_frames(VALUE thread, int start, int limit, VALUE *buff, int *lines, bool* is_ruby_frame, stack_snapshot *snapshot)
 {
     // **IMPORTANT: THIS IS A CUSTOM RB_PROFILE_FRAMES JUST FOR RUBY 2.2 AND BELOW;
     // SEE ABOVE FOR THE FUNCTION THAT GETS USED FOR MODERN RUBIES**
@@ -15,11 +15,37 @@
 
 #include "extconf.h"
 
+// Contains the native thread that is holding the Global VM Lock, and a flag to indicate if we failed to get it
+typedef struct {
+  bool valid;
+  rb_nativethread_id_t owner;
+} current_gvl_owner;
+
 rb_nativethread_id_t pthread_id_for(VALUE thread);
+long native_thread_id_for(VALUE thread);
+size_t live_object_size(VALUE object);
+current_gvl_owner gvl_owner(void);
 ptrdiff_t stack_depth_for(VALUE thread);
 VALUE ddtrace_thread_list(void);
 
-int ddtrace_rb_profile_frames(VALUE thread, int start, int limit, VALUE *buff, int *lines, bool* is_ruby_frame);
+// Called with each alive thread; return false to stop iterating
+typedef bool (*ddtrace_thread_callback)(VALUE thread, void *callback_data);
+
+// Same as ddtrace_thread_list, but does not allocate any Ruby objects.
+// The callback MUST NOT do anything that can cause threads to start or finish (e.g. call into Ruby code).
+void ddtrace_thread_list_each(ddtrace_thread_callback callback, void *callback_data);
+
+// Per-thread record of the last result of ddtrace_rb_profile_frames, used to unwind only the part of the stack that
+// changed since then. See ddtrace_rb_profile_frames for details.
+typedef struct stack_snapshot stack_snapshot;
+
+stack_snapshot *stack_snapshot_new(void);
+void stack_snapshot_free(stack_snapshot *snapshot);
+void stack_snapshot_mark(stack_snapshot *snapshot);
+size_t stack_snapshot_memsize(stack_snapshot *snapshot);
+
+// The `snapshot` is optional (can be NULL); when provided it MUST always be used with the same thread.
+int ddtrace_rb_profile_frames(VALUE thread, int start, int limit, VALUE *buff, int *lines, bool* is_ruby_frame, stack_snapshot *snapshot);
 
 // Ruby 3.0 finally added support for showing CFUNC frames (frames for methods written using native code)
 // in stack traces gathered via `rb_profile_frames` (https://github.com/ruby/ruby/pull/3299).
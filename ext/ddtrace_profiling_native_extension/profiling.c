@@ -3,9 +3,11 @@
 #include "clock_id.h"
 
 // Each class/module here is implemented in their separate file
+void collectors_allocations_init(VALUE profiling_module);
 void collectors_cpu_and_wall_time_init(VALUE profiling_module);
 void collectors_stack_init(VALUE profiling_module);
 void http_transport_init(VALUE profiling_module);
+void serialized_profile_init(VALUE profiling_module);
 void stack_recorder_init(VALUE profiling_module);
 
 static VALUE native_working_p(VALUE self);
@@ -22,9 +24,11 @@ void DDTRACE_EXPORT Init_ddtrace_profiling_native_extension(void) {
 
   rb_define_singleton_method(native_extension_module, "clock_id_for", clock_id_for, 1); // from clock_id.h
 
+  collectors_allocations_init(profiling_module);
   collectors_cpu_and_wall_time_init(profiling_module);
   collectors_stack_init(profiling_module);
   http_transport_init(profiling_module);
+  serialized_profile_init(profiling_module);
   stack_recorder_init(profiling_module);
 }
 
@@ -31,3 +31,7 @@ static inline int check_if_pending_exception(void) {
   rb_protect(process_pending_interruptions, Qnil, &pending_exception);
   return pending_exception;
 }
+
+// Similar to Check_Type, but for booleans (which are not a single Ruby type)
+#define ENFORCE_BOOLEAN(value) \
+  if (value != Qtrue && value != Qfalse) rb_raise(rb_eTypeError, "wrong argument %"PRIsVALUE" for '" #value "' (expected true or false)", value)
@@ -0,0 +1,577 @@
+#include <ruby.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sample_aggregation.h"
+
+// Used by the StackRecorder (see stack_recorder.c) to sum up samples with the same stack and labels before they get
+// added to the libddprof profile.
+//
+// Every call to ddprof_ffi_Profile_add crosses into libddprof, which interns every string and hashes every location of
+// the sample again, even if it's exactly the same as a sample recorded before (which is very common, as threads tend to
+// sit in the same stacks). Instead, we sum up the values of samples with the same stack and labels in a hashtable. Only
+// one sample per entry gets added to the profile, when the table gets flushed (before serialization).
+//
+// Stacks are identified by the raw frames they were built from (see sample_stack_identity in stack_recorder.h), so
+// finding a sample's entry only needs to look at a few words per frame, rather than at every byte of every name and
+// filename in the stack. Entries keep (and pin, see aggregation_table_mark) the frames, as well as the Ruby strings
+// that the stack's names and filenames point to, so that both stay valid until the table gets flushed. Only the
+// placeholder frames (e.g. "Garbage Collection") and the labels, which are small, get copied into each entry.
+//
+// Samples recorded without a sample_stack_identity never get aggregated, see stack_recorder.c.
+//
+// To bound the memory used (both by the table, and by the profile it gets flushed into), the table holds at most
+// `max_entries` entries, which in turn use at most `max_keys_bytes`. When it fills up, entries get folded one at a
+// time into a single "Truncated Stacks" sample, which keeps their values but not their stacks nor labels. The entry
+// folded is the one with the lowest values among a few candidates near the new sample's slot (see
+// fold_lowest_value_entry), so making room never needs to allocate nor go through the whole table.
+//
+// When not aggregating, samples get added to the profile right away (by the StackRecorder), and the table only keeps
+// their keys (without values), so that the profile gets capped in the same way. As samples already added to the
+// profile can't be taken out of it, once the table is full it's the samples with new stacks or labels that get folded
+// into the "Truncated Stacks" sample.
+
+#define TRUNCATED_STACKS_NAME "Truncated Stacks"
+
+typedef struct {
+  void *storage; // Holds the arrays below; NULL if this entry is not being used
+  size_t storage_bytes;
+  uint64_t hash;
+  unsigned long samples; // How many samples were added to this entry
+  int frames_count;
+  VALUE *frames;
+  VALUE *strings; // Two per frame: the name and filename that the frame's line points to
+  ddprof_ffi_Line *lines;
+  int *frame_lines;
+  bool *is_ruby_frame;
+  // The placeholder locations (if any) and the labels, encoded so that decode_sample can rebuild them
+  uint8_t *extra_key;
+  size_t extra_key_length;
+  uintptr_t placeholders_count;
+  uintptr_t placeholder_lines_count;
+  uintptr_t labels_count;
+} aggregated_sample;
+
+struct aggregation_table {
+  bool aggregate; // When false, entries have no values, see above
+  unsigned int max_entries;
+  size_t max_keys_bytes;
+  unsigned int values_count;
+  unsigned long entries_count;
+  size_t keys_bytes;
+  unsigned long merged_samples;
+  unsigned long truncated_samples;
+  // Hashtable using open addressing with linear probing. We size it at (at least) twice max_entries, and to a power of
+  // two, so that it never needs to grow and lookups stay fast. The values for the entry at slot `i` start at
+  // `values[i * values_count]`.
+  aggregated_sample *entries;
+  int64_t *values; // NULL when not aggregating
+  unsigned long capacity;
+  // Sum of the values of every sample folded since the last flush; only valid when has_truncated_values is set
+  int64_t *truncated_values;
+  bool has_truncated_values;
+  // Used as scratch space when encoding the extra keys, and when decoding samples back
+  uint8_t *key_buffer;
+  size_t key_buffer_capacity;
+  ddprof_ffi_Location *locations_buffer;
+  uintptr_t locations_buffer_capacity;
+  ddprof_ffi_Line *lines_buffer;
+  uintptr_t lines_buffer_capacity;
+  ddprof_ffi_Label *labels_buffer;
+  uintptr_t labels_buffer_capacity;
+}; // Note: typedef'd in the header to aggregation_table
+
+// How many entries fold_lowest_value_entry picks from
+#define FOLD_CANDIDATES 8
+
+static size_t encode_extra_key(
+  aggregation_table *table,
+  ddprof_ffi_Sample sample,
+  uintptr_t placeholders_count,
+  uintptr_t *placeholder_lines_count
+);
+static void write_bytes(aggregation_table *table, size_t *key_length, const void *bytes, size_t count);
+static void write_slice(aggregation_table *table, size_t *key_length, ddprof_ffi_CharSlice slice);
+static void read_bytes(const uint8_t **position, void *destination, size_t count);
+static ddprof_ffi_CharSlice read_slice(const uint8_t **position);
+static size_t storage_bytes_for(int frames_count, size_t extra_key_length);
+static void store_entry(
+  aggregated_sample *entry,
+  void *storage,
+  const sample_stack_identity *stack,
+  ddprof_ffi_Sample sample,
+  uintptr_t placeholders_count,
+  uint8_t *extra_key,
+  size_t extra_key_length
+);
+static ddprof_ffi_Sample decode_sample(aggregation_table *table, aggregated_sample *entry, int64_t *values);
+static uint64_t extra_key_hash(uint64_t hash, const uint8_t *key, size_t key_length);
+static unsigned long slot_for(
+  aggregation_table *table,
+  uint64_t hash,
+  const sample_stack_identity *stack,
+  size_t extra_key_length
+);
+static bool is_full(aggregation_table *table, size_t storage_bytes);
+static void fold_lowest_value_entry(aggregation_table *table, unsigned long start_slot);
+static int64_t entry_weight(aggregation_table *table, unsigned long slot);
+static void fold_values(aggregation_table *table, const int64_t *values);
+static void remove_entry(aggregation_table *table, unsigned long slot);
+
+aggregation_table *aggregation_table_new(
+  unsigned int max_entries,
+  size_t max_keys_bytes,
+  unsigned int values_count,
+  bool aggregate
+) {
+  aggregation_table *table = ruby_xcalloc(1, sizeof(aggregation_table));
+
+  table->aggregate = aggregate;
+  table->max_entries = max_entries;
+  table->max_keys_bytes = max_keys_bytes;
+  table->values_count = values_count;
+
+  table->capacity = 1;
+  while (table->capacity < 2UL * max_entries) table->capacity *= 2;
+  // Note: ruby_xcalloc zeroes the memory, so all entries start empty (with NULL storage) and with all values at zero
+  table->entries = ruby_xcalloc(table->capacity, sizeof(aggregated_sample));
+  table->values = aggregate ? ruby_xcalloc(table->capacity * values_count, sizeof(int64_t)) : NULL;
+  table->truncated_values = ruby_xcalloc(values_count, sizeof(int64_t));
+
+  table->key_buffer_capacity = 1024;
+  table->key_buffer = ruby_xcalloc(table->key_buffer_capacity, sizeof(uint8_t));
+
+  return table;
+}
+
+void aggregation_table_free(aggregation_table *table) {
+  for (unsigned long i = 0; i < table->capacity; i++) {
+    if (table->entries[i].storage != NULL) ruby_xfree(table->entries[i].storage);
+  }
+
+  ruby_xfree(table->entries);
+  if (table->values != NULL) ruby_xfree(table->values);
+  ruby_xfree(table->truncated_values);
+  ruby_xfree(table->key_buffer);
+  if (table->locations_buffer != NULL) ruby_xfree(table->locations_buffer);
+  if (table->lines_buffer != NULL) ruby_xfree(table->lines_buffer);
+  if (table->labels_buffer != NULL) ruby_xfree(table->labels_buffer);
+  ruby_xfree(table);
+}
+
+// We use rb_gc_mark (and not rb_gc_mark_movable) on purpose: the lines point at the contents of the strings, so they
+// must not move, and a frame must not be freed (and its address reused for a different frame) while it's being used to
+// identify a stack.
+void aggregation_table_mark(aggregation_table *table) {
+  for (unsigned long slot = 0; slot < table->capacity; slot++) {
+    aggregated_sample *entry = &table->entries[slot];
+    if (entry->storage == NULL) continue;
+
+    for (int i = 0; i < entry->frames_count; i++) {
+      rb_gc_mark(entry->frames[i]);
+      rb_gc_mark(entry->strings[2 * i]);
+      rb_gc_mark(entry->strings[2 * i + 1]);
+    }
+  }
+}
+
+bool aggregation_table_add(aggregation_table *table, ddprof_ffi_Sample sample, const sample_stack_identity *stack) {
+  uintptr_t placeholders_count = sample.locations.len - stack->frames_count;
+  uintptr_t placeholder_lines_count = 0;
+  size_t extra_key_length = encode_extra_key(table, sample, placeholders_count, &placeholder_lines_count);
+  uint64_t hash = extra_key_hash(stack->hash ^ (uint64_t) stack->frames_count, table->key_buffer, extra_key_length);
+
+  unsigned long slot = slot_for(table, hash, stack, extra_key_length);
+  aggregated_sample *entry = &table->entries[slot];
+
+  if (entry->storage == NULL) {
+    size_t storage_bytes = storage_bytes_for(stack->frames_count, extra_key_length);
+
+    // A sample that would not fit even in an empty table goes straight into the truncated sample
+    // Same for new samples that don't fit when not aggregating, see above
+    if (storage_bytes > table->max_keys_bytes || (!table->aggregate && is_full(table, storage_bytes))) {
+      table->truncated_samples++;
+      fold_values(table, sample.values.ptr);
+      return false;
+    }
+
+    if (is_full(table, storage_bytes)) {
+      while (is_full(table, storage_bytes)) fold_lowest_value_entry(table, slot);
+      slot = slot_for(table, hash, stack, extra_key_length);
+      entry = &table->entries[slot];
+    }
+
+    // Note: If this triggers the GC, the new entry is not yet visible to aggregation_table_mark; the caller keeps the
+    // stack's frames and strings alive until this returns (see sample_stack_identity).
+    void *storage = ruby_xmalloc(storage_bytes);
+    store_entry(entry, storage, stack, sample, placeholders_count, table->key_buffer, extra_key_length);
+    entry->storage_bytes = storage_bytes;
+    entry->hash = hash;
+    entry->placeholder_lines_count = placeholder_lines_count;
+    entry->labels_count = sample.labels.len;
+
+    table->entries_count++;
+    table->keys_bytes += storage_bytes;
+  } else {
+    table->merged_samples++;
+  }
+
+  entry->samples++;
+  if (!table->aggregate) return true;
+
+  int64_t *values = &table->values[slot * table->values_count];
+  for (unsigned int i = 0; i < table->values_count; i++) values[i] += sample.values.ptr[i];
+
+  return false;
+}
+
+void aggregation_table_flush(aggregation_table *table, ddprof_ffi_Profile *profile) {
+  for (unsigned long slot = 0; slot < table->capacity && table->entries_count > 0; slot++) {
+    aggregated_sample *entry = &table->entries[slot];
+    if (entry->storage == NULL) continue;
+
+    if (table->aggregate) {
+      int64_t *values = &table->values[slot * table->values_count];
+      ddprof_ffi_Profile_add(profile, decode_sample(table, entry, values));
+      memset(values, 0, table->values_count * sizeof(int64_t));
+    }
+
+    ruby_xfree(entry->storage);
+    *entry = (aggregated_sample) {.storage = NULL};
+
+    table->entries_count--;
+  }
+
+  table->keys_bytes = 0;
+
+  if (table->has_truncated_values) {
+    ddprof_ffi_Line truncated_line = {
+      .function = (ddprof_ffi_Function) {
+        .name = DDPROF_FFI_CHARSLICE_C(""),
+        .filename = DDPROF_FFI_CHARSLICE_C(TRUNCATED_STACKS_NAME),
+      },
+    };
+    ddprof_ffi_Location truncated_location = {.lines = (ddprof_ffi_Slice_line) {.ptr = &truncated_line, .len = 1}};
+
+    ddprof_ffi_Profile_add(profile, (ddprof_ffi_Sample) {
+      .locations = (ddprof_ffi_Slice_location) {.ptr = &truncated_location, .len = 1},
+      .values = (ddprof_ffi_Slice_i64) {.ptr = table->truncated_values, .len = table->values_count},
+      .labels = (ddprof_ffi_Slice_label) {.ptr = NULL, .len = 0},
+    });
+
+    memset(table->truncated_values, 0, table->values_count * sizeof(int64_t));
+    table->has_truncated_values = false;
+  }
+}
+
+aggregation_table_stats aggregation_table_stats_for(aggregation_table *table) {
+  return (aggregation_table_stats) {
+    .entries = table->entries_count,
+    .max_entries = table->max_entries,
+    .merged_samples = table->merged_samples,
+    .truncated_samples = table->truncated_samples,
+    .max_keys_bytes = table->max_keys_bytes,
+    .memory_bytes =
+      sizeof(aggregation_table) +
+      table->capacity * (sizeof(aggregated_sample) + (table->aggregate ? table->values_count * sizeof(int64_t) : 0)) +
+      table->values_count * sizeof(int64_t) + // truncated_values
+      table->keys_bytes +
+      table->key_buffer_capacity +
+      table->locations_buffer_capacity * sizeof(ddprof_ffi_Location) +
+      table->lines_buffer_capacity * sizeof(ddprof_ffi_Line) +
+      table->labels_buffer_capacity * sizeof(ddprof_ffi_Label),
+  };
+}
+
+// Encodes the parts of the sample that are not covered by its sample_stack_identity (the placeholder locations on top
+// of the stack, and the labels) into table->key_buffer, and returns their length. Every field of these gets encoded, so
+// that decode_sample can rebuild exactly the same sample.
+static size_t encode_extra_key(
+  aggregation_table *table,
+  ddprof_ffi_Sample sample,
+  uintptr_t placeholders_count,
+  uintptr_t *placeholder_lines_count
+) {
+  size_t key_length = 0;
+
+  for (uintptr_t i = 0; i < placeholders_count; i++) {
+    const ddprof_ffi_Location *location = &sample.locations.ptr[i];
+
+    write_bytes(table, &key_length, &location->lines.len, sizeof(uintptr_t));
+
+    for (uintptr_t j = 0; j < location->lines.len; j++) {
+      const ddprof_ffi_Line *line = &location->lines.ptr[j];
+
+      write_slice(table, &key_length, line->function.name);
+      write_slice(table, &key_length, line->function.filename);
+      write_bytes(table, &key_length, &line->line, sizeof(int64_t));
+    }
+
+    *placeholder_lines_count += location->lines.len;
+  }
+
+  for (uintptr_t i = 0; i < sample.labels.len; i++) {
+    const ddprof_ffi_Label *label = &sample.labels.ptr[i];
+
+    write_slice(table, &key_length, label->key);
+    write_slice(table, &key_length, label->str);
+    write_bytes(table, &key_length, &label->num, sizeof(int64_t));
+    write_slice(table, &key_length, label->num_unit);
+  }
+
+  return key_length;
+}
+
+static void write_bytes(aggregation_table *table, size_t *key_length, const void *bytes, size_t count) {
+  if (count == 0) return;
+
+  if (*key_length + count > table->key_buffer_capacity) {
+    while (*key_length + count > table->key_buffer_capacity) table->key_buffer_capacity *= 2;
+    table->key_buffer = ruby_xrealloc(table->key_buffer, table->key_buffer_capacity);
+  }
+
+  memcpy(table->key_buffer + *key_length, bytes, count);
+  *key_length += count;
+}
+
+static void write_slice(aggregation_table *table, size_t *key_length, ddprof_ffi_CharSlice slice) {
+  write_bytes(table, key_length, &slice.len, sizeof(uintptr_t));
+  write_bytes(table, key_length, slice.ptr, slice.len);
+}
+
+static void read_bytes(const uint8_t **position, void *destination, size_t count) {
+  memcpy(destination, *position, count);
+  *position += count;
+}
+
+// The slice points inside the extra key, so it's only valid for as long as the entry is
+static ddprof_ffi_CharSlice read_slice(const uint8_t **position) {
+  ddprof_ffi_CharSlice slice;
+
+  read_bytes(position, &slice.len, sizeof(uintptr_t));
+  slice.ptr = (const char *) *position;
+  *position += slice.len;
+
+  return slice;
+}
+
+// Every entry gets a single allocation, laid out so that each array is properly aligned
+static size_t storage_bytes_for(int frames_count, size_t extra_key_length) {
+  return
+    frames_count * (3 * sizeof(VALUE) + sizeof(ddprof_ffi_Line) + sizeof(int) + sizeof(bool)) +
+    extra_key_length;
+}
+
+static void store_entry(
+  aggregated_sample *entry,
+  void *storage,
+  const sample_stack_identity *stack,
+  ddprof_ffi_Sample sample,
+  uintptr_t placeholders_count,
+  uint8_t *extra_key,
+  size_t extra_key_length
+) {
+  int frames_count = stack->frames_count;
+  uint8_t *position = storage;
+
+  entry->frames = (VALUE *) position;
+  position += frames_count * sizeof(VALUE);
+  entry->strings = (VALUE *) position;
+  position += 2 * frames_count * sizeof(VALUE);
+  entry->lines = (ddprof_ffi_Line *) position;
+  position += frames_count * sizeof(ddprof_ffi_Line);
+  entry->frame_lines = (int *) position;
+  position += frames_count * sizeof(int);
+  entry->is_ruby_frame = (bool *) position;
+  position += frames_count * sizeof(bool);
+  entry->extra_key = position;
+
+  if (frames_count > 0) {
+    memcpy(entry->frames, stack->frames, frames_count * sizeof(VALUE));
+    memcpy(entry->strings, stack->strings, 2 * frames_count * sizeof(VALUE));
+    memcpy(entry->frame_lines, stack->lines, frames_count * sizeof(int));
+    memcpy(entry->is_ruby_frame, stack->is_ruby_frame, frames_count * sizeof(bool));
+  }
+  for (int i = 0; i < frames_count; i++) entry->lines[i] = sample.locations.ptr[placeholders_count + i].lines.ptr[0];
+  if (extra_key_length > 0) memcpy(entry->extra_key, extra_key, extra_key_length);
+
+  entry->extra_key_length = extra_key_length;
+  entry->placeholders_count = placeholders_count;
+  entry->frames_count = frames_count;
+  entry->storage = storage;
+}
+
+// The resulting sample points at the table's scratch buffers and at the entry's storage, so it needs to be used before
+// either gets changed
+static ddprof_ffi_Sample decode_sample(aggregation_table *table, aggregated_sample *entry, int64_t *values) {
+  uintptr_t locations_count = entry->placeholders_count + entry->frames_count;
+
+  if (locations_count > table->locations_buffer_capacity) {
+    table->locations_buffer_capacity = locations_count;
+    table->locations_buffer =
+      ruby_xrealloc2(table->locations_buffer, table->locations_buffer_capacity, sizeof(ddprof_ffi_Location));
+  }
+  if (entry->placeholder_lines_count > table->lines_buffer_capacity) {
+    table->lines_buffer_capacity = entry->placeholder_lines_count;
+    table->lines_buffer = ruby_xrealloc2(table->lines_buffer, table->lines_buffer_capacity, sizeof(ddprof_ffi_Line));
+  }
+  if (entry->labels_count > table->labels_buffer_capacity) {
+    table->labels_buffer_capacity = entry->labels_count;
+    table->labels_buffer =
+      ruby_xrealloc2(table->labels_buffer, table->labels_buffer_capacity, sizeof(ddprof_ffi_Label));
+  }
+
+  const uint8_t *position = entry->extra_key;
+  uintptr_t lines_used = 0;
+
+  for (uintptr_t i = 0; i < entry->placeholders_count; i++) {
+    uintptr_t location_lines_count;
+    read_bytes(&position, &location_lines_count, sizeof(uintptr_t));
+
+    ddprof_ffi_Line *lines = &table->lines_buffer[lines_used];
+    for (uintptr_t j = 0; j < location_lines_count; j++) {
+      lines[j] = (ddprof_ffi_Line) {.function = (ddprof_ffi_Function) {.name = read_slice(&position)}};
+      lines[j].function.filename = read_slice(&position);
+      read_bytes(&position, &lines[j].line, sizeof(int64_t));
+    }
+
+    table->locations_buffer[i] =
+      (ddprof_ffi_Location) {.lines = (ddprof_ffi_Slice_line) {.ptr = lines, .len = location_lines_count}};
+    lines_used += location_lines_count;
+  }
+
+  for (int i = 0; i < entry->frames_count; i++) {
+    table->locations_buffer[entry->placeholders_count + i] =
+      (ddprof_ffi_Location) {.lines = (ddprof_ffi_Slice_line) {.ptr = &entry->lines[i], .len = 1}};
+  }
+
+  for (uintptr_t i = 0; i < entry->labels_count; i++) {
+    ddprof_ffi_Label *label = &table->labels_buffer[i];
+
+    label->key = read_slice(&position);
+    label->str = read_slice(&position);
+    read_bytes(&position, &label->num, sizeof(int64_t));
+    label->num_unit = read_slice(&position);
+  }
+
+  return (ddprof_ffi_Sample) {
+    .locations = (ddprof_ffi_Slice_location) {.ptr = table->locations_buffer, .len = locations_count},
+    .values = (ddprof_ffi_Slice_i64) {.ptr = values, .len = table->values_count},
+    .labels = (ddprof_ffi_Slice_label) {.ptr = table->labels_buffer, .len = entry->labels_count},
+  };
+}
+
+// Continues the caller's hash (see sample_stack_identity) over the extra key, which is usually just a few labels
+static uint64_t extra_key_hash(uint64_t hash, const uint8_t *key, size_t key_length) {
+  for (size_t i = 0; i < key_length; i++) hash = (hash ^ key[i]) * 1099511628211ULL;
+
+  return hash;
+}
+
+// Returns either the slot where the sample (with its extra key in table->key_buffer) is, or the empty slot where it
+// should go
+static unsigned long slot_for(
+  aggregation_table *table,
+  uint64_t hash,
+  const sample_stack_identity *stack,
+  size_t extra_key_length
+) {
+  unsigned long mask = table->capacity - 1;
+  unsigned long slot = (unsigned long) (hash & mask);
+  int frames_count = stack->frames_count;
+
+  while (table->entries[slot].storage != NULL) {
+    aggregated_sample *entry = &table->entries[slot];
+
+    bool matches =
+      entry->hash == hash &&
+      entry->frames_count == frames_count &&
+      entry->extra_key_length == extra_key_length &&
+      memcmp(entry->frames, stack->frames, frames_count * sizeof(VALUE)) == 0 &&
+      memcmp(entry->frame_lines, stack->lines, frames_count * sizeof(int)) == 0 &&
+      memcmp(entry->is_ruby_frame, stack->is_ruby_frame, frames_count * sizeof(bool)) == 0 &&
+      memcmp(entry->extra_key, table->key_buffer, extra_key_length) == 0;
+
+    if (matches) break;
+
+    slot = (slot + 1) & mask;
+  }
+
+  return slot;
+}
+
+static bool is_full(aggregation_table *table, size_t storage_bytes) {
+  return table->entries_count >= table->max_entries || table->keys_bytes + storage_bytes > table->max_keys_bytes;
+}
+
+// Folds the entry with the lowest weight (see entry_weight) among the first FOLD_CANDIDATES entries found starting at
+// `start_slot` into the truncated values. Only valid when aggregating, and the table has at least one entry.
+//
+// Picking from a few neighbouring entries, rather than from the whole table, keeps this cheap enough to do while
+// recording samples; since slots are picked by hash, the candidates are effectively a random subset of the table.
+static void fold_lowest_value_entry(aggregation_table *table, unsigned long start_slot) {
+  unsigned long mask = table->capacity - 1;
+  unsigned long lowest_slot = 0;
+  int64_t lowest_weight = 0;
+  int candidates = 0;
+
+  for (unsigned long i = 0, slot = start_slot & mask; i < table->capacity && candidates < FOLD_CANDIDATES; i++) {
+    if (table->entries[slot].storage != NULL) {
+      int64_t weight = entry_weight(table, slot);
+      if (candidates == 0 || weight < lowest_weight) {
+        lowest_slot = slot;
+        lowest_weight = weight;
+      }
+      candidates++;
+    }
+
+    slot = (slot + 1) & mask;
+  }
+
+  fold_values(table, &table->values[lowest_slot * table->values_count]);
+  table->truncated_samples += table->entries[lowest_slot].samples;
+  remove_entry(table, lowest_slot);
+}
+
+// How much an entry contributes to the profile: the sum of its values. Weighting by values (rather than by how many
+// samples were added to it) avoids folding an entry that was only seen a few times, but was e.g. a long-running call.
+static int64_t entry_weight(aggregation_table *table, unsigned long slot) {
+  const int64_t *values = &table->values[slot * table->values_count];
+  int64_t weight = 0;
+
+  for (unsigned int i = 0; i < table->values_count; i++) weight += values[i];
+
+  return weight;
+}
+
+static void fold_values(aggregation_table *table, const int64_t *values) {
+  for (unsigned int i = 0; i < table->values_count; i++) table->truncated_values[i] += values[i];
+  table->has_truncated_values = true;
+}
+
+// Removes the entry at `slot`, and then moves back any entries after it that would otherwise no longer be found by
+// slot_for (as their probing sequence went through the removed entry). This never allocates, so the entries are always
+// visible to aggregation_table_mark.
+static void remove_entry(aggregation_table *table, unsigned long slot) {
+  unsigned long mask = table->capacity - 1;
+  size_t values_bytes = table->values_count * sizeof(int64_t);
+
+  table->keys_bytes -= table->entries[slot].storage_bytes;
+  table->entries_count--;
+  ruby_xfree(table->entries[slot].storage);
+
+  unsigned long empty_slot = slot;
+  for (unsigned long next = (slot + 1) & mask; table->entries[next].storage != NULL; next = (next + 1) & mask) {
+    unsigned long home = (unsigned long) (table->entries[next].hash & mask);
+
+    // Entries whose home is (cyclically) after the empty slot, and not after where they are, are still reachable
+    bool reachable = empty_slot <= next ? (empty_slot < home && home <= next) : (empty_slot < home || home <= next);
+    if (reachable) continue;
+
+    table->entries[empty_slot] = table->entries[next];
+    memcpy(&table->values[empty_slot * table->values_count], &table->values[next * table->values_count], values_bytes);
+    empty_slot = next;
+  }
+
+  table->entries[empty_slot] = (aggregated_sample) {.storage = NULL};
+  memset(&table->values[empty_slot * table->values_count], 0, values_bytes);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <ruby.h>
+#include <stdbool.h>
+#include <ddprof/ffi.h>
+#include "stack_recorder.h"
+
+// Sums up samples with the same stack and labels before they get handed over to libddprof, or (when not aggregating)
+// just keeps track of which samples were handed over, so that either way each profile gets capped. See
+// sample_aggregation.c for details.
+typedef struct aggregation_table aggregation_table;
+
+typedef struct {
+  unsigned long entries;
+  unsigned long max_entries;
+  // How many samples got merged into an already-existing entry, rather than needing a new one
+  unsigned long merged_samples;
+  // How many samples got folded into the "Truncated Stacks" sample because the table was full
+  unsigned long truncated_samples;
+  size_t max_keys_bytes;
+  size_t memory_bytes;
+} aggregation_table_stats;
+
+aggregation_table *aggregation_table_new(
+  unsigned int max_entries,
+  size_t max_keys_bytes,
+  unsigned int values_count,
+  bool aggregate
+);
+void aggregation_table_free(aggregation_table *table);
+// The table references Ruby objects (the frames and strings of the stacks it holds), so its owner MUST call this when
+// getting marked
+void aggregation_table_mark(aggregation_table *table);
+// When aggregating and the table is full, this makes room by folding entries with low values into a "Truncated Stacks"
+// sample. When not aggregating, samples that are already in the profile can't be folded anymore, so it's new samples
+// that get folded once the table is full.
+//
+// Returns true if the caller should add the sample to the profile itself, which only happens when not aggregating.
+bool aggregation_table_add(aggregation_table *table, ddprof_ffi_Sample sample, const sample_stack_identity *stack);
+// Adds every entry (when aggregating) and the "Truncated Stacks" sample (if any) to the profile, and leaves the table
+// empty
+void aggregation_table_flush(aggregation_table *table, ddprof_ffi_Profile *profile);
+aggregation_table_stats aggregation_table_stats_for(aggregation_table *table);
@@ -0,0 +1,196 @@
+#include <ruby.h>
+#include "serialized_profile.h"
+
+// Used to hand over serialized profiles from the StackRecorder to the HttpTransport without copying them
+// This file implements the native bits of the Datadog::Profiling::SerializedProfile class
+//
+// The pprof bytes stay in the buffer libddprof serialized them into (or, when the StackRecorder compresses them, in the
+// buffer they were compressed into, see pprof_compression.c), which this object owns. They only get turned into a Ruby
+// String when someone asks for it (see `_native_to_s`), so the usual path (serialize, then report) never copies them
+// nor puts them on the Ruby heap.
+
+static VALUE serialized_profile_class = Qnil;
+
+static VALUE gzip_symbol = Qnil; // :gzip in Ruby
+static VALUE zstd_symbol = Qnil; // :zstd in Ruby
+
+struct serialized_profile_state {
+  // Note: Places in this file that usually need to be changed when this struct is changed are tagged with
+  // "Update this when modifying state struct"
+  bool has_buffer; // false until adopted, and again once released
+  pprof_buffer pprof;
+  // How many callers are using the buffer (possibly without the Global VM Lock), see serialized_profile_borrow
+  unsigned int borrowed_count;
+};
+
+static VALUE _native_new(VALUE klass);
+static void serialized_profile_typed_data_free(void *state_ptr);
+static size_t serialized_profile_typed_data_size(const void *state_ptr);
+static void drop_buffer(struct serialized_profile_state *state);
+static struct serialized_profile_state *get_state(VALUE serialized_profile_instance);
+static struct serialized_profile_state *get_state_with_buffer(VALUE serialized_profile_instance);
+static VALUE _native_to_s(VALUE self, VALUE serialized_profile_instance);
+static VALUE _native_bytesize(VALUE self, VALUE serialized_profile_instance);
+static VALUE _native_release(VALUE self, VALUE serialized_profile_instance);
+static VALUE _native_released(VALUE self, VALUE serialized_profile_instance);
+static VALUE _native_compression(VALUE self, VALUE serialized_profile_instance);
+
+void serialized_profile_init(VALUE profiling_module) {
+  serialized_profile_class = rb_define_class_under(profiling_module, "SerializedProfile", rb_cObject);
+
+  // Instances of the SerializedProfile class are "TypedData" objects.
+  // "TypedData" objects are special objects in the Ruby VM that can wrap C structs.
+  // In our case, we're going to keep a (libddprof or compressed) pprof buffer inside our object.
+  //
+  // We MUST override the allocation function for objects of this class so that the struct always gets initialized,
+  // see https://bugs.ruby-lang.org/issues/18007 for a discussion around this.
+  rb_define_alloc_func(serialized_profile_class, _native_new);
+  // Instances only make sense when created by the StackRecorder
+  rb_undef_method(rb_singleton_class(serialized_profile_class), "new");
+
+  rb_define_singleton_method(serialized_profile_class, "_native_to_s", _native_to_s, 1);
+  rb_define_singleton_method(serialized_profile_class, "_native_bytesize", _native_bytesize, 1);
+  rb_define_singleton_method(serialized_profile_class, "_native_release", _native_release, 1);
+  rb_define_singleton_method(serialized_profile_class, "_native_released?", _native_released, 1);
+  rb_define_singleton_method(serialized_profile_class, "_native_compression", _native_compression, 1);
+
+  gzip_symbol = ID2SYM(rb_intern_const("gzip"));
+  zstd_symbol = ID2SYM(rb_intern_const("zstd"));
+}
+
+// This structure is used to define a Ruby object that stores a pointer to a struct serialized_profile_state
+// See also https://github.com/ruby/ruby/blob/master/doc/extension.rdoc for how this works
+static const rb_data_type_t serialized_profile_typed_data = {
+  .wrap_struct_name = "Datadog::Profiling::SerializedProfile",
+  .function = {
+    .dfree = serialized_profile_typed_data_free,
+    .dsize = serialized_profile_typed_data_size,
+    // No need to provide dmark nor dcompact because we don't reference Ruby VALUEs
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE _native_new(VALUE klass) {
+  struct serialized_profile_state *state = ruby_xcalloc(1, sizeof(struct serialized_profile_state));
+
+  // Update this when modifying state struct
+  state->has_buffer = false;
+  state->borrowed_count = 0;
+
+  return TypedData_Wrap_Struct(klass, &serialized_profile_typed_data, state);
+}
+
+static void serialized_profile_typed_data_free(void *state_ptr) {
+  struct serialized_profile_state *state = (struct serialized_profile_state *) state_ptr;
+
+  // Update this when modifying state struct
+  drop_buffer(state);
+
+  ruby_xfree(state);
+}
+
+static size_t serialized_profile_typed_data_size(const void *state_ptr) {
+  const struct serialized_profile_state *state = (const struct serialized_profile_state *) state_ptr;
+
+  // Update this when modifying state struct
+  return sizeof(struct serialized_profile_state) + (state->has_buffer ? state->pprof.capacity_bytes : 0);
+}
+
+VALUE serialized_profile_new(void) {
+  return _native_new(serialized_profile_class);
+}
+
+void serialized_profile_adopt(VALUE serialized_profile_instance, pprof_buffer pprof) {
+  struct serialized_profile_state *state = get_state(serialized_profile_instance);
+
+  // Should never be needed, as only the StackRecorder adopts results, and always into a brand new object
+  drop_buffer(state);
+
+  state->pprof = pprof;
+  state->has_buffer = true;
+}
+
+bool is_serialized_profile(VALUE object) {
+  return rb_typeddata_is_kind_of(object, &serialized_profile_typed_data);
+}
+
+bool serialized_profile_borrow(VALUE serialized_profile_instance, ddprof_ffi_ByteSlice *pprof) {
+  struct serialized_profile_state *state = get_state(serialized_profile_instance);
+
+  if (!state->has_buffer) return false;
+
+  state->borrowed_count++;
+
+  *pprof = state->pprof.bytes;
+  return true;
+}
+
+void serialized_profile_return(VALUE serialized_profile_instance, bool release) {
+  struct serialized_profile_state *state = get_state(serialized_profile_instance);
+
+  if (state->borrowed_count > 0) state->borrowed_count--;
+  if (release && state->borrowed_count == 0) drop_buffer(state);
+}
+
+bool serialized_profile_take(VALUE serialized_profile_instance, pprof_buffer *pprof) {
+  struct serialized_profile_state *state = get_state(serialized_profile_instance);
+
+  if (!state->has_buffer || state->borrowed_count > 0) return false;
+
+  *pprof = state->pprof;
+  state->has_buffer = false;
+  return true;
+}
+
+static void drop_buffer(struct serialized_profile_state *state) {
+  if (!state->has_buffer) return;
+
+  state->has_buffer = false;
+  pprof_buffer_drop(&state->pprof);
+}
+
+static struct serialized_profile_state *get_state(VALUE serialized_profile_instance) {
+  struct serialized_profile_state *state;
+  TypedData_Get_Struct(serialized_profile_instance, struct serialized_profile_state, &serialized_profile_typed_data, state);
+  return state;
+}
+
+static struct serialized_profile_state *get_state_with_buffer(VALUE serialized_profile_instance) {
+  struct serialized_profile_state *state = get_state(serialized_profile_instance);
+
+  if (!state->has_buffer) rb_raise(rb_eRuntimeError, "SerializedProfile was already released");
+
+  return state;
+}
+
+static VALUE _native_to_s(VALUE self, VALUE serialized_profile_instance) {
+  ddprof_ffi_ByteSlice bytes = get_state_with_buffer(serialized_profile_instance)->pprof.bytes;
+
+  return rb_str_new((const char *) bytes.ptr, bytes.len);
+}
+
+static VALUE _native_bytesize(VALUE self, VALUE serialized_profile_instance) {
+  return SIZET2NUM(get_state_with_buffer(serialized_profile_instance)->pprof.bytes.len);
+}
+
+static VALUE _native_release(VALUE self, VALUE serialized_profile_instance) {
+  struct serialized_profile_state *state = get_state(serialized_profile_instance);
+
+  if (state->borrowed_count > 0) rb_raise(rb_eRuntimeError, "Cannot release SerializedProfile while it is in use");
+
+  drop_buffer(state);
+  return Qnil;
+}
+
+static VALUE _native_released(VALUE self, VALUE serialized_profile_instance) {
+  return get_state(serialized_profile_instance)->has_buffer ? Qfalse : Qtrue;
+}
+
+// Returns :gzip or :zstd for compressed pprofs, or nil for uncompressed ones
+static VALUE _native_compression(VALUE self, VALUE serialized_profile_instance) {
+  switch (get_state_with_buffer(serialized_profile_instance)->pprof.codec) {
+    case PPROF_COMPRESSION_GZIP: return gzip_symbol;
+    case PPROF_COMPRESSION_ZSTD: return zstd_symbol;
+    default: return Qnil;
+  }
+}
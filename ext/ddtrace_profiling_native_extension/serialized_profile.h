@@ -0,0 +1,26 @@
+#pragma once
+
+#include <ruby.h>
+#include <stdbool.h>
+#include <ddprof/ffi.h>
+#include "pprof_compression.h"
+
+// Creates an empty Datadog::Profiling::SerializedProfile. This is done separately from `serialized_profile_adopt`
+// so that callers can allocate it (which may raise) before they have a libddprof result that they'd otherwise leak.
+VALUE serialized_profile_new(void);
+// Takes ownership of the `pprof`; it gets dropped when the object is released or garbage collected.
+// Does not raise.
+void serialized_profile_adopt(VALUE serialized_profile_instance, pprof_buffer pprof);
+bool is_serialized_profile(VALUE object);
+
+// Borrowing lets callers use the pprof bytes without holding the Global VM Lock, as the object refuses to be released
+// until they get returned. Returns false (leaving `pprof` untouched) if the object was already released.
+// Neither of these raise.
+bool serialized_profile_borrow(VALUE serialized_profile_instance, ddprof_ffi_ByteSlice *pprof);
+// If `release` is true, the pprof bytes get dropped right away (unless they're still borrowed by someone else), rather
+// than waiting for the object to be garbage collected
+void serialized_profile_return(VALUE serialized_profile_instance, bool release);
+// Hands over the pprof bytes to the caller (which becomes responsible for dropping them), leaving the object released.
+// Returns false (leaving `pprof` untouched) if the object was already released or is borrowed.
+// Does not raise.
+bool serialized_profile_take(VALUE serialized_profile_instance, pprof_buffer *pprof);
@@ -0,0 +1,522 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "spool.h"
+
+// Used by the HttpTransport to keep profiles that could not be reported (e.g. because the agent was restarting), so
+// they can be reported once reporting works again.
+//
+// Each spooled profile is a single file in the spool directory, containing the reported files (pprof and code
+// provenance), the start/finish timestamps and the tags it was going to be reported with. Files are only ever written
+// once, by appending to a hidden temporary file, which then gets renamed into place, so readers never see half-written
+// profiles. File names start with the profile's finish timestamp, so sorting them by name sorts them from oldest to
+// newest, which is the order in which they get dropped (when the spool is full) and reported back.
+//
+// Profiles get "claimed" (by renaming them) while they're being reported back, so that several processes sharing the
+// same spool (e.g. after forking) don't report the same profile twice.
+//
+// Everything in the directory (including claimed profiles and the temporary files being written) counts towards its
+// maximum size, but only profiles that nobody is working on get dropped to make room. Claimed and temporary files only
+// get dropped once they're stale (see STALE_FILE_SECONDS), as they were then left behind by a process that died while
+// working on them. Within a process, writes are serialized, so that concurrent writers don't both take the same room.
+//
+// While reporting works, the only cost of having a spool is listing its directory after each report (to check for
+// profiles to report back). Everything here gets called from threads that are not holding the Global VM Lock.
+//
+// Note: The format uses the native byte order, as spooled profiles are only meant to be read on the same machine.
+
+#define SPOOL_MAGIC "DDSPOOL2"
+#define SPOOL_MAGIC_SIZE 8
+// magic + start seconds + start nanoseconds + finish seconds + finish nanoseconds + tags length + files count
+#define SPOOL_HEADER_SIZE (SPOOL_MAGIC_SIZE + 8 + 4 + 8 + 4 + 4 + 4)
+// name length + contents length
+#define SPOOL_FILE_HEADER_SIZE (4 + 8)
+#define MAX_SPOOLED_FILES 2
+#define MAX_SPOOLED_TAGS_SIZE (64 * 1024)
+#define SPOOLED_PROFILE_PREFIX "profile-"
+#define TEMPORARY_PREFIX "." SPOOLED_PROFILE_PREFIX
+#define CLAIMED_SUFFIX ".claimed"
+// Gives up claiming after this many spooled profiles were taken by someone else (or were unreadable) in a row
+#define MAX_CLAIM_ATTEMPTS 8
+// Claimed and temporary files are only ever worked on for as long as an upload (or a write) takes, so ones that did not
+// change in this long were left behind
+#define STALE_FILE_SECONDS (60 * 60)
+
+struct spool {
+  char *directory;
+  uint64_t max_size_bytes;
+  unsigned int reference_count;
+  pthread_mutex_t write_mutex;
+  pid_t write_mutex_pid; // See lock_for_writing
+};
+
+typedef struct {
+  char *name;
+  uint64_t size_bytes;
+  time_t changed_at;
+} spool_entry;
+
+static unsigned int spooled_profiles_count = 0; // Used to give each spooled profile a unique name
+
+static void lock_for_writing(spool *spool);
+static const char *make_room(spool *spool, uint64_t needed_bytes);
+static bool is_spooled_profile(const char *name);
+static bool remove_entry(spool *spool, spool_entry *entry);
+static bool list_entries(const char *directory, spool_entry **entries, size_t *entries_count);
+static void free_entries(spool_entry *entries, size_t entries_count);
+static int compare_entries(const void *left, const void *right);
+static bool has_suffix(const char *name, const char *suffix);
+static char *join_path(const char *directory, const char *name, const char *suffix);
+static bool write_fully(int fd, const void *data, size_t size);
+static bool read_file(const char *path, uint8_t **contents, size_t *size);
+static bool parse_spooled_profile(spooled_profile *profile, size_t size);
+static uint8_t *put(uint8_t *destination, const void *source, size_t size);
+
+spool *spool_new(const char *directory, uint64_t max_size_bytes) {
+  spool *new_spool = malloc(sizeof(spool));
+  char *directory_copy = strdup(directory);
+  if (new_spool == NULL || directory_copy == NULL) {
+    free(new_spool);
+    free(directory_copy);
+    return NULL;
+  }
+
+  *new_spool = (spool) {.directory = directory_copy, .max_size_bytes = max_size_bytes, .reference_count = 1};
+  pthread_mutex_init(&new_spool->write_mutex, NULL);
+  new_spool->write_mutex_pid = getpid();
+
+  return new_spool;
+}
+
+void spool_retain(spool *spool) {
+  __atomic_add_fetch(&spool->reference_count, 1, __ATOMIC_SEQ_CST);
+}
+
+void spool_release(spool *spool) {
+  if (__atomic_sub_fetch(&spool->reference_count, 1, __ATOMIC_SEQ_CST) > 0) return;
+
+  pthread_mutex_destroy(&spool->write_mutex);
+  free(spool->directory);
+  free(spool);
+}
+
+ddprof_ffi_Vec_tag spool_decode_tags(ddprof_ffi_ByteSlice encoded_tags) {
+  ddprof_ffi_Vec_tag tags = ddprof_ffi_Vec_tag_new();
+
+  const char *next = (const char *) encoded_tags.ptr;
+  const char *end = next + encoded_tags.len;
+
+  while (next < end) {
+    const char *name_end = memchr(next, '\0', end - next);
+    if (name_end == NULL) break;
+    const char *value = name_end + 1;
+    const char *value_end = memchr(value, '\0', end - value);
+    if (value_end == NULL) break;
+
+    ddprof_ffi_PushTagResult push_result = ddprof_ffi_Vec_tag_push(
+      &tags,
+      (ddprof_ffi_CharSlice) {.ptr = next, .len = name_end - next},
+      (ddprof_ffi_CharSlice) {.ptr = value, .len = value_end - value}
+    );
+    ddprof_ffi_PushTagResult_drop(push_result);
+
+    next = value_end + 1;
+  }
+
+  return tags;
+}
+
+const char *spool_write(
+  spool *spool,
+  ddprof_ffi_Timespec start,
+  ddprof_ffi_Timespec finish,
+  ddprof_ffi_Slice_file files,
+  ddprof_ffi_ByteSlice encoded_tags
+) {
+  if (files.len == 0 || files.len > MAX_SPOOLED_FILES) return "Unexpected number of files to spool";
+  if (encoded_tags.len > MAX_SPOOLED_TAGS_SIZE) return "Tags are too large to spool";
+
+  uint64_t size_bytes = SPOOL_HEADER_SIZE + encoded_tags.len;
+  for (uintptr_t i = 0; i < files.len; i++) {
+    size_bytes += SPOOL_FILE_HEADER_SIZE + files.ptr[i].name.len + files.ptr[i].file.len;
+  }
+  if (size_bytes > spool->max_size_bytes) return "Profile is larger than the maximum spool size";
+
+  // Held until the profile is written, so the room we make doesn't get taken by someone else
+  lock_for_writing(spool);
+
+  const char *error = make_room(spool, size_bytes);
+  if (error != NULL) {
+    pthread_mutex_unlock(&spool->write_mutex);
+    return error;
+  }
+
+  char name[128];
+  snprintf(
+    name,
+    sizeof(name),
+    SPOOLED_PROFILE_PREFIX "%020" PRIu64 "-%ld-%u",
+    (uint64_t) finish.seconds * 1000000000 + finish.nanoseconds,
+    (long) getpid(),
+    __atomic_add_fetch(&spooled_profiles_count, 1, __ATOMIC_SEQ_CST)
+  );
+
+  char *path = join_path(spool->directory, name, "");
+  // Hidden, so that it does not get picked up (nor dropped, unless it gets left behind) until it's complete
+  char *temporary_path = join_path(spool->directory, ".", name);
+  if (path == NULL || temporary_path == NULL) {
+    pthread_mutex_unlock(&spool->write_mutex);
+    free(path);
+    free(temporary_path);
+    return "Failed to allocate spool path";
+  }
+
+  int fd = open(temporary_path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    pthread_mutex_unlock(&spool->write_mutex);
+    free(path);
+    free(temporary_path);
+    return "Failed to create spool file";
+  }
+
+  uint8_t header[SPOOL_HEADER_SIZE];
+  uint32_t tags_length = encoded_tags.len;
+  uint32_t files_count = files.len;
+  uint8_t *next = put(header, SPOOL_MAGIC, SPOOL_MAGIC_SIZE);
+  next = put(next, &start.seconds, sizeof(start.seconds));
+  next = put(next, &start.nanoseconds, sizeof(start.nanoseconds));
+  next = put(next, &finish.seconds, sizeof(finish.seconds));
+  next = put(next, &finish.nanoseconds, sizeof(finish.nanoseconds));
+  next = put(next, &tags_length, sizeof(tags_length));
+  put(next, &files_count, sizeof(files_count));
+
+  bool written =
+    write_fully(fd, header, sizeof(header)) &&
+    write_fully(fd, encoded_tags.ptr, encoded_tags.len);
+
+  for (uintptr_t i = 0; written && i < files.len; i++) {
+    ddprof_ffi_File file = files.ptr[i];
+    uint8_t file_header[SPOOL_FILE_HEADER_SIZE];
+    uint32_t name_length = file.name.len;
+    uint64_t contents_length = file.file.len;
+    put(put(file_header, &name_length, sizeof(name_length)), &contents_length, sizeof(contents_length));
+
+    written =
+      write_fully(fd, file_header, sizeof(file_header)) &&
+      write_fully(fd, file.name.ptr, file.name.len) &&
+      write_fully(fd, file.file.ptr, file.file.len);
+  }
+
+  written = (close(fd) == 0) && written;
+  bool renamed = written && rename(temporary_path, path) == 0;
+
+  if (!renamed) unlink(temporary_path);
+  pthread_mutex_unlock(&spool->write_mutex);
+  free(path);
+  free(temporary_path);
+
+  return renamed ? NULL : "Failed to write spool file";
+}
+
+spooled_profile *spool_claim_oldest(spool *spool) {
+  for (int attempt = 0; attempt < MAX_CLAIM_ATTEMPTS; attempt++) {
+    spool_entry *entries;
+    size_t entries_count;
+    if (!list_entries(spool->directory, &entries, &entries_count)) return NULL;
+
+    const char *oldest = NULL;
+    for (size_t i = 0; i < entries_count; i++) {
+      if (!is_spooled_profile(entries[i].name)) continue;
+      if (oldest == NULL || strcmp(entries[i].name, oldest) < 0) oldest = entries[i].name;
+    }
+
+    spooled_profile *profile = oldest == NULL ? NULL : calloc(1, sizeof(spooled_profile));
+    if (profile != NULL) {
+      profile->spooled_path = join_path(spool->directory, oldest, "");
+      profile->claimed_path = join_path(spool->directory, oldest, CLAIMED_SUFFIX);
+    }
+    free_entries(entries, entries_count);
+
+    if (profile == NULL) return NULL;
+    if (profile->spooled_path == NULL || profile->claimed_path == NULL) {
+      free(profile->spooled_path);
+      free(profile->claimed_path);
+      free(profile);
+      return NULL;
+    }
+
+    // If this fails, someone else claimed (or dropped) it first, so we move on to the next one
+    bool claimed = rename(profile->spooled_path, profile->claimed_path) == 0;
+    // Renaming keeps the modification time, which for claimed profiles should be when they got claimed (see make_room)
+    if (claimed) utimensat(AT_FDCWD, profile->claimed_path, NULL, 0);
+
+    size_t size = 0;
+    bool valid =
+      claimed &&
+      read_file(profile->claimed_path, &profile->contents, &size) &&
+      parse_spooled_profile(profile, size);
+
+    if (valid) return profile;
+
+    // Spooled profiles that can't be read would never be reported, so we get rid of them
+    if (claimed) unlink(profile->claimed_path);
+    free(profile->contents);
+    free(profile->spooled_path);
+    free(profile->claimed_path);
+    free(profile);
+  }
+
+  return NULL;
+}
+
+void spooled_profile_finish(spooled_profile *profile, bool reported) {
+  if (reported) {
+    unlink(profile->claimed_path);
+  } else {
+    rename(profile->claimed_path, profile->spooled_path);
+  }
+
+  free(profile->contents);
+  free(profile->spooled_path);
+  free(profile->claimed_path);
+  free(profile);
+}
+
+bool spool_should_keep(ddprof_ffi_SendResult result) {
+  return result.tag == DDPROF_FFI_SEND_RESULT_FAILURE || result.http_response.code >= 500;
+}
+
+// Threads don't survive `fork`, so if one of them was writing to the spool when the process forked, the mutex would
+// stay locked forever in the child. As with the upload queue, we start over when used from a child process.
+static void lock_for_writing(spool *spool) {
+  if (spool->write_mutex_pid != getpid()) {
+    pthread_mutex_init(&spool->write_mutex, NULL);
+    spool->write_mutex_pid = getpid();
+  }
+
+  pthread_mutex_lock(&spool->write_mutex);
+}
+
+// Drops stale claimed and temporary files, and then the oldest spooled profiles until there's room for `needed_bytes`
+// more. Must be called while holding the write mutex.
+static const char *make_room(spool *spool, uint64_t needed_bytes) {
+  spool_entry *entries;
+  size_t entries_count;
+  if (!list_entries(spool->directory, &entries, &entries_count)) return "Failed to list spool directory";
+
+  uint64_t total_size_bytes = 0;
+  for (size_t i = 0; i < entries_count; i++) total_size_bytes += entries[i].size_bytes;
+
+  time_t now = time(NULL);
+  for (size_t i = 0; i < entries_count; i++) {
+    if (is_spooled_profile(entries[i].name) || now - entries[i].changed_at < STALE_FILE_SECONDS) continue;
+    if (remove_entry(spool, &entries[i])) total_size_bytes -= entries[i].size_bytes;
+  }
+
+  qsort(entries, entries_count, sizeof(spool_entry), compare_entries);
+
+  for (size_t i = 0; i < entries_count && total_size_bytes + needed_bytes > spool->max_size_bytes; i++) {
+    // Someone else is reporting (or writing) it, or it was already removed above
+    if (!is_spooled_profile(entries[i].name)) continue;
+    if (remove_entry(spool, &entries[i])) total_size_bytes -= entries[i].size_bytes;
+  }
+
+  free_entries(entries, entries_count);
+
+  return total_size_bytes + needed_bytes > spool->max_size_bytes ? "Failed to make room in spool directory" : NULL;
+}
+
+// Spooled profiles that are neither claimed nor still being written
+static bool is_spooled_profile(const char *name) {
+  return
+    strncmp(name, SPOOLED_PROFILE_PREFIX, strlen(SPOOLED_PROFILE_PREFIX)) == 0 && !has_suffix(name, CLAIMED_SUFFIX);
+}
+
+static bool remove_entry(spool *spool, spool_entry *entry) {
+  char *path = join_path(spool->directory, entry->name, "");
+  // If it's already gone, someone else dropped (or reported) it, which makes room just the same
+  bool removed = path != NULL && (unlink(path) == 0 || errno == ENOENT);
+  free(path);
+  return removed;
+}
+
+// Lists everything in the `directory` that belongs to the spool (spooled profiles, claimed or not, and temporary
+// files), in no particular order
+static bool list_entries(const char *directory, spool_entry **entries, size_t *entries_count) {
+  DIR *dir = opendir(directory);
+  if (dir == NULL) return false;
+
+  size_t capacity = 16;
+  *entries = malloc(capacity * sizeof(spool_entry));
+  *entries_count = 0;
+  bool success = *entries != NULL;
+
+  struct dirent *entry;
+  while (success && (entry = readdir(dir)) != NULL) {
+    if (
+      strncmp(entry->d_name, SPOOLED_PROFILE_PREFIX, strlen(SPOOLED_PROFILE_PREFIX)) != 0 &&
+      strncmp(entry->d_name, TEMPORARY_PREFIX, strlen(TEMPORARY_PREFIX)) != 0
+    ) {
+      continue;
+    }
+
+    struct stat entry_stat;
+    if (fstatat(dirfd(dir), entry->d_name, &entry_stat, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(entry_stat.st_mode)) {
+      continue;
+    }
+
+    if (*entries_count == capacity) {
+      spool_entry *grown_entries = realloc(*entries, 2 * capacity * sizeof(spool_entry));
+      if (grown_entries == NULL) {
+        success = false;
+        break;
+      }
+      *entries = grown_entries;
+      capacity *= 2;
+    }
+
+    char *name = strdup(entry->d_name);
+    if (name == NULL) {
+      success = false;
+      break;
+    }
+    (*entries)[(*entries_count)++] =
+      (spool_entry) {.name = name, .size_bytes = entry_stat.st_size, .changed_at = entry_stat.st_mtime};
+  }
+
+  closedir(dir);
+
+  if (!success) {
+    if (*entries != NULL) free_entries(*entries, *entries_count);
+    *entries = NULL;
+    *entries_count = 0;
+  }
+
+  return success;
+}
+
+static void free_entries(spool_entry *entries, size_t entries_count) {
+  for (size_t i = 0; i < entries_count; i++) free(entries[i].name);
+  free(entries);
+}
+
+static int compare_entries(const void *left, const void *right) {
+  return strcmp(((const spool_entry *) left)->name, ((const spool_entry *) right)->name);
+}
+
+static bool has_suffix(const char *name, const char *suffix) {
+  size_t name_length = strlen(name);
+  size_t suffix_length = strlen(suffix);
+  return name_length >= suffix_length && strcmp(name + name_length - suffix_length, suffix) == 0;
+}
+
+// Returns `directory`/`name``suffix` (which must be freed), or NULL if out of memory
+static char *join_path(const char *directory, const char *name, const char *suffix) {
+  size_t length = strlen(directory) + 1 + strlen(name) + strlen(suffix) + 1;
+  char *path = malloc(length);
+  if (path != NULL) snprintf(path, length, "%s/%s%s", directory, name, suffix);
+  return path;
+}
+
+static bool write_fully(int fd, const void *data, size_t size) {
+  const uint8_t *next = data;
+
+  while (size > 0) {
+    ssize_t written = write(fd, next, size);
+    if (written == -1 && errno == EINTR) continue;
+    if (written <= 0) return false;
+
+    next += written;
+    size -= written;
+  }
+
+  return true;
+}
+
+static bool read_file(const char *path, uint8_t **contents, size_t *size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+
+  struct stat file_stat;
+  bool success = fstat(fd, &file_stat) == 0;
+
+  *size = success ? file_stat.st_size : 0;
+  *contents = success ? malloc(*size > 0 ? *size : 1) : NULL;
+  success = *contents != NULL;
+
+  size_t read_so_far = 0;
+  while (success && read_so_far < *size) {
+    ssize_t bytes_read = read(fd, *contents + read_so_far, *size - read_so_far);
+    if (bytes_read == -1 && errno == EINTR) continue;
+    if (bytes_read <= 0) success = false;
+    else read_so_far += bytes_read;
+  }
+
+  close(fd);
+
+  return success;
+}
+
+// Points the profile's files (and timestamps and tags) at its `contents`; returns false if they're not a valid spooled
+// profile
+static bool parse_spooled_profile(spooled_profile *profile, size_t size) {
+  const uint8_t *contents = profile->contents;
+
+  if (size < SPOOL_HEADER_SIZE || memcmp(contents, SPOOL_MAGIC, SPOOL_MAGIC_SIZE) != 0) return false;
+
+  uint32_t tags_length;
+  uint32_t files_count;
+  size_t offset = SPOOL_MAGIC_SIZE;
+  memcpy(&profile->start.seconds, contents + offset, sizeof(profile->start.seconds));
+  offset += sizeof(profile->start.seconds);
+  memcpy(&profile->start.nanoseconds, contents + offset, sizeof(profile->start.nanoseconds));
+  offset += sizeof(profile->start.nanoseconds);
+  memcpy(&profile->finish.seconds, contents + offset, sizeof(profile->finish.seconds));
+  offset += sizeof(profile->finish.seconds);
+  memcpy(&profile->finish.nanoseconds, contents + offset, sizeof(profile->finish.nanoseconds));
+  offset += sizeof(profile->finish.nanoseconds);
+  memcpy(&tags_length, contents + offset, sizeof(tags_length));
+  offset += sizeof(tags_length);
+  memcpy(&files_count, contents + offset, sizeof(files_count));
+  offset += sizeof(files_count);
+
+  if (files_count == 0 || files_count > MAX_SPOOLED_FILES || size - offset < tags_length) return false;
+
+  profile->encoded_tags = (ddprof_ffi_ByteSlice) {.ptr = contents + offset, .len = tags_length};
+  offset += tags_length;
+
+  for (uint32_t i = 0; i < files_count; i++) {
+    if (size - offset < SPOOL_FILE_HEADER_SIZE) return false;
+
+    uint32_t name_length;
+    uint64_t contents_length;
+    memcpy(&name_length, contents + offset, sizeof(name_length));
+    memcpy(&contents_length, contents + offset + sizeof(name_length), sizeof(contents_length));
+    offset += SPOOL_FILE_HEADER_SIZE;
+
+    if (size - offset < name_length || size - offset - name_length < contents_length) return false;
+
+    profile->files_storage[i].name =
+      (ddprof_ffi_CharSlice) {.ptr = (const char *) contents + offset, .len = name_length};
+    offset += name_length;
+    profile->files_storage[i].file = (ddprof_ffi_ByteSlice) {.ptr = contents + offset, .len = contents_length};
+    offset += contents_length;
+  }
+
+  profile->files = (ddprof_ffi_Slice_file) {.ptr = profile->files_storage, .len = files_count};
+
+  return offset == size;
+}
+
+static uint8_t *put(uint8_t *destination, const void *source, size_t size) {
+  memcpy(destination, source, size);
+  return destination + size;
+}
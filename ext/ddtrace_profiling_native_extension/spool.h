@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <ddprof/ffi.h>
+
+// Everything in this file can be used from any thread, and none of it needs (nor uses) the Global VM Lock or any
+// other Ruby APIs. See spool.c for details.
+
+#define SPOOL_FAILURE_PREFIX "Failed to spool profile: "
+
+// A directory where profiles that could not be reported get kept, so that they can be reported later. It's shared
+// (reference counted) by everyone writing to it from this process, so that they all stay within the same maximum size.
+typedef struct spool spool;
+
+// Copies the `directory`. Returns NULL if out of memory.
+spool *spool_new(const char *directory, uint64_t max_size_bytes);
+void spool_retain(spool *spool);
+void spool_release(spool *spool);
+
+// Tags get spooled along with each profile, so that it gets reported back with the same tags it would have been
+// reported with. They're encoded as a sequence of NUL-terminated names, each followed by its NUL-terminated value.
+//
+// Returns the `encoded_tags` as libddprof tags, which must be dropped with ddprof_ffi_Vec_tag_drop. Tags that libddprof
+// rejects get skipped.
+ddprof_ffi_Vec_tag spool_decode_tags(ddprof_ffi_ByteSlice encoded_tags);
+
+// Writes a profile (along with its `encoded_tags`) to the spool, first removing the oldest spooled profiles if needed
+// to stay within the maximum size. Returns NULL on success, or a description of what went wrong (a static string, which
+// gets reported with the SPOOL_FAILURE_PREFIX).
+const char *spool_write(
+  spool *spool,
+  ddprof_ffi_Timespec start,
+  ddprof_ffi_Timespec finish,
+  ddprof_ffi_Slice_file files,
+  ddprof_ffi_ByteSlice encoded_tags
+);
+
+// A profile read back from the spool. While it exists, no one else will try to report it.
+typedef struct {
+  ddprof_ffi_Timespec start;
+  ddprof_ffi_Timespec finish;
+  ddprof_ffi_ByteSlice encoded_tags; // Points into `contents`, see spool_decode_tags
+  ddprof_ffi_Slice_file files; // Point into `contents`
+  ddprof_ffi_File files_storage[2];
+  uint8_t *contents;
+  char *claimed_path;
+  char *spooled_path;
+} spooled_profile;
+
+// Returns the oldest profile in the spool, or NULL if there are none (or they can't be read)
+spooled_profile *spool_claim_oldest(spool *spool);
+// If `reported`, the profile gets removed from the spool; otherwise it's put back, to be retried later.
+// Frees the `spooled_profile`.
+void spooled_profile_finish(spooled_profile *profile, bool reported);
+
+// Profiles that failed to be reported because the agent (or intake) was unreachable or unavailable are worth spooling;
+// others (e.g. rejected with a 4xx) would just fail again
+bool spool_should_keep(ddprof_ffi_SendResult result);
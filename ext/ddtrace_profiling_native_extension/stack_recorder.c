@@ -1,29 +1,125 @@
 #include <ruby.h>
 #include <ruby/thread.h>
+#include <time.h>
 #include "stack_recorder.h"
 #include "libddprof_helpers.h"
+#include "pprof_compression.h"
 #include "ruby_helpers.h"
+#include "sample_aggregation.h"
+#include "serialized_profile.h"
 
 // Used to wrap a ddprof_ffi_Profile in a Ruby object and expose Ruby-level serialization APIs
 // This file implements the native bits of the Datadog::Profiling::StackRecorder class
+//
+// The recorder keeps two profiles ("slots"): samples always get recorded into the active slot, and serializing swaps the
+// slots and then serializes (and resets) the now-inactive slot with the Global VM Lock released. Thus, samples recorded
+// while a serialization is in progress go into the other slot, rather than racing with it (or getting dropped by the
+// reset afterwards).
+//
+// Samples can only be recorded while holding the GVL (see `record_sample`), and the swap also happens while holding
+// the GVL, so no other synchronization is needed.
+//
+// When enabled, samples are not added to the active slot right away: they first get summed up by stack and labels in
+// an aggregation table (see sample_aggregation.c), which gets flushed into the active slot right before the swap.
+// Either way, the table caps how many distinct samples (and how many bytes for their stacks and labels) each profile
+// can have; when not aggregating, it only keeps track of the samples that were added to the active slot.
+//
+// Each recorder only keeps the value types it was configured with. Collectors always pass in values for all of the
+// `all_value_types` (see stack_recorder.h), which record_sample then maps to this recorder's positions, via
+// `value_type_positions`.
+//
+// When configured with a compression codec, serialized pprofs also get compressed (see pprof_compression.c) while the
+// Global VM Lock is still released, so that they're handed over to Ruby ready to be reported.
 
 static VALUE ok_symbol = Qnil; // :ok in Ruby
 static VALUE error_symbol = Qnil; // :error in Ruby
 
 static ID ruby_time_from_id; // id of :ruby_time_from in Ruby
+static ID gzip_id; // id of :gzip in Ruby
+static ID zstd_id; // id of :zstd in Ruby
 
 static VALUE stack_recorder_class = Qnil;
 
+// Used to give every flushed profile a distinct epoch, see `recorder_epoch` below
+static uint64_t last_epoch = 0;
+
+// Collectors that only record some of their samples later (e.g. see `sample_thread_deferred`) use these hooks to make
+// sure everything they gathered gets recorded before the profile gets serialized
+#define MAX_BEFORE_SERIALIZE_HOOKS 4
+
+#define PROFILE_SLOTS 2
+#define VALUE_TYPE_DISABLED -1
+
+struct before_serialize_hook {
+  recorder_before_serialize_hook hook;
+  VALUE hook_owner;
+};
+
+struct stack_recorder_state {
+  // Note: Places in this file that usually need to be changed when this struct is changed are tagged with
+  // "Update this when modifying state struct"
+  ddprof_ffi_Profile *profile_slots[PROFILE_SLOTS];
+  int active_slot;
+  // Set when the inactive slot has samples that still need to be serialized (e.g. because a previous serialization was
+  // interrupted), in which case the next serialization picks them up instead of swapping slots again
+  bool inactive_slot_pending;
+  bool serialization_in_progress;
+  // We track the start/finish of each profile ourselves, rather than relying on libddprof, so that a profile always
+  // finishes at exactly the same time the next one starts (see _native_serialize)
+  ddprof_ffi_Timespec slot_start[PROFILE_SLOTS];
+  ddprof_ffi_Timespec inactive_slot_finish;
+  aggregation_table *aggregation_table;
+  // Indexed by the *_VALUE_POS in stack_recorder.h; VALUE_TYPE_DISABLED for the value types this recorder doesn't keep
+  int value_type_positions[ALL_VALUE_TYPES_COUNT];
+  unsigned int enabled_value_types_count;
+  uint64_t epoch;
+  pprof_compression_codec compression_codec;
+  int compression_level;
+  // Totals across every profile this recorder compressed, see _native_stats
+  unsigned long compressed_profiles;
+  unsigned long compression_failures;
+  pprof_compression_stats compression_totals;
+  // Times the inactive slot couldn't be reset after being serialized; its samples get dropped at the next swap instead
+  unsigned long reset_failures;
+  struct before_serialize_hook before_serialize_hooks[MAX_BEFORE_SERIALIZE_HOOKS];
+  int before_serialize_hooks_count;
+};
+
 struct call_serialize_without_gvl_arguments {
   ddprof_ffi_Profile *profile;
+  pprof_compression_codec compression_codec;
+  int compression_level;
   ddprof_ffi_SerializeResult result;
+  // Only set if serialization succeeded, in which case it owns the result's buffer (or the compressed version of it)
+  pprof_buffer pprof;
+  const char *compression_error;
+  pprof_compression_stats compression_stats;
+  bool reset_succeeded;
   bool serialize_ran;
 };
 
 static VALUE _native_new(VALUE klass);
+static void stack_recorder_typed_data_mark(void *state_ptr);
 static void stack_recorder_typed_data_free(void *data);
+static size_t stack_recorder_typed_data_size(const void *state_ptr);
+static VALUE _native_initialize(
+  VALUE self,
+  VALUE recorder_instance,
+  VALUE enabled_value_types,
+  VALUE aggregate_samples,
+  VALUE max_aggregated_samples,
+  VALUE max_aggregated_bytes,
+  VALUE pprof_compression,
+  VALUE pprof_compression_level
+);
+static void create_profiles(struct stack_recorder_state *state);
+static ddprof_ffi_Timespec timespec_now(void);
+static void free_profiles(struct stack_recorder_state *state);
 static VALUE _native_serialize(VALUE self, VALUE recorder_instance);
+static VALUE _native_stats(VALUE self, VALUE recorder_instance);
 static VALUE ruby_time_from(ddprof_ffi_Timespec ddprof_time);
+static VALUE serialize_inactive_slot(VALUE state_ptr);
+static VALUE finish_serialization(VALUE state_ptr);
 static void *call_serialize_without_gvl(void *call_args);
 
 void stack_recorder_init(VALUE profiling_module) {
@@ -39,44 +135,269 @@ void stack_recorder_init(VALUE profiling_module) {
   // https://bugs.ruby-lang.org/issues/18007 for a discussion around this.
   rb_define_alloc_func(stack_recorder_class, _native_new);
 
+  rb_define_singleton_method(stack_recorder_class, "_native_initialize", _native_initialize, 7);
   rb_define_singleton_method(stack_recorder_class, "_native_serialize",  _native_serialize, 1);
+  rb_define_singleton_method(stack_recorder_class, "_native_stats", _native_stats, 1);
 
   ok_symbol = ID2SYM(rb_intern_const("ok"));
   error_symbol = ID2SYM(rb_intern_const("error"));
   ruby_time_from_id = rb_intern_const("ruby_time_from");
+  gzip_id = rb_intern_const("gzip");
+  zstd_id = rb_intern_const("zstd");
+
+  VALUE value_types = rb_ary_new_capa(ALL_VALUE_TYPES_COUNT);
+  for (unsigned int i = 0; i < ALL_VALUE_TYPES_COUNT; i++) {
+    rb_ary_push(value_types, rb_obj_freeze(rb_str_new(all_value_types[i].type_.ptr, all_value_types[i].type_.len)));
+  }
+  rb_define_const(stack_recorder_class, "VALUE_TYPES", rb_obj_freeze(value_types));
+
+  // Depends on which compression libraries were available when building, see extconf.rb
+  VALUE available_pprof_compressions = rb_ary_new();
+  if (pprof_compression_available(PPROF_COMPRESSION_GZIP)) rb_ary_push(available_pprof_compressions, ID2SYM(gzip_id));
+  if (pprof_compression_available(PPROF_COMPRESSION_ZSTD)) rb_ary_push(available_pprof_compressions, ID2SYM(zstd_id));
+  rb_define_const(stack_recorder_class, "AVAILABLE_PPROF_COMPRESSIONS", rb_obj_freeze(available_pprof_compressions));
 }
 
-// This structure is used to define a Ruby object that stores a pointer to a ddprof_ffi_Profile instance
+// This structure is used to define a Ruby object that stores a pointer to a struct stack_recorder_state
 // See also https://github.com/ruby/ruby/blob/master/doc/extension.rdoc for how this works
 static const rb_data_type_t stack_recorder_typed_data = {
   .wrap_struct_name = "Datadog::Profiling::StackRecorder",
   .function = {
+    .dmark = stack_recorder_typed_data_mark,
     .dfree = stack_recorder_typed_data_free,
-    .dsize = NULL, // We don't track profile memory usage (although it'd be cool if we did!)
-    // No need to provide dmark nor dcompact because we don't directly reference Ruby VALUEs from inside this object
+    .dsize = stack_recorder_typed_data_size,
+    // No need to provide dcompact because the Ruby VALUEs we reference (the hook owners, and the frames and strings in
+    // the aggregation table) are pinned
   },
   .flags = RUBY_TYPED_FREE_IMMEDIATELY
 };
 
 static VALUE _native_new(VALUE klass) {
-  ddprof_ffi_Slice_value_type sample_types = {.ptr = enabled_value_types, .len = ENABLED_VALUE_TYPES_COUNT};
+  struct stack_recorder_state *state = ruby_xcalloc(1, sizeof(struct stack_recorder_state));
+
+  // Update this when modifying state struct
+  // All value types start enabled; _native_initialize then keeps only the ones configured
+  for (unsigned int i = 0; i < ALL_VALUE_TYPES_COUNT; i++) state->value_type_positions[i] = i;
+  state->enabled_value_types_count = ALL_VALUE_TYPES_COUNT;
+  create_profiles(state);
+  state->active_slot = 0;
+  state->inactive_slot_pending = false;
+  state->serialization_in_progress = false;
+  state->aggregation_table = NULL; // Set by _native_initialize
+  state->epoch = ++last_epoch;
+  state->compression_codec = PPROF_COMPRESSION_NONE; // Set by _native_initialize
+  state->compression_level = PPROF_COMPRESSION_DEFAULT_LEVEL;
+  state->compressed_profiles = 0;
+  state->compression_failures = 0;
+  state->reset_failures = 0;
+  state->compression_totals = (pprof_compression_stats) {0};
+  state->before_serialize_hooks_count = 0;
+
+  return TypedData_Wrap_Struct(klass, &stack_recorder_typed_data, state);
+}
+
+static void stack_recorder_typed_data_mark(void *state_ptr) {
+  struct stack_recorder_state *state = (struct stack_recorder_state *) state_ptr;
+
+  // Update this when modifying state struct
+  for (int i = 0; i < state->before_serialize_hooks_count; i++) rb_gc_mark(state->before_serialize_hooks[i].hook_owner);
+  if (state->aggregation_table != NULL) aggregation_table_mark(state->aggregation_table);
+}
+
+static void stack_recorder_typed_data_free(void *state_ptr) {
+  struct stack_recorder_state *state = (struct stack_recorder_state *) state_ptr;
+
+  // Update this when modifying state struct
+  free_profiles(state);
+  if (state->aggregation_table != NULL) aggregation_table_free(state->aggregation_table);
+
+  ruby_xfree(state);
+}
+
+// Note that libddprof does not tell us how much memory each profile is using, so this only covers our own structures.
+static size_t stack_recorder_typed_data_size(const void *state_ptr) {
+  const struct stack_recorder_state *state = (const struct stack_recorder_state *) state_ptr;
+
+  // Update this when modifying state struct
+  size_t size = sizeof(struct stack_recorder_state);
+  if (state->aggregation_table != NULL) size += aggregation_table_stats_for(state->aggregation_table).memory_bytes;
+
+  return size;
+}
+
+// `enabled_value_types` is an array with the names of the value types to keep (see VALUE_TYPES).
+// `max_aggregated_samples` and `max_aggregated_bytes` cap each profile, whether or not `aggregate_samples` is set.
+// `pprof_compression` is nil (no compression) or one of AVAILABLE_PPROF_COMPRESSIONS; a nil `pprof_compression_level`
+// picks the codec's default.
+//
+// Any samples recorded before this gets called are discarded.
+static VALUE _native_initialize(
+  VALUE self,
+  VALUE recorder_instance,
+  VALUE enabled_value_types,
+  VALUE aggregate_samples,
+  VALUE max_aggregated_samples,
+  VALUE max_aggregated_bytes,
+  VALUE pprof_compression,
+  VALUE pprof_compression_level
+) {
+  struct stack_recorder_state *state;
+  TypedData_Get_Struct(recorder_instance, struct stack_recorder_state, &stack_recorder_typed_data, state);
+
+  Check_Type(enabled_value_types, T_ARRAY);
+  ENFORCE_BOOLEAN(aggregate_samples);
+  unsigned int max_entries = NUM2UINT(max_aggregated_samples);
+  size_t max_keys_bytes = NUM2SIZET(max_aggregated_bytes);
+
+  if (max_entries == 0 || max_keys_bytes == 0) {
+    rb_raise(rb_eArgError, "max_aggregated_samples and max_aggregated_bytes must be positive");
+  }
+
+  if (state->serialization_in_progress) rb_raise(rb_eRuntimeError, "Cannot initialize StackRecorder while serializing");
 
-  ddprof_ffi_Profile *profile = ddprof_ffi_Profile_new(sample_types, NULL /* Period is optional */);
+  // Validate everything before changing the state, so we never leave it half-configured
+  bool enabled[ALL_VALUE_TYPES_COUNT] = {false};
+  for (long i = 0; i < RARRAY_LEN(enabled_value_types); i++) {
+    VALUE name = rb_ary_entry(enabled_value_types, i);
+    Check_Type(name, T_STRING);
 
-  return TypedData_Wrap_Struct(klass, &stack_recorder_typed_data, profile);
+    unsigned int type = 0;
+    while (
+      type < ALL_VALUE_TYPES_COUNT &&
+      !(all_value_types[type].type_.len == (uintptr_t) RSTRING_LEN(name) &&
+        memcmp(all_value_types[type].type_.ptr, RSTRING_PTR(name), RSTRING_LEN(name)) == 0)
+    ) type++;
+
+    if (type == ALL_VALUE_TYPES_COUNT) rb_raise(rb_eArgError, "Unknown value type: %"PRIsVALUE, name);
+    if (enabled[type]) rb_raise(rb_eArgError, "Duplicate value type: %"PRIsVALUE, name);
+    enabled[type] = true;
+  }
+  if (RARRAY_LEN(enabled_value_types) == 0) rb_raise(rb_eArgError, "At least one value type must be enabled");
+
+  pprof_compression_codec compression_codec = PPROF_COMPRESSION_NONE;
+  if (!NIL_P(pprof_compression)) {
+    Check_Type(pprof_compression, T_SYMBOL);
+    ID compression_id = SYM2ID(pprof_compression);
+
+    if (compression_id == gzip_id) compression_codec = PPROF_COMPRESSION_GZIP;
+    else if (compression_id == zstd_id) compression_codec = PPROF_COMPRESSION_ZSTD;
+    else rb_raise(rb_eArgError, "Unknown pprof compression: %"PRIsVALUE, pprof_compression);
+  }
+  int compression_level =
+    NIL_P(pprof_compression_level) ? PPROF_COMPRESSION_DEFAULT_LEVEL : NUM2INT(pprof_compression_level);
+
+  const char *compression_error = pprof_compression_validate(compression_codec, compression_level);
+  if (compression_error != NULL) rb_raise(rb_eArgError, "%s: %"PRIsVALUE, compression_error, pprof_compression);
+
+  if (state->aggregation_table != NULL) {
+    aggregation_table_free(state->aggregation_table);
+    state->aggregation_table = NULL;
+  }
+
+  // Positions follow the order in all_value_types, rather than the order they were given in
+  state->enabled_value_types_count = 0;
+  for (unsigned int i = 0; i < ALL_VALUE_TYPES_COUNT; i++) {
+    state->value_type_positions[i] = enabled[i] ? (int) state->enabled_value_types_count++ : VALUE_TYPE_DISABLED;
+  }
+
+  free_profiles(state);
+  create_profiles(state);
+  state->inactive_slot_pending = false;
+  state->epoch = ++last_epoch;
+  state->compression_codec = compression_codec;
+  state->compression_level = compression_level;
+
+  state->aggregation_table = aggregation_table_new(
+    max_entries, max_keys_bytes, state->enabled_value_types_count, aggregate_samples == Qtrue
+  );
+
+  return Qtrue;
 }
 
-static void stack_recorder_typed_data_free(void *data) {
-  ddprof_ffi_Profile_free((ddprof_ffi_Profile *) data);
+static void create_profiles(struct stack_recorder_state *state) {
+  ddprof_ffi_ValueType enabled_types[ALL_VALUE_TYPES_COUNT];
+  for (unsigned int i = 0; i < ALL_VALUE_TYPES_COUNT; i++) {
+    if (state->value_type_positions[i] != VALUE_TYPE_DISABLED) enabled_types[state->value_type_positions[i]] = all_value_types[i];
+  }
+  ddprof_ffi_Slice_value_type sample_types = {.ptr = enabled_types, .len = state->enabled_value_types_count};
+
+  ddprof_ffi_Timespec now = timespec_now();
+  for (int i = 0; i < PROFILE_SLOTS; i++) {
+    state->profile_slots[i] = ddprof_ffi_Profile_new(sample_types, NULL /* Period is optional */);
+    state->slot_start[i] = now;
+  }
+  state->inactive_slot_finish = now;
+}
+
+static ddprof_ffi_Timespec timespec_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (ddprof_ffi_Timespec) {.seconds = now.tv_sec, .nanoseconds = now.tv_nsec};
+}
+
+static void free_profiles(struct stack_recorder_state *state) {
+  for (int i = 0; i < PROFILE_SLOTS; i++) ddprof_ffi_Profile_free(state->profile_slots[i]);
 }
 
 static VALUE _native_serialize(VALUE self, VALUE recorder_instance) {
-  ddprof_ffi_Profile *profile;
-  TypedData_Get_Struct(recorder_instance, ddprof_ffi_Profile, &stack_recorder_typed_data, profile);
+  struct stack_recorder_state *state;
+  TypedData_Get_Struct(recorder_instance, struct stack_recorder_state, &stack_recorder_typed_data, state);
+
+  // This can only happen if several Ruby threads are serializing the same recorder at the same time
+  if (state->serialization_in_progress) {
+    return rb_ary_new_from_args(2, error_symbol, rb_str_new_cstr("Another serialization is already in progress"));
+  }
+
+  for (int i = 0; i < state->before_serialize_hooks_count; i++) {
+    state->before_serialize_hooks[i].hook(state->before_serialize_hooks[i].hook_owner);
+  }
 
-  // We'll release the Global VM Lock while we're calling serialize, so that the Ruby VM can continue to work while this
-  // is pending
-  struct call_serialize_without_gvl_arguments args = {.profile = profile, .serialize_ran = false};
+  if (!state->inactive_slot_pending) {
+    int next_active_slot = (state->active_slot + 1) % PROFILE_SLOTS;
+
+    if (state->aggregation_table != NULL) {
+      aggregation_table_flush(state->aggregation_table, state->profile_slots[state->active_slot]);
+    }
+
+    // The next active slot is usually empty already (it got reset when it was last serialized), so this is cheap. We
+    // still need it to drop anything left over from a failed serialization or a failed reset.
+    if (!ddprof_ffi_Profile_reset(state->profile_slots[next_active_slot])) {
+      return rb_ary_new_from_args(2, error_symbol, rb_str_new_cstr("Failed to reset profile"));
+    }
+
+    // The same timestamp is used for both, so there are no gaps (or overlaps) between consecutive profiles
+    ddprof_ffi_Timespec now = timespec_now();
+    state->inactive_slot_finish = now;
+    state->slot_start[next_active_slot] = now;
+
+    state->active_slot = next_active_slot;
+    state->inactive_slot_pending = true;
+
+    // Let collectors know that anything they cached for the previous profile can be dropped
+    state->epoch = ++last_epoch;
+  }
+
+  state->serialization_in_progress = true;
+  return rb_ensure(serialize_inactive_slot, (VALUE) state, finish_serialization, (VALUE) state);
+}
+
+static VALUE serialize_inactive_slot(VALUE state_ptr) {
+  struct stack_recorder_state *state = (struct stack_recorder_state *) state_ptr;
+  int inactive_slot = (state->active_slot + 1) % PROFILE_SLOTS;
+  ddprof_ffi_Profile *inactive_profile = state->profile_slots[inactive_slot];
+
+  // This gets created before serializing, as creating it may raise, and we wouldn't want to leak the serialized profile
+  VALUE encoded_pprof = serialized_profile_new();
+
+  // We'll release the Global VM Lock while we're calling serialize, so that the Ruby VM (including the collectors,
+  // which keep recording into the active slot) can continue to work while this is pending
+  struct call_serialize_without_gvl_arguments args = {
+    .profile = inactive_profile,
+    .compression_codec = state->compression_codec,
+    .compression_level = state->compression_level,
+    .compression_error = NULL,
+    .serialize_ran = false,
+  };
 
   while (!args.serialize_ran) {
     // Give the Ruby VM an opportunity to process any pending interruptions (including raising exceptions).
@@ -85,6 +406,8 @@ static VALUE _native_serialize(VALUE self, VALUE recorder_instance) {
     //
     // Note that we run this in a loop because `rb_thread_call_without_gvl2` may return multiple times due to
     // pending interrupts until it actually runs our code.
+    //
+    // If this raises, the inactive slot is left untouched and gets serialized next time (see inactive_slot_pending).
     process_pending_interruptions(Qnil);
 
     // We use rb_thread_call_without_gvl2 here because unlike the regular _gvl variant, gvl2 does not process
@@ -92,6 +415,8 @@ static VALUE _native_serialize(VALUE self, VALUE recorder_instance) {
     rb_thread_call_without_gvl2(call_serialize_without_gvl, &args, /* No interruption function supported */ NULL, NULL);
   }
 
+  state->inactive_slot_pending = false;
+
   ddprof_ffi_SerializeResult serialized_profile = args.result;
 
   if (serialized_profile.tag == DDPROF_FFI_SERIALIZE_RESULT_ERR) {
@@ -100,20 +425,35 @@ static VALUE _native_serialize(VALUE self, VALUE recorder_instance) {
     return rb_ary_new_from_args(2, error_symbol, err_details);
   }
 
-  VALUE encoded_pprof = ruby_string_from_vec_u8(serialized_profile.ok.buffer);
+  // The serialized pprof is still valid; the leftover samples get dropped when this slot next becomes active
+  if (!args.reset_succeeded) state->reset_failures++;
+
+  if (args.compression_error != NULL) {
+    // The pprof is still reported, just uncompressed, see SerializedProfile#compression
+    state->compression_failures++;
+  } else if (state->compression_codec != PPROF_COMPRESSION_NONE) {
+    state->compressed_profiles++;
+    state->compression_totals.uncompressed_bytes += args.compression_stats.uncompressed_bytes;
+    state->compression_totals.compressed_bytes += args.compression_stats.compressed_bytes;
+    state->compression_totals.duration_ns += args.compression_stats.duration_ns;
+  }
+
+  // From here on, the pprof buffer belongs to (and gets freed by) encoded_pprof, so it doesn't leak in case
+  // ruby_time_from raises an exception
+  serialized_profile_adopt(encoded_pprof, args.pprof);
 
-  ddprof_ffi_Timespec ddprof_start = serialized_profile.ok.start;
-  ddprof_ffi_Timespec ddprof_finish = serialized_profile.ok.end;
+  VALUE start = ruby_time_from(state->slot_start[inactive_slot]);
+  VALUE finish = ruby_time_from(state->inactive_slot_finish);
 
-  // Clean up libddprof object to avoid leaking in case ruby_time_from raises an exception
-  ddprof_ffi_SerializeResult_drop(serialized_profile);
+  return rb_ary_new_from_args(2, ok_symbol, rb_ary_new_from_args(3, start, finish, encoded_pprof));
+}
 
-  VALUE start = ruby_time_from(ddprof_start);
-  VALUE finish = ruby_time_from(ddprof_finish);
+static VALUE finish_serialization(VALUE state_ptr) {
+  struct stack_recorder_state *state = (struct stack_recorder_state *) state_ptr;
 
-  if (!ddprof_ffi_Profile_reset(profile)) return rb_ary_new_from_args(2, error_symbol, rb_str_new_cstr("Failed to reset profile"));
+  state->serialization_in_progress = false;
 
-  return rb_ary_new_from_args(2, ok_symbol, rb_ary_new_from_args(3, start, finish, encoded_pprof));
+  return Qnil;
 }
 
 static VALUE ruby_time_from(ddprof_ffi_Timespec ddprof_time) {
@@ -126,17 +466,121 @@ static VALUE ruby_time_from(ddprof_ffi_Timespec ddprof_time) {
   #endif
 }
 
-void record_sample(VALUE recorder_instance, ddprof_ffi_Sample sample) {
-  ddprof_ffi_Profile *profile;
-  TypedData_Get_Struct(recorder_instance, ddprof_ffi_Profile, &stack_recorder_typed_data, profile);
+void record_sample(VALUE recorder_instance, ddprof_ffi_Sample sample, const sample_stack_identity *stack) {
+  struct stack_recorder_state *state;
+  TypedData_Get_Struct(recorder_instance, struct stack_recorder_state, &stack_recorder_typed_data, state);
+
+  int64_t values[ALL_VALUE_TYPES_COUNT] = {0};
+  bool has_enabled_values = false;
+  bool has_disabled_values = false;
+
+  for (uintptr_t i = 0; i < sample.values.len && i < ALL_VALUE_TYPES_COUNT; i++) {
+    int position = state->value_type_positions[i];
+
+    if (position == VALUE_TYPE_DISABLED) {
+      has_disabled_values |= sample.values.ptr[i] != 0;
+    } else {
+      values[position] = sample.values.ptr[i];
+      has_enabled_values |= sample.values.ptr[i] != 0;
+    }
+  }
+
+  // A sample with values only for disabled value types would just show up with all values at zero
+  if (has_disabled_values && !has_enabled_values) return;
+
+  sample.values = (ddprof_ffi_Slice_i64) {.ptr = values, .len = state->enabled_value_types_count};
 
-  ddprof_ffi_Profile_add(profile, sample);
+  // Samples without a stack identity (e.g. stacks that were too deep to fully capture) are rare enough that it's not
+  // worth aggregating (or capping) them by looking at every location, so they get added directly
+  bool add_directly = state->aggregation_table == NULL || stack == NULL ||
+    aggregation_table_add(state->aggregation_table, sample, stack);
+
+  if (add_directly) ddprof_ffi_Profile_add(state->profile_slots[state->active_slot], sample);
+}
+
+static VALUE _native_stats(VALUE self, VALUE recorder_instance) {
+  struct stack_recorder_state *state;
+  TypedData_Get_Struct(recorder_instance, struct stack_recorder_state, &stack_recorder_typed_data, state);
+
+  VALUE stats_as_hash = rb_hash_new();
+
+  rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("reset_failures")), ULONG2NUM(state->reset_failures));
+
+  if (state->aggregation_table != NULL) {
+    aggregation_table_stats stats = aggregation_table_stats_for(state->aggregation_table);
+    rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("aggregated_samples")), ULONG2NUM(stats.entries));
+    rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("max_aggregated_samples")), ULONG2NUM(stats.max_entries));
+    rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("merged_samples")), ULONG2NUM(stats.merged_samples));
+    rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("truncated_samples")), ULONG2NUM(stats.truncated_samples));
+    rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("max_aggregated_bytes")), SIZET2NUM(stats.max_keys_bytes));
+    rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("aggregation_memory_bytes")), SIZET2NUM(stats.memory_bytes));
+  }
+
+  if (state->compression_codec != PPROF_COMPRESSION_NONE) {
+    pprof_compression_stats totals = state->compression_totals;
+    rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("compressed_profiles")), ULONG2NUM(state->compressed_profiles));
+    rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("compression_failures")), ULONG2NUM(state->compression_failures));
+    rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("uncompressed_pprof_bytes")), SIZET2NUM(totals.uncompressed_bytes));
+    rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("compressed_pprof_bytes")), SIZET2NUM(totals.compressed_bytes));
+    rb_hash_aset(stats_as_hash, ID2SYM(rb_intern("compression_time_ns")), ULL2NUM(totals.duration_ns));
+    // How many times smaller the compressed pprofs were, overall
+    rb_hash_aset(
+      stats_as_hash,
+      ID2SYM(rb_intern("compression_ratio")),
+      totals.compressed_bytes > 0 ? DBL2NUM((double) totals.uncompressed_bytes / totals.compressed_bytes) : Qnil
+    );
+  }
+
+  return stats_as_hash;
+}
+
+void recorder_add_before_serialize_hook(VALUE recorder_instance, recorder_before_serialize_hook hook, VALUE hook_owner) {
+  struct stack_recorder_state *state;
+  TypedData_Get_Struct(recorder_instance, struct stack_recorder_state, &stack_recorder_typed_data, state);
+
+  // Registering the same hook again (e.g. if a collector gets initialized again) is a no-op
+  for (int i = 0; i < state->before_serialize_hooks_count; i++) {
+    struct before_serialize_hook *existing = &state->before_serialize_hooks[i];
+    if (existing->hook == hook && existing->hook_owner == hook_owner) return;
+  }
+
+  if (state->before_serialize_hooks_count == MAX_BEFORE_SERIALIZE_HOOKS) {
+    rb_raise(rb_eRuntimeError, "Too many before serialize hooks registered for this StackRecorder");
+  }
+
+  state->before_serialize_hooks[state->before_serialize_hooks_count++] =
+    (struct before_serialize_hook) {.hook = hook, .hook_owner = hook_owner};
+}
+
+bool recorder_value_type_enabled(VALUE recorder_instance, int value_type_pos) {
+  struct stack_recorder_state *state;
+  TypedData_Get_Struct(recorder_instance, struct stack_recorder_state, &stack_recorder_typed_data, state);
+
+  return state->value_type_positions[value_type_pos] != VALUE_TYPE_DISABLED;
+}
+
+uint64_t recorder_epoch(VALUE recorder_instance) {
+  struct stack_recorder_state *state;
+  TypedData_Get_Struct(recorder_instance, struct stack_recorder_state, &stack_recorder_typed_data, state);
+
+  return state->epoch;
 }
 
 static void *call_serialize_without_gvl(void *call_args) {
   struct call_serialize_without_gvl_arguments *args = (struct call_serialize_without_gvl_arguments *) call_args;
 
   args->result = ddprof_ffi_Profile_serialize(args->profile);
+
+  if (args->result.tag == DDPROF_FFI_SERIALIZE_RESULT_OK) {
+    // Resetting frees the samples we just serialized, so we do it here rather than later while holding the GVL.
+    // A failed reset doesn't affect the pprof we already have; if either step fails, the samples get dropped
+    // instead when this slot next becomes active.
+    args->reset_succeeded = ddprof_ffi_Profile_reset(args->profile);
+    args->pprof = pprof_buffer_from(args->result);
+    // If this fails, the pprof is left uncompressed
+    args->compression_error =
+      pprof_buffer_compress(&args->pprof, args->compression_codec, args->compression_level, &args->compression_stats);
+  }
   args->serialize_ran = true;
 
   return NULL; // Unused
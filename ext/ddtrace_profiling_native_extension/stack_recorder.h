@@ -4,7 +4,7 @@
 
 // Note: Please DO NOT use `VALUE_STRING` anywhere else, instead use `DDPROF_FFI_CHARSLICE_C`.
 // `VALUE_STRING` is only needed because older versions of gcc (4.9.2, used in our Ruby 2.1 and 2.2 CI test images)
-// tripped when compiling `enabled_value_types` using `-std=gnu99` due to the extra cast that is included in
+// tripped when compiling `all_value_types` using `-std=gnu99` due to the extra cast that is included in
 // `DDPROF_FFI_CHARSLICE_C` with the following error:
 //
 // ```
@@ -15,23 +15,64 @@
 // ```
 #define VALUE_STRING(string) {.ptr = "" string, .len = sizeof(string) - 1}
 
-#define      CPU_TIME_VALUE {.type_ = VALUE_STRING("cpu-time"),      .unit = VALUE_STRING("nanoseconds")}
-#define   CPU_SAMPLES_VALUE {.type_ = VALUE_STRING("cpu-samples"),   .unit = VALUE_STRING("count")}
-#define     WALL_TIME_VALUE {.type_ = VALUE_STRING("wall-time"),     .unit = VALUE_STRING("nanoseconds")}
-#define ALLOC_SAMPLES_VALUE {.type_ = VALUE_STRING("alloc-samples"), .unit = VALUE_STRING("count")}
-#define   ALLOC_SPACE_VALUE {.type_ = VALUE_STRING("alloc-space"),   .unit = VALUE_STRING("bytes")}
-#define    HEAP_SPACE_VALUE {.type_ = VALUE_STRING("heap-space"),    .unit = VALUE_STRING("bytes")}
+#define         CPU_TIME_VALUE {.type_ = VALUE_STRING("cpu-time"),         .unit = VALUE_STRING("nanoseconds")}
+#define      CPU_SAMPLES_VALUE {.type_ = VALUE_STRING("cpu-samples"),      .unit = VALUE_STRING("count")}
+#define        WALL_TIME_VALUE {.type_ = VALUE_STRING("wall-time"),        .unit = VALUE_STRING("nanoseconds")}
+#define         GVL_WAIT_VALUE {.type_ = VALUE_STRING("gvl-wait"),         .unit = VALUE_STRING("nanoseconds")}
+#define OS_RUNQUEUE_WAIT_VALUE {.type_ = VALUE_STRING("os-runqueue-wait"), .unit = VALUE_STRING("nanoseconds")}
+#define    ALLOC_SAMPLES_VALUE {.type_ = VALUE_STRING("alloc-samples"),    .unit = VALUE_STRING("count")}
+#define      ALLOC_SPACE_VALUE {.type_ = VALUE_STRING("alloc-space"),      .unit = VALUE_STRING("bytes")}
+#define       HEAP_SPACE_VALUE {.type_ = VALUE_STRING("heap-space"),       .unit = VALUE_STRING("bytes")}
 
-static const ddprof_ffi_ValueType enabled_value_types[] = {
+// Every value type that collectors know how to record. Collectors always pass in metric values for all of them, at the
+// positions below, and each StackRecorder then only keeps the ones it was configured with (see
+// `recorder_value_type_enabled` and `_native_initialize` in stack_recorder.c).
+static const ddprof_ffi_ValueType all_value_types[] = {
   #define CPU_TIME_VALUE_POS 0
   CPU_TIME_VALUE,
   #define CPU_SAMPLES_VALUE_POS 1
   CPU_SAMPLES_VALUE,
   #define WALL_TIME_VALUE_POS 2
-  WALL_TIME_VALUE
+  WALL_TIME_VALUE,
+  #define GVL_WAIT_VALUE_POS 3
+  GVL_WAIT_VALUE,
+  #define OS_RUNQUEUE_WAIT_VALUE_POS 4
+  OS_RUNQUEUE_WAIT_VALUE,
+  #define ALLOC_SAMPLES_VALUE_POS 5
+  ALLOC_SAMPLES_VALUE,
+  #define ALLOC_SPACE_VALUE_POS 6
+  ALLOC_SPACE_VALUE,
+  #define HEAP_SPACE_VALUE_POS 7
+  HEAP_SPACE_VALUE
 };
 
-#define ENABLED_VALUE_TYPES_COUNT (sizeof(enabled_value_types) / sizeof(ddprof_ffi_ValueType))
+#define ALL_VALUE_TYPES_COUNT (sizeof(all_value_types) / sizeof(ddprof_ffi_ValueType))
 
-void record_sample(VALUE recorder_instance, ddprof_ffi_Sample sample);
+// Identifies the stack of a sample by the raw frames it was built from (see collectors_stack.c), so that samples with
+// the same stack can be found without looking at every name and filename in it (see sample_aggregation.c).
+//
+// The sample's locations must be the `frames_count` frames (each with a single line, pointing at the name and filename
+// in `strings`) at the bottom, optionally preceded by placeholder locations. The frames and strings MUST be kept alive
+// by the caller until record_sample returns; the recorder keeps (and pins) its own references to them afterwards.
+typedef struct {
+  const VALUE *frames;
+  const int *lines;
+  const bool *is_ruby_frame;
+  const VALUE *strings; // Two per frame: the name and filename that the frame's line points to
+  int frames_count;
+  uint64_t hash; // Computed by the caller from the frames, lines and is_ruby_frame
+} sample_stack_identity;
+
+// The `stack` is optional: samples recorded without one never get aggregated (see stack_recorder.c)
+void record_sample(VALUE recorder_instance, ddprof_ffi_Sample sample, const sample_stack_identity *stack);
+// Collectors can use this to skip gathering values that would be dropped anyway; `value_type_pos` is one of the
+// *_VALUE_POS above
+bool recorder_value_type_enabled(VALUE recorder_instance, int value_type_pos);
+// The epoch changes every time the recorder gets serialized (and thus reset), and is different for every recorder.
+// Collectors can use it to know when to drop caches that should not outlive the profile they were built for.
+uint64_t recorder_epoch(VALUE recorder_instance);
+// Hooks get called (with the Global VM Lock held) at the start of every serialization, before the profile gets
+// serialized and reset. The `hook_owner` is kept alive (and pinned) by the recorder.
+typedef void (*recorder_before_serialize_hook)(VALUE hook_owner);
+void recorder_add_before_serialize_hook(VALUE recorder_instance, recorder_before_serialize_hook hook, VALUE hook_owner);
 void enforce_recorder_instance(VALUE object);
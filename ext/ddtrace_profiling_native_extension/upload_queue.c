@@ -0,0 +1,658 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "spool.h"
+#include "upload_queue.h"
+
+// Used by the HttpTransport to report profiles without blocking the Ruby thread that asked for them to be reported.
+//
+// Uploads get pushed into a bounded queue, and a dedicated native (non-Ruby) thread takes them out and sends them, one
+// at a time. As this thread never touches Ruby objects, it never needs the Global VM Lock: uploads carry their own
+// copies of everything they need (or, for the pprof, take over the buffer it was serialized or compressed into).
+// How each upload went gets recorded as an `upload_result`, which the HttpTransport picks up (and logs) later.
+//
+// When the queue has a spool, uploads that fail because the agent was unreachable or unavailable get written to the
+// spool (see spool.c), and spooled profiles get reported back after an upload succeeds (or when asked to, see
+// upload_queue_replay_spool), one at a time, whenever there are no uploads pending. As the tags may have changed since
+// a profile got spooled, spooled profiles get reported back with an exporter without tags, plus the tags they were
+// spooled with.
+//
+// The sender thread only gets started when the first upload gets pushed. Threads don't survive `fork`, so if the queue
+// is used from a child process, it gets reset first: the uploads still pending in the parent are forgotten (the parent
+// reports them), and a new sender thread gets started in the child.
+//
+// Memory here is allocated with malloc/free rather than ruby_xmalloc/ruby_xfree, as it gets freed by the sender thread.
+
+#define MAX_UPLOAD_FILES 2
+// We only keep the results of the latest uploads; if nobody picks them up, the older ones get dropped
+#define MAX_UPLOAD_RESULTS 16
+
+struct shared_exporter {
+  ddprof_ffi_NewProfileExporterV3Result exporter_result;
+  unsigned int reference_count;
+  uint8_t *encoded_tags; // NULL when there are no tags
+  size_t encoded_tags_size;
+  shared_exporter *untagged_exporter; // Retained; NULL if this exporter is the untagged one
+};
+
+struct upload {
+  shared_exporter *exporter;
+  ddprof_ffi_Timespec start;
+  ddprof_ffi_Timespec finish;
+  uint64_t timeout_milliseconds;
+  ddprof_ffi_File files[MAX_UPLOAD_FILES];
+  uintptr_t files_count;
+  bool has_pprof;
+  pprof_buffer pprof;
+  uint8_t *copied_data; // Backs the names and contents of the files, apart from the serialized profile
+};
+
+struct upload_queue {
+  pthread_mutex_t mutex;
+  pthread_cond_t work_available; // Signaled when an upload gets pushed, or the queue gets shut down
+  pthread_cond_t idle; // Signaled whenever an upload finishes, or waiters get interrupted
+
+  upload **pending;
+  unsigned int max_pending_uploads;
+  unsigned int pending_start;
+  unsigned int pending_count;
+
+  upload_result results[MAX_UPLOAD_RESULTS];
+  unsigned int results_start;
+  unsigned int results_count;
+
+  // Not NULL while an upload (or spooled profile) is being sent; used to cancel it on shutdown
+  ddprof_ffi_CancellationToken *in_flight_cancel_token;
+  bool upload_in_flight; // Spooled profiles being reported back don't count, see upload_queue_wait_until_idle
+  unsigned int waiters_interrupted_count;
+  bool shutdown;
+
+  spool *spool; // NULL if profiles should not be spooled
+  // Not NULL when spooled profiles should be reported back (with this untagged exporter)
+  shared_exporter *replay_exporter;
+  uint64_t replay_timeout_milliseconds;
+
+  bool sender_started;
+  pid_t sender_pid; // Process where the sender thread got started, see reset_after_fork
+};
+
+static void push_result(upload_queue *queue, upload_result result);
+static upload_result failure_result(const char *failure, uintptr_t failure_len);
+static upload_result spool_failure_result(const char *spool_failure);
+static void *sender_thread_main(void *queue_ptr);
+static upload_result report_upload(
+  upload_queue *queue,
+  upload *to_report,
+  ddprof_ffi_CancellationToken *cancel_token,
+  shared_exporter **replay_exporter,
+  const char **spool_failure
+);
+static bool report_oldest_spooled_profile(
+  upload_queue *queue,
+  shared_exporter *exporter,
+  uint64_t timeout_milliseconds,
+  ddprof_ffi_CancellationToken *cancel_token,
+  upload_result *result
+);
+static ddprof_ffi_SendResult send_files(
+  shared_exporter *exporter,
+  ddprof_ffi_Timespec start,
+  ddprof_ffi_Timespec finish,
+  ddprof_ffi_Slice_file files,
+  ddprof_ffi_ByteSlice additional_encoded_tags,
+  uint64_t timeout_milliseconds,
+  ddprof_ffi_CancellationToken *cancel_token
+);
+static shared_exporter *retain_untagged_exporter(shared_exporter *exporter);
+static upload_result result_from(ddprof_ffi_SendResult send_result);
+static bool was_reported(upload_result result);
+static void request_replay(upload_queue *queue, shared_exporter *exporter, uint64_t timeout_milliseconds);
+static const char *start_sender_thread(upload_queue *queue);
+static void reset_after_fork(upload_queue *queue);
+static void free_queue(upload_queue *queue);
+
+shared_exporter *shared_exporter_new(
+  ddprof_ffi_NewProfileExporterV3Result exporter_result,
+  ddprof_ffi_ByteSlice encoded_tags,
+  shared_exporter *untagged_exporter
+) {
+  shared_exporter *exporter = malloc(sizeof(shared_exporter));
+  uint8_t *encoded_tags_copy = encoded_tags.len > 0 ? malloc(encoded_tags.len) : NULL;
+
+  if (exporter == NULL || (encoded_tags.len > 0 && encoded_tags_copy == NULL)) {
+    free(exporter);
+    free(encoded_tags_copy);
+    ddprof_ffi_NewProfileExporterV3Result_drop(exporter_result);
+    if (untagged_exporter != NULL) shared_exporter_release(untagged_exporter);
+    return NULL;
+  }
+
+  if (encoded_tags.len > 0) memcpy(encoded_tags_copy, encoded_tags.ptr, encoded_tags.len);
+
+  *exporter = (shared_exporter) {
+    .exporter_result = exporter_result,
+    .reference_count = 1,
+    .encoded_tags = encoded_tags_copy,
+    .encoded_tags_size = encoded_tags.len,
+    .untagged_exporter = untagged_exporter,
+  };
+
+  return exporter;
+}
+
+ddprof_ffi_ProfileExporterV3 *shared_exporter_get(shared_exporter *exporter) {
+  return exporter->exporter_result.ok;
+}
+
+ddprof_ffi_ByteSlice shared_exporter_tags(shared_exporter *exporter) {
+  return (ddprof_ffi_ByteSlice) {.ptr = exporter->encoded_tags, .len = exporter->encoded_tags_size};
+}
+
+void shared_exporter_retain(shared_exporter *exporter) {
+  __atomic_add_fetch(&exporter->reference_count, 1, __ATOMIC_SEQ_CST);
+}
+
+void shared_exporter_release(shared_exporter *exporter) {
+  if (__atomic_sub_fetch(&exporter->reference_count, 1, __ATOMIC_SEQ_CST) > 0) return;
+
+  ddprof_ffi_NewProfileExporterV3Result_drop(exporter->exporter_result);
+  if (exporter->untagged_exporter != NULL) shared_exporter_release(exporter->untagged_exporter);
+  free(exporter->encoded_tags);
+  free(exporter);
+}
+
+upload *upload_new(
+  shared_exporter *exporter,
+  ddprof_ffi_Timespec start,
+  ddprof_ffi_Timespec finish,
+  uint64_t timeout_milliseconds,
+  ddprof_ffi_Slice_file files,
+  pprof_buffer *pprof
+) {
+  if (files.len == 0 || files.len > MAX_UPLOAD_FILES) return NULL;
+
+  size_t copied_data_size = 0;
+  for (uintptr_t i = 0; i < files.len; i++) {
+    copied_data_size += files.ptr[i].name.len;
+    if (!(i == 0 && pprof != NULL)) copied_data_size += files.ptr[i].file.len;
+  }
+
+  upload *new_upload = malloc(sizeof(upload));
+  uint8_t *copied_data = malloc(copied_data_size > 0 ? copied_data_size : 1);
+  if (new_upload == NULL || copied_data == NULL) {
+    free(new_upload);
+    free(copied_data);
+    return NULL;
+  }
+
+  *new_upload = (upload) {
+    .exporter = exporter,
+    .start = start,
+    .finish = finish,
+    .timeout_milliseconds = timeout_milliseconds,
+    .files_count = files.len,
+    .has_pprof = pprof != NULL,
+    .copied_data = copied_data,
+  };
+
+  uint8_t *next_copy = copied_data;
+  for (uintptr_t i = 0; i < files.len; i++) {
+    ddprof_ffi_File file = files.ptr[i];
+
+    memcpy(next_copy, file.name.ptr, file.name.len);
+    new_upload->files[i].name = (ddprof_ffi_CharSlice) {.ptr = (const char *) next_copy, .len = file.name.len};
+    next_copy += file.name.len;
+
+    if (i == 0 && pprof != NULL) {
+      new_upload->files[i].file = pprof->bytes;
+    } else {
+      memcpy(next_copy, file.file.ptr, file.file.len);
+      new_upload->files[i].file = (ddprof_ffi_ByteSlice) {.ptr = next_copy, .len = file.file.len};
+      next_copy += file.file.len;
+    }
+  }
+
+  // Now that nothing else can fail, we take over the things we were given
+  if (pprof != NULL) new_upload->pprof = *pprof;
+  shared_exporter_retain(exporter);
+
+  return new_upload;
+}
+
+void upload_free(upload *to_free) {
+  shared_exporter_release(to_free->exporter);
+  if (to_free->has_pprof) pprof_buffer_drop(&to_free->pprof);
+  free(to_free->copied_data);
+  free(to_free);
+}
+
+upload_queue *upload_queue_new(unsigned int max_pending_uploads, spool *spool) {
+  upload_queue *queue = calloc(1, sizeof(upload_queue));
+  upload **pending = calloc(max_pending_uploads > 0 ? max_pending_uploads : 1, sizeof(upload *));
+  if (queue == NULL || pending == NULL) {
+    free(queue);
+    free(pending);
+    return NULL;
+  }
+
+  pthread_mutex_init(&queue->mutex, NULL);
+  pthread_cond_init(&queue->work_available, NULL);
+  pthread_cond_init(&queue->idle, NULL);
+  queue->pending = pending;
+  queue->max_pending_uploads = max_pending_uploads > 0 ? max_pending_uploads : 1;
+  if (spool != NULL) spool_retain(spool);
+  queue->spool = spool;
+  // Everything else starts zeroed (thanks to calloc)
+
+  return queue;
+}
+
+const char *upload_queue_push(upload_queue *queue, upload *new_upload) {
+  reset_after_fork(queue);
+
+  pthread_mutex_lock(&queue->mutex);
+
+  const char *error = queue->sender_started ? NULL : start_sender_thread(queue);
+  if (error != NULL) {
+    pthread_mutex_unlock(&queue->mutex);
+    upload_free(new_upload);
+    return error;
+  }
+
+  if (queue->pending_count == queue->max_pending_uploads) {
+    upload *oldest = queue->pending[queue->pending_start];
+    queue->pending_start = (queue->pending_start + 1) % queue->max_pending_uploads;
+    queue->pending_count--;
+
+    upload_free(oldest);
+    const char *dropped = "Profile was dropped without being reported, as too many profiles were waiting to be reported";
+    push_result(queue, failure_result(dropped, strlen(dropped)));
+  }
+
+  queue->pending[(queue->pending_start + queue->pending_count) % queue->max_pending_uploads] = new_upload;
+  queue->pending_count++;
+
+  pthread_cond_signal(&queue->work_available);
+  pthread_mutex_unlock(&queue->mutex);
+
+  return NULL;
+}
+
+const char *upload_queue_replay_spool(
+  upload_queue *queue,
+  shared_exporter *exporter,
+  uint64_t timeout_milliseconds
+) {
+  if (queue->spool == NULL) return NULL;
+
+  reset_after_fork(queue);
+
+  pthread_mutex_lock(&queue->mutex);
+
+  const char *error = queue->sender_started ? NULL : start_sender_thread(queue);
+  if (error == NULL) {
+    request_replay(queue, retain_untagged_exporter(exporter), timeout_milliseconds);
+    pthread_cond_signal(&queue->work_available);
+  }
+
+  pthread_mutex_unlock(&queue->mutex);
+
+  return error;
+}
+
+unsigned int upload_queue_take_results(upload_queue *queue, upload_result *results, unsigned int max_results) {
+  reset_after_fork(queue);
+
+  pthread_mutex_lock(&queue->mutex);
+
+  unsigned int taken = 0;
+  while (taken < max_results && queue->results_count > 0) {
+    results[taken++] = queue->results[queue->results_start];
+    queue->results_start = (queue->results_start + 1) % MAX_UPLOAD_RESULTS;
+    queue->results_count--;
+  }
+
+  pthread_mutex_unlock(&queue->mutex);
+
+  return taken;
+}
+
+bool upload_queue_wait_until_idle(upload_queue *queue, uint64_t timeout_milliseconds) {
+  reset_after_fork(queue);
+
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  uint64_t deadline_ns =
+    (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_usec * 1000 + timeout_milliseconds * 1000000;
+  struct timespec deadline = {.tv_sec = deadline_ns / 1000000000, .tv_nsec = deadline_ns % 1000000000};
+
+  pthread_mutex_lock(&queue->mutex);
+
+  unsigned int waiters_interrupted_count = queue->waiters_interrupted_count;
+  bool timed_out = false;
+
+  while (
+    (queue->pending_count > 0 || queue->upload_in_flight) &&
+    !timed_out &&
+    waiters_interrupted_count == queue->waiters_interrupted_count
+  ) {
+    timed_out = pthread_cond_timedwait(&queue->idle, &queue->mutex, &deadline) == ETIMEDOUT;
+  }
+
+  bool is_idle = queue->pending_count == 0 && !queue->upload_in_flight;
+
+  pthread_mutex_unlock(&queue->mutex);
+
+  return is_idle;
+}
+
+void upload_queue_interrupt_waiters(upload_queue *queue) {
+  pthread_mutex_lock(&queue->mutex);
+  queue->waiters_interrupted_count++;
+  pthread_cond_broadcast(&queue->idle);
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+void upload_queue_shutdown(upload_queue *queue) {
+  reset_after_fork(queue);
+
+  pthread_mutex_lock(&queue->mutex);
+
+  if (!queue->sender_started) {
+    pthread_mutex_unlock(&queue->mutex);
+    free_queue(queue);
+    return;
+  }
+
+  // The sender thread takes it from here, and frees the queue once it's done with it
+  queue->shutdown = true;
+  if (queue->in_flight_cancel_token != NULL) ddprof_ffi_CancellationToken_cancel(queue->in_flight_cancel_token);
+  pthread_cond_signal(&queue->work_available);
+  pthread_cond_broadcast(&queue->idle);
+
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+// Must be called with the mutex held
+static void push_result(upload_queue *queue, upload_result result) {
+  if (queue->results_count == MAX_UPLOAD_RESULTS) {
+    free(queue->results[queue->results_start].failure);
+    queue->results_start = (queue->results_start + 1) % MAX_UPLOAD_RESULTS;
+    queue->results_count--;
+  }
+
+  queue->results[(queue->results_start + queue->results_count) % MAX_UPLOAD_RESULTS] = result;
+  queue->results_count++;
+}
+
+static upload_result failure_result(const char *failure, uintptr_t failure_len) {
+  char *failure_copy = malloc(failure_len + 1);
+  if (failure_copy != NULL) {
+    memcpy(failure_copy, failure, failure_len);
+    failure_copy[failure_len] = '\0';
+  }
+
+  // If we ran out of memory, we still report the failure, just without the details
+  return (upload_result) {.http_response = false, .failure = failure_copy};
+}
+
+// The `spool_failure` is one of the descriptions returned by spool_write
+static upload_result spool_failure_result(const char *spool_failure) {
+  char failure[256];
+  int failure_len = snprintf(failure, sizeof(failure), "%s%s", SPOOL_FAILURE_PREFIX, spool_failure);
+  if (failure_len < 0) failure_len = 0;
+  if ((size_t) failure_len >= sizeof(failure)) failure_len = sizeof(failure) - 1;
+
+  return failure_result(failure, failure_len);
+}
+
+static void *sender_thread_main(void *queue_ptr) {
+  upload_queue *queue = (upload_queue *) queue_ptr;
+
+  pthread_mutex_lock(&queue->mutex);
+
+  while (true) {
+    while (queue->pending_count == 0 && queue->replay_exporter == NULL && !queue->shutdown) {
+      pthread_cond_wait(&queue->work_available, &queue->mutex);
+    }
+    if (queue->shutdown) break;
+
+    ddprof_ffi_CancellationToken *cancel_token = ddprof_ffi_CancellationToken_new();
+    queue->in_flight_cancel_token = cancel_token;
+
+    upload_result result;
+    bool have_result = true;
+    const char *spool_failure = NULL;
+
+    if (queue->pending_count > 0) {
+      upload *next_upload = queue->pending[queue->pending_start];
+      queue->pending_start = (queue->pending_start + 1) % queue->max_pending_uploads;
+      queue->pending_count--;
+      queue->upload_in_flight = true;
+
+      pthread_mutex_unlock(&queue->mutex);
+      shared_exporter *replay_exporter = NULL;
+      uint64_t timeout_milliseconds = next_upload->timeout_milliseconds;
+      result = report_upload(queue, next_upload, cancel_token, &replay_exporter, &spool_failure);
+      pthread_mutex_lock(&queue->mutex);
+
+      queue->upload_in_flight = false;
+      // Reporting works again, so it's a good time to report back whatever got spooled
+      if (replay_exporter != NULL) request_replay(queue, replay_exporter, timeout_milliseconds);
+    } else {
+      shared_exporter *exporter = queue->replay_exporter;
+      uint64_t timeout_milliseconds = queue->replay_timeout_milliseconds;
+      queue->replay_exporter = NULL;
+
+      pthread_mutex_unlock(&queue->mutex);
+      have_result = report_oldest_spooled_profile(queue, exporter, timeout_milliseconds, cancel_token, &result);
+      pthread_mutex_lock(&queue->mutex);
+
+      // We keep going until the spool is empty (or reporting fails), unless someone asked for a replay in the meanwhile
+      if (have_result && was_reported(result) && queue->replay_exporter == NULL) {
+        queue->replay_exporter = exporter;
+        queue->replay_timeout_milliseconds = timeout_milliseconds;
+      } else {
+        shared_exporter_release(exporter);
+      }
+    }
+
+    // Dropped while holding the mutex, so that upload_queue_shutdown never cancels a token that's already gone
+    queue->in_flight_cancel_token = NULL;
+    ddprof_ffi_CancellationToken_drop(cancel_token);
+
+    if (have_result) push_result(queue, result);
+    if (spool_failure != NULL) push_result(queue, spool_failure_result(spool_failure));
+    pthread_cond_broadcast(&queue->idle);
+  }
+
+  pthread_mutex_unlock(&queue->mutex);
+  free_queue(queue);
+
+  return NULL;
+}
+
+// Called without holding the mutex; frees the upload. If the upload was reported and there's a spool, also sets
+// `replay_exporter` (the upload's untagged exporter, retained) so the caller can ask for spooled profiles to be
+// reported back. If the upload needed spooling but that failed, sets `spool_failure` to what went wrong.
+static upload_result report_upload(
+  upload_queue *queue,
+  upload *to_report,
+  ddprof_ffi_CancellationToken *cancel_token,
+  shared_exporter **replay_exporter,
+  const char **spool_failure
+) {
+  ddprof_ffi_Slice_file files = {.ptr = to_report->files, .len = to_report->files_count};
+
+  // The exporter already includes the tags
+  ddprof_ffi_ByteSlice no_additional_tags = {0};
+
+  ddprof_ffi_SendResult send_result = send_files(
+    to_report->exporter,
+    to_report->start,
+    to_report->finish,
+    files,
+    no_additional_tags,
+    to_report->timeout_milliseconds,
+    cancel_token
+  );
+  upload_result result = result_from(send_result);
+
+  // Spooling is best-effort: if it fails (e.g. the disk is full), the profile gets dropped, as it would without a spool
+  if (queue->spool != NULL && spool_should_keep(send_result)) {
+    *spool_failure =
+      spool_write(queue->spool, to_report->start, to_report->finish, files, shared_exporter_tags(to_report->exporter));
+  }
+
+  if (queue->spool != NULL && was_reported(result)) *replay_exporter = retain_untagged_exporter(to_report->exporter);
+
+  ddprof_ffi_SendResult_drop(send_result);
+  upload_free(to_report);
+
+  return result;
+}
+
+// Called without holding the mutex, with an untagged `exporter`. Returns false if there was nothing to report.
+static bool report_oldest_spooled_profile(
+  upload_queue *queue,
+  shared_exporter *exporter,
+  uint64_t timeout_milliseconds,
+  ddprof_ffi_CancellationToken *cancel_token,
+  upload_result *result
+) {
+  spooled_profile *profile = spool_claim_oldest(queue->spool);
+  if (profile == NULL) return false;
+
+  ddprof_ffi_SendResult send_result = send_files(
+    exporter, profile->start, profile->finish, profile->files, profile->encoded_tags, timeout_milliseconds, cancel_token
+  );
+  *result = result_from(send_result);
+
+  // Profiles that were rejected for good (e.g. with a 4xx) get removed too, as retrying them would not help
+  spooled_profile_finish(profile, !spool_should_keep(send_result));
+  ddprof_ffi_SendResult_drop(send_result);
+
+  return true;
+}
+
+static ddprof_ffi_SendResult send_files(
+  shared_exporter *exporter,
+  ddprof_ffi_Timespec start,
+  ddprof_ffi_Timespec finish,
+  ddprof_ffi_Slice_file files,
+  ddprof_ffi_ByteSlice additional_encoded_tags,
+  uint64_t timeout_milliseconds,
+  ddprof_ffi_CancellationToken *cancel_token
+) {
+  ddprof_ffi_ProfileExporterV3 *libddprof_exporter = shared_exporter_get(exporter);
+  ddprof_ffi_Vec_tag additional_tags = spool_decode_tags(additional_encoded_tags);
+
+  // libddprof takes care of freeing the request, even if the send gets cancelled
+  ddprof_ffi_Request *request = ddprof_ffi_ProfileExporterV3_build(
+    libddprof_exporter, start, finish, files, &additional_tags, timeout_milliseconds
+  );
+
+  // The request has its own copy of the tags
+  ddprof_ffi_Vec_tag_drop(additional_tags);
+
+  return ddprof_ffi_ProfileExporterV3_send(libddprof_exporter, request, cancel_token);
+}
+
+// Returns (retained) the exporter to report spooled profiles back with
+static shared_exporter *retain_untagged_exporter(shared_exporter *exporter) {
+  shared_exporter *untagged_exporter = exporter->untagged_exporter != NULL ? exporter->untagged_exporter : exporter;
+  shared_exporter_retain(untagged_exporter);
+  return untagged_exporter;
+}
+
+// Does not drop the `send_result`
+static upload_result result_from(ddprof_ffi_SendResult send_result) {
+  return send_result.tag == DDPROF_FFI_SEND_RESULT_HTTP_RESPONSE ?
+    (upload_result) {.http_response = true, .http_status_code = send_result.http_response.code} :
+    failure_result((const char *) send_result.failure.ptr, send_result.failure.len);
+}
+
+static bool was_reported(upload_result result) {
+  return result.http_response && result.http_status_code >= 200 && result.http_status_code < 300;
+}
+
+// Must be called with the mutex held. Takes over the (retained) `exporter`.
+static void request_replay(upload_queue *queue, shared_exporter *exporter, uint64_t timeout_milliseconds) {
+  if (queue->replay_exporter != NULL) shared_exporter_release(queue->replay_exporter);
+
+  queue->replay_exporter = exporter;
+  queue->replay_timeout_milliseconds = timeout_milliseconds;
+}
+
+// Must be called with the mutex held
+static const char *start_sender_thread(upload_queue *queue) {
+  // The sender thread should never handle signals meant for the Ruby VM (or for the profiler), so we block them all
+  // while creating it, as it inherits our signal mask
+  sigset_t all_signals, previous_signal_mask;
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_BLOCK, &all_signals, &previous_signal_mask);
+
+  pthread_t sender_thread;
+  int error = pthread_create(&sender_thread, NULL, sender_thread_main, queue);
+
+  pthread_sigmask(SIG_SETMASK, &previous_signal_mask, NULL);
+
+  if (error != 0) return "Failed to start thread to report profiles";
+
+  pthread_detach(sender_thread);
+  queue->sender_started = true;
+  queue->sender_pid = getpid();
+
+  return NULL;
+}
+
+// Only the thread that called fork survives in the child, so the sender thread, and anything it was holding (including
+// the mutex) are gone. Here we start over, forgetting whatever was pending (the parent process reports it).
+//
+// The pending uploads get leaked rather than freed, as they may hold the last reference to an exporter created by the
+// parent, and libddprof exporters can't be safely used (nor dropped) after a fork (see also http_transport.c).
+static void reset_after_fork(upload_queue *queue) {
+  if (!queue->sender_started || queue->sender_pid == getpid()) return;
+
+  pthread_mutex_init(&queue->mutex, NULL);
+  pthread_cond_init(&queue->work_available, NULL);
+  pthread_cond_init(&queue->idle, NULL);
+
+  queue->pending_start = 0;
+  queue->pending_count = 0;
+
+  for (unsigned int i = 0; i < queue->results_count; i++) {
+    free(queue->results[(queue->results_start + i) % MAX_UPLOAD_RESULTS].failure);
+  }
+  queue->results_start = 0;
+  queue->results_count = 0;
+
+  queue->in_flight_cancel_token = NULL;
+  queue->upload_in_flight = false;
+  queue->replay_exporter = NULL; // Leaked, see above
+  queue->sender_started = false;
+  queue->sender_pid = 0;
+}
+
+static void free_queue(upload_queue *queue) {
+  for (unsigned int i = 0; i < queue->pending_count; i++) {
+    upload_free(queue->pending[(queue->pending_start + i) % queue->max_pending_uploads]);
+  }
+  for (unsigned int i = 0; i < queue->results_count; i++) {
+    free(queue->results[(queue->results_start + i) % MAX_UPLOAD_RESULTS].failure);
+  }
+
+  if (queue->replay_exporter != NULL) shared_exporter_release(queue->replay_exporter);
+  if (queue->spool != NULL) spool_release(queue->spool);
+
+  pthread_mutex_destroy(&queue->mutex);
+  pthread_cond_destroy(&queue->work_available);
+  pthread_cond_destroy(&queue->idle);
+  free(queue->pending);
+  free(queue);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdbool.h>
+#include <ddprof/ffi.h>
+#include "pprof_compression.h"
+#include "spool.h"
+
+// Everything in this file can be used from any thread, and none of it needs (nor uses) the Global VM Lock or any
+// other Ruby APIs. See upload_queue.c for details.
+
+// A libddprof exporter shared by an HttpTransport and the uploads it queued. It gets dropped once the last of them
+// releases it.
+typedef struct shared_exporter shared_exporter;
+
+// Takes ownership of an OK `exporter_result`, which was created with the `encoded_tags` (see spool_decode_tags; they
+// get copied), and of the (retained) `untagged_exporter`, which was created for the same endpoint but without any tags.
+// Profiles spooled by this exporter get spooled with its tags, and get reported back by the untagged exporter along
+// with those tags, so that they keep their tags even if the tags changed in the meanwhile.
+// The `untagged_exporter` is NULL when creating an untagged exporter.
+// Returns NULL (after dropping and releasing everything it was given) if out of memory.
+shared_exporter *shared_exporter_new(
+  ddprof_ffi_NewProfileExporterV3Result exporter_result,
+  ddprof_ffi_ByteSlice encoded_tags,
+  shared_exporter *untagged_exporter
+);
+ddprof_ffi_ProfileExporterV3 *shared_exporter_get(shared_exporter *exporter);
+ddprof_ffi_ByteSlice shared_exporter_tags(shared_exporter *exporter);
+void shared_exporter_retain(shared_exporter *exporter);
+void shared_exporter_release(shared_exporter *exporter);
+
+// A profile to be reported, along with copies of everything needed to report it
+typedef struct upload upload;
+
+// Copies the names and contents of the `files`, apart from the contents of the first one when a `pprof` is given, in
+// which case the upload takes ownership of it and reports it instead. Retains the `exporter`.
+// Returns NULL if out of memory, in which case nothing got retained nor taken.
+upload *upload_new(
+  shared_exporter *exporter,
+  ddprof_ffi_Timespec start,
+  ddprof_ffi_Timespec finish,
+  uint64_t timeout_milliseconds,
+  ddprof_ffi_Slice_file files,
+  pprof_buffer *pprof
+);
+void upload_free(upload *to_free);
+
+typedef struct {
+  bool http_response; // When false, `failure` describes what went wrong instead
+  uint16_t http_status_code;
+  char *failure; // NUL-terminated; freed by whoever takes the result
+} upload_result;
+
+typedef struct upload_queue upload_queue;
+
+// Retains the `spool`, if given, which then gets used to keep the uploads that failed because the agent was unreachable
+// or unavailable, and to report them back later. Returns NULL if out of memory.
+upload_queue *upload_queue_new(unsigned int max_pending_uploads, spool *spool);
+// Takes ownership of the `new_upload` (even on failure). When the queue is full, the oldest pending upload gets dropped
+// (and a failure result is recorded for it). Returns NULL on success, or a description of what went wrong.
+const char *upload_queue_push(upload_queue *queue, upload *new_upload);
+// Asks for the spooled profiles (if any) to be reported back, using the `exporter`'s untagged exporter (which gets
+// retained). This happens automatically after an upload succeeds, so it's only needed when profiles get reported some
+// other way.
+// Returns NULL on success (or if the queue has no spool), or a description of what went wrong.
+const char *upload_queue_replay_spool(
+  upload_queue *queue,
+  shared_exporter *exporter,
+  uint64_t timeout_milliseconds
+);
+// Moves up to `max_results` results (oldest first) into `results`, and returns how many were moved
+unsigned int upload_queue_take_results(upload_queue *queue, upload_result *results, unsigned int max_results);
+// Waits until there are no pending nor in-flight uploads, for at most `timeout_milliseconds`, or until
+// upload_queue_interrupt_waiters gets called. Returns true if the queue became idle. Spooled profiles being reported
+// back are not waited for.
+bool upload_queue_wait_until_idle(upload_queue *queue, uint64_t timeout_milliseconds);
+void upload_queue_interrupt_waiters(upload_queue *queue);
+// Cancels any in-flight upload, drops the pending ones, and frees the queue (right away, or from the sender thread
+// once it notices). Does not block.
+void upload_queue_shutdown(upload_queue *queue);
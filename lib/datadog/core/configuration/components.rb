@@ -330,6 +330,9 @@ module Datadog
                 site: settings.site,
                 api_key: settings.api_key,
                 upload_timeout_seconds: settings.profiling.upload.timeout_seconds,
+                asynchronous_uploads: settings.profiling.upload.asynchronous_enabled,
+                spool_directory: settings.profiling.upload.spool_directory,
+                spool_max_size_bytes: settings.profiling.upload.spool_max_size_bytes,
               )
           end
 
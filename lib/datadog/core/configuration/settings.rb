@@ -249,6 +249,32 @@ module Datadog
               o.default { env_to_float(Profiling::Ext::ENV_UPLOAD_TIMEOUT, 30.0) }
               o.lazy
             end
+
+            # Report profiles from a background native thread, so that slow or unreachable agents don't hold up the
+            # profiler. The outcome of each upload gets logged when the next profile is reported.
+            #
+            # @default `DD_PROFILING_UPLOAD_ASYNCHRONOUS_ENABLED` environment variable, otherwise `false`
+            option :asynchronous_enabled do |o|
+              o.default { env_to_bool(Profiling::Ext::ENV_UPLOAD_ASYNCHRONOUS_ENABLED, false) }
+              o.lazy
+            end
+
+            # Directory where profiles that could not be reported (e.g. because the agent was restarting) get kept, to
+            # be reported once reporting works again. When `nil`, such profiles are dropped.
+            #
+            # @default `DD_PROFILING_UPLOAD_SPOOL_DIRECTORY` environment variable, otherwise `nil`
+            option :spool_directory do |o|
+              o.default { ENV.fetch(Profiling::Ext::ENV_UPLOAD_SPOOL_DIRECTORY, nil) }
+              o.lazy
+            end
+
+            # Maximum size of the spool directory; once reached, the oldest profiles get dropped first.
+            #
+            # @default `DD_PROFILING_UPLOAD_SPOOL_MAX_SIZE_BYTES` environment variable, otherwise 64 MiB
+            option :spool_max_size_bytes do |o|
+              o.default { env_to_int(Profiling::Ext::ENV_UPLOAD_SPOOL_MAX_SIZE_BYTES, 64 * 1024 * 1024) }
+              o.lazy
+            end
           end
         end
 
@@ -146,11 +146,13 @@ module Datadog
       return false unless supported?
 
       require 'datadog/profiling/ext/forking'
+      require 'datadog/profiling/collectors/allocations'
       require 'datadog/profiling/collectors/code_provenance'
       require 'datadog/profiling/collectors/cpu_and_wall_time'
       require 'datadog/profiling/collectors/old_stack'
       require 'datadog/profiling/collectors/stack'
       require 'datadog/profiling/stack_recorder'
+      require 'datadog/profiling/serialized_profile'
       require 'datadog/profiling/old_recorder'
       require 'datadog/profiling/exporter'
       require 'datadog/profiling/scheduler'
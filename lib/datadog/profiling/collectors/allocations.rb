@@ -0,0 +1,64 @@
+# typed: false
+
+module Datadog
+  module Profiling
+    module Collectors
+      # Used to sample object allocations, recording the alloc-samples and alloc-space value types into the `recorder`.
+      # Allocations get sampled, on average, once every `sampling_interval_bytes` (each object counts as one slot of the
+      # Ruby heap), and each sample gets tagged with the class of the object allocated.
+      #
+      # When `heap_tracking` is enabled, sampled objects are kept track of until they get freed, and the ones still alive
+      # get recorded as the heap-space value type whenever the `recorder` gets serialized. At most `max_tracked_objects`
+      # are tracked at any one time, which bounds the memory used (see `#stats`).
+      #
+      # Methods prefixed with _native_ are implemented in `collectors_allocations.c`
+      class Allocations
+        DEFAULT_SAMPLING_INTERVAL_BYTES = 512 * 1024
+        DEFAULT_MAX_TRACKED_OBJECTS = 10_000
+
+        def initialize(
+          recorder:,
+          max_frames:,
+          sampling_interval_bytes: DEFAULT_SAMPLING_INTERVAL_BYTES,
+          heap_tracking: false,
+          max_tracked_objects: DEFAULT_MAX_TRACKED_OBJECTS
+        )
+          if heap_tracking && max_tracked_objects <= 0
+            raise ArgumentError, "Invalid max_tracked_objects: #{max_tracked_objects.inspect}, must be positive"
+          end
+
+          self.class._native_initialize(
+            self,
+            recorder,
+            max_frames,
+            sampling_interval_bytes,
+            heap_tracking ? max_tracked_objects : 0,
+          )
+        end
+
+        # Only one instance can be sampling at a time
+        def start
+          self.class._native_start(self)
+        end
+
+        # Returns false if this instance was not sampling
+        def stop
+          self.class._native_stop(self)
+        end
+
+        # Returns a hash with how many allocations were sampled, how many samples had to be skipped, and the time spent
+        # sampling (in nanoseconds). With heap tracking, also includes how many objects and stacks are being tracked, and
+        # the memory used to do so (in bytes).
+        def stats
+          self.class._native_stats(self)
+        end
+
+        # This method exists only to enable testing Datadog::Profiling::Collectors::Allocations behavior using RSpec.
+        # It SHOULD NOT be used for other purposes.
+        def flush
+          self.class._native_flush(self)
+        end
+      end
+    end
+  end
+end
@@ -1,15 +1,103 @@
 # typed: false
 
+require 'datadog/tracing/context_provider'
+
 module Datadog
   module Profiling
     module Collectors
       # Used to periodically (time-based) sample threads, recording elapsed CPU-time and Wall-time between samples.
       # The stack collection itself is handled using the Datadog::Profiling::Collectors::Stack.
       #
+      # When `defer_symbolization` is enabled, sampling only captures the raw stacks; turning them into frame names and
+      # recording them in the `recorder` happens later, in batches (at the latest just before the `recorder` gets
+      # serialized). This reduces the time spent sampling each thread. If too many samples are pending, new ones get
+      # dropped rather than flushed while sampling; see `deferred_samples_dropped` in `#stats`.
+      #
+      # Sampling is triggered natively (no Ruby-level worker thread is involved), see `#start`.
+      #
+      # When `cpu_time_timers` is enabled (Linux-only), CPU-time is sampled by per-thread timers that fire as each thread
+      # consumes CPU, rather than periodically. This makes the CPU profile unbiased: threads get sampled in proportion
+      # to the CPU they actually use.
+      #
+      # To bound overhead, the sampling frequency is automatically lowered whenever sampling would otherwise take more
+      # than `max_time_usage_pct` of the time. See `#stats` for how much time is being spent sampling.
+      #
+      # Each sample covers at most `max_threads_sampled` threads, going round-robin over all threads. Threads that are
+      # skipped get their elapsed time recorded the next time they are sampled.
+      #
+      # When a `tracer` is provided, samples get tagged with the identifiers of the trace that was active on each thread
+      # (see also Datadog::Profiling::TraceIdentifiers::Ddtrace). Unless `endpoint_collection_enabled` is false, samples
+      # taken during web requests also get tagged with their endpoint (the resource of the trace).
+      #
+      # While sampling (Ruby 2.3+), time spent in the garbage collector gets recorded separately, with a
+      # "Garbage Collection" frame on top of the stack that triggered it, and a "gc type" label (minor/major).
+      #
+      # While sampling (Ruby 3.2+), the time threads spend waiting to acquire the Global VM Lock gets recorded as the
+      # gvl-wait value type, with the stack of the thread that was waiting. Waits shorter than 100 microseconds are not
+      # recorded, as they're expected even without contention.
+      #
+      # On Linux (Ruby 3.1+), each sample also records how long the thread was runnable but not scheduled by the kernel
+      # (the os-runqueue-wait value type), which shows when the process needs more CPU than it's being given.
+      #
       # Methods prefixed with _native_ are implemented in `collectors_cpu_and_wall_time.c`
       class CpuAndWallTime
-        def initialize(recorder:, max_frames:)
-          self.class._native_initialize(self, recorder, max_frames)
+        DEFAULT_MAX_TIME_USAGE_PCT = 2.0
+        # Same as Datadog::Profiling::Collectors::OldStack::DEFAULT_MAX_THREADS_SAMPLED, see there for the rationale
+        DEFAULT_MAX_THREADS_SAMPLED = 16
+
+        def initialize(
+          recorder:,
+          max_frames:,
+          defer_symbolization: false,
+          cpu_time_timers: false,
+          max_time_usage_pct: DEFAULT_MAX_TIME_USAGE_PCT,
+          max_threads_sampled: DEFAULT_MAX_THREADS_SAMPLED,
+          tracer: nil,
+          endpoint_collection_enabled: true
+        )
+          self.class._native_initialize(
+            self,
+            recorder,
+            max_frames,
+            defer_symbolization,
+            cpu_time_timers,
+            max_time_usage_pct,
+            max_threads_sampled,
+            safely_extract_context_key_from(tracer),
+            endpoint_collection_enabled,
+          )
+        end
+
+        # Starts periodically sampling all threads, at the configured sampling frequency (100 Hz by default).
+        # Only one instance can be sampling at a time. Note that this relies on using the SIGPROF signal, and thus will
+        # refuse to start if some other library is already using it.
+        #
+        # Sampling does not survive `fork`: in the child, an instance that was sampling in the parent can be stopped and
+        # started again (or replaced by another instance).
+        def start
+          self.class._native_start(self)
+        end
+
+        # Returns false if this instance was not sampling
+        def stop
+          self.class._native_stop(self)
+        end
+
+        # Can be changed at any time, including while sampling
+        def sampling_frequency_hz=(sampling_frequency_hz)
+          self.class._native_set_sampling_frequency(self, sampling_frequency_hz)
+        end
+
+        # Returns a hash with the time spent sampling (in nanoseconds), as well as the configured and effective sampling
+        # intervals (the effective interval gets longer than the configured one when sampling is too expensive), and how
+        # many samples were recorded for time spent in the garbage collector and waiting for the Global VM Lock
+        def stats
+          self.class._native_stats(self)
+        end
+
+        # Records any samples pending due to `defer_symbolization`. No-op otherwise.
+        def flush_deferred_samples
+          self.class._native_flush_deferred_samples(self)
         end
 
         # This method exists only to enable testing Datadog::Profiling::Collectors::CpuAndWallTime behavior using RSpec.
@@ -23,6 +111,31 @@ module Datadog
         def thread_list
           self.class._native_thread_list
         end
+
+        # This method exists only to enable testing Datadog::Profiling::Collectors::CpuAndWallTime behavior using RSpec.
+        # It SHOULD NOT be used for other purposes.
+        def per_thread_context
+          self.class._native_per_thread_context(self)
+        end
+
+        # This method exists only to enable testing Datadog::Profiling::Collectors::CpuAndWallTime behavior using RSpec.
+        # It SHOULD NOT be used for other purposes.
+        def deferred_samples_count
+          self.class._native_deferred_samples_count(self)
+        end
+
+        private
+
+        # The native code reads the trace identifiers directly from the Datadog::Tracing::Context that the tracer keeps
+        # for each thread, so it needs to know where the tracer keeps it. We only support the default context provider;
+        # for anything else we return nil, and samples get no trace identifiers.
+        def safely_extract_context_key_from(tracer)
+          provider = tracer && tracer.respond_to?(:provider) && tracer.provider
+          return unless provider.is_a?(Datadog::Tracing::DefaultContextProvider)
+
+          context = provider.instance_variable_get(:@context)
+          context.instance_variable_get(:@key) if context.is_a?(Datadog::Tracing::FiberLocalContext)
+        end
       end
     end
   end
@@ -5,12 +5,19 @@ module Datadog
     module Collectors
       # Used to gather a stack trace from a given Ruby thread. Almost all of this class is implemented as native code.
       #
+      # Each instance keeps the frames and stacks it has already seen cached, until the recorder it samples into gets
+      # serialized; see `#stats` for how often sampling a stack could reuse one built for an identical earlier sample.
+      #
       # Methods prefixed with _native_ are implemented in `collectors_stack.c`
       class Stack
         # This method exists only to enable testing Datadog::Profiling::Collectors::Stack behavior using RSpec.
         # It SHOULD NOT be used for other purposes.
         def sample(thread, recorder_instance, metric_values_hash, labels_array, max_frames: 400)
-          self.class._native_sample(thread, recorder_instance, metric_values_hash, labels_array, max_frames)
+          self.class._native_sample(self, thread, recorder_instance, metric_values_hash, labels_array, max_frames)
+        end
+
+        def stats
+          self.class._native_stats(self)
         end
       end
     end
@@ -16,6 +16,8 @@ module Datadog
     class Exporter
       # Profiles with duration less than this will not be reported
       PROFILE_DURATION_THRESHOLD_SECONDS = 1
+      # The only compression the profiling backend accepts for pprofs
+      REPORTED_PPROF_COMPRESSION = :gzip
 
       private
 
@@ -31,18 +33,26 @@ module Datadog
         code_provenance_collector:,
         minimum_duration: PROFILE_DURATION_THRESHOLD_SECONDS
       )
+        if pprof_recorder.respond_to?(:pprof_compression) &&
+            ![nil, REPORTED_PPROF_COMPRESSION].include?(pprof_recorder.pprof_compression)
+          raise ArgumentError,
+            "Unsupported pprof_compression for reporting: #{pprof_recorder.pprof_compression.inspect}, " \
+            "pprofs can only be reported compressed with #{REPORTED_PPROF_COMPRESSION.inspect}"
+        end
+
         @pprof_recorder = pprof_recorder
         @code_provenance_collector = code_provenance_collector
         @minimum_duration = minimum_duration
       end
 
       def flush
-        start, finish, uncompressed_pprof = pprof_recorder.serialize
+        start, finish, pprof_data = serialize_pprof
 
-        return if uncompressed_pprof.nil? # We don't want to report empty profiles
+        return if pprof_data.nil? # We don't want to report empty profiles
 
         if duration_below_threshold?(start, finish)
           Datadog.logger.debug('Skipped exporting profiling events as profile duration is below minimum')
+          pprof_data.release if pprof_data.respond_to?(:release)
           return
         end
 
@@ -52,7 +62,7 @@ module Datadog
           start: start,
           finish: finish,
           pprof_file_name: Datadog::Profiling::Ext::Transport::HTTP::PPROF_DEFAULT_FILENAME,
-          pprof_data: Datadog::Core::Utils::Compression.gzip(uncompressed_pprof),
+          pprof_data: pprof_data,
           code_provenance_file_name: Datadog::Profiling::Ext::Transport::HTTP::CODE_PROVENANCE_FILENAME,
           code_provenance_data:
             (Datadog::Core::Utils::Compression.gzip(uncompressed_code_provenance) if uncompressed_code_provenance),
@@ -66,6 +76,37 @@ module Datadog
 
       private
 
+      # Recorders that gzip pprofs natively hand them over as a SerializedProfile, which gets reported as-is (without
+      # being copied into a Ruby String); otherwise, the pprof gets gzipped here
+      def serialize_pprof
+        if pprof_recorder.respond_to?(:compresses_pprof?) && pprof_recorder.compresses_pprof?
+          start, finish, serialized_profile = pprof_recorder.serialize_without_copy
+
+          return [start, finish, nil] if serialized_profile.nil?
+          return [start, finish, serialized_profile] if serialized_profile.compression == REPORTED_PPROF_COMPRESSION
+
+          unless serialized_profile.compression.nil?
+            # We can't recompress it here, and the backend would not be able to read it, so it can't be reported
+            Datadog.logger.error(
+              "Dropping profile compressed with #{serialized_profile.compression.inspect}, as only " \
+              "#{REPORTED_PPROF_COMPRESSION.inspect} pprofs can be reported"
+            )
+            serialized_profile.release
+            return [start, finish, nil]
+          end
+
+          # Compression failed, so the pprof was left uncompressed (see StackRecorder#stats)
+          uncompressed_pprof = serialized_profile.to_s
+          serialized_profile.release
+        else
+          start, finish, uncompressed_pprof = pprof_recorder.serialize
+        end
+
+        return [start, finish, nil] if uncompressed_pprof.nil?
+
+        [start, finish, Datadog::Core::Utils::Compression.gzip(uncompressed_pprof)]
+      end
+
       def duration_below_threshold?(start, finish)
         (finish - start) < @minimum_duration
       end
@@ -5,6 +5,9 @@ module Datadog
     module Ext
       ENV_ENABLED = 'DD_PROFILING_ENABLED'.freeze
       ENV_UPLOAD_TIMEOUT = 'DD_PROFILING_UPLOAD_TIMEOUT'.freeze
+      ENV_UPLOAD_ASYNCHRONOUS_ENABLED = 'DD_PROFILING_UPLOAD_ASYNCHRONOUS_ENABLED'.freeze
+      ENV_UPLOAD_SPOOL_DIRECTORY = 'DD_PROFILING_UPLOAD_SPOOL_DIRECTORY'.freeze
+      ENV_UPLOAD_SPOOL_MAX_SIZE_BYTES = 'DD_PROFILING_UPLOAD_SPOOL_MAX_SIZE_BYTES'.freeze
       ENV_MAX_FRAMES = 'DD_PROFILING_MAX_FRAMES'.freeze
       ENV_AGENTLESS = 'DD_PROFILING_AGENTLESS'.freeze
       ENV_ENDPOINT_COLLECTION_ENABLED = 'DD_PROFILING_ENDPOINT_COLLECTION_ENABLED'.freeze
@@ -14,7 +14,7 @@ module Datadog
         :start,
         :finish,
         :pprof_file_name,
-        :pprof_data, # gzipped pprof bytes
+        :pprof_data, # gzipped pprof bytes, or a gzipped SerializedProfile
         :code_provenance_file_name,
         :code_provenance_data, # gzipped json bytes
         :tags_as_array
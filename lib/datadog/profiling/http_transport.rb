@@ -1,12 +1,35 @@
 # typed: false
 
+require 'fileutils'
+
 module Datadog
   module Profiling
     # Used to report profiling data to Datadog.
     # Methods prefixed with _native_ are implemented in `http_transport.c`
+    #
+    # The native exporter (and thus its connections) gets reused across exports, and is only recreated when the tags
+    # being reported change.
+    #
+    # When `asynchronous_uploads` is enabled, `export` only queues the profile, which then gets reported from a native
+    # background thread (see `upload_queue.c`). How it went gets logged on the next `export` (or
+    # `wait_for_pending_uploads`).
+    #
+    # When a `spool_directory` is given, profiles that can't be reported because the agent is unreachable or unavailable
+    # get written there (see `spool.c`), and are reported back in the background once reporting works again.
     class HttpTransport
-      def initialize(agent_settings:, site:, api_key:, upload_timeout_seconds:)
+      DEFAULT_SPOOL_MAX_SIZE_BYTES = 64 * 1024 * 1024
+
+      def initialize(
+        agent_settings:,
+        site:,
+        api_key:,
+        upload_timeout_seconds:,
+        asynchronous_uploads: false,
+        spool_directory: nil,
+        spool_max_size_bytes: DEFAULT_SPOOL_MAX_SIZE_BYTES
+      )
         @upload_timeout_milliseconds = (upload_timeout_seconds * 1_000).to_i
+        @asynchronous_uploads = asynchronous_uploads
 
         validate_agent_settings(agent_settings)
 
@@ -20,44 +43,54 @@ module Datadog
         status, result = validate_exporter(@exporter_configuration)
 
         raise(ArgumentError, "Failed to initialize transport: #{result}") if status == :error
+
+        @exporter_tags = nil
+        @exporter_pid = nil
+
+        @spool_enabled = spool_directory ? configure_spool(spool_directory, spool_max_size_bytes) : false
       end
 
       def export(flush)
-        status, result = do_export(
-          exporter_configuration: @exporter_configuration,
-          upload_timeout_milliseconds: @upload_timeout_milliseconds,
+        # Results for profiles reported back from the spool show up here too, even without asynchronous uploads
+        log_upload_results
 
-          # why "timespec"?
-          # libddprof represents time using POSIX's struct timespec, see
-          # https://www.gnu.org/software/libc/manual/html_node/Time-Types.html
-          # aka it represents the seconds part separate from the nanoseconds part
-          start_timespec_seconds: flush.start.tv_sec,
-          start_timespec_nanoseconds: flush.start.tv_nsec,
-          finish_timespec_seconds: flush.finish.tv_sec,
-          finish_timespec_nanoseconds: flush.finish.tv_nsec,
+        return false unless configure_exporter(flush.tags_as_array)
 
-          pprof_file_name: flush.pprof_file_name,
-          pprof_data: flush.pprof_data,
-          code_provenance_file_name: flush.code_provenance_file_name,
-          code_provenance_data: flush.code_provenance_data,
+        if @asynchronous_uploads
+          status, result = self.class._native_enqueue_export(self, *export_arguments(flush))
 
-          tags_as_array: flush.tags_as_array,
-        )
-
-        if status == :ok
-          if (200..299).cover?(result)
-            Datadog.logger.debug('Successfully reported profiling data')
+          if status == :ok
+            Datadog.logger.debug('Queued profiling data to be reported')
             true
           else
-            Datadog.logger.error("Failed to report profiling data: server returned unexpected HTTP #{result} status code")
+            Datadog.logger.error("Failed to report profiling data: #{result}")
             false
           end
         else
-          Datadog.logger.error("Failed to report profiling data: #{result}")
-          false
+          status, result = self.class._native_do_export(self, *export_arguments(flush))
+
+          reported = log_export_result(status, result)
+          # E.g. if the profile could not be spooled
+          log_upload_results
+          replay_spool if reported && @spool_enabled
+          reported
         end
       end
 
+      # Waits for the profiles queued by `export` to be reported, and logs how it went. This waits at most for the upload
+      # timeout in total (regardless of how many profiles are queued), or for `timeout_seconds`, if given and shorter.
+      # Returns true if there was nothing left to report.
+      def wait_for_pending_uploads(timeout_seconds: nil)
+        timeout_milliseconds = @upload_timeout_milliseconds
+        timeout_milliseconds = [timeout_milliseconds, (timeout_seconds * 1_000).to_i].min if timeout_seconds
+
+        idle = self.class._native_wait_for_pending_uploads(self, timeout_milliseconds)
+
+        log_upload_results
+
+        idle
+      end
+
       # Used to log soft failures in `ddprof_ffi_Vec_tag_push` (e.g. we still report the profile in these cases)
       # Called from native code
       def self.log_failure_to_process_tag(failure_details)
@@ -99,32 +132,75 @@ module Datadog
         self.class._native_validate_exporter(exporter_configuration)
       end
 
-      def do_export(
-        exporter_configuration:,
-        upload_timeout_milliseconds:,
-        start_timespec_seconds:,
-        start_timespec_nanoseconds:,
-        finish_timespec_seconds:,
-        finish_timespec_nanoseconds:,
-        pprof_file_name:,
-        pprof_data:,
-        code_provenance_file_name:,
-        code_provenance_data:,
-        tags_as_array:
-      )
-        self.class._native_do_export(
-          exporter_configuration,
-          upload_timeout_milliseconds,
-          start_timespec_seconds,
-          start_timespec_nanoseconds,
-          finish_timespec_seconds,
-          finish_timespec_nanoseconds,
-          pprof_file_name,
-          pprof_data,
-          code_provenance_file_name,
-          code_provenance_data,
-          tags_as_array,
-        )
+      def configure_exporter(tags_as_array)
+        # libddprof exporters can't be reused after a fork, so children get their own
+        return true if @exporter_tags == tags_as_array && @exporter_pid == Process.pid
+
+        status, result = self.class._native_configure_exporter(self, @exporter_configuration, tags_as_array)
+
+        if status == :ok
+          @exporter_tags = tags_as_array
+          @exporter_pid = Process.pid
+          true
+        else
+          Datadog.logger.error("Failed to report profiling data: #{result}")
+          false
+        end
+      end
+
+      def configure_spool(spool_directory, spool_max_size_bytes)
+        FileUtils.mkdir_p(spool_directory)
+        self.class._native_configure_spool(self, spool_directory, spool_max_size_bytes)
+        true
+      rescue SystemCallError => e
+        Datadog.logger.warn("Not spooling profiles that fail to be reported: #{e.class.name} #{e.message}")
+        false
+      end
+
+      # Asynchronous uploads take care of this by themselves
+      def replay_spool
+        status, result = self.class._native_replay_spool(self, @upload_timeout_milliseconds)
+
+        Datadog.logger.error("Failed to report spooled profiling data: #{result}") if status == :error
+      end
+
+      def export_arguments(flush)
+        [
+          @upload_timeout_milliseconds,
+
+          # why "timespec"?
+          # libddprof represents time using POSIX's struct timespec, see
+          # https://www.gnu.org/software/libc/manual/html_node/Time-Types.html
+          # aka it represents the seconds part separate from the nanoseconds part
+          flush.start.tv_sec,
+          flush.start.tv_nsec,
+          flush.finish.tv_sec,
+          flush.finish.tv_nsec,
+
+          flush.pprof_file_name,
+          flush.pprof_data,
+          flush.code_provenance_file_name,
+          flush.code_provenance_data,
+        ]
+      end
+
+      def log_upload_results
+        self.class._native_take_upload_results(self).each { |status, result| log_export_result(status, result) }
+      end
+
+      def log_export_result(status, result)
+        if status == :ok
+          if (200..299).cover?(result)
+            Datadog.logger.debug('Successfully reported profiling data')
+            true
+          else
+            Datadog.logger.error("Failed to report profiling data: server returned unexpected HTTP #{result} status code")
+            false
+          end
+        else
+          Datadog.logger.error("Failed to report profiling data: #{result}")
+          false
+        end
       end
     end
   end
@@ -19,6 +19,10 @@ module Datadog
       # reporting profiles at the exact same time
       DEFAULT_FLUSH_JITTER_MAXIMUM_SECONDS = 3
 
+      # When reporting the last profile (e.g. while the app is shutting down), we wait at most this long for the
+      # transport to finish reporting it in the background, so as to not hold up the shutdown
+      SHUTDOWN_UPLOAD_WAIT_SECONDS = 1
+
       private
 
       attr_reader \
@@ -121,12 +125,23 @@ module Datadog
 
         begin
           transport.export(flush)
+
+          # Transports may report profiles in the background. In that case, if we're not running in a loop, there may
+          # not be a next flush to report how this one went (or it may never get reported, if the app is exiting).
+          wait_for_pending_uploads unless run_loop?
         rescue StandardError => e
           Datadog.logger.error("Unable to report profile. Cause: #{e} Location: #{Array(e.backtrace).first}")
         end
 
         true
       end
+
+      def wait_for_pending_uploads
+        # Only the HttpTransport (and not the legacy transport) supports this
+        return unless transport.respond_to?(:wait_for_pending_uploads)
+
+        transport.wait_for_pending_uploads(timeout_seconds: SHUTDOWN_UPLOAD_WAIT_SECONDS)
+      end
     end
   end
 end
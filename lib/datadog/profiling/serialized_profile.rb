@@ -0,0 +1,35 @@
+# typed: false
+
+module Datadog
+  module Profiling
+    # Holds a pprof serialized by the StackRecorder, in the buffer libddprof serialized it into (or that it was then
+    # compressed into), rather than as a Ruby String (see `StackRecorder#serialize_without_copy`).
+    # Methods prefixed with _native_ are implemented in `serialized_profile.c`
+    #
+    # The HttpTransport reports it without copying it, and releases it once done. Otherwise, it gets released when it is
+    # garbage collected, or when `release` gets called.
+    class SerializedProfile
+      # Copies the pprof into a new Ruby String
+      def to_s
+        self.class._native_to_s(self)
+      end
+
+      def bytesize
+        self.class._native_bytesize(self)
+      end
+
+      # The codec the pprof was compressed with (e.g. `:gzip`), or nil if it is not compressed
+      def compression
+        self.class._native_compression(self)
+      end
+
+      def release
+        self.class._native_release(self)
+      end
+
+      def released?
+        self.class._native_released?(self)
+      end
+    end
+  end
+end
@@ -1,19 +1,103 @@
 # typed: false
 
+require 'datadog/profiling/serialized_profile'
+
 module Datadog
   module Profiling
     # Used to wrap a ddprof_ffi_Profile in a Ruby object and expose Ruby-level serialization APIs
     # Methods prefixed with _native_ are implemented in `stack_recorder.c`
+    #
+    # Samples keep being recorded while a profile is being serialized: they go into the next profile, which starts when
+    # `serialize` gets called.
+    #
+    # Only the value types listed in `enabled_value_types` (out of the `VALUE_TYPES`, which get defined in
+    # `stack_recorder.c`) get stored in the profiles. Collectors may skip gathering values for the ones not enabled. By
+    # default, only the `DEFAULT_ENABLED_VALUE_TYPES` gathered by every sample of the CpuAndWallTime collector are kept;
+    # callers that also use other collectors (e.g. Collectors::Allocations) need to enable the value types they record.
+    #
+    # When `aggregate_samples` is enabled (it's off by default), samples with the same stack and labels get summed up
+    # natively before being handed over to libddprof. Stacks are matched by the frames they were sampled from, rather
+    # than by their names and filenames.
+    #
+    # Whether or not `aggregate_samples` is enabled, the size of each profile is capped: at most
+    # `max_aggregated_samples` distinct samples, whose stacks and labels take up at most `max_aggregated_bytes`, are
+    # kept. Once either limit is reached, samples get folded into a single "Truncated Stacks" sample (see `#stats`).
+    # When aggregating, it's the samples with the lowest values that get folded; otherwise, samples already handed over
+    # to libddprof can't be folded anymore, so it's any new distinct samples that get folded instead.
+    #
+    # When `pprof_compression` is set (to one of the `AVAILABLE_PPROF_COMPRESSIONS`, which depend on the libraries
+    # available when the native extension was built), serialized pprofs get compressed natively, without holding the
+    # Global VM Lock, using the given `pprof_compression_level` (or the codec's default, when nil). Both `serialize` and
+    # `serialize_without_copy` then return the compressed pprof. Note that the profiling backend (and thus the
+    # `Exporter`) only accepts pprofs compressed with `:gzip`.
     class StackRecorder
+      DEFAULT_ENABLED_VALUE_TYPES = ['cpu-time', 'cpu-samples', 'wall-time'].freeze
+      DEFAULT_MAX_AGGREGATED_SAMPLES = 10_000
+      DEFAULT_MAX_AGGREGATED_BYTES = 32 * 1024 * 1024
+
+      def initialize(
+        enabled_value_types: DEFAULT_ENABLED_VALUE_TYPES,
+        aggregate_samples: false,
+        max_aggregated_samples: DEFAULT_MAX_AGGREGATED_SAMPLES,
+        max_aggregated_bytes: DEFAULT_MAX_AGGREGATED_BYTES,
+        pprof_compression: nil,
+        pprof_compression_level: nil
+      )
+        if max_aggregated_samples <= 0
+          raise ArgumentError, "Invalid max_aggregated_samples: #{max_aggregated_samples.inspect}, must be positive"
+        end
+
+        if max_aggregated_bytes <= 0
+          raise ArgumentError, "Invalid max_aggregated_bytes: #{max_aggregated_bytes.inspect}, must be positive"
+        end
+
+        if pprof_compression && !AVAILABLE_PPROF_COMPRESSIONS.include?(pprof_compression)
+          raise ArgumentError,
+            "Unsupported pprof_compression: #{pprof_compression.inspect}, " \
+            "available: #{AVAILABLE_PPROF_COMPRESSIONS.inspect}"
+        end
+
+        @pprof_compression = pprof_compression
+
+        self.class._native_initialize(
+          self,
+          enabled_value_types,
+          aggregate_samples,
+          max_aggregated_samples,
+          max_aggregated_bytes,
+          pprof_compression,
+          pprof_compression_level,
+        )
+      end
+
+      attr_reader :pprof_compression
+
+      def compresses_pprof?
+        !@pprof_compression.nil?
+      end
+
       def serialize
+        start, finish, serialized_profile = serialize_without_copy
+
+        return unless serialized_profile
+
+        encoded_pprof = serialized_profile.to_s
+        serialized_profile.release
+
+        [start, finish, encoded_pprof]
+      end
+
+      # Same as `serialize`, but the pprof is returned as a `SerializedProfile`, which can be reported by the
+      # `HttpTransport` without ever being copied into a Ruby String
+      def serialize_without_copy
         status, result = self.class._native_serialize(self)
 
         if status == :ok
-          start, finish, encoded_pprof = result
+          start, finish, serialized_profile = result
 
           Datadog.logger.debug { "Encoded profile covering #{start.iso8601} to #{finish.iso8601}" }
 
-          [start, finish, encoded_pprof]
+          [start, finish, serialized_profile]
         else
           error_message = result
 
@@ -23,6 +107,20 @@ module Datadog
         end
       end
 
+      # Returns a hash with how many times a serialized profile couldn't be reset afterwards (its pprof is still reported,
+      # and its samples get dropped before it starts being recorded into again).
+      #
+      # It also includes the limits for each profile, how many distinct samples the current profile has, how many
+      # samples matched an existing one (and, when aggregating, got merged into it), how many got folded into the
+      # "Truncated Stacks" sample, and the memory used to keep track of them (in bytes).
+      #
+      # When `pprof_compression` is set, it also includes the totals for every pprof compressed so far: how many were
+      # compressed (or failed to be, and were left uncompressed), their sizes before and after, the overall compression
+      # ratio, and the time spent compressing them.
+      def stats
+        self.class._native_stats(self)
+      end
+
       # Used only for Ruby 2.2 and below which don't have the native `rb_time_timespec_new` API
       # Called from native code
       def self.ruby_time_from(timespec_seconds, timespec_nanoseconds)
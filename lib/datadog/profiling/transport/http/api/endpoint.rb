@@ -59,7 +59,11 @@ module Datadog
             end
 
             def build_pprof(flush)
-              gzipped_pprof_data = flush.pprof_data
+              pprof_data = flush.pprof_data
+              gzipped_pprof_data = pprof_data.to_s
+
+              # This transport needs a copy of SerializedProfiles, so we don't wait for the GC to release the original
+              pprof_data.release if pprof_data.respond_to?(:release)
 
               Core::Vendor::Multipart::Post::UploadIO.new(
                 StringIO.new(gzipped_pprof_data),
@@ -471,6 +471,87 @@ RSpec.describe Datadog::Core::Configuration::Settings do
           end
         end
       end
+
+      describe '#asynchronous_enabled' do
+        subject(:asynchronous_enabled) { settings.profiling.upload.asynchronous_enabled }
+
+        context "when #{Datadog::Profiling::Ext::ENV_UPLOAD_ASYNCHRONOUS_ENABLED}" do
+          around do |example|
+            ClimateControl.modify(Datadog::Profiling::Ext::ENV_UPLOAD_ASYNCHRONOUS_ENABLED => environment) do
+              example.run
+            end
+          end
+
+          context 'is not defined' do
+            let(:environment) { nil }
+
+            it { is_expected.to be false }
+          end
+
+          context 'is defined' do
+            let(:environment) { 'true' }
+
+            it { is_expected.to be true }
+          end
+        end
+      end
+
+      describe '#spool_directory' do
+        subject(:spool_directory) { settings.profiling.upload.spool_directory }
+
+        context "when #{Datadog::Profiling::Ext::ENV_UPLOAD_SPOOL_DIRECTORY}" do
+          around do |example|
+            ClimateControl.modify(Datadog::Profiling::Ext::ENV_UPLOAD_SPOOL_DIRECTORY => environment) do
+              example.run
+            end
+          end
+
+          context 'is not defined' do
+            let(:environment) { nil }
+
+            it { is_expected.to be nil }
+          end
+
+          context 'is defined' do
+            let(:environment) { '/tmp/profiling-spool' }
+
+            it { is_expected.to eq '/tmp/profiling-spool' }
+          end
+        end
+      end
+
+      describe '#spool_max_size_bytes' do
+        subject(:spool_max_size_bytes) { settings.profiling.upload.spool_max_size_bytes }
+
+        context "when #{Datadog::Profiling::Ext::ENV_UPLOAD_SPOOL_MAX_SIZE_BYTES}" do
+          around do |example|
+            ClimateControl.modify(Datadog::Profiling::Ext::ENV_UPLOAD_SPOOL_MAX_SIZE_BYTES => environment) do
+              example.run
+            end
+          end
+
+          context 'is not defined' do
+            let(:environment) { nil }
+
+            it { is_expected.to be 64 * 1024 * 1024 }
+          end
+
+          context 'is defined' do
+            let(:environment) { '1048576' }
+
+            it { is_expected.to be 1048576 }
+          end
+        end
+      end
+
+      describe '#spool_max_size_bytes=' do
+        it 'updates the #spool_max_size_bytes setting' do
+          expect { settings.profiling.upload.spool_max_size_bytes = 1024 }
+            .to change { settings.profiling.upload.spool_max_size_bytes }
+            .from(64 * 1024 * 1024)
+            .to(1024)
+        end
+      end
     end
   end
 
@@ -0,0 +1,259 @@
+# typed: ignore
+
+require 'datadog/profiling/spec_helper'
+require 'datadog/profiling/collectors/allocations'
+
+RSpec.describe Datadog::Profiling::Collectors::Allocations do
+  before { skip_if_profiling_not_supported(self) }
+
+  let(:recorder) do
+    Datadog::Profiling::StackRecorder.new(enabled_value_types: Datadog::Profiling::StackRecorder::VALUE_TYPES)
+  end
+  let(:max_frames) { 123 }
+  let(:sampling_interval_bytes) { 4096 }
+
+  subject(:allocations_collector) do
+    described_class.new(recorder: recorder, max_frames: max_frames, sampling_interval_bytes: sampling_interval_bytes)
+  end
+
+  after { allocations_collector.stop }
+
+  let(:example_class) { stub_const('AllocationsSpecExampleObject', Class.new) }
+
+  def allocate_example_objects(count)
+    example_class = self.example_class
+    count.times { example_class.new }
+  end
+
+  def samples_from(serialization_result)
+    decoded_profile = ::Perftools::Profiles::Profile.decode(serialization_result.last)
+    strings = decoded_profile.string_table
+    value_types = decoded_profile.sample_type.map { |type| strings[type.type] }
+
+    decoded_profile.sample.map do |sample|
+      {
+        values: value_types.zip(sample.value).to_h,
+        labels: sample.label.map { |label| [strings[label.key], strings[label.str]] }.to_h,
+        functions: sample.location_id.map do |location_id|
+          line_entry = decoded_profile.location.find { |location| location.id == location_id }.line.first
+          strings[decoded_profile.function.find { |func| func.id == line_entry.function_id }.name]
+        end,
+      }
+    end
+  end
+
+  describe '#start' do
+    it 'samples allocations, tagging them with the class of the object allocated' do
+      example_class
+      allocations_collector.start
+      allocate_example_objects(10_000)
+      allocations_collector.stop
+
+      example_samples = samples_from(recorder.serialize).select do |sample|
+        sample[:labels]['allocation class'] == 'AllocationsSpecExampleObject'
+      end
+
+      expect(example_samples).to_not be_empty
+      expect(example_samples.map { |sample| sample[:functions] }).to all(include('allocate_example_objects'))
+    end
+
+    it 'records, for each sample, the allocations since the previous sample' do
+      allocations_collector.start
+      allocate_example_objects(10_000)
+      allocations_collector.stop
+
+      samples = samples_from(recorder.serialize)
+      total_allocations = samples.map { |sample| sample[:values]['alloc-samples'] }.inject(0, :+)
+
+      # Roughly all allocations get accounted for; some of them happen after the last sample and thus are not recorded
+      expect(total_allocations).to be >= 5_000
+      expect(samples.size).to be < total_allocations
+      # Each object is accounted as one object slot, which is 5 machine words
+      expect(samples.map { |sample| sample[:values]['alloc-space'] })
+        .to eq(samples.map { |sample| sample[:values]['alloc-samples'] * 5 * 0.size })
+    end
+
+    it 'does not allow two instances to sample at the same time' do
+      allocations_collector.start
+
+      another_collector = described_class.new(recorder: Datadog::Profiling::StackRecorder.new, max_frames: max_frames)
+
+      expect { another_collector.start }.to raise_error(RuntimeError, /another instance/)
+    end
+  end
+
+  describe '#stop' do
+    it 'stops sampling allocations' do
+      allocations_collector.start
+      allocations_collector.stop
+
+      expect { allocate_example_objects(10_000) }.to_not(change { allocations_collector.stats[:sampled_allocations] })
+    end
+
+    it 'returns false when not sampling' do
+      expect(allocations_collector.stop).to be false
+    end
+  end
+
+  context 'when heap tracking is enabled' do
+    let(:max_tracked_objects) { 1_000 }
+
+    subject(:allocations_collector) do
+      described_class.new(
+        recorder: recorder,
+        max_frames: max_frames,
+        sampling_interval_bytes: sampling_interval_bytes,
+        heap_tracking: true,
+        max_tracked_objects: max_tracked_objects,
+      )
+    end
+
+    def allocate_retained_objects(count)
+      example_class = self.example_class
+      Array.new(count) { example_class.new }
+    end
+
+    def heap_samples_from(serialization_result)
+      samples_from(serialization_result).select { |sample| sample[:values]['heap-space'] > 0 }
+    end
+
+    it 'records the objects that are still alive as heap-space, at the stack where they were allocated' do
+      allocations_collector.start
+      retained_objects = allocate_retained_objects(10_000)
+      allocations_collector.stop
+
+      heap_samples = heap_samples_from(recorder.serialize)
+
+      expect(heap_samples.map { |sample| sample[:functions] }).to include(include('allocate_retained_objects'))
+      expect(retained_objects.size).to be 10_000
+    end
+
+    # The objects get allocated in a thread that then finishes, as otherwise a stale reference left on the stack of the
+    # current thread could keep them alive (the GC scans native stacks conservatively)
+    def allocate_and_free_objects(count)
+      Thread.new { allocate_retained_objects(count) && nil }.join
+      GC.start(full_mark: true, immediate_sweep: true)
+    end
+
+    it 'does not record objects that were freed' do
+      allocations_collector.start
+      allocate_and_free_objects(10_000)
+      allocations_collector.stop
+
+      heap_samples = heap_samples_from(recorder.serialize)
+
+      expect(heap_samples.map { |sample| sample[:functions] }).to_not include(include('allocate_retained_objects'))
+    end
+
+    it 'stops tracking the stacks of objects that were freed, without waiting for serialization' do
+      allocations_collector.start
+      thread = Thread.new do
+        Thread.current[:retained_objects] = allocate_retained_objects(10_000)
+        nil
+      end
+      thread.join
+      tracked_stacks_while_alive = allocations_collector.stats.fetch(:heap_tracked_stacks)
+
+      thread[:retained_objects] = nil
+      GC.start(full_mark: true, immediate_sweep: true)
+      tracked_stacks_after_gc = allocations_collector.stats.fetch(:heap_tracked_stacks)
+      allocations_collector.stop
+
+      expect(tracked_stacks_after_gc).to be < tracked_stacks_while_alive
+    end
+
+    it 'does not track more than max_tracked_objects' do
+      allocations_collector.start
+      retained_objects = allocate_retained_objects(100_000)
+      allocations_collector.stop
+
+      expect(allocations_collector.stats).to include(
+        heap_tracked_objects: be <= max_tracked_objects,
+        heap_max_tracked_objects: max_tracked_objects,
+        heap_skipped_objects: be > 0,
+        heap_tracked_stacks: be > 0,
+        heap_tracker_memory_bytes: be > 0,
+      )
+      expect(retained_objects.size).to be 100_000
+    end
+
+    context 'when objects that got freed without the heap tracker noticing are removed while recording the live heap' do
+      before { require 'objspace' }
+
+      let(:max_tracked_objects) { 4 }
+
+      def live_heap_bytes_from(serialization_result)
+        heap_samples_from(serialization_result).map { |sample| sample[:values]['heap-space'] }.inject(0, :+)
+      end
+
+      # With so few slots for tracked objects (see heap_tracker.c), removing an object often moves the objects that wrap
+      # around the end of the table, which (with enough tries) also covers moving objects that were already looked at
+      it 'counts every object that is still alive exactly once' do
+        100.times do
+          recorder =
+            Datadog::Profiling::StackRecorder.new(enabled_value_types: Datadog::Profiling::StackRecorder::VALUE_TYPES)
+          collector = described_class.new(
+            recorder: recorder,
+            max_frames: max_frames,
+            heap_tracking: true,
+            max_tracked_objects: max_tracked_objects,
+          )
+          retained_objects = allocate_retained_objects(2)
+          # Integers are never on the Ruby heap, so they look like objects that got freed
+          freed_objects = Array.new(2) { rand(2**40) }
+
+          described_class._native_track_objects(collector, freed_objects + retained_objects)
+
+          expect(live_heap_bytes_from(recorder.serialize))
+            .to eq(retained_objects.map { |object| ObjectSpace.memsize_of(object) }.inject(0, :+))
+          expect(collector.stats).to include(heap_tracked_objects: 2)
+        end
+      end
+    end
+
+    it 'rejects invalid max_tracked_objects' do
+      expect do
+        described_class.new(recorder: recorder, max_frames: max_frames, heap_tracking: true, max_tracked_objects: 0)
+      end.to raise_error(ArgumentError, /max_tracked_objects/)
+    end
+  end
+
+  describe '#stats' do
+    it 'reports how many allocations were sampled' do
+      allocations_collector.start
+      allocate_example_objects(10_000)
+      allocations_collector.stop
+      allocations_collector.flush
+
+      expect(allocations_collector.stats).to include(
+        sampled_allocations: be > 0,
+        sampling_interval_bytes: sampling_interval_bytes,
+      )
+    end
+  end
+
+  describe 'memory usage reporting' do
+    before { require 'objspace' }
+
+    it 'includes the memory used to track the live heap' do
+      heap_tracking_collector = described_class.new(
+        recorder: recorder,
+        max_frames: max_frames,
+        heap_tracking: true,
+        max_tracked_objects: 100_000,
+      )
+
+      memsize = ObjectSpace.memsize_of(heap_tracking_collector)
+
+      expect(memsize).to be > ObjectSpace.memsize_of(allocations_collector)
+      expect(memsize).to be > heap_tracking_collector.stats.fetch(:heap_tracker_memory_bytes)
+    end
+  end
+
+  describe '.new' do
+    it 'rejects invalid sampling intervals' do
+      expect { described_class.new(recorder: recorder, max_frames: max_frames, sampling_interval_bytes: 0) }
+        .to raise_error(ArgumentError, /sampling_interval_bytes/)
+    end
+  end
+end
@@ -6,7 +6,9 @@ require 'datadog/profiling/collectors/cpu_and_wall_time'
 RSpec.describe Datadog::Profiling::Collectors::CpuAndWallTime do
   before { skip_if_profiling_not_supported(self) }
 
-  let(:recorder) { Datadog::Profiling::StackRecorder.new }
+  let(:recorder) do
+    Datadog::Profiling::StackRecorder.new(enabled_value_types: Datadog::Profiling::StackRecorder::VALUE_TYPES)
+  end
   let(:max_frames) { 123 }
 
   subject(:cpu_and_wall_time_collector) { described_class.new(recorder: recorder, max_frames: max_frames) }
@@ -52,14 +54,709 @@ RSpec.describe Datadog::Profiling::Collectors::CpuAndWallTime do
       expect(decoded_profile.sample.size).to be all_threads.size
     end
 
-    def sample_and_decode
+    it 'gathers the same stacks for threads that did not move when sampling again after a GC' do
+      first_stacks = sleeping_stacks_from(sample_and_decode)
+
+      GC.start
+      GC.compact if GC.respond_to?(:compact)
+
+      second_stacks = sleeping_stacks_from(sample_and_decode)
+
+      expect(first_stacks.size).to be >= 3
+      expect(second_stacks).to eq first_stacks
+    end
+
+    it 'records one cpu-sample for each thread' do
+      decoded_profile = sample_and_decode
+
+      expect(values_from(decoded_profile).map { |values| values.fetch('cpu-samples') }).to all(be 1)
+    end
+
+    it 'records zero cpu-time and wall-time for threads on their first sample' do
+      decoded_profile = sample_and_decode
+
+      expect(values_from(decoded_profile)).to all(include('cpu-time' => 0, 'wall-time' => 0))
+    end
+
+    it 'records the wall-time elapsed since the previous sample of each thread' do
+      sample_and_decode
+
+      sleep 0.01
+      decoded_profile = sample_and_decode
+
+      expect(values_from(decoded_profile).map { |values| values.fetch('wall-time') }).to all(be >= 10_000_000)
+    end
+
+    it 'records the os-runqueue-wait of each thread since its previous sample' do
+      skip 'Scheduler stats are only available on Linux' unless PlatformHelpers.linux?
+      skip 'Native thread ids are only available on Ruby 3.1+' if RUBY_VERSION < '3.1'
+      skip 'Scheduler stats are not enabled in this kernel' unless File.exist?('/proc/self/schedstat')
+
+      sample_and_decode
+      decoded_profile = sample_and_decode
+
+      expect(cpu_and_wall_time_collector.per_thread_context.values)
+        .to all(include(runqueue_wait_at_previous_sample_ns: be >= 0))
+      expect(values_from(decoded_profile).map { |values| values.fetch('os-runqueue-wait') }).to all(be >= 0)
+    end
+
+    context 'when the sampled thread is competing with other processes for the CPU' do
+      before do
+        skip 'Scheduler stats are only available on Linux' unless PlatformHelpers.linux?
+        skip 'Native thread ids are only available on Ruby 3.1+' if RUBY_VERSION < '3.1'
+        skip 'Scheduler stats are not enabled in this kernel' unless File.exist?('/proc/self/schedstat')
+      end
+
+      def busy_loop_until(deadline)
+        nil while Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+      end
+
+      it 'records a non-zero os-runqueue-wait for it' do
+        require 'etc'
+
+        sample_and_decode
+        deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 0.5
+        busy_processes = Array.new(Etc.nprocessors * 2) do
+          fork do
+            busy_loop_until(deadline)
+            exit!(0)
+          end
+        end
+        begin
+          busy_loop_until(deadline)
+        ensure
+          busy_processes.each { |pid| Process.wait(pid) }
+        end
+        decoded_profile = sample_and_decode
+
+        main_thread_sample = decoded_profile.sample.find do |sample|
+          decode_stack(decoded_profile, sample).any? { |frame| frame[:base_label] == 'sample_and_decode' }
+        end
+
+        expect(sample_values(decoded_profile, main_thread_sample).fetch('os-runqueue-wait')).to be > 0
+      end
+    end
+
+    context 'after a fork' do
+      before do
+        skip 'Scheduler stats are only available on Linux' unless PlatformHelpers.linux?
+        skip 'Native thread ids are only available on Ruby 3.1+' if RUBY_VERSION < '3.1'
+        skip 'Scheduler stats are not enabled in this kernel' unless File.exist?('/proc/self/schedstat')
+      end
+
+      it 'reads the os-runqueue-wait of the threads in the child, not the ones in the parent' do
+        2.times { cpu_and_wall_time_collector.sample }
+
+        expect_in_fork do
+          cpu_and_wall_time_collector.sample
+          runqueue_wait_ns = cpu_and_wall_time_collector.per_thread_context
+            .fetch(Thread.current).fetch(:runqueue_wait_at_previous_sample_ns)
+          # The second field is the time spent waiting on a runqueue
+          current_runqueue_wait_ns = File.read('/proc/thread-self/schedstat').split[1].to_i
+
+          expect(runqueue_wait_ns).to be_between(0, current_runqueue_wait_ns)
+        end
+      end
+    end
+
+    context 'when the recorder does not enable os-runqueue-wait' do
+      let(:recorder) do
+        Datadog::Profiling::StackRecorder.new(enabled_value_types: ['cpu-time', 'cpu-samples', 'wall-time'])
+      end
+
+      it 'does not read the os-runqueue-wait of each thread' do
+        2.times { cpu_and_wall_time_collector.sample }
+
+        expect(cpu_and_wall_time_collector.per_thread_context.values)
+          .to all(include(runqueue_wait_at_previous_sample_ns: -1))
+      end
+    end
+
+    it 'records the cpu-time spent by each thread since its previous sample' do
+      skip 'Per-thread CPU time is only available on Linux' unless PlatformHelpers.linux?
+
+      sample_and_decode
+
+      # Burn some CPU on the main thread; the other threads are sleeping
+      cpu_time_before = Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID, :nanosecond)
+      nil while Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID, :nanosecond) - cpu_time_before < 20_000_000
+
+      decoded_profile = sample_and_decode
+
+      main_thread_sample = decoded_profile.sample.find do |sample|
+        decode_stack(decoded_profile, sample).any? { |frame| frame[:base_label] == 'sample_and_decode' }
+      end
+      sleeping_samples = decoded_profile.sample.select do |sample|
+        decode_stack(decoded_profile, sample).first[:base_label] == 'sleep'
+      end
+
+      expect(sample_values(decoded_profile, main_thread_sample).fetch('cpu-time')).to be >= 20_000_000
+      expect(values_from(decoded_profile, sleeping_samples).map { |values| values.fetch('cpu-time') })
+        .to all(be < 20_000_000)
+    end
+
+    it 'does not allocate any Ruby objects' do
+      skip 'GC.stat(:total_allocated_objects) is not available on Ruby 2.1' if RUBY_VERSION < '2.2'
+
+      # The first samples fill in caches (e.g. for frame names), so we only look at the last one
+      allocations_per_sample = Array.new(3) do
+        allocated_objects_before = GC.stat(:total_allocated_objects)
+        cpu_and_wall_time_collector.sample
+        GC.stat(:total_allocated_objects) - allocated_objects_before
+      end
+
+      expect(allocations_per_sample.last).to be 0
+    end
+
+    context 'when a tracer is provided' do
+      subject(:cpu_and_wall_time_collector) do
+        described_class.new(recorder: recorder, max_frames: max_frames, tracer: tracer)
+      end
+
+      # Only the current thread has an active trace, so that's the only one with labels
+      def labels_from(decoded_profile)
+        strings = decoded_profile.string_table
+
+        decoded_profile.sample.reject { |sample| sample.label.empty? }.map do |sample|
+          sample.label.map { |label| [strings[label.key], strings[label.str]] }.to_h
+        end
+      end
+
+      it 'tags the samples of threads with an active trace with the trace identifiers' do
+        labels = nil
+        root_span_id = nil
+        span_id = nil
+
+        tracer.trace('profiler.test', type: 'web', resource: 'profiler.test.resource') do |root_span|
+          root_span_id = root_span.id
+          tracer.trace('profiler.test.inner') do |inner_span|
+            span_id = inner_span.id
+            labels = labels_from(sample_and_decode)
+          end
+        end
+
+        expect(labels).to eq(
+          [
+            {
+              'local root span id' => root_span_id.to_s,
+              'span id' => span_id.to_s,
+              'trace endpoint' => 'profiler.test.resource',
+            }
+          ]
+        )
+      end
+
+      it 'does not include the trace endpoint when the root span is not a web request' do
+        labels = nil
+
+        tracer.trace('profiler.test', type: 'worker', resource: 'profiler.test.resource') do
+          labels = labels_from(sample_and_decode)
+        end
+
+        expect(labels.map(&:keys)).to eq [['local root span id', 'span id']]
+      end
+
+      it 'does not tag samples of threads without an active trace' do
+        expect(labels_from(sample_and_decode)).to be_empty
+      end
+
+      context 'when endpoint_collection_enabled is false' do
+        subject(:cpu_and_wall_time_collector) do
+          described_class.new(
+            recorder: recorder,
+            max_frames: max_frames,
+            tracer: tracer,
+            endpoint_collection_enabled: false,
+          )
+        end
+
+        it 'does not include the trace endpoint' do
+          labels = nil
+
+          tracer.trace('profiler.test', type: 'web', resource: 'profiler.test.resource') do
+            labels = labels_from(sample_and_decode)
+          end
+
+          expect(labels.map(&:keys)).to eq [['local root span id', 'span id']]
+        end
+      end
+    end
+
+    context 'when a thread moved since the previous sample' do
+      let(:move_queue) { Queue.new }
+      let(:moving_thread_ready) { Queue.new }
+      let!(:moving_thread) do
+        Thread.new(move_queue, moving_thread_ready) do |move_queue, moving_thread_ready|
+          nested_call(20) do
+            moving_thread_ready << true
+            move_queue.pop
+            nested_call(5) do
+              moving_thread_ready << true
+              sleep
+            end
+          end
+        end
+      end
+
+      after do
+        moving_thread.kill
+        moving_thread.join
+      end
+
+      def nested_call(depth, &block)
+        depth > 0 ? nested_call(depth - 1, &block) : yield
+      end
+
+      it 'gathers the same stack as the Ruby reference stack trace APIs' do
+        moving_thread_ready.pop
+        sample_and_decode
+
+        move_queue << true
+        moving_thread_ready.pop
+        # Make sure the thread went to sleep
+        Thread.pass until moving_thread.status == 'sleep'
+
+        reference_stack = moving_thread.backtrace_locations.map do |location|
+          { base_label: location.base_label, path: location.path, lineno: location.lineno }
+        end
+        decoded_profile = sample_and_decode
+        gathered_stack = decoded_profile.sample
+          .map { |sample| decode_stack(decoded_profile, sample) }
+          .find { |stack| stack.count { |frame| frame[:base_label] == 'nested_call' } == 20 + 1 + 5 + 1 }
+
+        expect(gathered_stack).to eq reference_stack
+      end
+    end
+
+    context 'when a different caller replaced the frame below an unchanged leaf frame' do
+      let(:switch_queue) { Queue.new }
+      let(:switching_thread_ready) { Queue.new }
+      let!(:switching_thread) do
+        Thread.new(switch_queue, switching_thread_ready) do |switch_queue, switching_thread_ready|
+          first_caller(switch_queue, switching_thread_ready)
+          second_caller(switch_queue, switching_thread_ready)
+        end
+      end
+
+      after do
+        switching_thread.kill
+        switching_thread.join
+      end
+
+      # Both callers wait in `Queue#pop` at the same depth, so the leaf control frame stays exactly the same
+      def first_caller(switch_queue, switching_thread_ready)
+        switching_thread_ready << true
+        switch_queue.pop
+      end
+
+      def second_caller(switch_queue, switching_thread_ready)
+        switching_thread_ready << true
+        switch_queue.pop
+      end
+
+      def wait_for_switching_thread
+        switching_thread_ready.pop
+        Thread.pass until switching_thread.status == 'sleep'
+      end
+
+      it 'gathers the stack with the new caller' do
+        wait_for_switching_thread
+        sample_and_decode
+
+        switch_queue << true
+        wait_for_switching_thread
+
+        reference_stack = switching_thread.backtrace_locations.map do |location|
+          { base_label: location.base_label, path: location.path, lineno: location.lineno }
+        end
+        decoded_profile = sample_and_decode
+        gathered_stack = decoded_profile.sample
+          .map { |sample| decode_stack(decoded_profile, sample) }
+          .find { |stack| stack.any? { |frame| %w[first_caller second_caller].include?(frame[:base_label]) } }
+
+        expect(gathered_stack).to include(hash_including(base_label: 'second_caller'))
+        expect(gathered_stack).to_not include(hash_including(base_label: 'first_caller'))
+        expect(gathered_stack).to eq reference_stack
+      end
+    end
+
+    it 'creates a context for each thread' do
+      cpu_and_wall_time_collector.sample
+
+      expect(cpu_and_wall_time_collector.per_thread_context.keys).to include(Thread.main, t1, t2, t3)
+    end
+
+    it 'keeps the time of the previous sample for each thread' do
+      cpu_and_wall_time_collector.sample
+
+      expect(cpu_and_wall_time_collector.per_thread_context.values)
+        .to all(include(wall_time_at_previous_sample_ns: be > 0))
+    end
+
+    it 'removes the contexts of threads that are no longer alive' do
       cpu_and_wall_time_collector.sample
 
-      serialization_result = recorder.serialize
-      raise 'Unexpected: Serialization failed' unless serialization_result
+      t1.kill
+      t1.join
+      cpu_and_wall_time_collector.sample
 
-      pprof_data = serialization_result.last
-      ::Perftools::Profiles::Profile.decode(pprof_data)
+      expect(cpu_and_wall_time_collector.per_thread_context.keys).to include(Thread.main, t2, t3)
+      expect(cpu_and_wall_time_collector.per_thread_context.keys).to_not include(t1)
+    end
+
+    context 'when defer_symbolization is enabled' do
+      subject(:cpu_and_wall_time_collector) do
+        described_class.new(recorder: recorder, max_frames: max_frames, defer_symbolization: true)
+      end
+
+      it 'does not record samples until they get flushed' do
+        cpu_and_wall_time_collector.sample
+
+        expect(cpu_and_wall_time_collector.deferred_samples_count).to be Thread.list.size
+
+        cpu_and_wall_time_collector.flush_deferred_samples
+
+        expect(cpu_and_wall_time_collector.deferred_samples_count).to be 0
+      end
+
+      it 'records all deferred samples when the recorder gets serialized' do
+        all_threads = Thread.list
+
+        decoded_profile = sample_and_decode
+
+        expect(decoded_profile.sample.size).to be all_threads.size
+        expect(cpu_and_wall_time_collector.deferred_samples_count).to be 0
+      end
+
+      it 'gathers the same stacks as when symbolization is not deferred, even if there is a GC before flushing' do
+        described_class.new(recorder: recorder, max_frames: max_frames).sample
+        expected_stacks = sleeping_stacks_from(decode(recorder.serialize))
+
+        cpu_and_wall_time_collector.sample
+
+        GC.start
+        GC.compact if GC.respond_to?(:compact)
+
+        expect(sleeping_stacks_from(decode(recorder.serialize))).to eq expected_stacks
+      end
+
+      it 'drops (and counts) new samples instead of flushing when there are too many pending samples' do
+        1100.times { cpu_and_wall_time_collector.sample }
+
+        expect(cpu_and_wall_time_collector.deferred_samples_count).to be 1024
+        expect(cpu_and_wall_time_collector.stats).to include(deferred_samples_dropped: be > 0)
+      end
+
+      it 'registers the flush with the recorder only once, even if initialized again' do
+        5.times do
+          described_class._native_initialize(
+            cpu_and_wall_time_collector, recorder, max_frames, true, false, 2.0, 16, nil, true
+          )
+        end
+
+        cpu_and_wall_time_collector.sample
+
+        expect(decode(recorder.serialize).sample.size).to be Thread.list.size
+      end
+    end
+  end
+
+  describe '#start' do
+    after { cpu_and_wall_time_collector.stop }
+
+    it 'periodically samples all threads until stopped' do
+      cpu_and_wall_time_collector.sampling_frequency_hz = 1000
+      cpu_and_wall_time_collector.start
+
+      # Keep the main thread busy, so that samples need to interrupt it
+      deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 0.2
+      nil while Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+
+      expect(cpu_and_wall_time_collector.stop).to be true
+
+      samples = ::Perftools::Profiles::Profile.decode(recorder.serialize.last).sample
+
+      expect(samples.size).to be > Thread.list.size
+    end
+
+    it 'stops right away, without waiting for the current sampling interval to end' do
+      cpu_and_wall_time_collector.sampling_frequency_hz = 1
+      cpu_and_wall_time_collector.start
+
+      start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      cpu_and_wall_time_collector.stop
+
+      expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - start).to be < 0.5
+    end
+
+    it 'does not allow two instances to sample at the same time' do
+      cpu_and_wall_time_collector.start
+
+      another_collector = described_class.new(recorder: Datadog::Profiling::StackRecorder.new, max_frames: max_frames)
+
+      expect { another_collector.start }.to raise_error(RuntimeError, /another instance/)
+    end
+
+    context 'when the process forks while sampling' do
+      it 'can be stopped and started again in the child' do
+        cpu_and_wall_time_collector.sampling_frequency_hz = 1000
+        cpu_and_wall_time_collector.start
+
+        expect_in_fork do
+          expect(cpu_and_wall_time_collector.stop).to be true
+
+          recorder.serialize # Discard anything sampled before the fork
+          cpu_and_wall_time_collector.start
+          deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 0.2
+          nil while Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+          expect(cpu_and_wall_time_collector.stop).to be true
+
+          expect(::Perftools::Profiles::Profile.decode(recorder.serialize.last).sample).to_not be_empty
+        end
+      end
+
+      it 'allows another instance to start sampling in the child' do
+        cpu_and_wall_time_collector.start
+
+        expect_in_fork do
+          another_collector = described_class.new(recorder: Datadog::Profiling::StackRecorder.new, max_frames: max_frames)
+
+          expect(another_collector.start).to be true
+          expect(cpu_and_wall_time_collector.stop).to be false
+          expect(another_collector.stop).to be true
+        end
+      end
+    end
+
+    it 'records time spent in GC with a Garbage Collection frame on top of the stack that triggered it' do
+      skip 'GC tracepoints are only available on Ruby 2.3+' if RUBY_VERSION < '2.3'
+
+      cpu_and_wall_time_collector.start
+      cpu_and_wall_time_collector.sample # Make sure there's a context for the main thread
+      GC.start(full_mark: true)
+      GC.start(full_mark: false)
+      expect(cpu_and_wall_time_collector.stop).to be true
+
+      decoded_profile = decode(recorder.serialize)
+      strings = decoded_profile.string_table
+      gc_samples = decoded_profile.sample.select do |sample|
+        decode_stack(decoded_profile, sample).first[:path] == 'Garbage Collection'
+      end
+      gc_types = gc_samples.map do |sample|
+        strings[sample.label.find { |label| strings[label.key] == 'gc type' }.str]
+      end
+
+      expect(gc_types).to include('major', 'minor')
+      expect(gc_samples.map { |sample| decode_stack(decoded_profile, sample)[1][:base_label] }).to include('start')
+      expect(values_from(decoded_profile, gc_samples).map { |values| values['wall-time'] }).to all(be > 0)
+      expect(cpu_and_wall_time_collector.stats[:gc_samples]).to be >= 2
+    end
+
+    context 'when threads are waiting for the Global VM Lock' do
+      before { skip 'GVL instrumentation is only available on Ruby 3.2+' if RUBY_VERSION < '3.2' }
+
+      let(:busy_threads) { Array.new(2) { Thread.new { busy_loop_until(deadline) } } }
+      let(:deadline) { Process.clock_gettime(Process::CLOCK_MONOTONIC) + 0.5 }
+
+      def busy_loop_until(deadline)
+        nil while Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+      end
+
+      it 'records the time each thread waited as gvl-wait, with the stack of the waiting thread' do
+        cpu_and_wall_time_collector.start
+        busy_threads.each(&:join)
+        expect(cpu_and_wall_time_collector.stop).to be true
+
+        decoded_profile = decode(recorder.serialize)
+        gvl_wait_samples = decoded_profile.sample.select { |sample| sample_values(decoded_profile, sample)['gvl-wait'] > 0 }
+
+        expect(gvl_wait_samples).to_not be_empty
+        expect(gvl_wait_samples.map { |sample| decode_stack(decoded_profile, sample).map { |frame| frame[:base_label] } })
+          .to include(include('busy_loop_until'))
+        expect(cpu_and_wall_time_collector.stats[:gvl_wait_samples]).to be > 0
+      end
+
+      it 'does not record waits shorter than 100 microseconds' do
+        cpu_and_wall_time_collector.start
+        busy_threads.each(&:join)
+        cpu_and_wall_time_collector.stop
+
+        decoded_profile = decode(recorder.serialize)
+        gvl_waits = decoded_profile.sample.map { |sample| sample_values(decoded_profile, sample)['gvl-wait'] }
+
+        expect(gvl_waits.reject(&:zero?)).to all(be >= 100_000)
+      end
+    end
+
+    context 'when cpu_time_timers is enabled' do
+      subject(:cpu_and_wall_time_collector) do
+        described_class.new(recorder: recorder, max_frames: max_frames, cpu_time_timers: true)
+      end
+
+      before do
+        skip 'CPU-time timers are only available on Linux' unless PlatformHelpers.linux?
+      end
+
+      it 'records the CPU-time consumed by busy threads from their own timers' do
+        cpu_and_wall_time_collector.sampling_frequency_hz = 1000
+        cpu_and_wall_time_collector.start
+
+        deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 0.2
+        nil while Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+
+        expect(cpu_and_wall_time_collector.per_thread_context.fetch(Thread.main))
+          .to include(:cpu_time_timer_active? => true)
+        expect(cpu_and_wall_time_collector.stop).to be true
+
+        decoded_profile = ::Perftools::Profiles::Profile.decode(recorder.serialize.last)
+        cpu_time_samples =
+          values_from(decoded_profile).select { |values| values['wall-time'] == 0 && values['cpu-samples'] == 1 }
+
+        expect(cpu_time_samples).to_not be_empty
+        expect(cpu_time_samples.map { |values| values['cpu-time'] }.inject(0, :+)).to be >= 100_000_000 # 100ms
+      end
+
+      it 'stops the timers when stopped' do
+        cpu_and_wall_time_collector.start
+        cpu_and_wall_time_collector.sample
+        cpu_and_wall_time_collector.stop
+
+        expect(cpu_and_wall_time_collector.per_thread_context.values).to all(include(:cpu_time_timer_active? => false))
+      end
+    end
+
+    context 'when there is a pre-existing SIGPROF signal handler' do
+      before { Signal.trap('PROF') {} }
+      after { Signal.trap('PROF', 'DEFAULT') }
+
+      it 'does not start' do
+        expect { cpu_and_wall_time_collector.start }.to raise_error(RuntimeError, /pre-existing SIGPROF/)
+      end
+    end
+  end
+
+  describe '#sampling_frequency_hz=' do
+    it 'rejects invalid frequencies' do
+      expect { cpu_and_wall_time_collector.sampling_frequency_hz = 0 }.to raise_error(ArgumentError)
+    end
+  end
+
+  context 'when there are more threads than max_threads_sampled' do
+    subject(:cpu_and_wall_time_collector) do
+      described_class.new(recorder: recorder, max_frames: max_frames, max_threads_sampled: 1)
+    end
+
+    let(:ready_queue) { Queue.new }
+    let!(:threads) do
+      Array.new(2) do
+        Thread.new(ready_queue) do |ready_queue|
+          ready_queue << true
+          sleep
+        end
+      end
+    end
+
+    before { threads.size.times { ready_queue.pop } }
+
+    after do
+      threads.each(&:kill)
+      threads.each(&:join)
+    end
+
+    def sampled_threads
+      cpu_and_wall_time_collector.per_thread_context
+        .reject { |_thread, context| context.fetch(:wall_time_at_previous_sample_ns) == -1 }
+        .keys
+    end
+
+    it 'samples only max_threads_sampled threads per sample' do
+      cpu_and_wall_time_collector.sample
+
+      expect(sampled_threads.size).to be 1
+    end
+
+    it 'goes round-robin over all threads' do
+      Thread.list.size.times { cpu_and_wall_time_collector.sample }
+
+      expect(sampled_threads).to match_array(Thread.list)
+    end
+
+    it 'carries over the wall-time of skipped threads to their next sample' do
+      thread_count = Thread.list.size
+      # First round: each thread gets sampled once, so from now on every thread has a previous sample
+      thread_count.times { cpu_and_wall_time_collector.sample }
+
+      sleep 0.05
+      thread_count.times { cpu_and_wall_time_collector.sample }
+
+      wall_times = values_from(decode(recorder.serialize)).map { |values| values.fetch('wall-time') }
+      # Every thread was skipped while we slept, so each of their second samples includes the time we slept
+      expect(wall_times.count { |wall_time| wall_time >= 50_000_000 }).to be thread_count
+    end
+  end
+
+  describe '#stats' do
+    it 'reports the time spent sampling' do
+      2.times { cpu_and_wall_time_collector.sample }
+
+      stats = cpu_and_wall_time_collector.stats
+
+      expect(stats).to include(sample_count: 2, sampling_time_ns_total: be > 0, sampling_time_ns_max: be > 0)
+      expect(stats.fetch(:sampling_time_ns_max)).to be <= stats.fetch(:sampling_time_ns_total)
+    end
+
+    it 'starts with the effective sampling interval matching the configured sampling frequency' do
+      cpu_and_wall_time_collector.sampling_frequency_hz = 200
+
+      expect(cpu_and_wall_time_collector.stats)
+        .to include(sampling_interval_ns: 5_000_000, effective_sampling_interval_ns: 5_000_000)
+    end
+
+    context 'when sampling takes more than max_time_usage_pct' do
+      subject(:cpu_and_wall_time_collector) do
+        described_class.new(recorder: recorder, max_frames: max_frames, max_time_usage_pct: 0.0001)
+      end
+
+      it 'makes the effective sampling interval longer than the configured one' do
+        cpu_and_wall_time_collector.sample
+
+        stats = cpu_and_wall_time_collector.stats
+
+        expect(stats.fetch(:effective_sampling_interval_ns)).to be > stats.fetch(:sampling_interval_ns)
+      end
+
+      it 'still samples at least once per second' do
+        cpu_and_wall_time_collector.sample
+
+        expect(cpu_and_wall_time_collector.stats.fetch(:effective_sampling_interval_ns)).to be <= 1_000_000_000
+      end
+    end
+  end
+
+  describe 'memory usage reporting' do
+    before { require 'objspace' }
+
+    it 'includes the sampling buffer and the contexts for the threads that were sampled' do
+      memsize_before_sampling = ObjectSpace.memsize_of(cpu_and_wall_time_collector)
+
+      cpu_and_wall_time_collector.sample
+
+      expect(memsize_before_sampling).to be > max_frames * 0.size
+      expect(ObjectSpace.memsize_of(cpu_and_wall_time_collector)).to be > memsize_before_sampling
+    end
+  end
+
+  describe '.new' do
+    it 'rejects invalid max_threads_sampled values' do
+      expect { described_class.new(recorder: recorder, max_frames: max_frames, max_threads_sampled: 0) }
+        .to raise_error(ArgumentError, /max_threads_sampled/)
+    end
+
+    it 'rejects invalid max_time_usage_pct values' do
+      [0, -1, 101].each do |max_time_usage_pct|
+        expect { described_class.new(recorder: recorder, max_frames: max_frames, max_time_usage_pct: max_time_usage_pct) }
+          .to raise_error(ArgumentError, /max_time_usage_pct/)
+      end
     end
   end
 
@@ -100,4 +797,45 @@ RSpec.describe Datadog::Profiling::Collectors::CpuAndWallTime do
       expect(cpu_and_wall_time_collector.thread_list).to eq Thread.list
     end
   end
+
+  # Returns the values of each sample as a hash of value type => value
+  def values_from(decoded_profile, samples = decoded_profile.sample)
+    samples.map { |sample| sample_values(decoded_profile, sample) }
+  end
+
+  def sample_values(decoded_profile, sample)
+    value_types = decoded_profile.sample_type.map { |type| decoded_profile.string_table[type.type] }
+    value_types.zip(sample.value).to_h
+  end
+
+  def sleeping_stacks_from(decoded_profile)
+    decoded_profile.sample
+      .map { |sample| decode_stack(decoded_profile, sample) }
+      .select { |stack| stack.first[:base_label] == 'sleep' }
+      .sort_by(&:inspect)
+  end
+
+  def decode_stack(decoded_profile, sample)
+    strings = decoded_profile.string_table
+
+    sample.location_id.map do |location_id|
+      line_entry = decoded_profile.location.find { |location| location.id == location_id }.line.first
+      function = decoded_profile.function.find { |func| func.id == line_entry.function_id }
+
+      { base_label: strings[function.name], path: strings[function.filename], lineno: line_entry.line }
+    end
+  end
+
+  def sample_and_decode
+    cpu_and_wall_time_collector.sample
+
+    decode(recorder.serialize)
+  end
+
+  def decode(serialization_result)
+    raise 'Unexpected: Serialization failed' unless serialization_result
+
+    pprof_data = serialization_result.last
+    ::Perftools::Profiles::Profile.decode(pprof_data)
+  end
 end
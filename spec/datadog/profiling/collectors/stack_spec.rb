@@ -12,7 +12,7 @@ RSpec.describe Datadog::Profiling::Collectors::Stack do
 
   subject(:collectors_stack) { described_class.new }
 
-  let(:metric_values) { { 'cpu-time' => 123, 'cpu-samples' => 456, 'wall-time' => 789 } }
+  let(:metric_values) { sample_metric_values('cpu-time' => 123, 'cpu-samples' => 456, 'wall-time' => 789) }
   let(:labels) { { 'label_a' => 'value_a', 'label_b' => 'value_b' }.to_a }
 
   let(:raw_reference_stack) { stacks.fetch(:reference) }
@@ -330,6 +330,51 @@ RSpec.describe Datadog::Profiling::Collectors::Stack do
     end
   end
 
+  describe '#stats' do
+    let(:recorder) { Datadog::Profiling::StackRecorder.new }
+    let(:ready_queue) { Queue.new }
+    let(:background_thread) do
+      Thread.new(ready_queue) do |ready_queue|
+        ready_queue << true
+        sleep
+      end
+    end
+
+    before do
+      background_thread
+      ready_queue.pop
+      # Make sure the thread is not still in Queue#<< when sampled, as then its stack would change between samples
+      Thread.pass until background_thread.status == 'sleep'
+    end
+
+    after do
+      background_thread.kill
+      background_thread.join
+    end
+
+    def sample_background_thread
+      collectors_stack.sample(background_thread, recorder, metric_values, labels)
+    end
+
+    it 'starts at zero' do
+      expect(collectors_stack.stats).to eq(stack_cache_hits: 0, stack_cache_misses: 0)
+    end
+
+    it 'reuses the stack built for a previous identical sample' do
+      2.times { sample_background_thread }
+
+      expect(collectors_stack.stats).to eq(stack_cache_hits: 1, stack_cache_misses: 1)
+    end
+
+    it 'builds stacks again after the recorder gets serialized' do
+      sample_background_thread
+      recorder.serialize
+      sample_background_thread
+
+      expect(collectors_stack.stats).to eq(stack_cache_hits: 0, stack_cache_misses: 2)
+    end
+  end
+
   def convert_reference_stack(raw_reference_stack)
     raw_reference_stack.map do |location|
       { base_label: location.base_label, path: location.path, lineno: location.lineno }
@@ -2,6 +2,7 @@
 
 require 'datadog/profiling/exporter'
 require 'datadog/profiling/old_recorder'
+require 'datadog/profiling/stack_recorder'
 require 'datadog/profiling/collectors/code_provenance'
 require 'datadog/core/logger'
 
@@ -71,6 +72,65 @@ RSpec.describe Datadog::Profiling::Exporter do
 
       it { is_expected.to_not be nil }
     end
+
+    context 'when the pprof recorder compresses pprofs natively' do
+      let(:serialized_profile) do
+        instance_double(Datadog::Profiling::SerializedProfile, compression: :gzip, to_s: 'compressed', release: nil)
+      end
+      let(:pprof_recorder) do
+        instance_double(
+          Datadog::Profiling::StackRecorder,
+          compresses_pprof?: true,
+          serialize_without_copy: [start, finish, serialized_profile],
+        )
+      end
+
+      it 'returns a flush with the serialized profile as-is' do
+        expect(flush.pprof_data).to be serialized_profile
+      end
+
+      context 'when the pprof was compressed with something other than gzip' do
+        before do
+          allow(serialized_profile).to receive(:compression).and_return(:zstd)
+          allow(Datadog.logger).to receive(:error)
+        end
+
+        it 'releases the serialized profile and does not report it' do
+          expect(flush).to be nil
+          expect(serialized_profile).to have_received(:release)
+          expect(Datadog.logger).to have_received(:error).with(/Dropping profile compressed with :zstd/)
+        end
+      end
+
+      context 'when the pprof recorder compresses pprofs with something other than gzip' do
+        let(:pprof_recorder) do
+          instance_double(Datadog::Profiling::StackRecorder, compresses_pprof?: true, pprof_compression: :zstd)
+        end
+
+        it 'raises an ArgumentError, as such pprofs can not be reported' do
+          expect { exporter }.to raise_error(ArgumentError, /Unsupported pprof_compression for reporting: :zstd/)
+        end
+      end
+
+      context 'when compression failed' do
+        before { allow(serialized_profile).to receive(:compression).and_return(nil) }
+
+        it 'returns a flush with the pprof gzipped' do
+          expect(Datadog::Core::Utils::Compression.gunzip(flush.pprof_data)).to eq 'compressed'
+          expect(serialized_profile).to have_received(:release)
+        end
+      end
+
+      context 'when duration of profile is below 1s' do
+        let(:finish) { start + 0.99 }
+
+        it 'releases the serialized profile' do
+          expect(serialized_profile).to receive(:release)
+
+          expect(flush).to be nil
+        end
+      end
+    end
   end
 
   describe '#empty?' do
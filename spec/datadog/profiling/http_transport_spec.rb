@@ -23,6 +23,9 @@ RSpec.describe Datadog::Profiling::HttpTransport do
       site: site,
       api_key: api_key,
       upload_timeout_seconds: upload_timeout_seconds,
+      asynchronous_uploads: asynchronous_uploads,
+      spool_directory: spool_directory,
+      spool_max_size_bytes: spool_max_size_bytes,
     )
   end
 
@@ -46,6 +49,9 @@ RSpec.describe Datadog::Profiling::HttpTransport do
   let(:site) { nil }
   let(:api_key) { nil }
   let(:upload_timeout_seconds) { 10 }
+  let(:asynchronous_uploads) { false }
+  let(:spool_directory) { nil }
+  let(:spool_max_size_bytes) { 1024 * 1024 }
 
   let(:flush) do
     Datadog::Profiling::Flush.new(
@@ -167,6 +173,37 @@ RSpec.describe Datadog::Profiling::HttpTransport do
       end
     end
 
+    context 'when a spool_directory is provided' do
+      let(:temporary_directory) { Dir.mktmpdir }
+      let(:spool_directory) { "#{temporary_directory}/spool" }
+
+      after { FileUtils.remove_entry(temporary_directory) }
+
+      it 'creates the directory and configures the spool' do
+        expect(described_class)
+          .to receive(:_native_configure_spool)
+          .with(kind_of(described_class), spool_directory, spool_max_size_bytes)
+          .and_call_original
+
+        http_transport
+
+        expect(File.directory?(spool_directory)).to be true
+      end
+
+      context 'when the directory cannot be created' do
+        let(:spool_directory) { "#{temporary_directory}/not_a_directory/spool" }
+
+        before { File.write("#{temporary_directory}/not_a_directory", '') }
+
+        it 'logs a warning and does not configure the spool' do
+          expect(Datadog.logger).to receive(:warn).with(/Not spooling profiles/)
+          expect(described_class).to_not receive(:_native_configure_spool)
+
+          http_transport
+        end
+      end
+    end
+
     context 'when an invalid configuration is provided' do
       let(:hostname) { 'this:is:not:a:valid:hostname!!!!' }
 
@@ -188,7 +225,7 @@ RSpec.describe Datadog::Profiling::HttpTransport do
       finish_timespec_nanoseconds = 123456789
 
       expect(described_class).to receive(:_native_do_export).with(
-        kind_of(Array), # exporter_configuration
+        http_transport,
         upload_timeout_milliseconds,
         start_timespec_seconds,
         start_timespec_nanoseconds,
@@ -198,12 +235,154 @@ RSpec.describe Datadog::Profiling::HttpTransport do
         pprof_data,
         code_provenance_file_name,
         code_provenance_data,
-        tags_as_array
       ).and_return([:ok, 200])
 
       export
     end
 
+    context 'when asynchronous_uploads is enabled' do
+      let(:asynchronous_uploads) { true }
+
+      before do
+        allow(described_class).to receive(:_native_take_upload_results).and_return([])
+      end
+
+      it 'queues the data from the flush instead of exporting it right away' do
+        expect(described_class).to_not receive(:_native_do_export)
+        expect(described_class).to receive(:_native_enqueue_export).with(
+          http_transport,
+          10_000,
+          1644249593,
+          987654321,
+          1699718400,
+          123456789,
+          pprof_file_name,
+          pprof_data,
+          code_provenance_file_name,
+          code_provenance_data,
+        ).and_return([:ok, nil])
+
+        expect(export).to be true
+      end
+
+      it 'logs the results of previously-queued exports' do
+        allow(described_class).to receive(:_native_enqueue_export).and_return([:ok, nil])
+        expect(described_class).to receive(:_native_take_upload_results).and_return([[:ok, 503], [:error, 'Kaboom']])
+
+        expect(Datadog.logger).to receive(:error).with(/unexpected HTTP 503/)
+        expect(Datadog.logger).to receive(:error).with(/Kaboom/)
+
+        export
+      end
+
+      context 'when the flush cannot be queued' do
+        before do
+          expect(described_class).to receive(:_native_enqueue_export).and_return([:error, 'test error message'])
+          allow(Datadog.logger).to receive(:error)
+        end
+
+        it 'logs an error message' do
+          expect(Datadog.logger).to receive(:error).with(/test error message/)
+
+          export
+        end
+
+        it { is_expected.to be false }
+      end
+    end
+
+    context 'when a spool_directory is provided' do
+      let(:temporary_directory) { Dir.mktmpdir }
+      let(:spool_directory) { temporary_directory }
+
+      after { FileUtils.remove_entry(temporary_directory) }
+
+      it 'asks for spooled profiles to be reported back after a successful export' do
+        expect(described_class).to receive(:_native_do_export).and_return([:ok, 200])
+        expect(described_class).to receive(:_native_replay_spool).with(http_transport, 10_000).and_return([:ok, nil])
+
+        expect(export).to be true
+      end
+
+      it 'does not ask for spooled profiles to be reported back after a failed export' do
+        allow(Datadog.logger).to receive(:error)
+        expect(described_class).to receive(:_native_do_export).and_return([:ok, 503])
+        expect(described_class).to_not receive(:_native_replay_spool)
+
+        expect(export).to be false
+      end
+    end
+
+    describe 'exporter configuration' do
+      before do
+        allow(described_class).to receive(:_native_do_export).and_return([:ok, 200])
+      end
+
+      it 'configures the exporter with the tags from the flush' do
+        expect(described_class).to receive(:_native_configure_exporter)
+          .with(http_transport, kind_of(Array), tags_as_array).and_call_original
+
+        export
+      end
+
+      it 'reuses the exporter while the tags stay the same' do
+        expect(described_class).to receive(:_native_configure_exporter).once.and_call_original
+
+        http_transport.export(flush)
+        http_transport.export(flush)
+      end
+
+      it 'configures a new exporter when the tags change' do
+        expect(described_class).to receive(:_native_configure_exporter).twice.and_call_original
+
+        http_transport.export(flush)
+        http_transport.export(
+          Datadog::Profiling::Flush.new(
+            start: start,
+            finish: finish,
+            pprof_file_name: pprof_file_name,
+            pprof_data: pprof_data,
+            code_provenance_file_name: code_provenance_file_name,
+            code_provenance_data: code_provenance_data,
+            tags_as_array: [%w[tag_c value_c]],
+          )
+        )
+      end
+
+      it 'configures a new exporter in forked children, even if the tags stay the same' do
+        http_transport.export(flush)
+
+        expect_in_fork do
+          allow(described_class).to receive(:_native_configure_exporter).and_call_original
+
+          http_transport.export(flush)
+
+          expect(described_class).to have_received(:_native_configure_exporter).once
+        end
+      end
+
+      context 'when configuring the exporter fails' do
+        before do
+          expect(described_class).to receive(:_native_configure_exporter).and_return([:error, 'test error message'])
+          allow(Datadog.logger).to receive(:error)
+        end
+
+        it 'does not try to export' do
+          expect(described_class).to_not receive(:_native_do_export)
+
+          export
+        end
+
+        it 'logs an error message' do
+          expect(Datadog.logger).to receive(:error).with(/test error message/)
+
+          export
+        end
+
+        it { is_expected.to be false }
+      end
+    end
+
     context 'when successful' do
       before do
         expect(described_class).to receive(:_native_do_export).and_return([:ok, 200])
@@ -343,6 +522,38 @@ RSpec.describe Datadog::Profiling::HttpTransport do
       end
     end
 
+    context 'when pprof data is a SerializedProfile' do
+      let(:pprof_data) { Datadog::Profiling::StackRecorder.new.serialize_without_copy[2] }
+
+      it 'reports the serialized pprof and then releases it' do
+        expected_pprof_data = pprof_data.to_s
+
+        success = http_transport.export(flush)
+
+        expect(success).to be true
+
+        boundary = request['content-type'][%r{^multipart/form-data; boundary=(.+)}, 1]
+        body = WEBrick::HTTPUtils.parse_form_data(StringIO.new(request.body), boundary)
+
+        expect(body["data[#{pprof_file_name}]"]).to eq expected_pprof_data
+        expect(pprof_data).to be_released
+      end
+
+      context 'when it was already released' do
+        before do
+          pprof_data.release
+          allow(Datadog.logger).to receive(:error)
+        end
+
+        it 'does not report anything' do
+          expect(Datadog.logger).to receive(:error).with(/already released/)
+
+          expect(http_transport.export(flush)).to be false
+          expect(messages).to be_empty
+        end
+      end
+    end
+
     context 'via unix domain socket' do
       let(:temporary_directory) { Dir.mktmpdir }
       let(:socket_path) { "#{temporary_directory}/rspec_unix_domain_socket" }
@@ -451,6 +662,280 @@ RSpec.describe Datadog::Profiling::HttpTransport do
       end
     end
 
+    context 'when asynchronous_uploads is enabled' do
+      let(:asynchronous_uploads) { true }
+
+      it 'reports the profiling data in the background' do
+        expect(http_transport.export(flush)).to be true
+        expect(http_transport.wait_for_pending_uploads).to be true
+
+        boundary = request['content-type'][%r{^multipart/form-data; boundary=(.+)}, 1]
+        body = WEBrick::HTTPUtils.parse_form_data(StringIO.new(request.body), boundary)
+
+        expect(body).to include(
+          'start' => start_timestamp,
+          'end' => end_timestamp,
+          "data[#{pprof_file_name}]" => pprof_data,
+          "data[#{code_provenance_file_name}]" => code_provenance_data,
+        )
+      end
+
+      it 'logs a debug message once the data was reported' do
+        allow(Datadog.logger).to receive(:debug)
+        expect(Datadog.logger).to receive(:debug).with('Successfully reported profiling data')
+
+        http_transport.export(flush)
+        http_transport.wait_for_pending_uploads
+      end
+
+      context 'when server returns a 5xx failure' do
+        let(:server_proc) { proc { |_req, res| res.status = 503 } }
+
+        it 'logs an error when the result is picked up' do
+          http_transport.export(flush)
+
+          expect(Datadog.logger).to receive(:error).with(/unexpected HTTP 503/)
+
+          http_transport.wait_for_pending_uploads
+        end
+      end
+
+      context 'when pprof data is a SerializedProfile' do
+        let(:pprof_data) { Datadog::Profiling::StackRecorder.new.serialize_without_copy[2] }
+
+        it 'takes over the serialized pprof and reports it' do
+          expected_pprof_data = pprof_data.to_s
+
+          http_transport.export(flush)
+
+          expect(pprof_data).to be_released
+
+          http_transport.wait_for_pending_uploads
+
+          boundary = request['content-type'][%r{^multipart/form-data; boundary=(.+)}, 1]
+          body = WEBrick::HTTPUtils.parse_form_data(StringIO.new(request.body), boundary)
+
+          expect(body["data[#{pprof_file_name}]"]).to eq expected_pprof_data
+        end
+      end
+
+      context 'when the server takes longer than the upload timeout' do
+        let!(:request_finish_queue) { Queue.new }
+        let(:server_proc) { proc { request_finish_queue.pop } }
+
+        after { request_finish_queue << true }
+
+        it 'does not block the caller' do
+          expect(http_transport.export(flush)).to be true
+        end
+
+        it 'waits for pending uploads for at most the given timeout_seconds' do
+          http_transport.export(flush)
+
+          wait_start = Time.now
+          expect(http_transport.wait_for_pending_uploads(timeout_seconds: 0.1)).to be false
+          expect(Time.now - wait_start).to be < upload_timeout_seconds
+        end
+      end
+    end
+
+    context 'when a spool_directory is provided' do
+      let(:temporary_directory) { Dir.mktmpdir }
+      let(:spool_directory) { temporary_directory }
+      let(:response_statuses) { [503] }
+      let(:server_proc) do
+        proc do |req, res|
+          messages << req.tap { req.body }
+          res.status = response_statuses.shift || 200
+          res.body = '{}'
+        end
+      end
+
+      def spooled_profiles
+        Dir.glob("#{spool_directory}/profile-*")
+      end
+
+      def flush_finishing_at(finish, tags: tags_as_array)
+        Datadog::Profiling::Flush.new(
+          start: start,
+          finish: finish,
+          pprof_file_name: pprof_file_name,
+          pprof_data: pprof_data,
+          code_provenance_file_name: code_provenance_file_name,
+          code_provenance_data: code_provenance_data,
+          tags_as_array: tags,
+        )
+      end
+
+      def leave_in_spool(name, size_bytes, modified_at: Time.now)
+        path = "#{spool_directory}/#{name}"
+        File.write(path, 'a' * size_bytes)
+        File.utime(modified_at, modified_at, path)
+        path
+      end
+
+      before { allow(Datadog.logger).to receive(:error) }
+      after { FileUtils.remove_entry(temporary_directory) }
+
+      it 'spools profiles that could not be reported' do
+        expect(http_transport.export(flush)).to be false
+
+        expect(spooled_profiles.size).to be 1
+      end
+
+      context 'when the agent is down' do
+        before do
+          server.shutdown
+          @server_thread.join
+        end
+
+        it 'spools profiles that could not be reported' do
+          http_transport.export(flush)
+
+          expect(spooled_profiles.size).to be 1
+        end
+      end
+
+      context 'when the server rejects the profile with a 4xx' do
+        let(:response_statuses) { [418] }
+
+        it 'does not spool it, as it would just get rejected again' do
+          expect(http_transport.export(flush)).to be false
+
+          expect(spooled_profiles).to be_empty
+        end
+      end
+
+      it 'reports spooled profiles back once reporting works again' do
+        expect(http_transport.export(flush)).to be false
+        expect(http_transport.export(flush_finishing_at(finish + 60))).to be true
+
+        try_wait_until { messages.size == 3 && spooled_profiles.empty? }
+
+        boundary = messages.last['content-type'][%r{^multipart/form-data; boundary=(.+)}, 1]
+        body = WEBrick::HTTPUtils.parse_form_data(StringIO.new(messages.last.body), boundary)
+
+        expect(body).to include(
+          'start' => start_timestamp,
+          'end' => end_timestamp,
+          "data[#{pprof_file_name}]" => pprof_data,
+          "data[#{code_provenance_file_name}]" => code_provenance_data,
+        )
+      end
+
+      it 'reports spooled profiles back with the tags they were spooled with' do
+        expect(http_transport.export(flush)).to be false
+        expect(http_transport.export(flush_finishing_at(finish + 60, tags: [%w[tag_c value_c]]))).to be true
+
+        try_wait_until { messages.size == 3 && spooled_profiles.empty? }
+
+        boundary = messages.last['content-type'][%r{^multipart/form-data; boundary=(.+)}, 1]
+        body = WEBrick::HTTPUtils.parse_form_data(StringIO.new(messages.last.body), boundary)
+
+        expect(body['tags[]'].list).to contain_exactly('tag_a:value_a', 'tag_b:value_b')
+      end
+
+      context 'when the spool gets full' do
+        let(:response_statuses) { [503] * 10 }
+        let(:spool_max_size_bytes) { 1000 }
+        let(:finishes) { Array.new(10) { |index| finish + index } }
+
+        def spooled_profile_prefix(finish)
+          format('profile-%020d-', (finish.to_i * 1_000_000_000) + finish.nsec)
+        end
+
+        it 'drops the oldest spooled profiles first' do
+          finishes.each { |finish| http_transport.export(flush_finishing_at(finish)) }
+
+          spooled_names = spooled_profiles.map { |path| File.basename(path) }
+
+          expect(spooled_profiles.map { |path| File.size(path) }.reduce(:+)).to be <= spool_max_size_bytes
+          expect(spooled_names.size).to be < finishes.size
+          expect(spooled_names).to include(start_with(spooled_profile_prefix(finishes.last)))
+          expect(spooled_names).to_not include(start_with(spooled_profile_prefix(finishes.first)))
+        end
+
+        it 'does not drop profiles claimed by someone else, but counts them' do
+          claimed_profile = leave_in_spool("#{spooled_profile_prefix(start)}1-1.claimed", 900)
+
+          http_transport.export(flush)
+
+          expect(File.exist?(claimed_profile)).to be true
+          expect(spooled_profiles).to contain_exactly(claimed_profile)
+        end
+
+        it 'does not drop profiles being written by someone else, but counts them' do
+          temporary_file = leave_in_spool(".#{spooled_profile_prefix(start)}1-1", 900)
+
+          http_transport.export(flush)
+
+          expect(File.exist?(temporary_file)).to be true
+          expect(spooled_profiles).to be_empty
+        end
+
+        it 'drops stale claimed and temporary files left behind by others' do
+          an_hour_and_a_bit_ago = Time.now - (60 * 60) - 60
+          left_behind = [
+            leave_in_spool("#{spooled_profile_prefix(start)}1-1.claimed", 400, modified_at: an_hour_and_a_bit_ago),
+            leave_in_spool(".#{spooled_profile_prefix(start)}1-2", 400, modified_at: an_hour_and_a_bit_ago),
+          ]
+
+          http_transport.export(flush)
+
+          left_behind.each { |path| expect(File.exist?(path)).to be false }
+          expect(spooled_profiles.size).to be 1
+        end
+      end
+
+      context 'when a profile could not be spooled' do
+        let(:spool_max_size_bytes) { 1 }
+
+        it 'logs why' do
+          expect(Datadog.logger).to receive(:error).with(/Failed to spool profile: Profile is larger than the maximum/)
+
+          http_transport.export(flush)
+
+          expect(spooled_profiles).to be_empty
+        end
+
+        context 'when asynchronous_uploads is enabled' do
+          let(:asynchronous_uploads) { true }
+
+          it 'logs why when the results get picked up' do
+            http_transport.export(flush)
+
+            expect(Datadog.logger).to receive(:error).with(/Failed to spool profile: Profile is larger than the maximum/)
+
+            http_transport.wait_for_pending_uploads
+          end
+        end
+      end
+
+      context 'when asynchronous_uploads is enabled' do
+        let(:asynchronous_uploads) { true }
+
+        it 'spools profiles that could not be reported, and reports them back once reporting works again' do
+          http_transport.export(flush)
+          http_transport.wait_for_pending_uploads
+
+          expect(spooled_profiles.size).to be 1
+
+          http_transport.export(flush_finishing_at(finish + 60))
+
+          try_wait_until { messages.size == 3 && spooled_profiles.empty? }
+        end
+      end
+    end
+
+    it 'reports multiple profiles using the same exporter' do
+      expect(described_class).to receive(:_native_configure_exporter).once.and_call_original
+
+      expect(http_transport.export(flush)).to be true
+      expect(http_transport.export(flush)).to be true
+
+      expect(messages.size).to be 2
+    end
+
     describe 'cancellation behavior' do
       let!(:request_received_queue) { Queue.new }
       let!(:request_finish_queue) { Queue.new }
@@ -3,6 +3,7 @@
 require 'spec_helper'
 
 require 'datadog/profiling/http_transport'
+require 'datadog/profiling/transport/http/client'
 require 'datadog/profiling/exporter'
 require 'datadog/profiling/scheduler'
 
@@ -10,7 +11,7 @@ RSpec.describe Datadog::Profiling::Scheduler do
   subject(:scheduler) { described_class.new(exporter: exporter, transport: transport, **options) }
 
   let(:exporter) { instance_double(Datadog::Profiling::Exporter) }
-  let(:transport) { instance_double(Datadog::Profiling::HttpTransport) }
+  let(:transport) { instance_double(Datadog::Profiling::HttpTransport, wait_for_pending_uploads: true) }
   let(:options) { {} }
 
   describe '.new' do
@@ -187,6 +188,24 @@ RSpec.describe Datadog::Profiling::Scheduler do
 
         flush_events
       end
+
+      it 'waits for the transport to finish reporting' do
+        expect(transport).to receive(:export).ordered
+        expect(transport).to receive(:wait_for_pending_uploads)
+          .with(timeout_seconds: described_class::SHUTDOWN_UPLOAD_WAIT_SECONDS).ordered
+
+        flush_events
+      end
+
+      context 'when the transport does not support waiting' do
+        let(:transport) { instance_double(Datadog::Profiling::Transport::HTTP::Client) }
+
+        it 'only exports the profiling data' do
+          expect(transport).to receive(:export)
+
+          flush_events
+        end
+      end
     end
   end
 
@@ -0,0 +1,94 @@
+# typed: ignore
+
+require 'datadog/profiling/spec_helper'
+require 'datadog/profiling/stack_recorder'
+
+RSpec.describe Datadog::Profiling::SerializedProfile do
+  before { skip_if_profiling_not_supported(self) }
+
+  subject(:serialized_profile) { Datadog::Profiling::StackRecorder.new.serialize_without_copy[2] }
+
+  describe '.new' do
+    it 'cannot be called directly' do
+      expect { described_class.new }.to raise_error(NoMethodError)
+    end
+  end
+
+  describe '#to_s' do
+    it 'returns the encoded pprof' do
+      expect(::Perftools::Profiles::Profile.decode(serialized_profile.to_s).sample).to be_empty
+    end
+
+    it 'returns a new copy every time' do
+      expect(serialized_profile.to_s).to eq serialized_profile.to_s
+      expect(serialized_profile.to_s).to_not be serialized_profile.to_s
+    end
+  end
+
+  describe '#bytesize' do
+    it 'returns the size of the encoded pprof' do
+      expect(serialized_profile.bytesize).to be serialized_profile.to_s.bytesize
+    end
+  end
+
+  describe '#compression' do
+    it 'is nil for uncompressed pprofs' do
+      expect(serialized_profile.compression).to be nil
+    end
+
+    context 'when the StackRecorder compresses pprofs' do
+      subject(:serialized_profile) do
+        Datadog::Profiling::StackRecorder.new(pprof_compression: :gzip).serialize_without_copy[2]
+      end
+
+      before do
+        unless Datadog::Profiling::StackRecorder::AVAILABLE_PPROF_COMPRESSIONS.include?(:gzip)
+          skip('gzip was not available when building the native extension')
+        end
+      end
+
+      it 'returns the codec used' do
+        expect(serialized_profile.compression).to be :gzip
+      end
+    end
+  end
+
+  describe '#release' do
+    it 'marks the serialized profile as released' do
+      expect { serialized_profile.release }.to change { serialized_profile.released? }.from(false).to(true)
+    end
+
+    it 'can be called multiple times' do
+      serialized_profile.release
+
+      expect { serialized_profile.release }.to_not raise_error
+    end
+
+    context 'after being released' do
+      before { serialized_profile.release }
+
+      it 'can no longer be turned into a String' do
+        expect { serialized_profile.to_s }.to raise_error(RuntimeError, /already released/)
+      end
+
+      it 'can no longer report its size' do
+        expect { serialized_profile.bytesize }.to raise_error(RuntimeError, /already released/)
+      end
+    end
+  end
+
+  describe 'memory usage reporting' do
+    it 'includes the encoded pprof while not released' do
+      require 'objspace'
+
+      bytesize = serialized_profile.bytesize
+      memsize_before_release = ObjectSpace.memsize_of(serialized_profile)
+
+      expect(memsize_before_release).to be >= bytesize
+
+      serialized_profile.release
+
+      expect(ObjectSpace.memsize_of(serialized_profile)).to be <= memsize_before_release - bytesize
+    end
+  end
+end
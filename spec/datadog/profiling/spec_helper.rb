@@ -31,6 +31,12 @@ module ProfileHelpers
     )
   end
 
+  # Returns a value (0, unless given in `overrides`) for every Datadog::Profiling::StackRecorder::VALUE_TYPES, as
+  # expected by Datadog::Profiling::Collectors::Stack#sample
+  def sample_metric_values(overrides = {})
+    Datadog::Profiling::StackRecorder::VALUE_TYPES.map { |type| [type, 0] }.to_h.merge(overrides)
+  end
+
   def skip_if_profiling_not_supported(testcase)
     testcase.skip('Profiling is not supported on JRuby') if PlatformHelpers.jruby?
     testcase.skip('Profiling is not supported on TruffleRuby') if PlatformHelpers.truffleruby?
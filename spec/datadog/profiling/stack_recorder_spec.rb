@@ -2,6 +2,7 @@
 
 require 'datadog/profiling/spec_helper'
 require 'datadog/profiling/stack_recorder'
+require 'datadog/core/utils/compression'
 
 RSpec.describe Datadog::Profiling::StackRecorder do
   before { skip_if_profiling_not_supported(self) }
@@ -44,7 +45,7 @@ RSpec.describe Datadog::Profiling::StackRecorder do
         expect(start).to be <= finish
       end
 
-      it 'returns a pprof with the configured sample types' do
+      it 'returns a pprof with the default sample types' do
         expect(sample_types_from(decoded_profile)).to eq(
           'cpu-time' => 'nanoseconds',
           'cpu-samples' => 'count',
@@ -52,6 +53,21 @@ RSpec.describe Datadog::Profiling::StackRecorder do
         )
       end
 
+      it 'returns a pprof with every sample type when all of them are enabled' do
+        recorder = described_class.new(enabled_value_types: described_class::VALUE_TYPES)
+
+        expect(sample_types_from(::Perftools::Profiles::Profile.decode(recorder.serialize[2]))).to eq(
+          'cpu-time' => 'nanoseconds',
+          'cpu-samples' => 'count',
+          'wall-time' => 'nanoseconds',
+          'gvl-wait' => 'nanoseconds',
+          'os-runqueue-wait' => 'nanoseconds',
+          'alloc-samples' => 'count',
+          'alloc-space' => 'bytes',
+          'heap-space' => 'bytes',
+        )
+      end
+
       it 'returns an empty pprof' do
         expect(decoded_profile).to have_attributes(
           sample: [],
@@ -74,9 +90,11 @@ RSpec.describe Datadog::Profiling::StackRecorder do
     end
 
     context 'when profile has a sample' do
+      subject(:stack_recorder) { described_class.new(enabled_value_types: described_class::VALUE_TYPES) }
+
       let(:collectors_stack) { Datadog::Profiling::Collectors::Stack.new }
 
-      let(:metric_values) { { 'cpu-time' => 123, 'cpu-samples' => 456, 'wall-time' => 789 } }
+      let(:metric_values) { sample_metric_values('cpu-time' => 123, 'cpu-samples' => 456, 'wall-time' => 789) }
       let(:labels) { { 'label_a' => 'value_a', 'label_b' => 'value_b' }.to_a }
 
       before do
@@ -121,6 +139,262 @@ RSpec.describe Datadog::Profiling::StackRecorder do
       end
     end
 
+    context 'when only some value types are enabled' do
+      subject(:stack_recorder) { described_class.new(enabled_value_types: ['wall-time', 'cpu-time']) }
+
+      let(:collectors_stack) { Datadog::Profiling::Collectors::Stack.new }
+
+      it 'only includes the enabled value types in the pprof, in the same order as VALUE_TYPES' do
+        strings = decoded_profile.string_table
+
+        expect(decoded_profile.sample_type.map { |sample_type| strings[sample_type.type] })
+          .to eq ['cpu-time', 'wall-time']
+      end
+
+      it 'only records the values for the enabled value types' do
+        collectors_stack.sample(
+          Thread.current,
+          stack_recorder,
+          sample_metric_values('cpu-time' => 123, 'wall-time' => 789, 'alloc-samples' => 1),
+          []
+        )
+
+        expect(decoded_profile.sample.map(&:value)).to eq [[123, 789]]
+      end
+
+      it 'drops samples that only have values for value types that are not enabled' do
+        collectors_stack.sample(Thread.current, stack_recorder, sample_metric_values('alloc-samples' => 1), [])
+
+        expect(decoded_profile.sample).to be_empty
+      end
+    end
+
+    context 'when serializing multiple times' do
+      let(:collectors_stack) { Datadog::Profiling::Collectors::Stack.new }
+      let(:metric_values) { sample_metric_values('cpu-time' => 123, 'cpu-samples' => 456, 'wall-time' => 789) }
+
+      def sample_count_from(serialization_result)
+        ::Perftools::Profiles::Profile.decode(serialization_result[2]).sample.size
+      end
+
+      def record_sample
+        collectors_stack.sample(Thread.current, stack_recorder, metric_values, [])
+      end
+
+      it 'does not include samples that were already serialized in the next profile' do
+        record_sample
+
+        expect(sample_count_from(stack_recorder.serialize)).to be 1
+        expect(sample_count_from(stack_recorder.serialize)).to be 0
+      end
+
+      it 'includes samples recorded after a serialization in the next profile' do
+        record_sample
+        stack_recorder.serialize
+        record_sample
+        record_sample
+
+        expect(sample_count_from(stack_recorder.serialize)).to be 2
+      end
+
+      it 'starts each profile when the previous one finished' do
+        _, first_finish, = stack_recorder.serialize
+        second_start, = stack_recorder.serialize
+
+        expect(second_start).to eq first_finish
+      end
+
+      it 'starts the first profile when the recorder was created' do
+        before_creation = Time.now
+        recorder = described_class.new
+        start, finish, = recorder.serialize
+
+        expect(start).to be >= before_creation
+        expect(finish).to be >= start
+      end
+
+      it 'reports no reset failures' do
+        record_sample
+        stack_recorder.serialize
+
+        expect(stack_recorder.stats).to include(reset_failures: 0)
+      end
+    end
+
+    context 'when aggregating samples' do
+      subject(:stack_recorder) { described_class.new(aggregate_samples: true) }
+
+      let(:collectors_stack) { Datadog::Profiling::Collectors::Stack.new }
+      let(:metric_values) { sample_metric_values('cpu-time' => 123, 'cpu-samples' => 1, 'wall-time' => 789) }
+
+      def record_samples(count, labels: [], recorder: stack_recorder, values: metric_values)
+        count.times { collectors_stack.sample(Thread.current, recorder, values, labels) }
+      end
+
+      def samples_from(serialization_result)
+        decoded_profile = ::Perftools::Profiles::Profile.decode(serialization_result[2])
+        strings = decoded_profile.string_table
+        value_types = decoded_profile.sample_type.map { |type| strings[type.type] }
+
+        decoded_profile.sample.map do |sample|
+          {
+            values: value_types.zip(sample.value).to_h,
+            labels: sample.label.map { |label| [strings[label.key], strings[label.str]] },
+          }
+        end
+      end
+
+      it 'sums up the values of samples with the same stack and labels' do
+        record_samples(3)
+
+        expect(stack_recorder.stats).to include(aggregated_samples: 1, merged_samples: 2)
+
+        samples = samples_from(stack_recorder.serialize)
+
+        expect(samples.size).to be 1
+        expect(samples.first[:values]).to include('cpu-time' => 369, 'cpu-samples' => 3, 'wall-time' => 2367)
+        expect(stack_recorder.stats).to include(aggregated_samples: 0)
+      end
+
+      it 'keeps samples with different stacks apart' do
+        record_samples(2)
+        record_samples(1)
+
+        expect(stack_recorder.stats).to include(aggregated_samples: 2, merged_samples: 1)
+        expect(samples_from(stack_recorder.serialize).map { |sample| sample[:values]['cpu-samples'] })
+          .to contain_exactly(2, 1)
+      end
+
+      it 'keeps samples with different labels apart' do
+        record_samples(2, labels: [['label_a', 'value_a']])
+        record_samples(1, labels: [['label_a', 'value_b']])
+
+        samples = samples_from(stack_recorder.serialize)
+
+        expect(samples.map { |sample| [sample[:labels], sample[:values]['cpu-samples']] }).to contain_exactly(
+          [[['label_a', 'value_a']], 2],
+          [[['label_a', 'value_b']], 1],
+        )
+      end
+
+      it 'produces the same profile as when aggregation is disabled' do
+        not_aggregating_recorder = described_class.new(aggregate_samples: false)
+
+        [stack_recorder, not_aggregating_recorder].each do |recorder|
+          record_samples(2, labels: [['label_a', 'value_a']], recorder: recorder)
+          record_samples(3, labels: [['label_a', 'value_b']], recorder: recorder)
+        end
+
+        expect(samples_from(stack_recorder.serialize))
+          .to match_array(samples_from(not_aggregating_recorder.serialize))
+      end
+
+      context 'when more than max_aggregated_samples distinct samples are recorded' do
+        subject(:stack_recorder) { described_class.new(aggregate_samples: true, max_aggregated_samples: 2) }
+
+        it 'folds the samples with the lowest values into a "Truncated Stacks" sample' do
+          record_samples(3, labels: [['label_a', 'value_a']])
+          record_samples(1, labels: [['label_a', 'value_b']])
+          record_samples(1, labels: [['label_a', 'value_c']])
+
+          expect(stack_recorder.stats).to include(aggregated_samples: 2, truncated_samples: 1)
+
+          serialization_result = stack_recorder.serialize
+
+          expect(samples_from(serialization_result).map { |sample| [sample[:labels], sample[:values]['cpu-samples']] })
+            .to contain_exactly([[['label_a', 'value_a']], 3], [[['label_a', 'value_c']], 1], [[], 1])
+          expect(::Perftools::Profiles::Profile.decode(serialization_result[2]).string_table)
+            .to include('Truncated Stacks')
+        end
+
+        it 'keeps a sample seen fewer times if it has higher values' do
+          record_samples(1, labels: [['label_a', 'value_a']], values: metric_values.merge('cpu-time' => 10**9))
+          record_samples(3, labels: [['label_a', 'value_b']])
+          record_samples(1, labels: [['label_a', 'value_c']])
+
+          expect(samples_from(stack_recorder.serialize).map { |sample| [sample[:labels], sample[:values]['cpu-samples']] })
+            .to contain_exactly([[['label_a', 'value_a']], 1], [[['label_a', 'value_c']], 1], [[], 3])
+        end
+
+        it 'keeps merging into the remaining samples after folding' do
+          # Recorded from the same line, so that only the labels differ
+          [['value_a', 3], ['value_b', 1], ['value_c', 1], ['value_a', 2], ['value_c', 1]].each do |value, count|
+            record_samples(count, labels: [['label_a', value]])
+          end
+
+          expect(stack_recorder.stats).to include(aggregated_samples: 2, truncated_samples: 1, merged_samples: 5)
+        end
+      end
+
+      context 'when the samples take up more than max_aggregated_bytes' do
+        subject(:stack_recorder) { described_class.new(aggregate_samples: true, max_aggregated_bytes: 1) }
+
+        it 'folds them into a "Truncated Stacks" sample' do
+          record_samples(2)
+
+          expect(stack_recorder.stats).to include(aggregated_samples: 0, truncated_samples: 2)
+          expect(samples_from(stack_recorder.serialize).map { |sample| [sample[:labels], sample[:values]['cpu-samples']] })
+            .to eq [[[], 2]]
+        end
+      end
+
+      context 'when aggregate_samples is not set' do
+        subject(:stack_recorder) { described_class.new }
+
+        it 'records samples directly' do
+          record_samples(2)
+
+          expect(stack_recorder.stats).to include(
+            aggregated_samples: 1,
+            merged_samples: 1,
+            max_aggregated_samples: described_class::DEFAULT_MAX_AGGREGATED_SAMPLES,
+            max_aggregated_bytes: described_class::DEFAULT_MAX_AGGREGATED_BYTES,
+          )
+          expect(samples_from(stack_recorder.serialize).map { |sample| sample[:values]['cpu-samples'] })
+            .to contain_exactly(1, 1)
+          expect(stack_recorder.stats).to include(aggregated_samples: 0)
+        end
+
+        it 'folds samples beyond the default max_aggregated_samples into a "Truncated Stacks" sample' do
+          (described_class::DEFAULT_MAX_AGGREGATED_SAMPLES + 1).times do |index|
+            record_samples(1, labels: [['label_a', "value_#{index}"]])
+          end
+
+          expect(stack_recorder.stats).to include(
+            aggregated_samples: described_class::DEFAULT_MAX_AGGREGATED_SAMPLES,
+            truncated_samples: 1,
+          )
+
+          serialization_result = stack_recorder.serialize
+
+          expect(samples_from(serialization_result).size).to be(described_class::DEFAULT_MAX_AGGREGATED_SAMPLES + 1)
+          expect(::Perftools::Profiles::Profile.decode(serialization_result[2]).string_table)
+            .to include('Truncated Stacks')
+        end
+
+        context 'when more than max_aggregated_samples distinct samples are recorded' do
+          subject(:stack_recorder) { described_class.new(max_aggregated_samples: 2) }
+
+          it 'keeps adding the samples already in the profile, and folds the new ones' do
+            record_samples(1, labels: [['label_a', 'value_a']])
+            record_samples(1, labels: [['label_a', 'value_b']])
+            record_samples(2, labels: [['label_a', 'value_c']])
+            record_samples(1, labels: [['label_a', 'value_a']])
+
+            expect(stack_recorder.stats).to include(aggregated_samples: 2, truncated_samples: 2)
+            expect(
+              samples_from(stack_recorder.serialize).map { |sample| [sample[:labels], sample[:values]['cpu-samples']] }
+            ).to contain_exactly(
+              [[['label_a', 'value_a']], 1],
+              [[['label_a', 'value_b']], 1],
+              [[['label_a', 'value_a']], 1],
+              [[], 2],
+            )
+          end
+        end
+      end
+    end
+
     context 'when there is a failure during serialization' do
       before do
         allow(Datadog.logger).to receive(:error)
@@ -137,5 +411,147 @@ RSpec.describe Datadog::Profiling::StackRecorder do
         serialize
       end
     end
+
+    it 'returns the pprof as a String' do
+      expect(encoded_pprof).to be_a_kind_of(String)
+    end
+  end
+
+  describe '#serialize_without_copy' do
+    subject(:serialize_without_copy) { stack_recorder.serialize_without_copy }
+
+    let(:serialized_profile) { serialize_without_copy[2] }
+
+    it 'returns the pprof as a SerializedProfile' do
+      expect(serialized_profile).to be_a_kind_of(Datadog::Profiling::SerializedProfile)
+      expect(serialized_profile).to_not be_released
+    end
+
+    it 'returns the same pprof as #serialize' do
+      another_recorder = described_class.new
+
+      expect(::Perftools::Profiles::Profile.decode(serialized_profile.to_s).sample_type)
+        .to eq ::Perftools::Profiles::Profile.decode(another_recorder.serialize[2]).sample_type
+    end
+
+    context 'when there is a failure during serialization' do
+      before do
+        allow(Datadog.logger).to receive(:error)
+
+        expect(described_class).to receive(:_native_serialize).and_return([:error, 'test error message'])
+      end
+
+      it { is_expected.to be nil }
+    end
+  end
+
+  describe 'pprof compression' do
+    let(:stack_recorder) { described_class.new(pprof_compression: pprof_compression) }
+    let(:pprof_compression) { :gzip }
+
+    before do
+      unless described_class::AVAILABLE_PPROF_COMPRESSIONS.include?(pprof_compression)
+        skip("#{pprof_compression} was not available when building the native extension")
+      end
+    end
+
+    it 'is disabled by default' do
+      expect(described_class.new.compresses_pprof?).to be false
+      expect(described_class.new.serialize_without_copy[2].compression).to be nil
+    end
+
+    it 'compresses the serialized pprof' do
+      serialized_profile = stack_recorder.serialize_without_copy[2]
+
+      expect(serialized_profile.compression).to be :gzip
+      expect(::Perftools::Profiles::Profile.decode(Datadog::Core::Utils::Compression.gunzip(serialized_profile.to_s)))
+        .to be_a_kind_of(::Perftools::Profiles::Profile)
+    end
+
+    it 'returns the compressed pprof from #serialize' do
+      pprof = stack_recorder.serialize[2]
+
+      expect(::Perftools::Profiles::Profile.decode(Datadog::Core::Utils::Compression.gunzip(pprof)).sample).to be_empty
+    end
+
+    it 'includes compression totals in #stats' do
+      2.times { stack_recorder.serialize }
+
+      expect(stack_recorder.stats).to include(
+        compressed_profiles: 2,
+        compression_failures: 0,
+        uncompressed_pprof_bytes: be > 0,
+        compressed_pprof_bytes: be > 0,
+        compression_ratio: be_a_kind_of(Float),
+        compression_time_ns: be >= 0,
+      )
+    end
+
+    it 'does not include compression totals in #stats when disabled' do
+      expect(described_class.new.stats).to_not include(:compressed_profiles)
+    end
+
+    it 'rejects unsupported codecs' do
+      expect { described_class.new(pprof_compression: :lzma) }.to raise_error(ArgumentError, /pprof_compression/)
+    end
+
+    it 'rejects invalid levels' do
+      expect { described_class.new(pprof_compression: :gzip, pprof_compression_level: 42) }
+        .to raise_error(ArgumentError, /level/)
+    end
+
+    context 'when using zstd' do
+      let(:pprof_compression) { :zstd }
+
+      it 'compresses the serialized pprof' do
+        serialized_profile = stack_recorder.serialize_without_copy[2]
+
+        expect(serialized_profile.compression).to be :zstd
+        expect(serialized_profile.to_s).to start_with("\x28\xB5\x2F\xFD".b) # zstd frame magic number
+      end
+    end
+  end
+
+  describe '.new' do
+    it 'rejects invalid max_aggregated_samples' do
+      expect { described_class.new(max_aggregated_samples: 0) }
+        .to raise_error(ArgumentError, /max_aggregated_samples/)
+    end
+
+    it 'rejects unknown, duplicate, or missing value types' do
+      [['cpu-time', 'not-a-value-type'], ['cpu-time', 'cpu-time'], []].each do |enabled_value_types|
+        expect { described_class.new(enabled_value_types: enabled_value_types) }.to raise_error(ArgumentError)
+      end
+    end
+
+    it 'knows about every value type' do
+      expect(described_class::VALUE_TYPES).to eq(
+        [
+          'cpu-time',
+          'cpu-samples',
+          'wall-time',
+          'gvl-wait',
+          'os-runqueue-wait',
+          'alloc-samples',
+          'alloc-space',
+          'heap-space',
+        ]
+      )
+    end
+
+    it 'rejects invalid max_aggregated_bytes' do
+      expect { described_class.new(max_aggregated_bytes: 0) }
+        .to raise_error(ArgumentError, /max_aggregated_bytes/)
+    end
+  end
+
+  describe 'memory usage reporting' do
+    before { require 'objspace' }
+
+    subject(:stack_recorder) { described_class.new(aggregate_samples: true) }
+
+    it 'includes the memory used to aggregate samples' do
+      expect(ObjectSpace.memsize_of(stack_recorder)).to be > stack_recorder.stats.fetch(:aggregation_memory_bytes)
+    end
   end
 end
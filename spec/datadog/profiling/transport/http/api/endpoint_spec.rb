@@ -93,6 +93,24 @@ RSpec.describe Datadog::Profiling::Transport::HTTP::API::Endpoint do
       end
     end
 
+    context 'when the pprof data is a SerializedProfile' do
+      it_behaves_like 'profile request' do
+        let(:serialized_profile) { Datadog::Profiling::StackRecorder.new.serialize_without_copy[2] }
+        let(:flush) do
+          get_test_profiling_flush.tap { |it| allow(it).to receive(:pprof_data).and_return(serialized_profile) }
+        end
+
+        it 'reports a copy of it, and releases it' do
+          expected_pprof_data = serialized_profile.to_s
+
+          call
+
+          expect(env.form['data[rubyprofile.pprof]'].read).to eq expected_pprof_data
+          expect(serialized_profile).to be_released
+        end
+      end
+    end
+
     context 'when additional tags are provided' do
       it_behaves_like 'profile request' do
         let(:tags) { { 'test_tag_key' => 'test_tag_value', 'another_tag_key' => :another_tag_value } }
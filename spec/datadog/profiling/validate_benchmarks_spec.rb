@@ -19,6 +19,18 @@ RSpec.describe 'Profiling benchmarks', if: (RUBY_VERSION >= '2.4.0') do
     it('runs without raising errors') { expect_in_fork { load './benchmarks/profiler_sample_loop.rb' } }
   end
 
+  describe 'profiler_sample_loop_v2' do
+    it('runs without raising errors') { expect_in_fork { load './benchmarks/profiler_sample_loop_v2.rb' } }
+  end
+
+  describe 'profiler_stack_recorder' do
+    it('runs without raising errors') { expect_in_fork { load './benchmarks/profiler_stack_recorder.rb' } }
+  end
+
+  describe 'profiler_allocations' do
+    it('runs without raising errors') { expect_in_fork { load './benchmarks/profiler_allocations.rb' } }
+  end
+
   describe 'profiler_http_transport' do
     it('runs without raising errors') { expect_in_fork { load './benchmarks/profiler_http_transport.rb' } }
   end